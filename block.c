@@ -1306,6 +1306,11 @@ int bdrv_get_translation_hint(BlockDriverState *bs)
     return bs->translation;
 }
 
+void bdrv_set_l2_cache_size(BlockDriverState *bs, uint64_t size)
+{
+    bs->l2_cache_size = size;
+}
+
 void bdrv_set_on_error(BlockDriverState *bs, BlockErrorAction on_read_error,
                        BlockErrorAction on_write_error)
 {
@@ -1634,22 +1639,42 @@ void bdrv_info(Monitor *mon, QObject **ret_data)
 
 static void bdrv_stats_iter(QObject *data, void *opaque)
 {
-    QDict *qdict;
+    QDict *qdict, *stats;
     Monitor *mon = opaque;
 
     qdict = qobject_to_qdict(data);
     monitor_printf(mon, "%s:", qdict_get_str(qdict, "device"));
 
-    qdict = qobject_to_qdict(qdict_get(qdict, "stats"));
+    stats = qobject_to_qdict(qdict_get(qdict, "stats"));
     monitor_printf(mon, " rd_bytes=%" PRId64
                         " wr_bytes=%" PRId64
                         " rd_operations=%" PRId64
-                        " wr_operations=%" PRId64
-                        "\n",
-                        qdict_get_int(qdict, "rd_bytes"),
-                        qdict_get_int(qdict, "wr_bytes"),
-                        qdict_get_int(qdict, "rd_operations"),
-                        qdict_get_int(qdict, "wr_operations"));
+                        " wr_operations=%" PRId64,
+                        qdict_get_int(stats, "rd_bytes"),
+                        qdict_get_int(stats, "wr_bytes"),
+                        qdict_get_int(stats, "rd_operations"),
+                        qdict_get_int(stats, "wr_operations"));
+
+    /* The thread pool is used by the protocol, e.g. the host file */
+    if (!qdict_haskey(stats, "aio_pool") && qdict_haskey(qdict, "parent")) {
+        stats = qobject_to_qdict(qdict_get(qdict_get_qdict(qdict, "parent"),
+                                           "stats"));
+    }
+    if (qdict_haskey(stats, "aio_pool")) {
+        QDict *pool = qdict_get_qdict(stats, "aio_pool");
+
+        monitor_printf(mon, " aio_requests=%" PRId64
+                            " aio_stolen=%" PRId64
+                            " aio_max_queue_depth=%" PRId64
+                            " aio_threads=%" PRId64
+                            " aio_idle_threads=%" PRId64,
+                            qdict_get_int(pool, "requests"),
+                            qdict_get_int(pool, "stolen"),
+                            qdict_get_int(pool, "max_queue_depth"),
+                            qdict_get_int(pool, "threads"),
+                            qdict_get_int(pool, "idle_threads"));
+    }
+    monitor_printf(mon, "\n");
 }
 
 void bdrv_stats_print(Monitor *mon, const QObject *data)
@@ -1679,6 +1704,25 @@ static QObject* bdrv_info_stats_bs(BlockDriverState *bs)
         qdict_put(dict, "device", qstring_from_str(bs->device_name));
     }
 
+    if (bs->drv && bs->drv->bdrv_get_aio_pool_stats) {
+        BlockAIOPoolStats pool;
+
+        if (bs->drv->bdrv_get_aio_pool_stats(bs, &pool) == 0) {
+            QObject *obj;
+
+            obj = qobject_from_jsonf("{ 'requests': %" PRId64 ","
+                                     "'stolen': %" PRId64 ","
+                                     "'max_queue_depth': %d,"
+                                     "'threads': %d,"
+                                     "'idle_threads': %d }",
+                                     pool.requests, pool.stolen,
+                                     pool.max_queue_depth, pool.threads,
+                                     pool.idle_threads);
+            qdict_put_obj(qobject_to_qdict(qdict_get(dict, "stats")),
+                          "aio_pool", obj);
+        }
+    }
+
     if (bs->file) {
         QObject *parent = bdrv_info_stats_bs(bs->file);
         qdict_put_obj(dict, "parent", parent);
@@ -2095,7 +2139,7 @@ static int multiwrite_req_compare(const void *a, const void *b)
  * requests that remain after merging.
  */
 static int multiwrite_merge(BlockDriverState *bs, BlockRequest *reqs,
-    int num_reqs, MultiwriteCB *mcb)
+    int num_reqs, MultiwriteCB *mcb, int is_write)
 {
     int i, outidx;
 
@@ -2115,11 +2159,17 @@ static int multiwrite_merge(BlockDriverState *bs, BlockRequest *reqs,
             merge = 1;
         }
 
+        // Overlapping reads can't be merged, the first request would miss the
+        // data of the overlapping sectors.
+        if (!is_write && reqs[i].sector != oldreq_last) {
+            merge = 0;
+        }
+
         // The block driver may decide that it makes sense to combine requests
         // even if there is a gap of some sectors between them. In this case,
         // the gap is filled with zeros (therefore only applicable for yet
         // unused space in format like qcow2).
-        if (!merge && bs->drv->bdrv_merge_requests) {
+        if (!merge && is_write && bs->drv->bdrv_merge_requests) {
             merge = bs->drv->bdrv_merge_requests(bs, &reqs[outidx], &reqs[i]);
         }
 
@@ -2166,7 +2216,7 @@ static int multiwrite_merge(BlockDriverState *bs, BlockRequest *reqs,
 }
 
 /*
- * Submit multiple AIO write requests at once.
+ * Submit multiple AIO write (or read) requests at once.
  *
  * On success, the function returns 0 and all requests in the reqs array have
  * been submitted. In error case this function returns -1, and any of the
@@ -2179,7 +2229,8 @@ static int multiwrite_merge(BlockDriverState *bs, BlockRequest *reqs,
  * requests. However, the fields opaque and error are left unmodified as they
  * are used to signal failure for a single request to the caller.
  */
-int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
+static int bdrv_aio_multi(BlockDriverState *bs, BlockRequest *reqs,
+    int num_reqs, int is_write)
 {
     BlockDriverAIOCB *acb;
     MultiwriteCB *mcb;
@@ -2200,7 +2251,7 @@ int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
     }
 
     // Check for mergable requests
-    num_reqs = multiwrite_merge(bs, reqs, num_reqs, mcb);
+    num_reqs = multiwrite_merge(bs, reqs, num_reqs, mcb, is_write);
 
     /*
      * Run the aio requests. As soon as one request can't be submitted
@@ -2208,7 +2259,7 @@ int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
      * return failure for all requests anyway)
      *
      * num_requests cannot be set to the right value immediately: If
-     * bdrv_aio_writev fails for some request, num_requests would be too high
+     * bdrv_aio_writev/readv fails for some request, num_requests would be too high
      * and therefore multiwrite_cb() would never recognize the multiwrite
      * request as completed. We also cannot use the loop variable i to set it
      * when the first request fails because the callback may already have been
@@ -2225,8 +2276,13 @@ int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
 
     for (i = 0; i < num_reqs; i++) {
         mcb->num_requests++;
-        acb = bdrv_aio_writev(bs, reqs[i].sector, reqs[i].qiov,
-            reqs[i].nb_sectors, multiwrite_cb, mcb);
+        if (is_write) {
+            acb = bdrv_aio_writev(bs, reqs[i].sector, reqs[i].qiov,
+                reqs[i].nb_sectors, multiwrite_cb, mcb);
+        } else {
+            acb = bdrv_aio_readv(bs, reqs[i].sector, reqs[i].qiov,
+                reqs[i].nb_sectors, multiwrite_cb, mcb);
+        }
 
         if (acb == NULL) {
             // We can only fail the whole thing if no request has been
@@ -2254,6 +2310,47 @@ fail:
     return -1;
 }
 
+int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
+{
+    return bdrv_aio_multi(bs, reqs, num_reqs, 1);
+}
+
+/*
+ * Submit multiple AIO read requests at once. Exactly adjacent requests are
+ * merged. Otherwise the same as bdrv_aio_multiwrite().
+ */
+int bdrv_aio_multiread(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
+{
+    return bdrv_aio_multi(bs, reqs, num_reqs, 0);
+}
+
+/*
+ * Between bdrv_io_plug() and bdrv_io_unplug(), the driver may queue requests
+ * and submit them to the host together when it is unplugged. Drivers that
+ * don't implement this pass it on to their protocol.
+ */
+void bdrv_io_plug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_plug) {
+        drv->bdrv_io_plug(bs);
+    } else if (bs->file) {
+        bdrv_io_plug(bs->file);
+    }
+}
+
+void bdrv_io_unplug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_unplug) {
+        drv->bdrv_io_unplug(bs);
+    } else if (bs->file) {
+        bdrv_io_unplug(bs->file);
+    }
+}
+
 BlockDriverAIOCB *bdrv_aio_flush(BlockDriverState *bs,
         BlockDriverCompletionFunc *cb, void *opaque)
 {
@@ -134,6 +134,14 @@ typedef struct BlockRequest {
 
 int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs,
     int num_reqs);
+int bdrv_aio_multiread(BlockDriverState *bs, BlockRequest *reqs,
+    int num_reqs);
+
+void bdrv_io_plug(BlockDriverState *bs);
+void bdrv_io_unplug(BlockDriverState *bs);
+
+/* host file of a raw, cache=none,aio=native image (block/raw-posix.c) */
+int raw_get_aio_fd(BlockDriverState *bs);
 
 /* sg packet commands */
 int bdrv_ioctl(BlockDriverState *bs, unsigned long int req, void *buf);
@@ -167,6 +175,7 @@ void bdrv_get_geometry_hint(BlockDriverState *bs,
                             int *pcyls, int *pheads, int *psecs);
 int bdrv_get_type_hint(BlockDriverState *bs);
 int bdrv_get_translation_hint(BlockDriverState *bs);
+void bdrv_set_l2_cache_size(BlockDriverState *bs, uint64_t size);
 void bdrv_set_on_error(BlockDriverState *bs, BlockErrorAction on_read_error,
                        BlockErrorAction on_write_error);
 BlockErrorAction bdrv_get_on_error(BlockDriverState *bs, int is_read);
@@ -242,6 +251,7 @@ typedef enum {
     BLKDBG_L1_GROW_ACTIVATE_TABLE,
 
     BLKDBG_L2_LOAD,
+    BLKDBG_L2_LOAD_AIO,
     BLKDBG_L2_UPDATE,
     BLKDBG_L2_UPDATE_COMPRESSED,
     BLKDBG_L2_ALLOC_COW_READ,
@@ -142,6 +142,7 @@ static const char *event_names[BLKDBG_EVENT_MAX] = {
     [BLKDBG_L1_GROW_ACTIVATE_TABLE]         = "l1_grow.activate_table",
 
     [BLKDBG_L2_LOAD]                        = "l2_load",
+    [BLKDBG_L2_LOAD_AIO]                    = "l2_load_aio",
     [BLKDBG_L2_UPDATE]                      = "l2_update",
     [BLKDBG_L2_UPDATE_COMPRESSED]           = "l2_update_compressed",
     [BLKDBG_L2_ALLOC_COW_READ]              = "l2_alloc.cow_read",
@@ -0,0 +1,683 @@
+/*
+ * L2/refcount table cache for the QCOW2 format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "block_int.h"
+#include "qemu-common.h"
+#include "qemu-aio.h"
+#include "qcow2.h"
+
+/*
+ * Every cached table is one cluster. All tables of a cache live in a single
+ * buffer so that the entry of a table can be computed from its address.
+ *
+ * Lookup goes through a hash of the table offset. Entries that are not in
+ * use are kept on an LRU list; the least recently used one is recycled on a
+ * miss. Modified tables are only written back when they are evicted, when
+ * the cache is flushed or when another cache depending on them is flushed.
+ *
+ * Tables can also be read asynchronously with qcow2_cache_aio_load(). While
+ * such a read is in flight, the entry is already hashed but holds a reference
+ * and has a Qcow2CacheLoad attached; requests for the same table are queued
+ * on it instead of issuing another read.
+ *
+ * A read only completes in the AIO context that started it. Code running in
+ * a nested context (synchronous I/O through bdrv_read_em(), savevm, ...)
+ * therefore never waits for or queues on a read of an outer context: it
+ * detaches the read from the cache and reads the table itself.
+ */
+
+typedef struct Qcow2CacheWaiter {
+    BlockDriverCompletionFunc *cb;
+    void *opaque;
+    QLIST_ENTRY(Qcow2CacheWaiter) next;
+} Qcow2CacheWaiter;
+
+typedef struct Qcow2CacheLoad {
+    BlockDriverState *bs;
+    Qcow2Cache *c;
+    struct Qcow2CachedTable *entry;
+    struct iovec iov;
+    QEMUIOVector qiov;
+    int context;        /* AIO context that the read completes in */
+    bool detached;      /* table no longer hashed, data is discarded */
+    QLIST_HEAD(, Qcow2CacheWaiter) waiters;
+} Qcow2CacheLoad;
+
+typedef struct Qcow2CachedTable {
+    int64_t offset;
+    int ref;
+    int dirty_start;
+    int dirty_end;
+    Qcow2CacheLoad *load;
+    QLIST_ENTRY(Qcow2CachedTable) hash_next;
+    QTAILQ_ENTRY(Qcow2CachedTable) lru_next;
+} Qcow2CachedTable;
+
+struct Qcow2Cache {
+    int size;
+    int nb_loads;
+    int table_bits;
+    uint8_t *tables;
+    Qcow2CachedTable *entries;
+
+    int hash_mask;
+    QLIST_HEAD(, Qcow2CachedTable) *hash;
+    QTAILQ_HEAD(, Qcow2CachedTable) lru;
+
+    struct Qcow2Cache *depends;
+    bool depends_on_flush;
+    bool writethrough;
+};
+
+static inline int cache_index(Qcow2Cache *c, Qcow2CachedTable *entry)
+{
+    return entry - c->entries;
+}
+
+static inline void *cache_table(Qcow2Cache *c, int i)
+{
+    return c->tables + ((size_t) i << c->table_bits);
+}
+
+static inline int cache_hash(Qcow2Cache *c, int64_t offset)
+{
+    uint64_t n = offset >> c->table_bits;
+
+    return (n ^ (n >> 16)) & c->hash_mask;
+}
+
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+    bool writethrough)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Cache *c;
+    int i, buckets;
+
+    c = qemu_mallocz(sizeof(*c));
+    c->size = num_tables;
+    c->table_bits = s->cluster_bits;
+    c->writethrough = writethrough;
+    c->tables = qemu_blockalign(bs, (size_t) num_tables << c->table_bits);
+    c->entries = qemu_mallocz(num_tables * sizeof(*c->entries));
+
+    buckets = 1;
+    while (buckets < num_tables) {
+        buckets <<= 1;
+    }
+    c->hash_mask = buckets - 1;
+    c->hash = qemu_mallocz(buckets * sizeof(*c->hash));
+
+    QTAILQ_INIT(&c->lru);
+    for (i = 0; i < num_tables; i++) {
+        c->entries[i].offset = 0;
+        c->entries[i].dirty_start = -1;
+        QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru_next);
+    }
+
+    return c;
+}
+
+static inline bool load_is_foreign(Qcow2CacheLoad *load)
+{
+    return load->context != get_async_context_id();
+}
+
+/* Number of table reads in flight that can complete in the current context */
+static int qcow2_cache_local_loads(Qcow2Cache *c)
+{
+    int i, n = 0;
+
+    if (c->nb_loads == 0) {
+        return 0;
+    }
+
+    for (i = 0; i < c->size; i++) {
+        Qcow2CacheLoad *load = c->entries[i].load;
+
+        if (load != NULL && !load_is_foreign(load)) {
+            n++;
+        }
+    }
+    return n;
+}
+
+/*
+ * Takes a table that is being read in an outer AIO context out of the cache.
+ * The entry stays in use until the read completes, its waiters are still
+ * called and will find the table cached by then.
+ */
+static void qcow2_cache_detach_load(Qcow2Cache *c, Qcow2CachedTable *entry)
+{
+    if (!entry->load->detached) {
+        QLIST_REMOVE(entry, hash_next);
+        entry->offset = 0;
+        entry->load->detached = true;
+    }
+}
+
+/*
+ * Waits until no asynchronous table read of the current context is in flight
+ * any more. Reads of outer contexts can't complete here.
+ */
+static void qcow2_cache_drain(Qcow2Cache *c)
+{
+    while (qcow2_cache_local_loads(c) > 0) {
+        qemu_aio_wait();
+    }
+}
+
+int qcow2_cache_destroy(BlockDriverState *bs, Qcow2Cache *c)
+{
+    int i;
+
+    qcow2_cache_drain(c);
+
+    for (i = 0; i < c->size; i++) {
+        assert(c->entries[i].ref == 0);
+    }
+
+    qemu_vfree(c->tables);
+    qemu_free(c->entries);
+    qemu_free(c->hash);
+    qemu_free(c);
+
+    return 0;
+}
+
+static int qcow2_cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c)
+{
+    int ret;
+
+    ret = qcow2_cache_flush(bs, c->depends);
+    if (ret < 0) {
+        return ret;
+    }
+
+    c->depends = NULL;
+    c->depends_on_flush = false;
+
+    return 0;
+}
+
+static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CachedTable *entry = &c->entries[i];
+    int ret;
+
+    if (entry->dirty_start < 0 || !entry->offset) {
+        return 0;
+    }
+
+    if (c->depends) {
+        ret = qcow2_cache_flush_dependency(bs, c);
+    } else if (c->depends_on_flush) {
+        bdrv_flush(bs->file);
+        c->depends_on_flush = false;
+        ret = 0;
+    } else {
+        ret = 0;
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (c == s->refcount_block_cache) {
+        BLKDBG_EVENT(bs->file, BLKDBG_REFBLOCK_UPDATE_PART);
+    } else if (c == s->l2_table_cache) {
+        BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
+    }
+
+    ret = bdrv_pwrite(bs->file, entry->offset + entry->dirty_start,
+        (uint8_t *) cache_table(c, i) + entry->dirty_start,
+        entry->dirty_end - entry->dirty_start);
+    if (ret < 0) {
+        return ret;
+    }
+
+    entry->dirty_start = -1;
+    return 0;
+}
+
+int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
+{
+    int result = 0;
+    int ret;
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        ret = qcow2_cache_entry_flush(bs, c, i);
+        if (ret < 0 && result != -ENOSPC) {
+            result = ret;
+        }
+    }
+
+    if (result == 0) {
+        bdrv_flush(bs->file);
+    }
+
+    return result;
+}
+
+/*
+ * Makes sure that all tables of dependency are on disk before any table of c
+ * is written back.
+ */
+int qcow2_cache_set_dependency(BlockDriverState *bs, Qcow2Cache *c,
+    Qcow2Cache *dependency)
+{
+    int ret;
+
+    if (dependency->depends) {
+        ret = qcow2_cache_flush_dependency(bs, dependency);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (c->depends && (c->depends != dependency)) {
+        ret = qcow2_cache_flush_dependency(bs, c);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    c->depends = dependency;
+    return 0;
+}
+
+/*
+ * Makes sure that bs->file is flushed before any table of c is written back,
+ * so that guest data written before the metadata update reaches the disk
+ * first.
+ */
+void qcow2_cache_depends_on_flush(Qcow2Cache *c)
+{
+    c->depends_on_flush = true;
+}
+
+/*
+ * Writes back and drops all tables, e.g. because the tables have been changed
+ * on disk behind the back of the cache. No table may be in use.
+ */
+int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
+{
+    int ret, i;
+
+    qcow2_cache_drain(c);
+
+    ret = qcow2_cache_flush(bs, c);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (i = 0; i < c->size; i++) {
+        Qcow2CachedTable *entry = &c->entries[i];
+
+        if (entry->load != NULL) {
+            /* Still being read in an outer context */
+            qcow2_cache_detach_load(c, entry);
+            continue;
+        }
+        assert(entry->ref == 0);
+        if (entry->offset) {
+            QLIST_REMOVE(entry, hash_next);
+            entry->offset = 0;
+        }
+    }
+
+    return 0;
+}
+
+static Qcow2CachedTable *qcow2_cache_find(Qcow2Cache *c, int64_t offset)
+{
+    Qcow2CachedTable *entry;
+
+    QLIST_FOREACH(entry, &c->hash[cache_hash(c, offset)], hash_next) {
+        if (entry->offset == offset) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Picks the least recently used table that isn't in use and prepares it for
+ * reuse. If prefer_clean is set, clean tables are preferred over dirty ones
+ * so that no write back is needed.
+ */
+static Qcow2CachedTable *qcow2_cache_evict(BlockDriverState *bs, Qcow2Cache *c,
+    bool prefer_clean, int *ret)
+{
+    Qcow2CachedTable *entry, *victim = NULL;
+
+    QTAILQ_FOREACH(entry, &c->lru, lru_next) {
+        if (entry->ref != 0) {
+            continue;
+        }
+        if (victim == NULL) {
+            victim = entry;
+        }
+        if (!prefer_clean || entry->dirty_start < 0) {
+            victim = entry;
+            break;
+        }
+    }
+    if (victim == NULL) {
+        *ret = -ENOSPC;
+        return NULL;
+    }
+
+    *ret = qcow2_cache_entry_flush(bs, c, cache_index(c, victim));
+    if (*ret < 0) {
+        return NULL;
+    }
+
+    if (victim->offset) {
+        QLIST_REMOVE(victim, hash_next);
+        victim->offset = 0;
+    }
+
+    return victim;
+}
+
+static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
+    uint64_t offset, void **table, bool read_from_disk)
+{
+    Qcow2CachedTable *entry;
+    int ret, i;
+
+    /* Check if the table is already cached */
+    entry = qcow2_cache_find(c, offset);
+    while (entry != NULL && entry->load != NULL) {
+        if (load_is_foreign(entry->load)) {
+            /* Waiting would hang, read the table into another entry */
+            qcow2_cache_detach_load(c, entry);
+            entry = NULL;
+            break;
+        }
+        /* An asynchronous read is in flight, wait for it */
+        qemu_aio_wait();
+        entry = qcow2_cache_find(c, offset);
+    }
+    if (entry != NULL) {
+        goto found;
+    }
+
+    /* If not, recycle the least recently used table that isn't in use */
+    entry = qcow2_cache_evict(bs, c, false, &ret);
+    while (entry == NULL && ret == -ENOSPC && qcow2_cache_local_loads(c) > 0) {
+        /* All free tables are being loaded, one of them will be released */
+        qemu_aio_wait();
+        entry = qcow2_cache_evict(bs, c, false, &ret);
+    }
+    if (entry == NULL) {
+        return ret;
+    }
+    i = cache_index(c, entry);
+
+    if (read_from_disk) {
+        if (c == ((BDRVQcowState *) bs->opaque)->l2_table_cache) {
+            BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
+        }
+
+        ret = bdrv_pread(bs->file, offset, cache_table(c, i),
+            1 << c->table_bits);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    entry->offset = offset;
+    QLIST_INSERT_HEAD(&c->hash[cache_hash(c, offset)], entry, hash_next);
+
+found:
+    entry->ref++;
+    QTAILQ_REMOVE(&c->lru, entry, lru_next);
+    QTAILQ_INSERT_TAIL(&c->lru, entry, lru_next);
+    *table = cache_table(c, cache_index(c, entry));
+    return 0;
+}
+
+/*
+ * Returns the table at the given offset, reading it from disk if it isn't
+ * cached yet. The table stays valid until it is released with
+ * qcow2_cache_put().
+ */
+int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
+    void **table)
+{
+    return qcow2_cache_do_get(bs, c, offset, table, true);
+}
+
+/*
+ * Like qcow2_cache_get(), but doesn't read the table from disk. Used for newly
+ * allocated tables; the caller must initialise the whole table.
+ */
+int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
+    void **table)
+{
+    return qcow2_cache_do_get(bs, c, offset, table, false);
+}
+
+int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
+{
+    int i = ((uint8_t *) *table - c->tables) >> c->table_bits;
+
+    if (i < 0 || i >= c->size) {
+        return -ENOENT;
+    }
+
+    c->entries[i].ref--;
+    *table = NULL;
+
+    assert(c->entries[i].ref >= 0);
+
+    if (c->writethrough) {
+        return qcow2_cache_entry_flush(bs, c, i);
+    } else {
+        return 0;
+    }
+}
+
+/*
+ * Marks the byte range [start, start + len) of a table as modified. The range
+ * is rounded to sectors so that write back never needs a read-modify-write.
+ */
+void qcow2_cache_entry_mark_dirty_range(Qcow2Cache *c, void *table,
+    int start, int len)
+{
+    int i = ((uint8_t *) table - c->tables) >> c->table_bits;
+    Qcow2CachedTable *entry = &c->entries[i];
+    int end = (start + len + 511) & ~511;
+
+    assert(i >= 0 && i < c->size);
+
+    start &= ~511;
+    if (entry->dirty_start < 0) {
+        entry->dirty_start = start;
+        entry->dirty_end = end;
+    } else {
+        entry->dirty_start = MIN(entry->dirty_start, start);
+        entry->dirty_end = MAX(entry->dirty_end, end);
+    }
+}
+
+void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
+{
+    qcow2_cache_entry_mark_dirty_range(c, table, 0, 1 << c->table_bits);
+}
+
+/*
+ * Returns true if the table at the given offset can be accessed with
+ * qcow2_cache_get() without any I/O.
+ */
+bool qcow2_cache_is_cached(Qcow2Cache *c, uint64_t offset)
+{
+    Qcow2CachedTable *entry = qcow2_cache_find(c, offset);
+
+    return entry != NULL && entry->load == NULL;
+}
+
+static void qcow2_cache_aio_load_cb(void *opaque, int ret)
+{
+    Qcow2CacheLoad *load = opaque;
+    Qcow2CachedTable *entry = load->entry;
+    Qcow2Cache *c = load->c;
+    Qcow2CacheWaiter *waiter, *next;
+
+    entry->load = NULL;
+    entry->ref--;
+    c->nb_loads--;
+
+    if (ret < 0 && !load->detached) {
+        QLIST_REMOVE(entry, hash_next);
+        entry->offset = 0;
+    }
+
+    QLIST_FOREACH_SAFE(waiter, &load->waiters, next, next) {
+        QLIST_REMOVE(waiter, next);
+        waiter->cb(waiter->opaque, ret < 0 ? ret : 0);
+        qemu_free(waiter);
+    }
+
+    qemu_free(load);
+}
+
+/*
+ * Reads the table at the given offset into the cache without blocking. cb is
+ * called when the table has been read (or the read failed); a following
+ * qcow2_cache_get() for it will then normally be served from memory.
+ *
+ * Returns 0 if cb will be called, -errno if the read could not be started;
+ * callers can fall back to the synchronous qcow2_cache_get() in this case.
+ */
+int qcow2_cache_aio_load(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
+    BlockDriverCompletionFunc *cb, void *opaque)
+{
+    Qcow2CachedTable *entry;
+    Qcow2CacheLoad *load;
+    Qcow2CacheWaiter *waiter;
+    BlockDriverAIOCB *aiocb;
+    int ret;
+
+    entry = qcow2_cache_find(c, offset);
+    if (entry != NULL && entry->load == NULL) {
+        return -EEXIST;
+    }
+    if (entry != NULL && load_is_foreign(entry->load)) {
+        /* We would wait for the outer context, read synchronously instead */
+        return -EBUSY;
+    }
+
+    /*
+     * Don't let reads in flight take up more than half of the cache, the
+     * synchronous paths need some tables to work with.
+     */
+    if (entry == NULL && c->nb_loads >= c->size / 2) {
+        return -EBUSY;
+    }
+
+    waiter = qemu_mallocz(sizeof(*waiter));
+    waiter->cb = cb;
+    waiter->opaque = opaque;
+
+    if (entry != NULL) {
+        /* Somebody else is already reading the table */
+        QLIST_INSERT_HEAD(&entry->load->waiters, waiter, next);
+        return 0;
+    }
+
+    entry = qcow2_cache_evict(bs, c, true, &ret);
+    if (entry == NULL) {
+        qemu_free(waiter);
+        return ret;
+    }
+
+    load = qemu_mallocz(sizeof(*load));
+    load->bs = bs;
+    load->c = c;
+    load->entry = entry;
+    load->context = get_async_context_id();
+    load->iov.iov_base = cache_table(c, cache_index(c, entry));
+    load->iov.iov_len = 1 << c->table_bits;
+    qemu_iovec_init_external(&load->qiov, &load->iov, 1);
+    QLIST_INIT(&load->waiters);
+    QLIST_INSERT_HEAD(&load->waiters, waiter, next);
+
+    entry->offset = offset;
+    entry->ref++;
+    entry->load = load;
+    QLIST_INSERT_HEAD(&c->hash[cache_hash(c, offset)], entry, hash_next);
+    QTAILQ_REMOVE(&c->lru, entry, lru_next);
+    QTAILQ_INSERT_TAIL(&c->lru, entry, lru_next);
+    c->nb_loads++;
+
+    if (c == ((BDRVQcowState *) bs->opaque)->l2_table_cache) {
+        BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD_AIO);
+    }
+
+    aiocb = bdrv_aio_readv(bs->file, offset >> BDRV_SECTOR_BITS, &load->qiov,
+        load->iov.iov_len >> BDRV_SECTOR_BITS, qcow2_cache_aio_load_cb, load);
+    if (aiocb == NULL) {
+        QLIST_REMOVE(entry, hash_next);
+        entry->offset = 0;
+        entry->ref--;
+        entry->load = NULL;
+        c->nb_loads--;
+        qemu_free(waiter);
+        qemu_free(load);
+        return -EIO;
+    }
+
+    return 0;
+}
+
+/*
+ * Forgets about all callbacks with the given opaque that are waiting for an
+ * asynchronous table read, e.g. because the request they belong to is
+ * cancelled. The reads themselves continue.
+ */
+void qcow2_cache_aio_cancel(Qcow2Cache *c, void *opaque)
+{
+    Qcow2CacheWaiter *waiter, *next;
+    int i;
+
+    if (c->nb_loads == 0) {
+        return;
+    }
+
+    for (i = 0; i < c->size; i++) {
+        Qcow2CacheLoad *load = c->entries[i].load;
+
+        if (load == NULL) {
+            continue;
+        }
+        QLIST_FOREACH_SAFE(waiter, &load->waiters, next, next) {
+            if (waiter->opaque == opaque) {
+                QLIST_REMOVE(waiter, next);
+                qemu_free(waiter);
+            }
+        }
+    }
+}
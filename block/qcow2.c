@@ -142,6 +142,8 @@ static int qcow_open(BlockDriverState *bs, int flags)
     int len, i;
     QCowHeader header;
     uint64_t ext_end;
+    int l2_cache_size;
+    bool writethrough;
 
     if (bdrv_pread(bs->file, 0, &header, sizeof(header)) != sizeof(header))
         goto fail;
@@ -203,8 +205,17 @@ static int qcow_open(BlockDriverState *bs, int flags)
             be64_to_cpus(&s->l1_table[i]);
         }
     }
-    /* alloc L2 cache */
-    s->l2_cache = qemu_malloc(s->l2_size * L2_CACHE_SIZE * sizeof(uint64_t));
+    /* alloc L2 table/refcount block cache */
+    l2_cache_size = L2_CACHE_SIZE;
+    if (bs->l2_cache_size > 0) {
+        l2_cache_size = MIN(bs->l2_cache_size >> s->cluster_bits, INT_MAX / 4);
+        l2_cache_size = MAX(MIN_L2_CACHE_SIZE, l2_cache_size);
+    }
+    writethrough = ((flags & BDRV_O_CACHE_MASK) == 0);
+    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_size, writethrough);
+    s->refcount_block_cache = qcow2_cache_create(bs,
+        MAX(MIN_REFCOUNT_CACHE_SIZE, l2_cache_size / 4), writethrough);
+
     s->cluster_cache = qemu_malloc(s->cluster_size);
     /* one more sector for decompressed data alignment */
     s->cluster_data = qemu_malloc(QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size
@@ -245,7 +256,12 @@ static int qcow_open(BlockDriverState *bs, int flags)
     qcow2_free_snapshots(bs);
     qcow2_refcount_close(bs);
     qemu_free(s->l1_table);
-    qemu_free(s->l2_cache);
+    if (s->l2_table_cache) {
+        qcow2_cache_destroy(bs, s->l2_table_cache);
+    }
+    if (s->refcount_block_cache) {
+        qcow2_cache_destroy(bs, s->refcount_block_cache);
+    }
     qemu_free(s->cluster_cache);
     qemu_free(s->cluster_data);
     return -1;
@@ -339,6 +355,7 @@ typedef struct QCowAIOCB {
     struct iovec hd_iov;
     QEMUIOVector hd_qiov;
     QEMUBH *bh;
+    int ret;                    /* result of a request completed by bh */
     QCowL2Meta l2meta;
     QLIST_ENTRY(QCowAIOCB) next_depend;
 } QCowAIOCB;
@@ -346,8 +363,15 @@ typedef struct QCowAIOCB {
 static void qcow_aio_cancel(BlockDriverAIOCB *blockacb)
 {
     QCowAIOCB *acb = container_of(blockacb, QCowAIOCB, common);
+    BDRVQcowState *s = acb->common.bs->opaque;
+
     if (acb->hd_aiocb)
         bdrv_aio_cancel(acb->hd_aiocb);
+    if (acb->bh) {
+        qemu_bh_delete(acb->bh);
+        acb->bh = NULL;
+    }
+    qcow2_cache_aio_cancel(s->l2_table_cache, acb);
     qemu_aio_release(acb);
 }
 
@@ -356,6 +380,43 @@ static AIOPool qcow_aio_pool = {
     .cancel             = qcow_aio_cancel,
 };
 
+/*
+ * Makes sure that the L2 table for the next part of the request is cached
+ * before the request goes on, so that looking up (or allocating) its clusters
+ * doesn't block on a synchronous metadata read.
+ *
+ * Returns 1 if the table is being read in the background; cb is called with
+ * acb when it's done and the request continues from there. Returns 0 if the
+ * request can go on immediately.
+ */
+static int qcow_aio_load_l2(QCowAIOCB *acb, BlockDriverCompletionFunc *cb)
+{
+    BlockDriverState *bs = acb->common.bs;
+    BDRVQcowState *s = bs->opaque;
+    uint64_t l1_index, l2_offset;
+
+    l1_index = acb->sector_num >> (s->l2_bits + s->cluster_bits - 9);
+    if (l1_index >= s->l1_size) {
+        return 0;
+    }
+
+    l2_offset = s->l1_table[l1_index] & ~QCOW_OFLAG_COPIED;
+    if (!l2_offset || qcow2_cache_is_cached(s->l2_table_cache, l2_offset)) {
+        return 0;
+    }
+
+    /* If the read can't be started, the synchronous path still works */
+    if (qcow2_cache_aio_load(bs, s->l2_table_cache, l2_offset, cb, acb) < 0) {
+        return 0;
+    }
+
+    /* Nothing to complete when cb is called */
+    acb->cur_nr_sectors = 0;
+    acb->l2meta.nb_clusters = 0;
+
+    return 1;
+}
+
 static void qcow_aio_read_cb(void *opaque, int ret);
 static void qcow_aio_read_bh(void *opaque)
 {
@@ -414,6 +475,10 @@ static void qcow_aio_read_cb(void *opaque, int ret)
     }
 
     /* prepare next AIO request */
+    if (qcow_aio_load_l2(acb, qcow_aio_read_cb)) {
+        return;
+    }
+
     acb->cur_nr_sectors = acb->remaining_sectors;
     ret = qcow2_get_cluster_offset(bs, acb->sector_num << 9,
         &acb->cur_nr_sectors, &acb->cluster_offset);
@@ -587,6 +652,10 @@ static void qcow_aio_write_cb(void *opaque, int ret)
         n_end > QCOW_MAX_CRYPT_CLUSTERS * s->cluster_sectors)
         n_end = QCOW_MAX_CRYPT_CLUSTERS * s->cluster_sectors;
 
+    if (qcow_aio_load_l2(acb, qcow_aio_write_cb)) {
+        return;
+    }
+
     ret = qcow2_alloc_cluster_offset(bs, acb->sector_num << 9,
         index_in_cluster, n_end, &acb->cur_nr_sectors, &acb->l2meta);
     if (ret < 0) {
@@ -661,8 +730,16 @@ static BlockDriverAIOCB *qcow_aio_writev(BlockDriverState *bs,
 static void qcow_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+
+    qcow2_discard_prealloc(bs);
     qemu_free(s->l1_table);
-    qemu_free(s->l2_cache);
+
+    qcow2_cache_flush(bs, s->l2_table_cache);
+    qcow2_cache_flush(bs, s->refcount_block_cache);
+
+    qcow2_cache_destroy(bs, s->l2_table_cache);
+    qcow2_cache_destroy(bs, s->refcount_block_cache);
+
     qemu_free(s->cluster_cache);
     qemu_free(s->cluster_data);
     qcow2_refcount_close(bs);
@@ -1214,14 +1291,56 @@ static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
     return 0;
 }
 
+/*
+ * Writes back all cached metadata. The L2 table cache is flushed first, it
+ * takes care of flushing the refcount block cache as well if it depends on it.
+ */
+static int qcow_flush_metadata(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    ret = qcow2_cache_flush(bs, s->l2_table_cache);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return qcow2_cache_flush(bs, s->refcount_block_cache);
+}
+
 static void qcow_flush(BlockDriverState *bs)
 {
+    qcow_flush_metadata(bs);
     bdrv_flush(bs->file);
 }
 
+static void qcow_aio_flush_bh(void *opaque)
+{
+    QCowAIOCB *acb = opaque;
+
+    qemu_bh_delete(acb->bh);
+    acb->bh = NULL;
+    acb->common.cb(acb->common.opaque, acb->ret);
+    qemu_aio_release(acb);
+}
+
 static BlockDriverAIOCB *qcow_aio_flush(BlockDriverState *bs,
          BlockDriverCompletionFunc *cb, void *opaque)
 {
+    QCowAIOCB *acb;
+    int ret;
+
+    ret = qcow_flush_metadata(bs);
+    if (ret < 0) {
+        /* A NULL return would look like "no AIO", report the error */
+        acb = qemu_aio_get(&qcow_aio_pool, bs, cb, opaque);
+        acb->hd_aiocb = NULL;
+        acb->bh = NULL;
+        acb->ret = ret;
+        qcow_schedule_bh(qcow_aio_flush_bh, acb);
+        return &acb->common;
+    }
+
     return bdrv_aio_flush(bs->file, cb, opaque);
 }
 
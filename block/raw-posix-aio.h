@@ -27,10 +27,13 @@
 
 /* posix-aio-compat.c - thread pool based implementation */
 int paio_init(void);
-BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
+void *paio_queue_new(void);
+void paio_queue_free(void *aio_queue);
+void paio_get_stats(void *aio_queue, BlockAIOPoolStats *stats);
+BlockDriverAIOCB *paio_submit(BlockDriverState *bs, void *aio_queue, int fd,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque, int type);
-BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, int fd,
+BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, void *aio_queue, int fd,
         unsigned long int req, void *buf,
         BlockDriverCompletionFunc *cb, void *opaque);
 
@@ -39,5 +42,7 @@ void *laio_init(void);
 BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque, int type);
+void laio_io_plug(void *aio_ctx);
+void laio_io_unplug(void *aio_ctx);
 
 #endif /* QEMU_RAW_POSIX_AIO_H */
@@ -117,6 +117,7 @@ typedef struct BDRVRawState {
     int use_aio;
     void *aio_ctx;
 #endif
+    void *paio_queue;
     uint8_t* aligned_buf;
 } BDRVRawState;
 
@@ -188,6 +189,7 @@ static int raw_open_common(BlockDriverState *bs, const char *filename,
         s->use_aio = 0;
 #endif
     }
+    s->paio_queue = paio_queue_new();
 
     return 0;
 
@@ -524,7 +526,7 @@ static BlockDriverAIOCB *raw_aio_submit(BlockDriverState *bs,
         }
     }
 
-    return paio_submit(bs, s->fd, sector_num, qiov, nb_sectors,
+    return paio_submit(bs, s->paio_queue, s->fd, sector_num, qiov, nb_sectors,
                        cb, opaque, type);
 }
 
@@ -544,6 +546,28 @@ static BlockDriverAIOCB *raw_aio_writev(BlockDriverState *bs,
                           cb, opaque, QEMU_AIO_WRITE);
 }
 
+static void raw_io_plug(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_aio) {
+        laio_io_plug(s->aio_ctx);
+    }
+#endif
+}
+
+static void raw_io_unplug(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_aio) {
+        laio_io_unplug(s->aio_ctx);
+    }
+#endif
+}
+
 static BlockDriverAIOCB *raw_aio_flush(BlockDriverState *bs,
         BlockDriverCompletionFunc *cb, void *opaque)
 {
@@ -552,12 +576,17 @@ static BlockDriverAIOCB *raw_aio_flush(BlockDriverState *bs,
     if (fd_open(bs) < 0)
         return NULL;
 
-    return paio_submit(bs, s->fd, 0, NULL, 0, cb, opaque, QEMU_AIO_FLUSH);
+    return paio_submit(bs, s->paio_queue, s->fd, 0, NULL, 0, cb, opaque,
+                       QEMU_AIO_FLUSH);
 }
 
 static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
+    if (s->paio_queue) {
+        paio_queue_free(s->paio_queue);
+        s->paio_queue = NULL;
+    }
     if (s->fd >= 0) {
         close(s->fd);
         s->fd = -1;
@@ -566,6 +595,51 @@ static void raw_close(BlockDriverState *bs)
     }
 }
 
+/*
+ * Returns the host file descriptor of a raw image that is opened with
+ * cache=none,aio=native, so that callers can submit Linux AIO on it without
+ * going through the block layer.
+ */
+int raw_get_aio_fd(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s;
+
+    if (!bs->drv) {
+        return -ENOMEDIUM;
+    }
+
+    if (!strcmp(bs->drv->format_name, "raw")) {
+        bs = bs->file;
+        if (!bs || !bs->drv) {
+            return -ENOTSUP;
+        }
+    }
+
+    /* raw-posix has several protocols, all using the same AIO entry point */
+    if (bs->drv->bdrv_aio_readv != raw_aio_readv) {
+        return -ENOTSUP;
+    }
+
+    s = bs->opaque;
+    if (!s->use_aio || s->fd < 0) {
+        return -ENOTSUP;
+    }
+    return s->fd;
+#else
+    return -ENOTSUP;
+#endif
+}
+
+static int raw_get_aio_pool_stats(BlockDriverState *bs,
+    BlockAIOPoolStats *stats)
+{
+    BDRVRawState *s = bs->opaque;
+
+    paio_get_stats(s->paio_queue, stats);
+    return 0;
+}
+
 static int raw_truncate(BlockDriverState *bs, int64_t offset)
 {
     BDRVRawState *s = bs->opaque;
@@ -745,12 +819,15 @@ static BlockDriver bdrv_file = {
     .bdrv_read = raw_read,
     .bdrv_write = raw_write,
     .bdrv_close = raw_close,
+    .bdrv_get_aio_pool_stats = raw_get_aio_pool_stats,
     .bdrv_create = raw_create,
     .bdrv_flush = raw_flush,
 
     .bdrv_aio_readv = raw_aio_readv,
     .bdrv_aio_writev = raw_aio_writev,
     .bdrv_aio_flush = raw_aio_flush,
+    .bdrv_io_plug = raw_io_plug,
+    .bdrv_io_unplug = raw_io_unplug,
 
     .bdrv_truncate = raw_truncate,
     .bdrv_getlength = raw_getlength,
@@ -941,7 +1018,7 @@ static BlockDriverAIOCB *hdev_aio_ioctl(BlockDriverState *bs,
 
     if (fd_open(bs) < 0)
         return NULL;
-    return paio_ioctl(bs, s->fd, req, buf, cb, opaque);
+    return paio_ioctl(bs, s->paio_queue, s->fd, req, buf, cb, opaque);
 }
 
 #elif defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
@@ -1005,6 +1082,7 @@ static BlockDriver bdrv_host_device = {
     .bdrv_probe_device  = hdev_probe_device,
     .bdrv_file_open     = hdev_open,
     .bdrv_close         = raw_close,
+    .bdrv_get_aio_pool_stats = raw_get_aio_pool_stats,
     .bdrv_create        = hdev_create,
     .create_options     = raw_create_options,
     .bdrv_has_zero_init = hdev_has_zero_init,
@@ -1013,6 +1091,8 @@ static BlockDriver bdrv_host_device = {
     .bdrv_aio_readv	= raw_aio_readv,
     .bdrv_aio_writev	= raw_aio_writev,
     .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_io_plug       = raw_io_plug,
+    .bdrv_io_unplug     = raw_io_unplug,
 
     .bdrv_read          = raw_read,
     .bdrv_write         = raw_write,
@@ -1120,6 +1200,7 @@ static BlockDriver bdrv_host_floppy = {
     .bdrv_probe_device	= floppy_probe_device,
     .bdrv_file_open     = floppy_open,
     .bdrv_close         = raw_close,
+    .bdrv_get_aio_pool_stats = raw_get_aio_pool_stats,
     .bdrv_create        = hdev_create,
     .create_options     = raw_create_options,
     .bdrv_has_zero_init = hdev_has_zero_init,
@@ -1217,6 +1298,7 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_probe_device	= cdrom_probe_device,
     .bdrv_file_open     = cdrom_open,
     .bdrv_close         = raw_close,
+    .bdrv_get_aio_pool_stats = raw_get_aio_pool_stats,
     .bdrv_create        = hdev_create,
     .create_options     = raw_create_options,
     .bdrv_has_zero_init = hdev_has_zero_init,
@@ -1340,6 +1422,7 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_probe_device	= cdrom_probe_device,
     .bdrv_file_open     = cdrom_open,
     .bdrv_close         = raw_close,
+    .bdrv_get_aio_pool_stats = raw_get_aio_pool_stats,
     .bdrv_create        = hdev_create,
     .create_options     = raw_create_options,
     .bdrv_has_zero_init = hdev_has_zero_init,
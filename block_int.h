@@ -46,6 +46,15 @@ typedef struct AIOPool {
     BlockDriverAIOCB *free_aiocb;
 } AIOPool;
 
+/* Statistics of the thread pool that serves the requests of a drive */
+typedef struct BlockAIOPoolStats {
+    int64_t requests;       /* requests submitted */
+    int64_t stolen;         /* requests processed by threads of other drives */
+    int max_queue_depth;    /* highest number of requests waiting for a thread */
+    int threads;
+    int idle_threads;
+} BlockAIOPoolStats;
+
 struct BlockDriver {
     const char *format_name;
     int instance_size;
@@ -79,6 +88,14 @@ struct BlockDriver {
     int (*bdrv_merge_requests)(BlockDriverState *bs, BlockRequest* a,
         BlockRequest *b);
 
+    /* Requests between plug and unplug may be submitted to the host at once */
+    void (*bdrv_io_plug)(BlockDriverState *bs);
+    void (*bdrv_io_unplug)(BlockDriverState *bs);
+
+    /* Returns 0 and fills stats if the driver uses a thread pool */
+    int (*bdrv_get_aio_pool_stats)(BlockDriverState *bs,
+        BlockAIOPoolStats *stats);
+
 
     const char *protocol_name;
     int (*bdrv_truncate)(BlockDriverState *bs, int64_t offset);
@@ -187,6 +204,9 @@ struct BlockDriverState {
     /* do we need to tell the quest if we have a volatile write cache? */
     int enable_write_cache;
 
+    /* size of the image metadata cache in bytes, 0 for the driver default */
+    uint64_t l2_cache_size;
+
     /* NOTE: the following infos are only hints for real hardware
        drivers. They are not used by the block driver */
     int cyls, heads, secs, translation;
@@ -151,6 +151,7 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi, int *fatal_error)
     const char *devaddr;
     DriveInfo *dinfo;
     int snapshot = 0;
+    uint64_t l2_cache_size;
     int ret;
 
     *fatal_error = 1;
@@ -179,6 +180,7 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi, int *fatal_error)
 
     snapshot = qemu_opt_get_bool(opts, "snapshot", 0);
     ro = qemu_opt_get_bool(opts, "readonly", 0);
+    l2_cache_size = qemu_opt_get_size(opts, "l2-cache-size", 0);
 
     file = qemu_opt_get(opts, "file");
     serial = qemu_opt_get(opts, "serial");
@@ -422,6 +424,7 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi, int *fatal_error)
     QTAILQ_INSERT_TAIL(&drives, dinfo, next);
 
     bdrv_set_on_error(dinfo->bdrv, on_read_error, on_write_error);
+    bdrv_set_l2_cache_size(dinfo->bdrv, l2_cache_size);
 
     switch(type) {
     case IF_IDE:
@@ -0,0 +1,164 @@
+/*
+ * posix-aio-compat unit-tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+#include <check.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+/*
+ * Reads block until the test lets them go, so that it can control how many
+ * worker threads are busy.
+ */
+static pthread_mutex_t gate_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gate_cond = PTHREAD_COND_INITIALIZER;
+static int gate_open;
+static int gate_waiters;
+
+static ssize_t test_pread(int fd, void *buf, size_t count, off_t offset)
+{
+    pthread_mutex_lock(&gate_lock);
+    gate_waiters++;
+    pthread_cond_broadcast(&gate_cond);
+    while (!gate_open) {
+        pthread_cond_wait(&gate_cond, &gate_lock);
+    }
+    gate_waiters--;
+    pthread_mutex_unlock(&gate_lock);
+
+    memset(buf, 0, count);
+    return count;
+}
+
+#define pread test_pread
+
+/* Include the implementation to get at the queues and the thread limit */
+#include "posix-aio-compat.c"
+
+#define NB_QUEUES   3
+
+static int completed;
+static uint8_t buf[512];
+
+static void read_cb(void *opaque, int ret)
+{
+    fail_unless(ret == 0);
+    completed++;
+}
+
+static struct qemu_paiocb *submit_read(void *queue, int fd, QEMUIOVector *qiov)
+{
+    BlockDriverAIOCB *acb;
+
+    acb = paio_submit(NULL, queue, fd, 0, qiov, 1, read_cb, NULL,
+                      QEMU_AIO_READ);
+    fail_unless(acb != NULL);
+    return (struct qemu_paiocb *)acb;
+}
+
+static int count_idle(PaioQueue **q, int n)
+{
+    int i, idle = 0;
+
+    for (i = 0; i < n; i++) {
+        mutex_lock(&q[i]->lock);
+        idle += q[i]->idle_threads;
+        mutex_unlock(&q[i]->lock);
+    }
+    return idle;
+}
+
+/*
+ * Once all threads in the pool are taken, a request for a queue without
+ * threads of its own must still be picked up by an idle thread of another
+ * queue instead of waiting for the idle timeout.
+ */
+START_TEST(steal_at_thread_limit_test)
+{
+    PaioQueue *q[NB_QUEUES];
+    struct qemu_paiocb *acb;
+    QEMUIOVector qiov;
+    struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+    int fd, i, tries;
+
+    max_threads = 4;
+    fail_unless(paio_init() == 0);
+    fd = open("/dev/null", O_RDONLY);
+    fail_unless(fd >= 0);
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    for (i = 0; i < NB_QUEUES; i++) {
+        q[i] = paio_queue_new();
+    }
+
+    /* Take all threads with blocked reads on the first two queues */
+    for (i = 0; i < max_threads; i++) {
+        submit_read(q[i % 2], fd, &qiov);
+    }
+    pthread_mutex_lock(&gate_lock);
+    while (gate_waiters < max_threads) {
+        pthread_cond_wait(&gate_cond, &gate_lock);
+    }
+    gate_open = 1;
+    pthread_cond_broadcast(&gate_cond);
+    pthread_mutex_unlock(&gate_lock);
+
+    /* Let the threads finish and go to sleep */
+    for (tries = 0; count_idle(q, 2) < max_threads; tries++) {
+        fail_unless(tries < 1000);
+        usleep(1000);
+    }
+    fail_unless(cur_threads == max_threads);
+
+    /* The third queue can't get a thread of its own */
+    acb = submit_read(q[2], fd, &qiov);
+    for (tries = 0; qemu_paio_error(acb) == EINPROGRESS; tries++) {
+        fail_unless(tries < 2000, "request was not stolen");
+        usleep(1000);
+    }
+    fail_unless(q[2]->cur_threads == 0);
+    fail_unless(q[2]->stolen == 1);
+
+    qemu_aio_flush();
+    fail_unless(completed == max_threads + 1);
+
+    for (i = 0; i < NB_QUEUES; i++) {
+        paio_queue_free(q[i]);
+    }
+    close(fd);
+}
+END_TEST
+
+static Suite *paio_suite(void)
+{
+    Suite *s;
+    TCase *paio_pool_tcase;
+
+    s = suite_create("posix-aio-compat test-suite");
+
+    paio_pool_tcase = tcase_create("Thread pool");
+    suite_add_tcase(s, paio_pool_tcase);
+    tcase_add_test(paio_pool_tcase, steal_at_thread_limit_test);
+
+    return s;
+}
+
+int main(void)
+{
+    int nf;
+    Suite *s;
+    SRunner *sr;
+
+    s = paio_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_NORMAL);
+    nf = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return (nf == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
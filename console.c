@@ -159,9 +159,27 @@ static TextConsole *active_console;
 static TextConsole *consoles[MAX_CONSOLES];
 static int nb_consoles = 0;
 
+/* true if every listener of ds is idle, e.g. a VNC server without clients
+   or a minimized SDL window: nobody would see a refreshed screen */
+static int display_is_idle(DisplayState *ds)
+{
+    DisplayChangeListener *dcl;
+
+    if (!ds || !ds->listeners)
+        return 0;
+    for (dcl = ds->listeners; dcl != NULL; dcl = dcl->next) {
+        if (!dcl->idle)
+            return 0;
+    }
+    return 1;
+}
+
 void vga_hw_update(void)
 {
-    if (active_console && active_console->hw_update)
+    /* Dirty tracking keeps accumulating while the display is idle, so the
+       first update after a listener wakes up catches up on everything. */
+    if (active_console && active_console->hw_update &&
+        !display_is_idle(active_console->ds))
         active_console->hw_update(active_console->hw);
 }
 
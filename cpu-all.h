@@ -950,6 +950,8 @@ static inline void cpu_physical_memory_mask_dirty_range(ram_addr_t start,
 
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
                                      int dirty_flags);
+int cpu_physical_memory_get_dirty_bitmap(ram_addr_t start, ram_addr_t end,
+                                         int dirty_flags, uint64_t *bitmap);
 void cpu_tlb_update_dirty(CPUState *env);
 
 int cpu_physical_memory_set_dirty_tracking(int enable);
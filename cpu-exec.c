@@ -99,37 +99,12 @@ void cpu_resume_from_signal(CPUState *env1, void *puc)
     longjmp(env->jmp_env, 1);
 }
 
-/* Execute the code without caching the generated code. An interpreter
-   could be used if available. */
-static void cpu_exec_nocache(int max_cycles, TranslationBlock *orig_tb)
-{
-    unsigned long next_tb;
-    TranslationBlock *tb;
-
-    /* Should never happen.
-       We only end up here when an existing TB is too long.  */
-    if (max_cycles > CF_COUNT_MASK)
-        max_cycles = CF_COUNT_MASK;
-
-    tb = tb_gen_code(env, orig_tb->pc, orig_tb->cs_base, orig_tb->flags,
-                     max_cycles);
-    env->current_tb = tb;
-    /* execute the generated code */
-    next_tb = tcg_qemu_tb_exec(tb->tc_ptr);
-    env->current_tb = NULL;
-
-    if ((next_tb & 3) == 2) {
-        /* Restore PC.  This may happen if async event occurs before
-           the TB starts executing.  */
-        cpu_pc_from_tb(env, tb);
-    }
-    tb_phys_invalidate(tb, -1);
-    tb_free(tb);
-}
-
+/* Blocks built with CF_ICOUNT_TAIL only match a lookup asking for the
+   same cflags; every other lookup passes 0 and gets a full-size block. */
 static TranslationBlock *tb_find_slow(target_ulong pc,
                                       target_ulong cs_base,
-                                      uint64_t flags)
+                                      uint64_t flags,
+                                      int cflags)
 {
     TranslationBlock *tb, **ptb1;
     unsigned int h;
@@ -151,7 +126,8 @@ static TranslationBlock *tb_find_slow(target_ulong pc,
         if (tb->pc == pc &&
             tb->page_addr[0] == phys_page1 &&
             tb->cs_base == cs_base &&
-            tb->flags == flags) {
+            tb->flags == flags &&
+            (tb->cflags & CF_ICOUNT_TAIL ? tb->cflags : 0) == cflags) {
             /* check next page if needed */
             if (tb->page_addr[1] != -1) {
                 virt_page2 = (pc & TARGET_PAGE_MASK) +
@@ -167,11 +143,13 @@ static TranslationBlock *tb_find_slow(target_ulong pc,
     }
  not_found:
    /* if no translated code available, then translate it now */
-    tb = tb_gen_code(env, pc, cs_base, flags, 0);
+    tb = tb_gen_code(env, pc, cs_base, flags, cflags);
 
  found:
     /* we add the TB in the virtual pc hash table */
-    env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
+    if (!cflags) {
+        env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
+    }
     return tb;
 }
 
@@ -188,11 +166,42 @@ static inline TranslationBlock *tb_find_fast(void)
     tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
     if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
                  tb->flags != flags)) {
-        tb = tb_find_slow(pc, cs_base, flags);
+        tb = tb_find_slow(pc, cs_base, flags, 0);
     }
     return tb;
 }
 
+/* Execute the first max_cycles instructions of orig_tb, where the
+   instruction budget runs out.  The shortened block stays in the code
+   cache, so the next deadline that lands on the same instruction reuses
+   it; it is only ever found by this exact-length lookup. */
+static void cpu_exec_icount_tail(int max_cycles, TranslationBlock *orig_tb)
+{
+    unsigned long next_tb;
+    TranslationBlock *tb;
+
+    /* Should never happen.
+       We only end up here when an existing TB is too long.  */
+    if (max_cycles > CF_COUNT_MASK)
+        max_cycles = CF_COUNT_MASK;
+
+    tb = tb_find_slow(orig_tb->pc, orig_tb->cs_base, orig_tb->flags,
+                      CF_ICOUNT_TAIL | max_cycles);
+    env->current_tb = tb;
+    /* execute the generated code */
+    jit_prof_where = JIT_PROF_EXEC;
+    next_tb = tcg_qemu_tb_exec(tb->tc_ptr);
+    jit_prof_where = JIT_PROF_DISPATCH;
+    env->current_tb = NULL;
+
+    if ((next_tb & 3) == 2) {
+        /* Restore PC and the budget.  This may happen if async event
+           occurs before the TB starts executing.  */
+        env->icount_decr.u16.low += tb->icount;
+        cpu_pc_from_tb(env, tb);
+    }
+}
+
 static CPUDebugExcpHandler *debug_excp_handler;
 
 CPUDebugExcpHandler *cpu_set_debug_excp_handler(CPUDebugExcpHandler *handler)
@@ -231,6 +240,7 @@ int cpu_exec(CPUState *env1)
         return EXCP_HALTED;
 
     cpu_single_env = env1;
+    jit_prof_where = JIT_PROF_DISPATCH;
 
     /* the access to env below is actually saving the global register's
        value, so that files not including target-xyz/exec.h are free to
@@ -279,6 +289,8 @@ int cpu_exec(CPUState *env1)
                     env = cpu_single_env;
 #define env cpu_single_env
 #endif
+            /* also after a longjmp out of translated code or a helper */
+            jit_prof_where = JIT_PROF_DISPATCH;
             /* if an exception is pending, we execute it here */
             if (env->exception_index >= 0) {
                 if (env->exception_index >= EXCP_INTERRUPT) {
@@ -618,13 +630,17 @@ int cpu_exec(CPUState *env1)
                         update_ibtc_entry(tb);
 #endif
 
+                    jit_prof_where = JIT_PROF_EXEC;
                     next_tb = tcg_qemu_tb_exec(tc_ptr);
+                    jit_prof_where = JIT_PROF_DISPATCH;
                     if ((next_tb & 3) == 2) {
                         /* Instruction counter expired.  */
                         int insns_left;
                         tb = (TranslationBlock *)(long)(next_tb & ~3);
-                        /* Restore PC.  */
+                        /* Restore PC, and refund the block: its prologue
+                           charges the budget before checking it.  */
                         cpu_pc_from_tb(env, tb);
+                        env->icount_decr.u16.low += tb->icount;
                         insns_left = env->icount_decr.u32;
                         if (env->icount_extra && insns_left >= 0) {
                             /* Refill decrementer and continue execution.  */
@@ -636,10 +652,12 @@ int cpu_exec(CPUState *env1)
                             }
                             env->icount_extra -= insns_left;
                             env->icount_decr.u16.low = insns_left;
+                            /* tb did not exit through a jump slot.  */
+                            next_tb = 0;
                         } else {
                             if (insns_left > 0) {
                                 /* Execute remaining instructions.  */
-                                cpu_exec_nocache(insns_left, tb);
+                                cpu_exec_icount_tail(insns_left, tb);
                             }
                             env->exception_index = EXCP_INTERRUPT;
                             next_tb = 0;
@@ -684,6 +702,7 @@ int cpu_exec(CPUState *env1)
 
     /* fail safe : never use cpu_single_env outside cpu_exec() */
     cpu_single_env = NULL;
+    jit_prof_where = JIT_PROF_OTHER;
     return ret;
 }
 
@@ -558,8 +558,10 @@ static void tcg_init_ipi(void)
     sigact.sa_handler = cpu_signal;
     sigaction(SIG_IPI, &sigact, NULL);
 
+    /* The JIT profiler's SIGPROF is meant for the TCG thread */
     sigemptyset(&set);
     sigaddset(&set, SIG_IPI);
+    sigaddset(&set, SIGPROF);
     pthread_sigmask(SIG_UNBLOCK, &set, NULL);
 }
 
@@ -596,8 +598,11 @@ static void unblock_io_signals(void)
     sigaddset(&set, SIGALRM);
     pthread_sigmask(SIG_UNBLOCK, &set, NULL);
 
+    /* Also keep the process-wide SIGPROF away from the io thread and the
+       threads it creates, so that it only lands in the TCG thread */
     sigemptyset(&set);
     sigaddset(&set, SIG_IPI);
+    sigaddset(&set, SIGPROF);
     pthread_sigmask(SIG_BLOCK, &set, NULL);
 }
 
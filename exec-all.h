@@ -131,9 +131,11 @@ struct TranslationBlock {
     uint64_t flags; /* flags defining in which context the code was generated */
     uint16_t size;      /* size of target code for this block (1 <=
                            size <= TARGET_PAGE_SIZE) */
-    uint16_t cflags;    /* compile flags */
+    uint32_t cflags;    /* compile flags */
 #define CF_COUNT_MASK  0x7fff
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
+#define CF_ICOUNT_TAIL 0x10000 /* Runs out the icount budget; only found
+                                  by an exact cflags match.  */
 
     uint8_t *tc_ptr;    /* pointer to the translated code */
     /* next matching tb for physical address. */
@@ -158,6 +160,7 @@ struct TranslationBlock {
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
     uint32_t icount;
+    uint32_t prof_samples; /* JIT profiler samples taken in this TB */
 };
 
 static inline unsigned int tb_jmp_cache_hash_page(target_ulong pc)
@@ -271,6 +274,64 @@ extern spinlock_t tb_lock;
 
 extern int tb_invalidated_flag;
 
+/* Runtime TCG statistics, written out by tcg_stats_report() when the
+   QEMU_TCG_STATS environment variable names an output file ("-" for
+   stderr).  Counting guest instructions and shadow stack outcomes adds
+   code to the translated blocks, so it is decided once at startup.  */
+typedef struct TCGStats {
+    uint64_t insns;             /* guest instructions executed */
+    uint64_t tb_translated;
+    int64_t translate_ticks;    /* host ticks spent in tb_gen_code() */
+    uint64_t ibtc_hits;
+    uint64_t ibtc_misses;
+    uint64_t shack_hits;
+    uint64_t shack_misses;
+    uint64_t tlb_fills;         /* softmmu TLB refills */
+} TCGStats;
+
+extern TCGStats tcg_stats;
+extern int tcg_stats_enabled;
+
+void tcg_stats_init(void);
+void tcg_stats_report(void);
+
+/* Sampling JIT profiler.  A SIGPROF timer classifies each sample by what
+   the interrupted thread was doing (jit_prof_where) and, for samples in
+   translated code, charges the TB the host PC falls in.  */
+enum {
+    JIT_PROF_OTHER,     /* not running guest code: main loop, devices */
+    JIT_PROF_DISPATCH,  /* cpu_exec() loop, TB lookup, prologue */
+    JIT_PROF_TRANSLATE, /* tb_gen_code() */
+    JIT_PROF_EXEC,      /* translated code */
+    JIT_PROF_HELPER,    /* helpers called from translated code */
+    JIT_PROF_NB,
+};
+
+#define JIT_PROFILE_TOP 16
+
+typedef struct JitProfileEntry {
+    target_ulong pc;
+    unsigned long host_pc;      /* 0 in the per-PC summary */
+    uint64_t samples;
+} JitProfileEntry;
+
+typedef struct JitProfile {
+    int enabled;
+    int perf_map;
+    int hz;
+    uint64_t samples[JIT_PROF_NB];
+    int nb_hot_tbs;
+    JitProfileEntry hot_tbs[JIT_PROFILE_TOP];
+    int nb_hot_pcs;
+    JitProfileEntry hot_pcs[JIT_PROFILE_TOP];
+} JitProfile;
+
+extern __thread int jit_prof_where;
+
+int jit_profile_set(int enable, int perf_map);
+void jit_profile_get(JitProfile *prof);
+void jit_profile_report(void);
+
 #if !defined(CONFIG_USER_ONLY)
 
 extern CPUWriteMemoryFunc *io_mem_write[IO_MEM_NB_ENTRIES][4];
@@ -22,6 +22,8 @@
 #else
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/time.h>
+#include <signal.h>
 #endif
 #include <stdlib.h>
 #include <stdio.h>
@@ -40,6 +42,7 @@
 #include "osdep.h"
 #include "kvm.h"
 #include "qemu-timer.h"
+#include "optimization.h"
 #if defined(CONFIG_USER_ONLY)
 #include <qemu.h>
 #include <signal.h>
@@ -228,6 +231,12 @@ static int tlb_flush_count;
 static int tb_flush_count;
 static int tb_phys_invalidate_count;
 
+TCGStats tcg_stats;
+int tcg_stats_enabled;
+static const char *tcg_stats_file;
+static int64_t tcg_stats_start_ticks;
+static int64_t tcg_stats_start_us;
+
 #ifdef _WIN32
 static void map_exec(void *addr, long size)
 {
@@ -561,6 +570,400 @@ static void code_gen_alloc(unsigned long tb_size)
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
    (in bytes) allocated to the translation buffer. Zero means default
    size. */
+static int64_t tcg_stats_clock_us(void)
+{
+    qemu_timeval tv;
+
+    qemu_gettimeofday(&tv);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+void tcg_stats_init(void)
+{
+    tcg_stats_file = getenv("QEMU_TCG_STATS");
+    if (!tcg_stats_file || !*tcg_stats_file) {
+        return;
+    }
+    tcg_stats_enabled = 1;
+    tcg_stats_start_ticks = cpu_get_real_ticks();
+    tcg_stats_start_us = tcg_stats_clock_us();
+    atexit(tcg_stats_report);
+}
+
+/* Write the counters as one line of JSON; the derived rates are left to
+   the consumer (see tests/bench/run-bench.sh).  */
+void tcg_stats_report(void)
+{
+    int64_t wall_us, wall_ticks, translate_us;
+    int tlb_flushes;
+    FILE *f;
+
+    if (!tcg_stats_enabled) {
+        return;
+    }
+    /* report once, whichever exit path gets here first */
+    tcg_stats_enabled = 0;
+
+    wall_us = tcg_stats_clock_us() - tcg_stats_start_us;
+    wall_ticks = cpu_get_real_ticks() - tcg_stats_start_ticks;
+    translate_us = wall_ticks > 0 ?
+        (double)tcg_stats.translate_ticks * wall_us / wall_ticks : 0;
+#if defined(CONFIG_USER_ONLY)
+    tlb_flushes = 0;
+#else
+    tlb_flushes = tlb_flush_count;
+#endif
+
+    if (!strcmp(tcg_stats_file, "-")) {
+        f = stderr;
+    } else {
+        f = fopen(tcg_stats_file, "a");
+        if (!f) {
+            fprintf(stderr, "qemu: could not open %s: %s\n",
+                    tcg_stats_file, strerror(errno));
+            return;
+        }
+    }
+    fprintf(f, "{\"wall_us\": %" PRId64 ", \"insns\": %" PRIu64
+            ", \"tb_translated\": %" PRIu64 ", \"translate_us\": %" PRId64
+            ", \"tb_flushes\": %d, \"tb_invalidates\": %d"
+            ", \"ibtc_hits\": %" PRIu64 ", \"ibtc_misses\": %" PRIu64
+            ", \"shack_hits\": %" PRIu64 ", \"shack_misses\": %" PRIu64
+            ", \"tlb_fills\": %" PRIu64 ", \"tlb_flushes\": %d}\n",
+            wall_us, tcg_stats.insns, tcg_stats.tb_translated, translate_us,
+            tb_flush_count, tb_phys_invalidate_count,
+            tcg_stats.ibtc_hits, tcg_stats.ibtc_misses,
+            tcg_stats.shack_hits, tcg_stats.shack_misses,
+            tcg_stats.tlb_fills, tlb_flushes);
+    if (f != stderr) {
+        fclose(f);
+    }
+}
+
+/* JIT profiler */
+
+#define JIT_PROF_HZ 1000
+
+__thread int jit_prof_where;
+static int jit_prof_enabled;
+static uint64_t jit_prof_samples[JIT_PROF_NB];
+static FILE *jit_perf_map;
+static const char *jit_prof_report_file;
+
+static void jit_perf_map_add(TranslationBlock *tb, int size)
+{
+    fprintf(jit_perf_map, "%lx %x qemu:" TARGET_FMT_lx "\n",
+            (unsigned long)tb->tc_ptr, size, tb->pc);
+}
+
+/* Host size of a TB: TBs are laid out in allocation order until the
+   next flush, so it runs to the start of the next one.  */
+static int jit_tb_host_size(int n)
+{
+    uint8_t *end = n + 1 < nb_tbs ? tbs[n + 1].tc_ptr : code_gen_ptr;
+
+    return end - tbs[n].tc_ptr;
+}
+
+static int jit_perf_map_open(void)
+{
+    char path[64];
+    int i;
+
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+    jit_perf_map = fopen(path, "a");
+    if (!jit_perf_map) {
+        return -errno;
+    }
+    /* perf reads the map while we run; keep every entry complete in it */
+    setvbuf(jit_perf_map, NULL, _IOLBF, 0);
+    fprintf(jit_perf_map, "%lx %x qemu:prologue\n",
+            (unsigned long)code_gen_prologue,
+            (int)sizeof(code_gen_prologue));
+    for (i = 0; i < nb_tbs; i++) {
+        jit_perf_map_add(&tbs[i], jit_tb_host_size(i));
+    }
+    return 0;
+}
+
+static void jit_perf_map_close(void)
+{
+    if (jit_perf_map) {
+        fclose(jit_perf_map);
+        jit_perf_map = NULL;
+    }
+}
+
+#ifndef _WIN32
+static struct sigaction jit_prof_old_action;
+
+static unsigned long jit_prof_host_pc(void *puc)
+{
+#if defined(__linux__) && defined(__x86_64__)
+    return ((ucontext_t *)puc)->uc_mcontext.gregs[REG_RIP];
+#elif defined(__linux__) && defined(__i386__)
+    return ((ucontext_t *)puc)->uc_mcontext.gregs[REG_EIP];
+#else
+    return 0;
+#endif
+}
+
+static void jit_prof_sample(int sig, siginfo_t *info, void *puc)
+{
+    int where = jit_prof_where;
+    unsigned long pc;
+    TranslationBlock *tb;
+
+    if (where == JIT_PROF_EXEC) {
+        pc = jit_prof_host_pc(puc);
+        if (pc >= (unsigned long)code_gen_buffer &&
+            pc < (unsigned long)code_gen_ptr) {
+            tb = tb_find_pc(pc);
+            if (tb) {
+                tb->prof_samples++;
+            }
+        } else if (pc >= (unsigned long)code_gen_prologue &&
+                   pc < (unsigned long)code_gen_prologue +
+                        sizeof(code_gen_prologue)) {
+            where = JIT_PROF_DISPATCH;
+        } else if (pc) {
+            where = JIT_PROF_HELPER;
+        }
+    }
+    jit_prof_samples[where]++;
+}
+
+static int jit_prof_start(void)
+{
+    struct sigaction act;
+    struct itimerval it;
+    int i;
+
+    memset(jit_prof_samples, 0, sizeof(jit_prof_samples));
+    for (i = 0; i < nb_tbs; i++) {
+        tbs[i].prof_samples = 0;
+    }
+
+    memset(&act, 0, sizeof(act));
+    act.sa_sigaction = jit_prof_sample;
+    act.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigfillset(&act.sa_mask);
+    if (sigaction(SIGPROF, &act, &jit_prof_old_action) < 0) {
+        return -errno;
+    }
+
+    it.it_interval.tv_sec = 0;
+    it.it_interval.tv_usec = 1000000 / JIT_PROF_HZ;
+    it.it_value = it.it_interval;
+    if (setitimer(ITIMER_PROF, &it, NULL) < 0) {
+        int ret = -errno;
+
+        sigaction(SIGPROF, &jit_prof_old_action, NULL);
+        return ret;
+    }
+    return 0;
+}
+
+static void jit_prof_stop(void)
+{
+    struct itimerval it;
+
+    memset(&it, 0, sizeof(it));
+    setitimer(ITIMER_PROF, &it, NULL);
+    sigaction(SIGPROF, &jit_prof_old_action, NULL);
+}
+#else
+static int jit_prof_start(void)
+{
+    return -ENOTSUP;
+}
+
+static void jit_prof_stop(void)
+{
+}
+#endif
+
+/* Start or stop sampling; perf_map additionally (re)writes
+   /tmp/perf-<pid>.map so that host perf can symbolize the code buffer.
+   Starting again resets the samples.  */
+int jit_profile_set(int enable, int perf_map)
+{
+    int ret;
+
+    if (jit_prof_enabled) {
+        jit_prof_stop();
+        jit_prof_enabled = 0;
+    }
+    jit_perf_map_close();
+    if (!enable) {
+        return 0;
+    }
+
+    if (perf_map) {
+        ret = jit_perf_map_open();
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    ret = jit_prof_start();
+    if (ret < 0) {
+        jit_perf_map_close();
+        return ret;
+    }
+    jit_prof_enabled = 1;
+    return 0;
+}
+
+/* While this is true the profiler owns SIGPROF and ITIMER_PROF */
+int jit_profile_active(void)
+{
+    return jit_prof_enabled;
+}
+
+static void jit_prof_insert(JitProfileEntry *top, int *n,
+                            target_ulong pc, unsigned long host_pc,
+                            uint64_t samples)
+{
+    int i;
+
+    if (*n == JIT_PROFILE_TOP && top[*n - 1].samples >= samples) {
+        return;
+    }
+    i = *n < JIT_PROFILE_TOP ? (*n)++ : *n - 1;
+    for (; i > 0 && top[i - 1].samples < samples; i--) {
+        top[i] = top[i - 1];
+    }
+    top[i].pc = pc;
+    top[i].host_pc = host_pc;
+    top[i].samples = samples;
+}
+
+static int jit_prof_cmp_pc(const void *a, const void *b)
+{
+    const JitProfileEntry *ea = a, *eb = b;
+
+    return ea->pc < eb->pc ? -1 : ea->pc > eb->pc;
+}
+
+void jit_profile_get(JitProfile *prof)
+{
+    JitProfileEntry *pcs;
+    int i, n;
+
+    memset(prof, 0, sizeof(*prof));
+    prof->enabled = jit_prof_enabled;
+    prof->perf_map = jit_perf_map != NULL;
+    prof->hz = JIT_PROF_HZ;
+    memcpy(prof->samples, jit_prof_samples, sizeof(prof->samples));
+
+    /* hottest TBs, and the same samples summed per guest PC, since one PC
+       can be translated several times with different flags */
+    pcs = qemu_malloc(sizeof(*pcs) * (nb_tbs + 1));
+    n = 0;
+    for (i = 0; i < nb_tbs; i++) {
+        if (!tbs[i].prof_samples) {
+            continue;
+        }
+        jit_prof_insert(prof->hot_tbs, &prof->nb_hot_tbs, tbs[i].pc,
+                        (unsigned long)tbs[i].tc_ptr, tbs[i].prof_samples);
+        pcs[n].pc = tbs[i].pc;
+        pcs[n].samples = tbs[i].prof_samples;
+        n++;
+    }
+    qsort(pcs, n, sizeof(*pcs), jit_prof_cmp_pc);
+    for (i = 0; i < n; i++) {
+        if (i + 1 < n && pcs[i + 1].pc == pcs[i].pc) {
+            pcs[i + 1].samples += pcs[i].samples;
+            continue;
+        }
+        jit_prof_insert(prof->hot_pcs, &prof->nb_hot_pcs, pcs[i].pc, 0,
+                        pcs[i].samples);
+    }
+    qemu_free(pcs);
+}
+
+static const char * const jit_prof_names[JIT_PROF_NB] = {
+    [JIT_PROF_OTHER] = "other",
+    [JIT_PROF_DISPATCH] = "dispatch",
+    [JIT_PROF_TRANSLATE] = "translate",
+    [JIT_PROF_EXEC] = "exec",
+    [JIT_PROF_HELPER] = "helper",
+};
+
+/* Text report for QEMU_JIT_PROFILE; the monitor has "info jit-profile".  */
+void jit_profile_report(void)
+{
+    JitProfile prof;
+    uint64_t total = 0;
+    FILE *f;
+    int i;
+
+    if (!jit_prof_report_file || !jit_prof_enabled) {
+        return;
+    }
+    jit_profile_get(&prof);
+    jit_profile_set(0, 0);
+
+    if (!strcmp(jit_prof_report_file, "-")) {
+        f = stderr;
+    } else {
+        f = fopen(jit_prof_report_file, "a");
+        if (!f) {
+            fprintf(stderr, "qemu: could not open %s: %s\n",
+                    jit_prof_report_file, strerror(errno));
+            return;
+        }
+    }
+    for (i = 0; i < JIT_PROF_NB; i++) {
+        total += prof.samples[i];
+    }
+    fprintf(f, "JIT profile: %" PRIu64 " samples at %d Hz\n",
+            total, prof.hz);
+    for (i = 0; i < JIT_PROF_NB; i++) {
+        fprintf(f, "  %-10s %5.1f%%\n", jit_prof_names[i],
+                total ? prof.samples[i] * 100.0 / total : 0);
+    }
+    fprintf(f, "hottest TBs:\n");
+    for (i = 0; i < prof.nb_hot_tbs; i++) {
+        fprintf(f, "  pc " TARGET_FMT_lx " host %#lx %5.1f%%\n",
+                prof.hot_tbs[i].pc, prof.hot_tbs[i].host_pc,
+                prof.hot_tbs[i].samples * 100.0 / total);
+    }
+    fprintf(f, "hottest guest PCs:\n");
+    for (i = 0; i < prof.nb_hot_pcs; i++) {
+        fprintf(f, "  pc " TARGET_FMT_lx " %5.1f%%\n",
+                prof.hot_pcs[i].pc,
+                prof.hot_pcs[i].samples * 100.0 / total);
+    }
+    if (f != stderr) {
+        fclose(f);
+    }
+}
+
+/* QEMU_JIT_PROFILE=<file|-> profiles from startup and writes a report at
+   exit; QEMU_PERF_MAP=1 writes /tmp/perf-<pid>.map.  Called once signal
+   handlers are set up, as SIGPROF is taken over while profiling.  */
+void jit_profile_init(void)
+{
+    const char *perf_map = getenv("QEMU_PERF_MAP");
+    int ret;
+
+    jit_prof_report_file = getenv("QEMU_JIT_PROFILE");
+    if (jit_prof_report_file && !*jit_prof_report_file) {
+        jit_prof_report_file = NULL;
+    }
+    if (!jit_prof_report_file && !(perf_map && *perf_map)) {
+        return;
+    }
+    ret = jit_profile_set(1, perf_map && *perf_map);
+    if (ret < 0) {
+        fprintf(stderr, "qemu: could not start JIT profiler: %s\n",
+                strerror(-ret));
+        return;
+    }
+    atexit(jit_profile_report);
+}
+
 void cpu_exec_init_all(unsigned long tb_size)
 {
     cpu_gen_init();
@@ -570,6 +973,7 @@ void cpu_exec_init_all(unsigned long tb_size)
 #if !defined(CONFIG_USER_ONLY)
     io_mem_init();
 #endif
+    tcg_stats_init();
 #if !defined(CONFIG_USER_ONLY) || !defined(CONFIG_USE_GUEST_BASE)
     /* There's no guest base to take into account, so go ahead and
        initialize the prologue now.  */
@@ -710,6 +1114,9 @@ void tb_flush(CPUState *env1)
 
     memset (tb_phys_hash, 0, CODE_GEN_PHYS_HASH_SIZE * sizeof (void *));
     page_flush_tb();
+#ifdef ENABLE_OPTIMIZATION
+    optimization_tb_flush();
+#endif
 
     code_gen_ptr = code_gen_buffer;
     /* XXX: flush processor icache at this point if cache flush is
@@ -876,6 +1283,9 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     }
     tb->jmp_first = (TranslationBlock *)((long)tb | 2); /* fail safe */
 
+#ifdef ENABLE_OPTIMIZATION
+    optimization_tb_invalidate(tb);
+#endif
     tb_phys_invalidate_count++;
 }
 
@@ -942,7 +1352,7 @@ TranslationBlock *tb_gen_code(CPUState *env,
     uint8_t *tc_ptr;
     tb_page_addr_t phys_pc, phys_page2;
     target_ulong virt_page2;
-    int code_gen_size;
+    int code_gen_size, where;
 
     phys_pc = get_page_addr_code(env, pc);
     tb = tb_alloc(pc);
@@ -959,7 +1369,21 @@ TranslationBlock *tb_gen_code(CPUState *env,
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
-    cpu_gen_code(env, tb, &code_gen_size);
+    where = jit_prof_where;
+    jit_prof_where = JIT_PROF_TRANSLATE;
+    if (tcg_stats_enabled) {
+        int64_t ticks = cpu_get_real_ticks();
+
+        cpu_gen_code(env, tb, &code_gen_size);
+        tcg_stats.translate_ticks += cpu_get_real_ticks() - ticks;
+        tcg_stats.tb_translated++;
+    } else {
+        cpu_gen_code(env, tb, &code_gen_size);
+    }
+    jit_prof_where = where;
+    if (jit_perf_map) {
+        jit_perf_map_add(tb, code_gen_size);
+    }
     code_gen_ptr = (void *)(((unsigned long)code_gen_ptr + code_gen_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
 
     /* check next page if needed */
@@ -1237,6 +1661,7 @@ TranslationBlock *tb_alloc(target_ulong pc)
     tb = &tbs[nb_tbs++];
     tb->pc = pc;
     tb->cflags = 0;
+    tb->prof_samples = 0;
     return tb;
 }
 
@@ -1739,7 +2164,8 @@ static int cpu_notify_migration_log(int enable)
 }
 
 static void phys_page_for_each_1(CPUPhysMemoryClient *client,
-                                 int level, void **lp)
+                                 int level, void **lp,
+                                 target_phys_addr_t addr)
 {
     int i;
 
@@ -1748,16 +2174,18 @@ static void phys_page_for_each_1(CPUPhysMemoryClient *client,
     }
     if (level == 0) {
         PhysPageDesc *pd = *lp;
+        addr <<= L2_BITS + TARGET_PAGE_BITS;
         for (i = 0; i < L2_SIZE; ++i) {
             if (pd[i].phys_offset != IO_MEM_UNASSIGNED) {
-                client->set_memory(client, pd[i].region_offset,
+                client->set_memory(client, addr | i << TARGET_PAGE_BITS,
                                    TARGET_PAGE_SIZE, pd[i].phys_offset);
             }
         }
     } else {
         void **pp = *lp;
         for (i = 0; i < L2_SIZE; ++i) {
-            phys_page_for_each_1(client, level - 1, pp + i);
+            phys_page_for_each_1(client, level - 1, pp + i,
+                                 (addr << L2_BITS) | i);
         }
     }
 }
@@ -1767,7 +2195,7 @@ static void phys_page_for_each(CPUPhysMemoryClient *client)
     int i;
     for (i = 0; i < P_L1_SIZE; ++i) {
         phys_page_for_each_1(client, P_L1_SHIFT / L2_BITS - 1,
-                             l1_phys_map + 1);
+                             l1_phys_map + i, i);
     }
 }
 
@@ -2055,6 +2483,43 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
     }
 }
 
+/* Collect the dirty_flags state of the pages in [start, end) into bitmap,
+   one bit per page and 64 pages per word.  Clean runs are skipped eight
+   pages at a time.  Returns non-zero if any page is dirty.  */
+int cpu_physical_memory_get_dirty_bitmap(ram_addr_t start, ram_addr_t end,
+                                         int dirty_flags, uint64_t *bitmap)
+{
+    const uint64_t mask = 0x0101010101010101ULL * (uint8_t)dirty_flags;
+    uint8_t *p = ram_list.phys_dirty + (start >> TARGET_PAGE_BITS);
+    unsigned long npages, i;
+    int j, n, dirty = 0;
+
+    npages = (TARGET_PAGE_ALIGN(end) - (start & TARGET_PAGE_MASK))
+        >> TARGET_PAGE_BITS;
+    for (i = 0; i < npages; i += 64, p += 64) {
+        uint64_t word = 0;
+
+        n = MIN(64, npages - i);
+        for (j = 0; j < n; j++) {
+            if ((j & 7) == 0 && n - j >= 8) {
+                uint64_t bytes;
+
+                memcpy(&bytes, p + j, sizeof(bytes));
+                if (!(bytes & mask)) {
+                    j += 7;
+                    continue;
+                }
+            }
+            if (p[j] & dirty_flags) {
+                word |= 1ULL << j;
+            }
+        }
+        bitmap[i / 64] = word;
+        dirty |= (word != 0);
+    }
+    return dirty;
+}
+
 int cpu_physical_memory_set_dirty_tracking(int enable)
 {
     int ret = 0;
@@ -2162,6 +2627,7 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
     CPUWatchpoint *wp;
     target_phys_addr_t iotlb;
 
+    tcg_stats.tlb_fills++;
     assert(size >= TARGET_PAGE_SIZE);
     if (size != TARGET_PAGE_SIZE) {
         tlb_add_large_page(env, vaddr, size);
@@ -3,29 +3,72 @@
 /* Helpers for instruction counting code generation.  */
 
 static TCGArg *icount_arg;
+static TCGArg *stats_insns_arg;
 static int icount_label;
 
-static inline void gen_icount_start(void)
+/* Add the TB's instruction count to tcg_stats.insns.  Only 64-bit hosts
+   can patch the 64-bit immediate in place, so 32-bit hosts don't count.  */
+static inline void gen_stats_insns_start(void)
 {
-    TCGv_i32 count;
+#if TCG_TARGET_REG_BITS == 64
+    TCGv_ptr counter;
+    TCGv_i64 count;
 
-    if (!use_icount)
+    stats_insns_arg = NULL;
+    if (!tcg_stats_enabled)
         return;
 
-    icount_label = gen_new_label();
-    count = tcg_temp_local_new_i32();
-    tcg_gen_ld_i32(count, cpu_env, offsetof(CPUState, icount_decr.u32));
-    /* This is a horrid hack to allow fixing up the value later.  */
-    icount_arg = gen_opparam_ptr + 1;
-    tcg_gen_subi_i32(count, count, 0xdeadbeef);
+    counter = tcg_const_ptr((tcg_target_long)&tcg_stats.insns);
+    count = tcg_temp_new_i64();
+    tcg_gen_ld_i64(count, counter, 0);
+    /* Fixed up by gen_icount_end(), same as icount_arg.  */
+    stats_insns_arg = gen_opparam_ptr + 1;
+    tcg_gen_addi_i64(count, count, 0xdeadbeef);
+    tcg_gen_st_i64(count, counter, 0);
+    tcg_temp_free_i64(count);
+    tcg_temp_free_ptr(counter);
+#endif
+}
+
+/* The low half of icount_decr is the budget, the high half is set to
+   0xffff by cpu_interrupt() to force an exit.  Each half is loaded at
+   its own width so the load can be forwarded from the previous block's
+   16-bit store.  The block is charged before the check, which keeps the
+   count from living across the branch; cpu_exec() refunds tb->icount
+   when the block exits here instead of running.  */
+static inline void gen_icount_start(void)
+{
+    TCGv_i32 count, exit_req;
+
+    if (use_icount) {
+        icount_label = gen_new_label();
+        count = tcg_temp_new_i32();
+        tcg_gen_ld16u_i32(count, cpu_env,
+                          offsetof(CPUState, icount_decr.u16.low));
+        /* This is a horrid hack to allow fixing up the value later.  */
+        icount_arg = gen_opparam_ptr + 1;
+        tcg_gen_subi_i32(count, count, 0xdeadbeef);
+        tcg_gen_st16_i32(count, cpu_env,
+                         offsetof(CPUState, icount_decr.u16.low));
+
+        exit_req = tcg_temp_new_i32();
+        tcg_gen_ld16s_i32(exit_req, cpu_env,
+                          offsetof(CPUState, icount_decr.u16.high));
+        tcg_gen_or_i32(count, count, exit_req);
+        tcg_temp_free_i32(exit_req);
 
-    tcg_gen_brcondi_i32(TCG_COND_LT, count, 0, icount_label);
-    tcg_gen_st16_i32(count, cpu_env, offsetof(CPUState, icount_decr.u16.low));
-    tcg_temp_free_i32(count);
+        tcg_gen_brcondi_i32(TCG_COND_LT, count, 0, icount_label);
+        tcg_temp_free_i32(count);
+    }
+    /* after the icount check, which may leave without executing */
+    gen_stats_insns_start();
 }
 
 static void gen_icount_end(TranslationBlock *tb, int num_insns)
 {
+    if (stats_insns_arg) {
+        *stats_insns_arg = num_insns;
+    }
     if (use_icount) {
         *icount_arg = num_insns;
         gen_set_label(icount_label);
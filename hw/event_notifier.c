@@ -39,6 +39,22 @@ int event_notifier_get_fd(EventNotifier *e)
     return e->fd;
 }
 
+int event_notifier_set(EventNotifier *e)
+{
+    uint64_t value = 1;
+    int r;
+
+    do {
+        r = write(e->fd, &value, sizeof(value));
+    } while (r < 0 && errno == EINTR);
+
+    /* EAGAIN means the counter is saturated, i.e. already signalled */
+    if (r < 0 && errno != EAGAIN) {
+        return -errno;
+    }
+    return 0;
+}
+
 int event_notifier_test_and_clear(EventNotifier *e)
 {
     uint64_t value;
@@ -285,6 +285,9 @@ static int syborg_virtio_net_init(SysBusDevice *dev)
     SyborgVirtIOProxy *proxy = FROM_SYSBUS(SyborgVirtIOProxy, dev);
 
     vdev = virtio_net_init(&dev->qdev, &proxy->nic);
+    if (!vdev) {
+        return -1;
+    }
     return syborg_virtio_init(proxy, vdev);
 }
 
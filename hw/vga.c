@@ -1638,6 +1638,29 @@ void vga_dirty_log_restart(VGACommonState *s)
 /*
  * graphic modes
  */
+
+/* look a page up in the snapshot taken by vga_draw_graphic() */
+static inline int vga_page_is_dirty(VGACommonState *s, ram_addr_t page)
+{
+    ram_addr_t index = (page - s->vram_offset) >> TARGET_PAGE_BITS;
+
+    if (index >= (s->vram_size >> TARGET_PAGE_BITS)) {
+        /* beyond the end of VRAM, not covered by the snapshot */
+        return cpu_physical_memory_get_dirty(page, VGA_DIRTY_FLAG);
+    }
+    return (s->dirty_pages[index / 64] >> (index % 64)) & 1;
+}
+
+static int vga_lines_invalidated(VGACommonState *s, int height)
+{
+    int i;
+
+    for (i = 0; i < (height + 31) >> 5; i++) {
+        if (s->invalidated_y_table[i])
+            return 1;
+    }
+    return 0;
+}
 static void vga_draw_graphic(VGACommonState *s, int full_update)
 {
     int y1, y, update, linesize, y_start, double_scan, mask, depth;
@@ -1689,7 +1712,9 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
         height != s->last_height ||
         s->last_depth != depth) {
 #if defined(HOST_WORDS_BIGENDIAN) == defined(TARGET_WORDS_BIGENDIAN)
-        if (depth == 16 || depth == 32) {
+        /* VRAM already holds a format the display can use: alias it and
+           skip the line conversion altogether */
+        if (depth == 15 || depth == 16 || depth == 32) {
 #else
         if (depth == 32) {
 #endif
@@ -1772,6 +1797,17 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
     if (!is_buffer_shared(s->ds->surface) && s->cursor_invalidate)
         s->cursor_invalidate(s);
 
+    /* Take the dirty state of all of VRAM at once, 64 pages per word;
+       if nothing changed there is no line to look at. */
+    if (!full_update &&
+        !cpu_physical_memory_get_dirty_bitmap(s->vram_offset,
+                                              s->vram_offset + s->vram_size,
+                                              VGA_DIRTY_FLAG,
+                                              s->dirty_pages) &&
+        !vga_lines_invalidated(s, height)) {
+        return;
+    }
+
     line_offset = s->line_offset;
 #if 0
     printf("w=%d h=%d v=%d line_offset=%d cr[0x09]=0x%02x cr[0x17]=0x%02x linecmp=%d sr[0x01]=0x%02x\n",
@@ -1798,13 +1834,11 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
         }
         page0 = s->vram_offset + (addr & TARGET_PAGE_MASK);
         page1 = s->vram_offset + ((addr + bwidth - 1) & TARGET_PAGE_MASK);
-        update = full_update |
-            cpu_physical_memory_get_dirty(page0, VGA_DIRTY_FLAG) |
-            cpu_physical_memory_get_dirty(page1, VGA_DIRTY_FLAG);
-        if ((page1 - page0) > TARGET_PAGE_SIZE) {
+        update = full_update ||
+            vga_page_is_dirty(s, page0) || vga_page_is_dirty(s, page1);
+        if (!update && (page1 - page0) > TARGET_PAGE_SIZE) {
             /* if wide line, can use another page */
-            update |= cpu_physical_memory_get_dirty(page0 + TARGET_PAGE_SIZE,
-                                                    VGA_DIRTY_FLAG);
+            update = vga_page_is_dirty(s, page0 + TARGET_PAGE_SIZE);
         }
         /* explicit invalidation for the hardware cursor */
         update |= (s->invalidated_y_table[y >> 5] >> (y & 0x1f)) & 1;
@@ -2264,6 +2298,8 @@ void vga_common_init(VGACommonState *s, int vga_ram_size)
     s->vram_offset = qemu_ram_alloc(NULL, "vga.vram", vga_ram_size);
     s->vram_ptr = qemu_get_ram_ptr(s->vram_offset);
     s->vram_size = vga_ram_size;
+    s->dirty_pages = qemu_mallocz(((vga_ram_size >> TARGET_PAGE_BITS) + 63)
+                                  / 64 * sizeof(uint64_t));
     s->get_bpp = vga_get_bpp;
     s->get_offsets = vga_get_offsets;
     s->get_resolution = vga_get_resolution;
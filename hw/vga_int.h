@@ -171,6 +171,7 @@ typedef struct VGACommonState {
     vga_hw_text_update_ptr text_update;
     /* hardware mouse cursor support */
     uint32_t invalidated_y_table[VGA_MAX_HEIGHT / 32];
+    uint64_t *dirty_pages;  /* VGA_DIRTY_FLAG snapshot, one bit per page */
     void (*cursor_invalidate)(struct VGACommonState *s);
     void (*cursor_draw_line)(struct VGACommonState *s, uint8_t *d, int y);
     /* tell for each page if it has been updated since the last time */
@@ -454,49 +454,52 @@ static int vhost_virtqueue_init(struct vhost_dev *dev,
     struct vhost_vring_state state = {
         .index = idx,
     };
-    struct VirtQueue *vvq = virtio_get_queue(vdev, idx);
+    /* idx is the ring index inside this vhost device, vdev_idx the
+     * index of the same ring among the virtio device's queues. */
+    int vdev_idx = dev->vq_index + idx;
+    struct VirtQueue *vvq = virtio_get_queue(vdev, vdev_idx);
 
     if (!vdev->binding->set_host_notifier) {
         fprintf(stderr, "binding does not support host notifiers\n");
         return -ENOSYS;
     }
 
-    vq->num = state.num = virtio_queue_get_num(vdev, idx);
+    vq->num = state.num = virtio_queue_get_num(vdev, vdev_idx);
     r = ioctl(dev->control, VHOST_SET_VRING_NUM, &state);
     if (r) {
         return -errno;
     }
 
-    state.num = virtio_queue_get_last_avail_idx(vdev, idx);
+    state.num = virtio_queue_get_last_avail_idx(vdev, vdev_idx);
     r = ioctl(dev->control, VHOST_SET_VRING_BASE, &state);
     if (r) {
         return -errno;
     }
 
-    s = l = virtio_queue_get_desc_size(vdev, idx);
-    a = virtio_queue_get_desc_addr(vdev, idx);
+    s = l = virtio_queue_get_desc_size(vdev, vdev_idx);
+    a = virtio_queue_get_desc_addr(vdev, vdev_idx);
     vq->desc = cpu_physical_memory_map(a, &l, 0);
     if (!vq->desc || l != s) {
         r = -ENOMEM;
         goto fail_alloc_desc;
     }
-    s = l = virtio_queue_get_avail_size(vdev, idx);
-    a = virtio_queue_get_avail_addr(vdev, idx);
+    s = l = virtio_queue_get_avail_size(vdev, vdev_idx);
+    a = virtio_queue_get_avail_addr(vdev, vdev_idx);
     vq->avail = cpu_physical_memory_map(a, &l, 0);
     if (!vq->avail || l != s) {
         r = -ENOMEM;
         goto fail_alloc_avail;
     }
-    vq->used_size = s = l = virtio_queue_get_used_size(vdev, idx);
-    vq->used_phys = a = virtio_queue_get_used_addr(vdev, idx);
+    vq->used_size = s = l = virtio_queue_get_used_size(vdev, vdev_idx);
+    vq->used_phys = a = virtio_queue_get_used_addr(vdev, vdev_idx);
     vq->used = cpu_physical_memory_map(a, &l, 1);
     if (!vq->used || l != s) {
         r = -ENOMEM;
         goto fail_alloc_used;
     }
 
-    vq->ring_size = s = l = virtio_queue_get_ring_size(vdev, idx);
-    vq->ring_phys = a = virtio_queue_get_ring_addr(vdev, idx);
+    vq->ring_size = s = l = virtio_queue_get_ring_size(vdev, vdev_idx);
+    vq->ring_phys = a = virtio_queue_get_ring_addr(vdev, vdev_idx);
     vq->ring = cpu_physical_memory_map(a, &l, 1);
     if (!vq->ring || l != s) {
         r = -ENOMEM;
@@ -508,7 +511,7 @@ static int vhost_virtqueue_init(struct vhost_dev *dev,
         r = -errno;
         goto fail_alloc;
     }
-    r = vdev->binding->set_host_notifier(vdev->binding_opaque, idx, true);
+    r = vdev->binding->set_host_notifier(vdev->binding_opaque, vdev_idx, true);
     if (r < 0) {
         fprintf(stderr, "Error binding host notifier: %d\n", -r);
         goto fail_host_notifier;
@@ -532,19 +535,19 @@ static int vhost_virtqueue_init(struct vhost_dev *dev,
 
 fail_call:
 fail_kick:
-    vdev->binding->set_host_notifier(vdev->binding_opaque, idx, false);
+    vdev->binding->set_host_notifier(vdev->binding_opaque, vdev_idx, false);
 fail_host_notifier:
 fail_alloc:
-    cpu_physical_memory_unmap(vq->ring, virtio_queue_get_ring_size(vdev, idx),
+    cpu_physical_memory_unmap(vq->ring, virtio_queue_get_ring_size(vdev, vdev_idx),
                               0, 0);
 fail_alloc_ring:
-    cpu_physical_memory_unmap(vq->used, virtio_queue_get_used_size(vdev, idx),
+    cpu_physical_memory_unmap(vq->used, virtio_queue_get_used_size(vdev, vdev_idx),
                               0, 0);
 fail_alloc_used:
-    cpu_physical_memory_unmap(vq->avail, virtio_queue_get_avail_size(vdev, idx),
+    cpu_physical_memory_unmap(vq->avail, virtio_queue_get_avail_size(vdev, vdev_idx),
                               0, 0);
 fail_alloc_avail:
-    cpu_physical_memory_unmap(vq->desc, virtio_queue_get_desc_size(vdev, idx),
+    cpu_physical_memory_unmap(vq->desc, virtio_queue_get_desc_size(vdev, vdev_idx),
                               0, 0);
 fail_alloc_desc:
     return r;
@@ -558,8 +561,9 @@ static void vhost_virtqueue_cleanup(struct vhost_dev *dev,
     struct vhost_vring_state state = {
         .index = idx,
     };
+    int vdev_idx = dev->vq_index + idx;
     int r;
-    r = vdev->binding->set_host_notifier(vdev->binding_opaque, idx, false);
+    r = vdev->binding->set_host_notifier(vdev->binding_opaque, vdev_idx, false);
     if (r < 0) {
         fprintf(stderr, "vhost VQ %d host cleanup failed: %d\n", idx, r);
         fflush(stderr);
@@ -570,16 +574,16 @@ static void vhost_virtqueue_cleanup(struct vhost_dev *dev,
         fprintf(stderr, "vhost VQ %d ring restore failed: %d\n", idx, r);
         fflush(stderr);
     }
-    virtio_queue_set_last_avail_idx(vdev, idx, state.num);
+    virtio_queue_set_last_avail_idx(vdev, vdev_idx, state.num);
     assert (r >= 0);
-    cpu_physical_memory_unmap(vq->ring, virtio_queue_get_ring_size(vdev, idx),
-                              0, virtio_queue_get_ring_size(vdev, idx));
-    cpu_physical_memory_unmap(vq->used, virtio_queue_get_used_size(vdev, idx),
-                              1, virtio_queue_get_used_size(vdev, idx));
-    cpu_physical_memory_unmap(vq->avail, virtio_queue_get_avail_size(vdev, idx),
-                              0, virtio_queue_get_avail_size(vdev, idx));
-    cpu_physical_memory_unmap(vq->desc, virtio_queue_get_desc_size(vdev, idx),
-                              0, virtio_queue_get_desc_size(vdev, idx));
+    cpu_physical_memory_unmap(vq->ring, virtio_queue_get_ring_size(vdev, vdev_idx),
+                              0, virtio_queue_get_ring_size(vdev, vdev_idx));
+    cpu_physical_memory_unmap(vq->used, virtio_queue_get_used_size(vdev, vdev_idx),
+                              1, virtio_queue_get_used_size(vdev, vdev_idx));
+    cpu_physical_memory_unmap(vq->avail, virtio_queue_get_avail_size(vdev, vdev_idx),
+                              0, virtio_queue_get_avail_size(vdev, vdev_idx));
+    cpu_physical_memory_unmap(vq->desc, virtio_queue_get_desc_size(vdev, vdev_idx),
+                              0, virtio_queue_get_desc_size(vdev, vdev_idx));
 }
 
 int vhost_dev_init(struct vhost_dev *hdev, int devfd)
@@ -628,20 +632,11 @@ void vhost_dev_cleanup(struct vhost_dev *hdev)
     close(hdev->control);
 }
 
+/* Guest notifiers are owned by the caller: a device backed by several
+ * vhost devices must bind them for all its queues at once. */
 int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
 {
     int i, r;
-    if (!vdev->binding->set_guest_notifiers) {
-        fprintf(stderr, "binding does not support guest notifiers\n");
-        r = -ENOSYS;
-        goto fail;
-    }
-
-    r = vdev->binding->set_guest_notifiers(vdev->binding_opaque, true);
-    if (r < 0) {
-        fprintf(stderr, "Error binding guest notifier: %d\n", -r);
-        goto fail_notifiers;
-    }
 
     r = vhost_dev_set_features(hdev, hdev->log_enabled);
     if (r < 0) {
@@ -663,11 +658,13 @@ int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
     }
 
     if (hdev->log_enabled) {
+        uint64_t log_base;
+
         hdev->log_size = vhost_get_log_size(hdev);
         hdev->log = hdev->log_size ?
             qemu_mallocz(hdev->log_size * sizeof *hdev->log) : NULL;
-        r = ioctl(hdev->control, VHOST_SET_LOG_BASE,
-                  (uint64_t)(unsigned long)hdev->log);
+        log_base = (uint64_t)(unsigned long)hdev->log;
+        r = ioctl(hdev->control, VHOST_SET_LOG_BASE, &log_base);
         if (r < 0) {
             r = -errno;
             goto fail_log;
@@ -678,6 +675,9 @@ int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
 
     return 0;
 fail_log:
+    qemu_free(hdev->log);
+    hdev->log = NULL;
+    hdev->log_size = 0;
 fail_vq:
     while (--i >= 0) {
         vhost_virtqueue_cleanup(hdev,
@@ -687,15 +687,12 @@ fail_vq:
     }
 fail_mem:
 fail_features:
-    vdev->binding->set_guest_notifiers(vdev->binding_opaque, false);
-fail_notifiers:
-fail:
     return r;
 }
 
 void vhost_dev_stop(struct vhost_dev *hdev, VirtIODevice *vdev)
 {
-    int i, r;
+    int i;
 
     for (i = 0; i < hdev->nvqs; ++i) {
         vhost_virtqueue_cleanup(hdev,
@@ -705,14 +702,9 @@ void vhost_dev_stop(struct vhost_dev *hdev, VirtIODevice *vdev)
     }
     vhost_client_sync_dirty_bitmap(&hdev->client, 0,
                                    (target_phys_addr_t)~0x0ull);
-    r = vdev->binding->set_guest_notifiers(vdev->binding_opaque, false);
-    if (r < 0) {
-        fprintf(stderr, "vhost guest notifier cleanup failed: %d\n", r);
-        fflush(stderr);
-    }
-    assert (r >= 0);
 
     hdev->started = false;
     qemu_free(hdev->log);
+    hdev->log = NULL;
     hdev->log_size = 0;
 }
@@ -15,6 +15,7 @@
 
 #include "virtio-net.h"
 #include "vhost_net.h"
+#include "kvm.h"
 
 #include "config.h"
 
@@ -40,6 +41,7 @@ struct vhost_net {
     struct vhost_virtqueue vqs[2];
     int backend;
     VLANClientState *vc;
+    bool force;
 };
 
 unsigned vhost_net_get_features(struct vhost_net *net, unsigned features)
@@ -51,10 +53,22 @@ unsigned vhost_net_get_features(struct vhost_net *net, unsigned features)
     if (!(net->dev.features & (1 << VIRTIO_RING_F_INDIRECT_DESC))) {
         features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
     }
+    if (!(net->dev.features & (1 << VIRTIO_RING_F_EVENT_IDX))) {
+        features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
+    }
     features &= ~(1 << VIRTIO_NET_F_MRG_RXBUF);
     return features;
 }
 
+/* Unless vhost was asked for explicitly, it is only used if the guest can
+ * be offered the same features as in userspace.  The device then looks the
+ * same to the guest whether or not the host has vhost-net, and can migrate
+ * between such hosts. */
+bool vhost_net_query_features(struct vhost_net *net, unsigned features)
+{
+    return net->force || vhost_net_get_features(net, features) == features;
+}
+
 void vhost_net_ack_features(struct vhost_net *net, unsigned features)
 {
     net->dev.acked_features = net->dev.backend_features;
@@ -64,6 +78,9 @@ void vhost_net_ack_features(struct vhost_net *net, unsigned features)
     if (features & (1 << VIRTIO_RING_F_INDIRECT_DESC)) {
         net->dev.acked_features |= (1 << VIRTIO_RING_F_INDIRECT_DESC);
     }
+    if (features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
+        net->dev.acked_features |= (1 << VIRTIO_RING_F_EVENT_IDX);
+    }
 }
 
 static int vhost_net_get_fd(VLANClientState *backend)
@@ -77,7 +94,8 @@ static int vhost_net_get_fd(VLANClientState *backend)
     }
 }
 
-struct vhost_net *vhost_net_init(VLANClientState *backend, int devfd)
+struct vhost_net *vhost_net_init(VLANClientState *backend, int devfd,
+                                 bool force)
 {
     int r;
     struct vhost_net *net = qemu_malloc(sizeof *net);
@@ -90,6 +108,7 @@ struct vhost_net *vhost_net_init(VLANClientState *backend, int devfd)
         goto fail;
     }
     net->vc = backend;
+    net->force = force;
     net->dev.backend_features = tap_has_vnet_hdr(backend) ? 0 :
         (1 << VHOST_NET_F_VIRTIO_NET_HDR);
     net->backend = r;
@@ -113,14 +132,24 @@ fail:
     return NULL;
 }
 
-int vhost_net_start(struct vhost_net *net,
-                    VirtIODevice *dev)
+/* The in-kernel data path needs ioeventfd for guest kicks, so it is only
+ * of use with KVM and a binding that can hand out notifiers. */
+bool vhost_net_query(VHostNetState *net, VirtIODevice *dev)
+{
+    return kvm_enabled() && dev->binding->set_host_notifier &&
+        dev->binding->set_guest_notifiers;
+}
+
+static int vhost_net_start_one(struct vhost_net *net,
+                               VirtIODevice *dev,
+                               int vq_index)
 {
     struct vhost_vring_file file = { };
     int r;
 
     net->dev.nvqs = 2;
     net->dev.vqs = net->vqs;
+    net->dev.vq_index = vq_index;
     r = vhost_dev_start(&net->dev, dev);
     if (r < 0) {
         return r;
@@ -148,8 +177,8 @@ fail:
     return r;
 }
 
-void vhost_net_stop(struct vhost_net *net,
-                    VirtIODevice *dev)
+static void vhost_net_stop_one(struct vhost_net *net,
+                               VirtIODevice *dev)
 {
     struct vhost_vring_file file = { .fd = -1 };
 
@@ -161,24 +190,82 @@ void vhost_net_stop(struct vhost_net *net,
     vhost_dev_stop(&net->dev, dev);
 }
 
+/* Queue pair i of the device (rx 2 * i, tx 2 * i + 1) is served by the
+ * vhost device of backend ncs[i]. */
+int vhost_net_start(VirtIODevice *dev, VLANClientState **ncs,
+                    int total_queues)
+{
+    int r, i;
+
+    if (!dev->binding->set_guest_notifiers) {
+        fprintf(stderr, "binding does not support guest notifiers\n");
+        return -ENOSYS;
+    }
+
+    r = dev->binding->set_guest_notifiers(dev->binding_opaque, true);
+    if (r < 0) {
+        fprintf(stderr, "Error binding guest notifier: %d\n", -r);
+        return r;
+    }
+
+    for (i = 0; i < total_queues; i++) {
+        r = vhost_net_start_one(tap_get_vhost_net(ncs[i]), dev, i * 2);
+        if (r < 0) {
+            goto fail_start;
+        }
+    }
+
+    return 0;
+
+fail_start:
+    while (--i >= 0) {
+        vhost_net_stop_one(tap_get_vhost_net(ncs[i]), dev);
+    }
+    dev->binding->set_guest_notifiers(dev->binding_opaque, false);
+    return r;
+}
+
+void vhost_net_stop(VirtIODevice *dev, VLANClientState **ncs,
+                    int total_queues)
+{
+    int r, i;
+
+    for (i = 0; i < total_queues; i++) {
+        vhost_net_stop_one(tap_get_vhost_net(ncs[i]), dev);
+    }
+
+    r = dev->binding->set_guest_notifiers(dev->binding_opaque, false);
+    if (r < 0) {
+        fprintf(stderr, "vhost guest notifier cleanup failed: %d\n", r);
+        fflush(stderr);
+    }
+    assert(r >= 0);
+}
+
 void vhost_net_cleanup(struct vhost_net *net)
 {
     vhost_dev_cleanup(&net->dev);
     qemu_free(net);
 }
 #else
-struct vhost_net *vhost_net_init(VLANClientState *backend, int devfd)
+struct vhost_net *vhost_net_init(VLANClientState *backend, int devfd,
+                                 bool force)
 {
 	return NULL;
 }
 
-int vhost_net_start(struct vhost_net *net,
-		    VirtIODevice *dev)
+bool vhost_net_query(VHostNetState *net, VirtIODevice *dev)
+{
+	return false;
+}
+
+int vhost_net_start(VirtIODevice *dev, VLANClientState **ncs,
+		    int total_queues)
 {
 	return -ENOSYS;
 }
-void vhost_net_stop(struct vhost_net *net,
-		    VirtIODevice *dev)
+void vhost_net_stop(VirtIODevice *dev, VLANClientState **ncs,
+		    int total_queues)
 {
 }
 
@@ -186,6 +273,11 @@ void vhost_net_cleanup(struct vhost_net *net)
 {
 }
 
+bool vhost_net_query_features(struct vhost_net *net, unsigned features)
+{
+	return false;
+}
+
 unsigned vhost_net_get_features(struct vhost_net *net, unsigned features)
 {
 	return features;
@@ -6,13 +6,17 @@
 struct vhost_net;
 typedef struct vhost_net VHostNetState;
 
-VHostNetState *vhost_net_init(VLANClientState *backend, int devfd);
+VHostNetState *vhost_net_init(VLANClientState *backend, int devfd,
+                              bool force);
 
-int vhost_net_start(VHostNetState *net, VirtIODevice *dev);
-void vhost_net_stop(VHostNetState *net, VirtIODevice *dev);
+bool vhost_net_query(VHostNetState *net, VirtIODevice *dev);
+
+int vhost_net_start(VirtIODevice *dev, VLANClientState **ncs, int total_queues);
+void vhost_net_stop(VirtIODevice *dev, VLANClientState **ncs, int total_queues);
 
 void vhost_net_cleanup(VHostNetState *net);
 
+bool vhost_net_query_features(VHostNetState *net, unsigned features);
 unsigned vhost_net_get_features(VHostNetState *net, unsigned features);
 void vhost_net_ack_features(VHostNetState *net, unsigned features);
 
@@ -0,0 +1,815 @@
+/*
+ * Virtio Block Device data plane
+ *
+ * Requests of a virtio-blk device with x-data-plane=on are handled by a
+ * dedicated thread instead of the main loop: the thread is woken through the
+ * queue's ioeventfd, pops the vring directly from guest RAM, submits the I/O
+ * with Linux AIO on the raw image file and signals completions through the
+ * queue's guest notifier.  The main loop is only involved to raise the
+ * interrupt.
+ *
+ * The thread runs only while the guest driver is active, the VM is running
+ * and dirty logging is off; otherwise requests go through the regular
+ * virtio-blk code, which sees a consistent queue state because the thread
+ * hands its last_avail_idx back when it stops.  Likewise the thread only
+ * starts once the main loop has completed the requests it still owns.
+ *
+ * Completions are signalled through an eventfd that the io thread reads, so
+ * the data plane is only built with CONFIG_IOTHREAD.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <libaio.h>
+
+#include "hw.h"
+#include "qemu-error.h"
+#include "sysemu.h"
+#include "kvm.h"
+#include "iov.h"
+#include "virtio-blk.h"
+#include "virtio-blk-dataplane.h"
+
+/* Largest descriptor chain: seg_max data segments plus the two headers */
+#define DATA_PLANE_MAX_IOV 128
+
+typedef struct VRingDesc
+{
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} VRingDesc;
+
+typedef struct VRingAvail
+{
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[0];
+} VRingAvail;
+
+typedef struct VRingUsedElem
+{
+    uint32_t id;
+    uint32_t len;
+} VRingUsedElem;
+
+typedef struct VRingUsed
+{
+    uint16_t flags;
+    uint16_t idx;
+    VRingUsedElem ring[0];
+} VRingUsed;
+
+/* A guest RAM range and where it is mapped in our address space */
+typedef struct DataPlaneRegion {
+    target_phys_addr_t start;
+    target_phys_addr_t size;
+    uint8_t *host;
+} DataPlaneRegion;
+
+typedef struct DataPlaneReq {
+    struct iocb iocb;
+    struct iovec iov[DATA_PLANE_MAX_IOV];
+    unsigned int out_num;
+    unsigned int in_num;
+    unsigned int head;
+    uint8_t *status;
+    size_t len;         /* bytes of data the host has to transfer */
+    uint32_t used_len;  /* bytes written to the guest, for the used ring */
+    int busy;
+} DataPlaneReq;
+
+struct VirtIOBlockDataPlane {
+    VirtIODevice *vdev;
+    VirtQueue *vq;
+    int fd;
+    int read_only;
+    unsigned short sector_mask;
+    const char *serial;
+
+    /* Guest RAM map, maintained by the main thread */
+    CPUPhysMemoryClient client;
+    pthread_mutex_t lock;
+    DataPlaneRegion *regions;
+    int nb_regions;
+
+    /* Conditions for running the thread, main thread only */
+    VMChangeStateEntry *vmstate;
+    int driver_ok;
+    int migration_log;
+    int disabled;
+    int started;
+
+    /* State of the I/O thread */
+    pthread_t thread;
+    EventNotifier stop_notifier;
+    EventNotifier io_notifier;
+    EventNotifier *host_notifier;
+    EventNotifier *guest_notifier;
+    io_context_t io_ctx;
+    struct io_event *events;
+    struct iocb **pending;
+    int nb_pending;
+    int nb_inflight;
+    int need_notify;
+
+    unsigned int num;
+    VRingDesc *desc;
+    VRingAvail *avail;
+    VRingUsed *used;
+    uint16_t last_avail_idx;
+    uint16_t used_idx;
+    int event_idx;
+    uint16_t signalled_used;
+    int signalled_used_valid;
+    DataPlaneReq *reqs;
+};
+
+/*
+ * Guest memory map.  The regions are kept merged, so that the table stays
+ * small even though exec.c reports existing memory one page at a time.
+ */
+
+static void data_plane_unassign(VirtIOBlockDataPlane *s,
+                                target_phys_addr_t start,
+                                target_phys_addr_t size)
+{
+    target_phys_addr_t end = start + size;
+    int i = 0;
+
+    while (i < s->nb_regions) {
+        DataPlaneRegion *r = &s->regions[i];
+        target_phys_addr_t rend = r->start + r->size;
+
+        if (rend <= start || r->start >= end) {
+            i++;
+        } else if (r->start < start && rend > end) {
+            /* Hole in the middle: split the region in two */
+            s->regions = qemu_realloc(s->regions, (s->nb_regions + 1) *
+                                      sizeof(*s->regions));
+            r = &s->regions[i];
+            s->regions[s->nb_regions].start = end;
+            s->regions[s->nb_regions].size = rend - end;
+            s->regions[s->nb_regions].host = r->host + (end - r->start);
+            s->nb_regions++;
+            r->size = start - r->start;
+            i++;
+        } else if (r->start < start) {
+            r->size = start - r->start;
+            i++;
+        } else if (rend > end) {
+            r->host += end - r->start;
+            r->size = rend - end;
+            r->start = end;
+            i++;
+        } else {
+            s->regions[i] = s->regions[--s->nb_regions];
+        }
+    }
+}
+
+static void data_plane_assign(VirtIOBlockDataPlane *s,
+                              target_phys_addr_t start,
+                              target_phys_addr_t size, uint8_t *host)
+{
+    DataPlaneRegion *r;
+    int i;
+
+    for (i = 0; i < s->nb_regions; i++) {
+        r = &s->regions[i];
+        if (r->start + r->size == start && r->host + r->size == host) {
+            r->size += size;
+            return;
+        }
+        if (start + size == r->start && host + size == r->host) {
+            r->start = start;
+            r->host = host;
+            r->size += size;
+            return;
+        }
+    }
+
+    s->regions = qemu_realloc(s->regions, (s->nb_regions + 1) *
+                              sizeof(*s->regions));
+    r = &s->regions[s->nb_regions++];
+    r->start = start;
+    r->size = size;
+    r->host = host;
+}
+
+static void data_plane_set_memory(CPUPhysMemoryClient *client,
+                                  target_phys_addr_t start_addr,
+                                  ram_addr_t size,
+                                  ram_addr_t phys_offset)
+{
+    VirtIOBlockDataPlane *s = container_of(client, VirtIOBlockDataPlane,
+                                           client);
+    ram_addr_t flags = phys_offset & ~TARGET_PAGE_MASK;
+
+    pthread_mutex_lock(&s->lock);
+    data_plane_unassign(s, start_addr, size);
+    if (flags == IO_MEM_RAM) {
+        data_plane_assign(s, start_addr, size, qemu_get_ram_ptr(phys_offset));
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+static int data_plane_sync_dirty_bitmap(CPUPhysMemoryClient *client,
+                                        target_phys_addr_t start_addr,
+                                        target_phys_addr_t end_addr)
+{
+    /* The thread is stopped while dirty logging is on, nothing to sync */
+    return 0;
+}
+
+static void data_plane_update(VirtIOBlockDataPlane *s);
+
+static int data_plane_migration_log(CPUPhysMemoryClient *client, int enable)
+{
+    VirtIOBlockDataPlane *s = container_of(client, VirtIOBlockDataPlane,
+                                           client);
+
+    s->migration_log = enable;
+    data_plane_update(s);
+    return 0;
+}
+
+/* Returns a host pointer for guest RAM, or NULL if it is not all RAM */
+static void *data_plane_map(VirtIOBlockDataPlane *s, target_phys_addr_t addr,
+                            target_phys_addr_t len)
+{
+    void *p = NULL;
+    int i;
+
+    pthread_mutex_lock(&s->lock);
+    for (i = 0; i < s->nb_regions; i++) {
+        DataPlaneRegion *r = &s->regions[i];
+        if (addr >= r->start && addr - r->start < r->size) {
+            if (len <= r->size - (addr - r->start)) {
+                p = r->host + (addr - r->start);
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return p;
+}
+
+/* Virtqueue handling, I/O thread only */
+
+static uint16_t data_plane_avail_idx(VirtIOBlockDataPlane *s)
+{
+    return *(volatile uint16_t *)&s->avail->idx;
+}
+
+/* With VIRTIO_RING_F_EVENT_IDX, used_event follows the avail ring and
+ * avail_event follows the used ring */
+static uint16_t data_plane_used_event(VirtIOBlockDataPlane *s)
+{
+    return *(volatile uint16_t *)&s->avail->ring[s->num];
+}
+
+static void data_plane_set_avail_event(VirtIOBlockDataPlane *s, uint16_t val)
+{
+    *(volatile uint16_t *)&s->used->ring[s->num] = val;
+}
+
+static int data_plane_should_notify(VirtIOBlockDataPlane *s)
+{
+    uint16_t old = s->signalled_used;
+    int valid = s->signalled_used_valid;
+
+    s->signalled_used = s->used_idx;
+    s->signalled_used_valid = 1;
+
+    /* Always notify when queue is empty (when feature acknowledge) */
+    if ((s->vdev->guest_features & (1 << VIRTIO_F_NOTIFY_ON_EMPTY)) &&
+        !s->nb_inflight && data_plane_avail_idx(s) == s->last_avail_idx) {
+        return 1;
+    }
+
+    if (!s->event_idx) {
+        return !(*(volatile uint16_t *)&s->avail->flags &
+                 VRING_AVAIL_F_NO_INTERRUPT);
+    }
+
+    return !valid || virtio_need_event(data_plane_used_event(s),
+                                       s->used_idx, old);
+}
+
+static void data_plane_notify_guest(VirtIOBlockDataPlane *s)
+{
+    if (!s->need_notify) {
+        return;
+    }
+    s->need_notify = 0;
+
+    /* The used index must be visible before we look at the guest's flags */
+    __sync_synchronize();
+
+    if (data_plane_should_notify(s)) {
+        event_notifier_set(s->guest_notifier);
+    }
+}
+
+static void data_plane_complete(VirtIOBlockDataPlane *s, DataPlaneReq *req,
+                                int status)
+{
+    VRingUsedElem *elem;
+
+    *req->status = status;
+
+    elem = &s->used->ring[s->used_idx % s->num];
+    elem->id = req->head;
+    elem->len = req->used_len;
+
+    /* The guest must see the element before the index that exposes it */
+    __sync_synchronize();
+    s->used->idx = ++s->used_idx;
+
+    req->busy = 0;
+    s->nb_inflight--;
+    s->need_notify = 1;
+}
+
+static void data_plane_map_chain(VirtIOBlockDataPlane *s, unsigned int head,
+                                 DataPlaneReq *req)
+{
+    VRingDesc *desc = s->desc;
+    unsigned int max = s->num;
+    unsigned int i = head;
+    unsigned int found = 0;
+
+    req->out_num = 0;
+    req->in_num = 0;
+
+    if (desc[i].flags & VRING_DESC_F_INDIRECT) {
+        if (desc[i].len % sizeof(VRingDesc)) {
+            fprintf(stderr, "Invalid size for indirect buffer table\n");
+            exit(1);
+        }
+        max = desc[i].len / sizeof(VRingDesc);
+        desc = data_plane_map(s, desc[i].addr, desc[i].len);
+        if (!desc) {
+            fprintf(stderr, "virtio-blk: indirect table not in guest RAM\n");
+            exit(1);
+        }
+        i = 0;
+    }
+
+    for (;;) {
+        VRingDesc d = desc[i];
+        struct iovec *iov;
+
+        if (++found > max) {
+            fprintf(stderr, "Looped descriptor");
+            exit(1);
+        }
+        if (req->out_num + req->in_num == DATA_PLANE_MAX_IOV) {
+            fprintf(stderr, "virtio-blk: too many segments in request\n");
+            exit(1);
+        }
+
+        iov = &req->iov[req->out_num + req->in_num];
+        iov->iov_base = data_plane_map(s, d.addr, d.len);
+        iov->iov_len = d.len;
+        if (!iov->iov_base) {
+            fprintf(stderr, "virtio: trying to map MMIO memory\n");
+            exit(1);
+        }
+
+        if (d.flags & VRING_DESC_F_WRITE) {
+            req->in_num++;
+        } else if (req->in_num) {
+            fprintf(stderr, "virtio-blk: read-only segment after "
+                    "write-only segment\n");
+            exit(1);
+        } else {
+            req->out_num++;
+        }
+
+        if (!(d.flags & VRING_DESC_F_NEXT)) {
+            break;
+        }
+        i = d.next;
+        if (i >= max) {
+            fprintf(stderr, "Desc next is %u\n", i);
+            exit(1);
+        }
+    }
+}
+
+static void data_plane_submit(VirtIOBlockDataPlane *s)
+{
+    int i, ret;
+
+    while (s->nb_pending) {
+        ret = io_submit(s->io_ctx, s->nb_pending, s->pending);
+        if (ret < 0) {
+            for (i = 0; i < s->nb_pending; i++) {
+                data_plane_complete(s, s->pending[i]->data,
+                                    VIRTIO_BLK_S_IOERR);
+            }
+            s->nb_pending = 0;
+            return;
+        }
+        s->nb_pending -= ret;
+        memmove(s->pending, s->pending + ret,
+                s->nb_pending * sizeof(s->pending[0]));
+    }
+}
+
+static void data_plane_queue(VirtIOBlockDataPlane *s, DataPlaneReq *req)
+{
+    io_set_eventfd(&req->iocb, event_notifier_get_fd(&s->io_notifier));
+    req->iocb.data = req;
+    s->pending[s->nb_pending++] = &req->iocb;
+}
+
+static void data_plane_handle_request(VirtIOBlockDataPlane *s,
+                                      unsigned int head)
+{
+    DataPlaneReq *req = &s->reqs[head];
+    struct virtio_blk_outhdr *out;
+    struct iovec *in_iov;
+    uint32_t type;
+    uint64_t sector;
+
+    if (req->busy) {
+        fprintf(stderr, "virtio-blk: guest reused descriptor %u\n", head);
+        exit(1);
+    }
+
+    data_plane_map_chain(s, head, req);
+    if (req->out_num < 1 || req->in_num < 1) {
+        fprintf(stderr, "virtio-blk missing headers\n");
+        exit(1);
+    }
+    if (req->iov[0].iov_len < sizeof(*out) ||
+        req->iov[req->out_num + req->in_num - 1].iov_len <
+            sizeof(struct virtio_blk_inhdr)) {
+        fprintf(stderr, "virtio-blk header not in correct element\n");
+        exit(1);
+    }
+
+    out = req->iov[0].iov_base;
+    type = out->type;
+    sector = out->sector;
+    in_iov = &req->iov[req->out_num];
+
+    req->head = head;
+    req->status = req->iov[req->out_num + req->in_num - 1].iov_base;
+    req->used_len = sizeof(struct virtio_blk_inhdr);
+    req->busy = 1;
+    s->nb_inflight++;
+
+    if (type & VIRTIO_BLK_T_FLUSH) {
+        /* Writes that came before the flush must reach the disk first */
+        data_plane_submit(s);
+        data_plane_complete(s, req, fdatasync(s->fd) ? VIRTIO_BLK_S_IOERR
+                                                     : VIRTIO_BLK_S_OK);
+    } else if (type & VIRTIO_BLK_T_SCSI_CMD) {
+        data_plane_complete(s, req, VIRTIO_BLK_S_UNSUPP);
+    } else if (type & VIRTIO_BLK_T_GET_ID) {
+        size_t len;
+
+        if (req->in_num < 2) {
+            data_plane_complete(s, req, VIRTIO_BLK_S_IOERR);
+            return;
+        }
+        len = MIN(in_iov[0].iov_len, BLOCK_SERIAL_STRLEN);
+        memcpy(in_iov[0].iov_base, s->serial, len);
+        req->used_len += len;
+        data_plane_complete(s, req, VIRTIO_BLK_S_OK);
+    } else if ((sector & s->sector_mask) ||
+               ((type & VIRTIO_BLK_T_OUT) && s->read_only)) {
+        data_plane_complete(s, req, VIRTIO_BLK_S_IOERR);
+    } else if (type & VIRTIO_BLK_T_OUT) {
+        req->len = iov_size(&req->iov[1], req->out_num - 1);
+        io_prep_pwritev(&req->iocb, s->fd, &req->iov[1], req->out_num - 1,
+                        sector * BDRV_SECTOR_SIZE);
+        data_plane_queue(s, req);
+    } else {
+        req->len = iov_size(in_iov, req->in_num - 1);
+        req->used_len += req->len;
+        io_prep_preadv(&req->iocb, s->fd, in_iov, req->in_num - 1,
+                       sector * BDRV_SECTOR_SIZE);
+        data_plane_queue(s, req);
+    }
+}
+
+/*
+ * Takes everything the guest made available, with guest notifications
+ * suppressed while we are at it, and submits it with a single io_submit().
+ */
+static void data_plane_handle_kick(VirtIOBlockDataPlane *s)
+{
+    uint16_t avail_idx;
+
+    for (;;) {
+        /* With event indexes, leaving avail_event behind does the same */
+        if (!s->event_idx) {
+            s->used->flags |= VRING_USED_F_NO_NOTIFY;
+        }
+
+        while ((avail_idx = data_plane_avail_idx(s)) != s->last_avail_idx) {
+            unsigned int head;
+
+            if ((uint16_t)(avail_idx - s->last_avail_idx) > s->num) {
+                fprintf(stderr, "Guest moved used index from %u to %u",
+                        s->last_avail_idx, avail_idx);
+                exit(1);
+            }
+
+            /* Read the ring entry only after the index that exposed it */
+            __sync_synchronize();
+            head = s->avail->ring[s->last_avail_idx % s->num];
+            if (head >= s->num) {
+                fprintf(stderr, "Guest says index %u is available", head);
+                exit(1);
+            }
+            s->last_avail_idx++;
+
+            data_plane_handle_request(s, head);
+        }
+        data_plane_submit(s);
+
+        /* Check again after reenabling notifications, or we may miss one */
+        if (s->event_idx) {
+            data_plane_set_avail_event(s, data_plane_avail_idx(s));
+        } else {
+            s->used->flags &= ~VRING_USED_F_NO_NOTIFY;
+        }
+        __sync_synchronize();
+        if (data_plane_avail_idx(s) == s->last_avail_idx) {
+            break;
+        }
+    }
+
+    data_plane_notify_guest(s);
+}
+
+static void data_plane_handle_completions(VirtIOBlockDataPlane *s)
+{
+    struct timespec ts = { 0, 0 };
+    int i, n;
+
+    event_notifier_test_and_clear(&s->io_notifier);
+
+    do {
+        n = io_getevents(s->io_ctx, 0, s->num, s->events, &ts);
+        for (i = 0; i < n; i++) {
+            struct io_event *ev = &s->events[i];
+            DataPlaneReq *req = ev->obj->data;
+            ssize_t ret = (ssize_t)(((uint64_t)ev->res2 << 32) | ev->res);
+
+            data_plane_complete(s, req, ret == (ssize_t)req->len ? VIRTIO_BLK_S_OK
+                                                        : VIRTIO_BLK_S_IOERR);
+        }
+    } while (n > 0);
+
+    data_plane_notify_guest(s);
+}
+
+static void *data_plane_thread(void *opaque)
+{
+    VirtIOBlockDataPlane *s = opaque;
+    struct pollfd fds[3];
+    int stopping = 0;
+
+    fds[0].fd = event_notifier_get_fd(s->host_notifier);
+    fds[1].fd = event_notifier_get_fd(&s->io_notifier);
+    fds[2].fd = event_notifier_get_fd(&s->stop_notifier);
+    fds[0].events = fds[1].events = fds[2].events = POLLIN;
+
+    /* Pick up whatever was queued while the main loop owned the ring */
+    data_plane_handle_kick(s);
+
+    while (!stopping || s->nb_inflight) {
+        if (poll(fds, 3, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "virtio-blk: poll failed: %s\n", strerror(errno));
+            exit(1);
+        }
+
+        if (fds[2].revents & POLLIN) {
+            event_notifier_test_and_clear(&s->stop_notifier);
+            stopping = 1;
+        }
+        if (fds[1].revents & POLLIN) {
+            data_plane_handle_completions(s);
+        }
+        /* Once stopping, new requests are left to whoever takes over */
+        if ((fds[0].revents & POLLIN) && !stopping) {
+            event_notifier_test_and_clear(s->host_notifier);
+            data_plane_handle_kick(s);
+        }
+    }
+
+    return NULL;
+}
+
+/* Starting and stopping, main thread only */
+
+static int data_plane_start(VirtIOBlockDataPlane *s)
+{
+    VirtIODevice *vdev = s->vdev;
+    const VirtIOBindings *binding = vdev->binding;
+    sigset_t set, oldset;
+    int r;
+
+    if (!binding->set_host_notifier || !binding->set_guest_notifiers) {
+        return -ENOSYS;
+    }
+
+    s->desc = data_plane_map(s, virtio_queue_get_desc_addr(vdev, 0),
+                             virtio_queue_get_desc_size(vdev, 0));
+    s->avail = data_plane_map(s, virtio_queue_get_avail_addr(vdev, 0),
+                              virtio_queue_get_avail_size(vdev, 0));
+    s->used = data_plane_map(s, virtio_queue_get_used_addr(vdev, 0),
+                             virtio_queue_get_used_size(vdev, 0));
+    if (!s->desc || !s->avail || !s->used) {
+        return -EFAULT;
+    }
+    s->last_avail_idx = virtio_queue_get_last_avail_idx(vdev, 0);
+    s->used_idx = s->used->idx;
+    s->event_idx = !!(vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX));
+    s->signalled_used_valid = 0;
+
+    r = binding->set_guest_notifiers(vdev->binding_opaque, true);
+    if (r < 0) {
+        return r;
+    }
+    r = binding->set_host_notifier(vdev->binding_opaque, 0, true);
+    if (r < 0) {
+        binding->set_guest_notifiers(vdev->binding_opaque, false);
+        return r;
+    }
+    s->host_notifier = virtio_queue_get_host_notifier(s->vq);
+    s->guest_notifier = virtio_queue_get_guest_notifier(s->vq);
+
+    /* Signals are for the main thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+    r = pthread_create(&s->thread, NULL, data_plane_thread, s);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    if (r) {
+        binding->set_host_notifier(vdev->binding_opaque, 0, false);
+        binding->set_guest_notifiers(vdev->binding_opaque, false);
+        return -r;
+    }
+
+    s->started = 1;
+    return 0;
+}
+
+static void data_plane_stop(VirtIOBlockDataPlane *s)
+{
+    VirtIODevice *vdev = s->vdev;
+    const VirtIOBindings *binding = vdev->binding;
+
+    /* The thread waits for all in-flight requests before it exits */
+    event_notifier_set(&s->stop_notifier);
+    pthread_join(s->thread, NULL);
+
+    virtio_queue_set_last_avail_idx(vdev, 0, s->last_avail_idx);
+    binding->set_host_notifier(vdev->binding_opaque, 0, false);
+
+    /* Don't lose an interrupt the main loop has not seen yet */
+    if (event_notifier_test_and_clear(s->guest_notifier)) {
+        virtio_irq(s->vq);
+    }
+    binding->set_guest_notifiers(vdev->binding_opaque, false);
+
+    s->started = 0;
+}
+
+static void data_plane_update(VirtIOBlockDataPlane *s)
+{
+    int run = s->driver_ok && vm_running && !s->migration_log &&
+              !s->disabled;
+    int r;
+
+    if (run == s->started) {
+        return;
+    }
+
+    if (run) {
+        /* The main loop must be done with the ring before we take it over */
+        virtio_blk_drain(s->vdev);
+        if (!vm_running) {
+            /* A failed request stopped the VM again */
+            return;
+        }
+        r = data_plane_start(s);
+        if (r < 0) {
+            error_report("virtio-blk: cannot start data plane (%s), "
+                         "using the main loop", strerror(-r));
+            s->disabled = 1;
+        }
+    } else {
+        data_plane_stop(s);
+        if (s->driver_ok && vm_running) {
+            /* The ioeventfd is gone, pass on requests nobody picked up */
+            virtio_queue_notify(s->vdev, 0);
+        }
+    }
+}
+
+static void data_plane_vm_state_change(void *opaque, int running, int reason)
+{
+    data_plane_update(opaque);
+}
+
+void virtio_blk_data_plane_set_status(VirtIOBlockDataPlane *s, uint8_t val)
+{
+    s->driver_ok = !!(val & VIRTIO_CONFIG_S_DRIVER_OK);
+    data_plane_update(s);
+}
+
+VirtIOBlockDataPlane *virtio_blk_data_plane_create(VirtIODevice *vdev,
+                                                   BlockDriverState *bs,
+                                                   unsigned short sector_mask,
+                                                   const char *serial)
+{
+    VirtIOBlockDataPlane *s;
+    int fd, r;
+
+    if (!kvm_enabled()) {
+        error_report("virtio-blk: x-data-plane requires KVM");
+        return NULL;
+    }
+
+    fd = raw_get_aio_fd(bs);
+    if (fd < 0) {
+        error_report("virtio-blk: x-data-plane requires a raw image "
+                     "with cache=none,aio=native");
+        return NULL;
+    }
+
+    s = qemu_mallocz(sizeof(*s));
+    s->vdev = vdev;
+    s->vq = virtio_get_queue(vdev, 0);
+    s->num = virtio_queue_get_num(vdev, 0);
+    s->fd = fd;
+    s->read_only = bdrv_is_read_only(bs);
+    s->sector_mask = sector_mask;
+    s->serial = serial;
+
+    r = io_setup(s->num, &s->io_ctx);
+    if (r < 0) {
+        error_report("virtio-blk: cannot create AIO context: %s",
+                     strerror(-r));
+        qemu_free(s);
+        return NULL;
+    }
+    if (event_notifier_init(&s->io_notifier, 0) < 0 ||
+        event_notifier_init(&s->stop_notifier, 0) < 0) {
+        error_report("virtio-blk: cannot create eventfd: %s",
+                     strerror(errno));
+        exit(1);
+    }
+
+    s->reqs = qemu_mallocz(s->num * sizeof(s->reqs[0]));
+    s->pending = qemu_malloc(s->num * sizeof(s->pending[0]));
+    s->events = qemu_malloc(s->num * sizeof(s->events[0]));
+
+    pthread_mutex_init(&s->lock, NULL);
+    s->client.set_memory = data_plane_set_memory;
+    s->client.sync_dirty_bitmap = data_plane_sync_dirty_bitmap;
+    s->client.migration_log = data_plane_migration_log;
+    cpu_register_phys_memory_client(&s->client);
+
+    s->vmstate = qemu_add_vm_change_state_handler(data_plane_vm_state_change,
+                                                  s);
+    return s;
+}
+
+void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
+{
+    s->driver_ok = 0;
+    data_plane_update(s);
+
+    qemu_del_vm_change_state_handler(s->vmstate);
+    cpu_unregister_phys_memory_client(&s->client);
+    pthread_mutex_destroy(&s->lock);
+
+    io_destroy(s->io_ctx);
+    event_notifier_cleanup(&s->io_notifier);
+    event_notifier_cleanup(&s->stop_notifier);
+
+    qemu_free(s->regions);
+    qemu_free(s->events);
+    qemu_free(s->pending);
+    qemu_free(s->reqs);
+    qemu_free(s);
+}
@@ -0,0 +1,27 @@
+/*
+ * Virtio Block Device data plane
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef _QEMU_VIRTIO_BLK_DATAPLANE_H
+#define _QEMU_VIRTIO_BLK_DATAPLANE_H
+
+#include "virtio.h"
+#include "block.h"
+
+typedef struct VirtIOBlockDataPlane VirtIOBlockDataPlane;
+
+VirtIOBlockDataPlane *virtio_blk_data_plane_create(VirtIODevice *vdev,
+                                                   BlockDriverState *bs,
+                                                   unsigned short sector_mask,
+                                                   const char *serial);
+void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s);
+void virtio_blk_data_plane_set_status(VirtIOBlockDataPlane *s, uint8_t val);
+
+/* In virtio-blk.c: complete the requests the main loop has in flight */
+void virtio_blk_drain(VirtIODevice *vdev);
+
+#endif
@@ -17,6 +17,9 @@
 #ifdef __linux__
 # include <scsi/sg.h>
 #endif
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+# include "virtio-blk-dataplane.h"
+#endif
 
 typedef struct VirtIOBlock
 {
@@ -25,10 +28,15 @@ typedef struct VirtIOBlock
     VirtQueue *vq;
     void *rq;
     QEMUBH *bh;
+    QEMUBH *notify_bh;
+    int notify_pending;
     BlockConf *conf;
     unsigned short sector_mask;
     char sn[BLOCK_SERIAL_STRLEN];
     DeviceState *qdev;
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    VirtIOBlockDataPlane *dataplane;
+#endif
 } VirtIOBlock;
 
 static VirtIOBlock *to_virtio_blk(VirtIODevice *vdev)
@@ -47,13 +55,28 @@ typedef struct VirtIOBlockReq
     struct VirtIOBlockReq *next;
 } VirtIOBlockReq;
 
+static void virtio_blk_notify_bh(void *opaque)
+{
+    VirtIOBlock *s = opaque;
+
+    s->notify_pending = 0;
+    virtio_notify(&s->vdev, s->vq);
+}
+
+/*
+ * The guest is notified from a bottom half, so that all requests completed
+ * in one go (e.g. a batch of AIO completions) cost a single interrupt.
+ */
 static void virtio_blk_req_complete(VirtIOBlockReq *req, int status)
 {
     VirtIOBlock *s = req->dev;
 
     req->in->status = status;
     virtqueue_push(s->vq, &req->elem, req->qiov.size + sizeof(*req->in));
-    virtio_notify(&s->vdev, s->vq);
+    if (!s->notify_pending) {
+        s->notify_pending = 1;
+        qemu_bh_schedule(s->notify_bh);
+    }
 
     qemu_free(req);
 }
@@ -228,6 +251,8 @@ static void virtio_blk_handle_scsi(VirtIOBlockReq *req)
 typedef struct MultiReqBuffer {
     BlockRequest        blkreq[32];
     unsigned int        num_writes;
+    BlockRequest        readreq[32];
+    unsigned int        num_reads;
 } MultiReqBuffer;
 
 static void virtio_submit_multiwrite(BlockDriverState *bs, MultiReqBuffer *mrb)
@@ -250,6 +275,37 @@ static void virtio_submit_multiwrite(BlockDriverState *bs, MultiReqBuffer *mrb)
     mrb->num_writes = 0;
 }
 
+static void virtio_submit_multiread(BlockDriverState *bs, MultiReqBuffer *mrb)
+{
+    int i, ret;
+
+    if (!mrb->num_reads) {
+        return;
+    }
+
+    ret = bdrv_aio_multiread(bs, mrb->readreq, mrb->num_reads);
+    if (ret != 0) {
+        for (i = 0; i < mrb->num_reads; i++) {
+            if (mrb->readreq[i].error) {
+                virtio_blk_rw_complete(mrb->readreq[i].opaque, -EIO);
+            }
+        }
+    }
+
+    mrb->num_reads = 0;
+}
+
+/*
+ * Submits all requests that have been collected from the virtqueue. Callers
+ * plug the block device around this, so that the whole batch can reach the
+ * host with a single system call.
+ */
+static void virtio_submit_multireq(BlockDriverState *bs, MultiReqBuffer *mrb)
+{
+    virtio_submit_multiread(bs, mrb);
+    virtio_submit_multiwrite(bs, mrb);
+}
+
 static void virtio_blk_handle_flush(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 {
     BlockDriverAIOCB *acb;
@@ -257,7 +313,7 @@ static void virtio_blk_handle_flush(VirtIOBlockReq *req, MultiReqBuffer *mrb)
     /*
      * Make sure all outstanding writes are posted to the backing device.
      */
-    virtio_submit_multiwrite(req->dev->bs, mrb);
+    virtio_submit_multireq(req->dev->bs, mrb);
 
     acb = bdrv_aio_flush(req->dev->bs, virtio_blk_flush_complete, req);
     if (!acb) {
@@ -289,21 +345,28 @@ static void virtio_blk_handle_write(VirtIOBlockReq *req, MultiReqBuffer *mrb)
     mrb->num_writes++;
 }
 
-static void virtio_blk_handle_read(VirtIOBlockReq *req)
+static void virtio_blk_handle_read(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 {
-    BlockDriverAIOCB *acb;
+    BlockRequest *blkreq;
 
     if (req->out->sector & req->dev->sector_mask) {
         virtio_blk_rw_complete(req, -EIO);
         return;
     }
 
-    acb = bdrv_aio_readv(req->dev->bs, req->out->sector, &req->qiov,
-                         req->qiov.size / BDRV_SECTOR_SIZE,
-                         virtio_blk_rw_complete, req);
-    if (!acb) {
-        virtio_blk_rw_complete(req, -EIO);
+    if (mrb->num_reads == 32) {
+        virtio_submit_multiread(req->dev->bs, mrb);
     }
+
+    blkreq = &mrb->readreq[mrb->num_reads];
+    blkreq->sector = req->out->sector;
+    blkreq->nb_sectors = req->qiov.size / BDRV_SECTOR_SIZE;
+    blkreq->qiov = &req->qiov;
+    blkreq->cb = virtio_blk_rw_complete;
+    blkreq->opaque = req;
+    blkreq->error = 0;
+
+    mrb->num_reads++;
 }
 
 static void virtio_blk_handle_request(VirtIOBlockReq *req,
@@ -340,7 +403,7 @@ static void virtio_blk_handle_request(VirtIOBlockReq *req,
     } else {
         qemu_iovec_init_external(&req->qiov, &req->elem.in_sg[0],
                                  req->elem.in_num - 1);
-        virtio_blk_handle_read(req);
+        virtio_blk_handle_read(req, mrb);
     }
 }
 
@@ -350,13 +413,16 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
     VirtIOBlockReq *req;
     MultiReqBuffer mrb = {
         .num_writes = 0,
+        .num_reads = 0,
     };
 
+    bdrv_io_plug(s->bs);
     while ((req = virtio_blk_get_request(s))) {
         virtio_blk_handle_request(req, &mrb);
     }
 
-    virtio_submit_multiwrite(s->bs, &mrb);
+    virtio_submit_multireq(s->bs, &mrb);
+    bdrv_io_unplug(s->bs);
 
     /*
      * FIXME: Want to check for completions before returning to guest mode,
@@ -365,25 +431,34 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
      */
 }
 
-static void virtio_blk_dma_restart_bh(void *opaque)
+static void virtio_blk_dma_restart(VirtIOBlock *s)
 {
-    VirtIOBlock *s = opaque;
     VirtIOBlockReq *req = s->rq;
     MultiReqBuffer mrb = {
         .num_writes = 0,
+        .num_reads = 0,
     };
 
-    qemu_bh_delete(s->bh);
-    s->bh = NULL;
-
     s->rq = NULL;
 
+    bdrv_io_plug(s->bs);
     while (req) {
         virtio_blk_handle_request(req, &mrb);
         req = req->next;
     }
 
-    virtio_submit_multiwrite(s->bs, &mrb);
+    virtio_submit_multireq(s->bs, &mrb);
+    bdrv_io_unplug(s->bs);
+}
+
+static void virtio_blk_dma_restart_bh(void *opaque)
+{
+    VirtIOBlock *s = opaque;
+
+    qemu_bh_delete(s->bh);
+    s->bh = NULL;
+
+    virtio_blk_dma_restart(s);
 }
 
 static void virtio_blk_dma_restart_cb(void *opaque, int running, int reason)
@@ -452,11 +527,50 @@ static uint32_t virtio_blk_get_features(VirtIODevice *vdev, uint32_t features)
     return features;
 }
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+static void virtio_blk_set_status(VirtIODevice *vdev, uint8_t val)
+{
+    VirtIOBlock *s = to_virtio_blk(vdev);
+
+    virtio_blk_data_plane_set_status(s->dataplane, val);
+}
+
+/*
+ * Called before the data plane takes over the vring: requests the main loop
+ * still owns, including those waiting for the restart bh, must have
+ * completed so that both sides agree on the used index.
+ */
+void virtio_blk_drain(VirtIODevice *vdev)
+{
+    VirtIOBlock *s = to_virtio_blk(vdev);
+
+    if (s->bh) {
+        qemu_bh_delete(s->bh);
+        s->bh = NULL;
+    }
+    if (s->rq) {
+        virtio_blk_dma_restart(s);
+    }
+    qemu_aio_flush();
+
+    if (s->notify_pending) {
+        qemu_bh_cancel(s->notify_bh);
+        virtio_blk_notify_bh(s);
+    }
+}
+#endif
+
 static void virtio_blk_save(QEMUFile *f, void *opaque)
 {
     VirtIOBlock *s = opaque;
     VirtIOBlockReq *req = s->rq;
 
+    /* Don't lose the interrupt for requests that completed just now */
+    if (s->notify_pending) {
+        qemu_bh_cancel(s->notify_bh);
+        virtio_blk_notify_bh(s);
+    }
+
     virtio_save(&s->vdev, f);
     
     while (req) {
@@ -475,6 +589,12 @@ static int virtio_blk_load(QEMUFile *f, void *opaque, int version_id)
         return -EINVAL;
 
     virtio_load(&s->vdev, f);
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    /* The driver status is restored behind the set_status callback */
+    if (s->dataplane) {
+        virtio_blk_data_plane_set_status(s->dataplane, s->vdev.status);
+    }
+#endif
     while (qemu_get_sbyte(f)) {
         VirtIOBlockReq *req = virtio_blk_alloc_request(s);
         qemu_get_buffer(f, (unsigned char*)&req->elem, sizeof(req->elem));
@@ -490,7 +610,8 @@ static int virtio_blk_load(QEMUFile *f, void *opaque, int version_id)
     return 0;
 }
 
-VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf)
+VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf,
+                              int data_plane)
 {
     VirtIOBlock *s;
     int cylinders, heads, secs;
@@ -526,6 +647,28 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf)
     strncpy(s->sn, dinfo->serial, sizeof (s->sn));
 
     s->vq = virtio_add_queue(&s->vdev, 128, virtio_blk_handle_output);
+    s->notify_bh = qemu_bh_new(virtio_blk_notify_bh, s);
+
+    if (data_plane) {
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+        s->dataplane = virtio_blk_data_plane_create(&s->vdev, s->bs,
+                                                    s->sector_mask, s->sn);
+        if (!s->dataplane) {
+            qemu_bh_delete(s->notify_bh);
+            virtio_cleanup(&s->vdev);
+            qemu_free(s);
+            return NULL;
+        }
+        s->vdev.set_status = virtio_blk_set_status;
+#else
+        error_report("virtio-blk: x-data-plane requires Linux AIO support "
+                     "and the I/O thread");
+        qemu_bh_delete(s->notify_bh);
+        virtio_cleanup(&s->vdev);
+        qemu_free(s);
+        return NULL;
+#endif
+    }
 
     qemu_add_vm_change_state_handler(virtio_blk_dma_restart_cb, s);
     s->qdev = dev;
@@ -539,5 +682,11 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf)
 void virtio_blk_exit(VirtIODevice *vdev)
 {
     VirtIOBlock *s = to_virtio_blk(vdev);
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (s->dataplane) {
+        virtio_blk_data_plane_destroy(s->dataplane);
+    }
+#endif
+    qemu_bh_delete(s->notify_bh);
     unregister_savevm(s->qdev, "virtio-blk", s);
 }
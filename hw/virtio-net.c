@@ -18,6 +18,8 @@
 #include "net/tap.h"
 #include "qemu-error.h"
 #include "qemu-timer.h"
+#include "qint.h"
+#include "qstring.h"
 #include "virtio-net.h"
 #include "vhost_net.h"
 
@@ -26,24 +28,41 @@
 #define MAC_TABLE_ENTRIES    64
 #define MAX_VLAN    (1 << 12)   /* Per 802.1Q definition */
 
-typedef struct VirtIONet
+/* One rx/tx queue pair; each has its own NIC client, peered to one queue
+ * of a multiqueue tap device (and to its vhost-net instance). */
+typedef struct VirtIONetQueue
 {
-    VirtIODevice vdev;
-    uint8_t mac[ETH_ALEN];
-    uint16_t status;
     VirtQueue *rx_vq;
     VirtQueue *tx_vq;
-    VirtQueue *ctrl_vq;
-    NICState *nic;
     QEMUTimer *tx_timer;
     int tx_timer_active;
-    uint32_t has_vnet_hdr;
-    uint8_t has_ufo;
     struct {
         VirtQueueElement elem;
         ssize_t len;
     } async_tx;
+    /* Buffer lent to the peer for zero-copy receive; rx_copy is set once
+     * the guest turns out to post buffers too small for that */
+    VirtQueueElement rx_elem;
+    int rx_copy;
+    QEMUBH *rx_bh;
+    NICState *nic;
+    NICConf conf;
+    struct VirtIONet *n;
+} VirtIONetQueue;
+
+typedef struct VirtIONet
+{
+    VirtIODevice vdev;
+    uint8_t mac[ETH_ALEN];
+    uint16_t status;
+    VirtIONetQueue vqs[MAX_QUEUE_NUM];
+    VirtQueue *ctrl_vq;
+    uint32_t has_vnet_hdr;
+    uint8_t has_ufo;
     int mergeable_rx_bufs;
+    int multiqueue;
+    uint16_t max_queues;
+    uint16_t curr_queues;
     uint8_t promisc;
     uint8_t allmulti;
     uint8_t alluni;
@@ -51,6 +70,12 @@ typedef struct VirtIONet
     uint8_t nouni;
     uint8_t nobcast;
     uint8_t vhost_started;
+    /* vhost was not asked for and can't offer what userspace does */
+    uint8_t vhost_disabled;
+    struct {
+        uint64_t starts;
+        uint64_t fallbacks;
+    } vhost_stats;
     bool vm_running;
     VMChangeStateEntry *vmstate;
     struct {
@@ -73,6 +98,23 @@ static VirtIONet *to_virtio_net(VirtIODevice *vdev)
     return (VirtIONet *)vdev;
 }
 
+static VirtIONetQueue *virtio_net_get_queue(VLANClientState *nc)
+{
+    return DO_UPCAST(NICState, nc, nc)->opaque;
+}
+
+/* Queue pair i is made of virtqueues 2 * i (rx) and 2 * i + 1 (tx) */
+static VirtIONetQueue *virtio_net_vq_to_queue(VirtIONet *n, VirtQueue *vq)
+{
+    return &n->vqs[virtio_get_queue_index(vq) / 2];
+}
+
+/* The backend of the first queue pair stands for all of them */
+static VLANClientState *virtio_net_peer(VirtIONet *n)
+{
+    return n->vqs[0].nic->nc.peer;
+}
+
 static void virtio_net_get_config(VirtIODevice *vdev, uint8_t *config)
 {
     VirtIONet *n = to_virtio_net(vdev);
@@ -80,33 +122,100 @@ static void virtio_net_get_config(VirtIODevice *vdev, uint8_t *config)
 
     netcfg.status = n->status;
     memcpy(netcfg.mac, n->mac, ETH_ALEN);
-    memcpy(config, &netcfg, sizeof(netcfg));
+    netcfg.max_virtqueue_pairs = n->max_queues;
+    memcpy(config, &netcfg, n->vdev.config_len);
 }
 
 static void virtio_net_set_config(VirtIODevice *vdev, const uint8_t *config)
 {
     VirtIONet *n = to_virtio_net(vdev);
     struct virtio_net_config netcfg;
+    int i;
 
-    memcpy(&netcfg, config, sizeof(netcfg));
+    memcpy(&netcfg, config, n->vdev.config_len);
 
     if (memcmp(netcfg.mac, n->mac, ETH_ALEN)) {
         memcpy(n->mac, netcfg.mac, ETH_ALEN);
-        qemu_format_nic_info_str(&n->nic->nc, n->mac);
+        for (i = 0; i < n->max_queues; i++) {
+            qemu_format_nic_info_str(&n->vqs[i].nic->nc, n->mac);
+        }
     }
 }
 
-static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
+static int virtio_net_vhost_peers(VirtIONet *n, VLANClientState **peers)
 {
-    VirtIONet *n = to_virtio_net(vdev);
-    if (!n->nic->nc.peer) {
-        return;
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int i;
+
+    /* All negotiated pairs go to vhost, even those the guest has not
+     * enabled yet: VIRTIO_NET_CTRL_MQ only switches tap queues. */
+    for (i = 0; i < queues; i++) {
+        peers[i] = n->vqs[i].nic->nc.peer;
+    }
+    return queues;
+}
+
+/* The vhost-net instance of the first queue pair, if the in-kernel data
+ * path can be used at all.  Every negotiated pair must have one, else the
+ * whole device stays in userspace. */
+static VHostNetState *virtio_net_vhost(VirtIONet *n)
+{
+    VLANClientState *peers[MAX_QUEUE_NUM];
+    int queues = virtio_net_vhost_peers(n, peers);
+    VHostNetState *net;
+    int i;
+
+    if (n->vhost_disabled) {
+        return NULL;
     }
-    if (n->nic->nc.peer->info->type != NET_CLIENT_TYPE_TAP) {
+    for (i = 0; i < queues; i++) {
+        if (!peers[i] || peers[i]->info->type != NET_CLIENT_TYPE_TAP) {
+            return NULL;
+        }
+        net = tap_get_vhost_net(peers[i]);
+        if (!net || !vhost_net_query(net, &n->vdev)) {
+            return NULL;
+        }
+    }
+    return tap_get_vhost_net(peers[0]);
+}
+
+static void virtio_net_vhost_start(VirtIONet *n)
+{
+    VLANClientState *peers[MAX_QUEUE_NUM];
+    int queues = virtio_net_vhost_peers(n, peers);
+    int r;
+
+    r = vhost_net_start(&n->vdev, peers, queues);
+    if (r < 0) {
+        /* Not fatal: the rings are still in sync with userspace, and the
+         * next status change tries again */
+        fprintf(stderr, "unable to start vhost net: %d: "
+                "falling back on userspace virtio\n", -r);
+        n->vhost_stats.fallbacks++;
         return;
     }
+    n->vhost_started = 1;
+    n->vhost_stats.starts++;
+}
 
-    if (!tap_get_vhost_net(n->nic->nc.peer)) {
+static void virtio_net_vhost_stop(VirtIONet *n)
+{
+    VLANClientState *peers[MAX_QUEUE_NUM];
+    int queues = virtio_net_vhost_peers(n, peers);
+
+    vhost_net_stop(&n->vdev, peers, queues);
+    n->vhost_started = 0;
+}
+
+/* vhost runs while the guest driver is up and the VM is running, so it
+ * is stopped for migration (the kernel hands back the ring state) and
+ * picked up again on the destination, or here if migration fails. */
+static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
+{
+    VirtIONet *n = to_virtio_net(vdev);
+
+    if (!virtio_net_vhost(n)) {
         return;
     }
     if (!!n->vhost_started == ((status & VIRTIO_CONFIG_S_DRIVER_OK) &&
@@ -114,23 +223,28 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
                                n->vm_running)) {
         return;
     }
+
     if (!n->vhost_started) {
-        int r = vhost_net_start(tap_get_vhost_net(n->nic->nc.peer), &n->vdev);
-        if (r < 0) {
-            fprintf(stderr, "unable to start vhost net: %d: "
-                    "falling back on userspace virtio\n", -r);
-        } else {
-            n->vhost_started = 1;
-        }
+        virtio_net_vhost_start(n);
     } else {
-        vhost_net_stop(tap_get_vhost_net(n->nic->nc.peer), &n->vdev);
-        n->vhost_started = 0;
+        virtio_net_vhost_stop(n);
     }
 }
 
+static void virtio_net_get_stats(VirtIODevice *vdev, QDict *stats)
+{
+    VirtIONet *n = to_virtio_net(vdev);
+
+    qdict_put(stats, "datapath",
+              qstring_from_str(n->vhost_started ? "vhost" : "userspace"));
+    qdict_put(stats, "vhost-starts", qint_from_int(n->vhost_stats.starts));
+    qdict_put(stats, "vhost-fallbacks",
+              qint_from_int(n->vhost_stats.fallbacks));
+}
+
 static void virtio_net_set_link_status(VLANClientState *nc)
 {
-    VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONet *n = virtio_net_get_queue(nc)->n;
     uint16_t old_status = n->status;
 
     if (nc->link_down)
@@ -144,9 +258,35 @@ static void virtio_net_set_link_status(VLANClientState *nc)
     virtio_net_set_status(&n->vdev, n->vdev.status);
 }
 
+/* Attach the tap queues of the enabled pairs and detach the others, so
+ * that the host kernel only steers received flows to queues the guest
+ * is polling. */
+static void virtio_net_set_queues(VirtIONet *n)
+{
+    int i;
+
+    if (n->max_queues == 1) {
+        return;
+    }
+
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        if (i >= n->curr_queues && q->tx_timer_active) {
+            qemu_del_timer(q->tx_timer);
+            q->tx_timer_active = 0;
+        }
+        if (q->nic->peer_deleted) {
+            continue;
+        }
+        tap_set_queue_enabled(q->nic->nc.peer, i < n->curr_queues);
+    }
+}
+
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    int i;
 
     /* Reset back to compatibility mode */
     n->promisc = 1;
@@ -163,17 +303,25 @@ static void virtio_net_reset(VirtIODevice *vdev)
     n->mac_table.uni_overflow = 0;
     memset(n->mac_table.macs, 0, MAC_TABLE_ENTRIES * ETH_ALEN);
     memset(n->vlans, 0, MAX_VLAN >> 3);
+
+    for (i = 0; i < n->max_queues; i++) {
+        n->vqs[i].rx_copy = 0;
+    }
+
+    /* Only the first queue pair is used until the guest enables more */
+    n->curr_queues = 1;
+    virtio_net_set_queues(n);
 }
 
 static int peer_has_vnet_hdr(VirtIONet *n)
 {
-    if (!n->nic->nc.peer)
+    if (!virtio_net_peer(n))
         return 0;
 
-    if (n->nic->nc.peer->info->type != NET_CLIENT_TYPE_TAP)
+    if (virtio_net_peer(n)->info->type != NET_CLIENT_TYPE_TAP)
         return 0;
 
-    n->has_vnet_hdr = tap_has_vnet_hdr(n->nic->nc.peer);
+    n->has_vnet_hdr = tap_has_vnet_hdr(virtio_net_peer(n));
 
     return n->has_vnet_hdr;
 }
@@ -183,19 +331,76 @@ static int peer_has_ufo(VirtIONet *n)
     if (!peer_has_vnet_hdr(n))
         return 0;
 
-    n->has_ufo = tap_has_ufo(n->nic->nc.peer);
+    n->has_ufo = tap_has_ufo(virtio_net_peer(n));
 
     return n->has_ufo;
 }
 
+static void peer_using_vnet_hdr(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        tap_using_vnet_hdr(n->vqs[i].nic->nc.peer, 1);
+    }
+}
+
+static void peer_set_offload(VirtIONet *n, uint32_t features)
+{
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        tap_set_offload(n->vqs[i].nic->nc.peer,
+                        (features >> VIRTIO_NET_F_GUEST_CSUM) & 1,
+                        (features >> VIRTIO_NET_F_GUEST_TSO4) & 1,
+                        (features >> VIRTIO_NET_F_GUEST_TSO6) & 1,
+                        (features >> VIRTIO_NET_F_GUEST_ECN)  & 1,
+                        (features >> VIRTIO_NET_F_GUEST_UFO)  & 1);
+    }
+}
+
+static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq);
+static void virtio_net_handle_tx(VirtIODevice *vdev, VirtQueue *vq);
+static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq);
+
+/* Without VIRTIO_NET_F_MQ the layout is rx0, tx0, ctrl; with it the
+ * control queue follows all max_queues pairs. */
+static void virtio_net_set_multiqueue(VirtIONet *n, int multiqueue)
+{
+    int i, queues = multiqueue ? n->max_queues : 1;
+
+    if (n->multiqueue == multiqueue) {
+        return;
+    }
+    n->multiqueue = multiqueue;
+
+    for (i = 2; i <= n->max_queues * 2; i++) {
+        virtio_del_queue(&n->vdev, i);
+    }
+    for (i = 1; i < n->max_queues; i++) {
+        n->vqs[i].rx_vq = NULL;
+        n->vqs[i].tx_vq = NULL;
+    }
+
+    for (i = 1; i < queues; i++) {
+        n->vqs[i].rx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_rx);
+        n->vqs[i].tx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx);
+    }
+    n->ctrl_vq = virtio_add_queue(&n->vdev, 64, virtio_net_handle_ctrl);
+
+    n->curr_queues = 1;
+    virtio_net_set_queues(n);
+}
+
 static uint32_t virtio_net_get_features(VirtIODevice *vdev, uint32_t features)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    VHostNetState *net;
 
     features |= (1 << VIRTIO_NET_F_MAC);
 
     if (peer_has_vnet_hdr(n)) {
-        tap_using_vnet_hdr(n->nic->nc.peer, 1);
+        peer_using_vnet_hdr(n);
     } else {
         features &= ~(0x1 << VIRTIO_NET_F_CSUM);
         features &= ~(0x1 << VIRTIO_NET_F_HOST_TSO4);
@@ -213,14 +418,20 @@ static uint32_t virtio_net_get_features(VirtIODevice *vdev, uint32_t features)
         features &= ~(0x1 << VIRTIO_NET_F_HOST_UFO);
     }
 
-    if (!n->nic->nc.peer ||
-        n->nic->nc.peer->info->type != NET_CLIENT_TYPE_TAP) {
+    /* the number of queue pairs is set through the control queue */
+    if (n->max_queues == 1 || !(features & (1 << VIRTIO_NET_F_CTRL_VQ))) {
+        features &= ~(0x1 << VIRTIO_NET_F_MQ);
+    }
+
+    net = virtio_net_vhost(n);
+    if (!net) {
         return features;
     }
-    if (!tap_get_vhost_net(n->nic->nc.peer)) {
+    if (!vhost_net_query_features(net, features)) {
+        n->vhost_disabled = 1;
         return features;
     }
-    return vhost_net_get_features(tap_get_vhost_net(n->nic->nc.peer), features);
+    return vhost_net_get_features(net, features);
 }
 
 static uint32_t virtio_net_bad_features(VirtIODevice *vdev)
@@ -241,25 +452,36 @@ static uint32_t virtio_net_bad_features(VirtIODevice *vdev)
 static void virtio_net_set_features(VirtIODevice *vdev, uint32_t features)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    VLANClientState *peers[MAX_QUEUE_NUM];
+    int i, queues, started = n->vhost_started;
+
+    /* The kernel only picks up acked features when vhost is started, and
+     * the number of queue pairs it serves may change below */
+    if (started) {
+        virtio_net_vhost_stop(n);
+    }
 
     n->mergeable_rx_bufs = !!(features & (1 << VIRTIO_NET_F_MRG_RXBUF));
 
+    for (i = 0; i < n->max_queues; i++) {
+        n->vqs[i].rx_copy = 0;
+    }
+
+    virtio_net_set_multiqueue(n, !!(features & (1 << VIRTIO_NET_F_MQ)));
+
     if (n->has_vnet_hdr) {
-        tap_set_offload(n->nic->nc.peer,
-                        (features >> VIRTIO_NET_F_GUEST_CSUM) & 1,
-                        (features >> VIRTIO_NET_F_GUEST_TSO4) & 1,
-                        (features >> VIRTIO_NET_F_GUEST_TSO6) & 1,
-                        (features >> VIRTIO_NET_F_GUEST_ECN)  & 1,
-                        (features >> VIRTIO_NET_F_GUEST_UFO)  & 1);
+        peer_set_offload(n, features);
     }
-    if (!n->nic->nc.peer ||
-        n->nic->nc.peer->info->type != NET_CLIENT_TYPE_TAP) {
+    if (!virtio_net_vhost(n)) {
         return;
     }
-    if (!tap_get_vhost_net(n->nic->nc.peer)) {
-        return;
+    queues = virtio_net_vhost_peers(n, peers);
+    for (i = 0; i < queues; i++) {
+        vhost_net_ack_features(tap_get_vhost_net(peers[i]), features);
+    }
+    if (started) {
+        virtio_net_vhost_start(n);
     }
-    vhost_net_ack_features(tap_get_vhost_net(n->nic->nc.peer), features);
 }
 
 static int virtio_net_handle_rx_mode(VirtIONet *n, uint8_t cmd,
@@ -369,6 +591,31 @@ static int virtio_net_handle_vlan_table(VirtIONet *n, uint8_t cmd,
     return VIRTIO_NET_OK;
 }
 
+static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
+                                VirtQueueElement *elem)
+{
+    uint16_t queues;
+
+    if (elem->out_num != 2 ||
+        elem->out_sg[1].iov_len != sizeof(struct virtio_net_ctrl_mq)) {
+        fprintf(stderr, "virtio-net ctrl invalid multiqueue command\n");
+        return VIRTIO_NET_ERR;
+    }
+
+    queues = lduw_le_p(elem->out_sg[1].iov_base);
+
+    if (cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET || !n->multiqueue ||
+        queues < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN ||
+        queues > VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX ||
+        queues > n->max_queues)
+        return VIRTIO_NET_ERR;
+
+    n->curr_queues = queues;
+    virtio_net_set_queues(n);
+
+    return VIRTIO_NET_OK;
+}
+
 static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
@@ -397,6 +644,8 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
             status = virtio_net_handle_mac(n, ctrl.cmd, &elem);
         else if (ctrl.class == VIRTIO_NET_CTRL_VLAN)
             status = virtio_net_handle_vlan_table(n, ctrl.cmd, &elem);
+        else if (ctrl.class == VIRTIO_NET_CTRL_MQ)
+            status = virtio_net_handle_mq(n, ctrl.cmd, &elem);
 
         stb_p(elem.in_sg[elem.in_num - 1].iov_base, status);
 
@@ -410,8 +659,9 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
 static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    VirtIONetQueue *q = virtio_net_vq_to_queue(n, vq);
 
-    qemu_flush_queued_packets(&n->nic->nc);
+    qemu_flush_queued_packets(&q->nic->nc);
 
     /* We now have RX buffers, signal to the IO thread to break out of the
      * select to re-poll the tap file descriptor */
@@ -420,33 +670,39 @@ static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 
 static int virtio_net_can_receive(VLANClientState *nc)
 {
-    VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONetQueue *q = virtio_net_get_queue(nc);
+    VirtIONet *n = q->n;
 
-    if (!virtio_queue_ready(n->rx_vq) ||
+    if (q - n->vqs >= n->curr_queues)
+        return 0;
+
+    if (!virtio_queue_ready(q->rx_vq) ||
         !(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK))
         return 0;
 
     return 1;
 }
 
-static int virtio_net_has_buffers(VirtIONet *n, int bufsize)
+static int virtio_net_has_buffers(VirtIONetQueue *q, int bufsize)
 {
-    if (virtio_queue_empty(n->rx_vq) ||
+    VirtIONet *n = q->n;
+
+    if (virtio_queue_empty(q->rx_vq) ||
         (n->mergeable_rx_bufs &&
-         !virtqueue_avail_bytes(n->rx_vq, bufsize, 0))) {
-        virtio_queue_set_notification(n->rx_vq, 1);
+         !virtqueue_avail_bytes(q->rx_vq, bufsize, 0))) {
+        virtio_queue_set_notification(q->rx_vq, 1);
 
         /* To avoid a race condition where the guest has made some buffers
          * available after the above check but before notification was
          * enabled, check for available buffers again.
          */
-        if (virtio_queue_empty(n->rx_vq) ||
+        if (virtio_queue_empty(q->rx_vq) ||
             (n->mergeable_rx_bufs &&
-             !virtqueue_avail_bytes(n->rx_vq, bufsize, 0)))
+             !virtqueue_avail_bytes(q->rx_vq, bufsize, 0)))
             return 0;
     }
 
-    virtio_queue_set_notification(n->rx_vq, 0);
+    virtio_queue_set_notification(q->rx_vq, 0);
     return 1;
 }
 
@@ -464,14 +720,20 @@ static int virtio_net_has_buffers(VirtIONet *n, int bufsize)
  * we should provide a mechanism to disable it to avoid polluting the host
  * cache.
  */
-static void work_around_broken_dhclient(struct virtio_net_hdr *hdr,
-                                        const uint8_t *buf, size_t size)
+static int is_broken_dhclient_packet(const struct virtio_net_hdr *hdr,
+                                     const uint8_t *buf, size_t size)
 {
-    if ((hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) && /* missing csum */
+    return (hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) && /* missing csum */
         (size > 27 && size < 1500) && /* normal sized MTU */
         (buf[12] == 0x08 && buf[13] == 0x00) && /* ethertype == IPv4 */
         (buf[23] == 17) && /* ip.protocol == UDP */
-        (buf[34] == 0 && buf[35] == 67)) { /* udp.srcport == bootps */
+        (buf[34] == 0 && buf[35] == 67); /* udp.srcport == bootps */
+}
+
+static void work_around_broken_dhclient(struct virtio_net_hdr *hdr,
+                                        const uint8_t *buf, size_t size)
+{
+    if (is_broken_dhclient_packet(hdr, buf, size)) {
         /* FIXME this cast is evil */
         net_checksum_calculate((uint8_t *)buf, size);
         hdr->flags &= ~VIRTIO_NET_HDR_F_NEEDS_CSUM;
@@ -557,11 +819,12 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
 
 static ssize_t virtio_net_receive(VLANClientState *nc, const uint8_t *buf, size_t size)
 {
-    VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONetQueue *q = virtio_net_get_queue(nc);
+    VirtIONet *n = q->n;
     struct virtio_net_hdr_mrg_rxbuf *mhdr = NULL;
     size_t guest_hdr_len, offset, i, host_hdr_len;
 
-    if (!virtio_net_can_receive(&n->nic->nc))
+    if (!virtio_net_can_receive(&q->nic->nc))
         return -1;
 
     /* hdr_len refers to the header we supply to the guest */
@@ -570,7 +833,7 @@ static ssize_t virtio_net_receive(VLANClientState *nc, const uint8_t *buf, size_
 
 
     host_hdr_len = n->has_vnet_hdr ? sizeof(struct virtio_net_hdr) : 0;
-    if (!virtio_net_has_buffers(n, size + guest_hdr_len - host_hdr_len))
+    if (!virtio_net_has_buffers(q, size + guest_hdr_len - host_hdr_len))
         return 0;
 
     if (!receive_filter(n, buf, size))
@@ -585,7 +848,7 @@ static ssize_t virtio_net_receive(VLANClientState *nc, const uint8_t *buf, size_
 
         total = 0;
 
-        if (virtqueue_pop(n->rx_vq, &elem) == 0) {
+        if (virtqueue_pop(q->rx_vq, &elem) == 0) {
             if (i == 0)
                 return -1;
             fprintf(stderr, "virtio-net unexpected empty queue: "
@@ -638,43 +901,138 @@ static ssize_t virtio_net_receive(VLANClientState *nc, const uint8_t *buf, size_
         }
 
         /* signal other side */
-        virtqueue_fill(n->rx_vq, &elem, total, i++);
+        virtqueue_fill(q->rx_vq, &elem, total, i++);
     }
 
     if (mhdr)
         mhdr->num_buffers = i;
 
-    virtqueue_flush(n->rx_vq, i);
-    virtio_notify(&n->vdev, n->rx_vq);
+    virtqueue_flush(q->rx_vq, i);
+    qemu_bh_schedule(q->rx_bh);
 
     return size;
 }
 
-static void virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq);
+/* Zero-copy receive for guests that post buffers big enough for any
+ * packet (no mergeable rx buffers): the peer reads straight into them. */
+static int virtio_net_get_rx_buffer(VLANClientState *nc, struct iovec *iov,
+                                    int iovcnt)
+{
+    VirtIONetQueue *q = virtio_net_get_queue(nc);
+    VirtIONet *n = q->n;
+    VirtQueueElement *elem = &q->rx_elem;
+    int skip = n->has_vnet_hdr ? 0 : 1;
+
+    if (n->mergeable_rx_bufs || q->rx_copy || !virtio_net_can_receive(nc) ||
+        !virtio_net_has_buffers(q, 0)) {
+        return 0;
+    }
+
+    if (!virtqueue_pop(q->rx_vq, elem)) {
+        return 0;
+    }
+
+    if (elem->in_num < 1 ||
+        elem->in_sg[0].iov_len != sizeof(struct virtio_net_hdr)) {
+        fprintf(stderr, "virtio-net header not in first element\n");
+        exit(1);
+    }
+
+    if (elem->in_num - skip > iovcnt ||
+        iov_size(elem->in_sg, elem->in_num) < VIRTIO_NET_MAX_BUFSIZE) {
+        virtqueue_discard(q->rx_vq, elem, 0);
+        q->rx_copy = 1;
+        return 0;
+    }
+
+    /* Without a vnet header from the peer we only fill in the packet */
+    if (skip) {
+        memset(elem->in_sg[0].iov_base, 0, sizeof(struct virtio_net_hdr));
+    }
+
+    memcpy(iov, &elem->in_sg[skip], sizeof(*iov) * (elem->in_num - skip));
+
+    return elem->in_num - skip;
+}
+
+static void virtio_net_put_rx_buffer(VLANClientState *nc, ssize_t size)
+{
+    VirtIONetQueue *q = virtio_net_get_queue(nc);
+    VirtIONet *n = q->n;
+    VirtQueueElement *elem = &q->rx_elem;
+    struct virtio_net_hdr *hdr = elem->in_sg[0].iov_base;
+    size_t hdr_len = sizeof(struct virtio_net_hdr);
+    int skip = n->has_vnet_hdr ? 0 : 1;
+    uint8_t head[sizeof(struct virtio_net_hdr) + 64];
+    size_t total;
+
+    if (size <= 0) {
+        virtqueue_discard(q->rx_vq, elem, 0);
+        return;
+    }
+
+    /* size counts the vnet header only if the peer provided it */
+    total = skip ? size + hdr_len : size;
+
+    /* The filters and the dhclient check only need the frame headers */
+    memset(head, 0, sizeof(head));
+    iov_to_buf(&elem->in_sg[skip], elem->in_num - skip, head, 0, sizeof(head));
+
+    if (!receive_filter(n, head, size)) {
+        virtqueue_discard(q->rx_vq, elem, total);
+        return;
+    }
+
+    if (n->has_vnet_hdr &&
+        is_broken_dhclient_packet(hdr, head + hdr_len, size - hdr_len)) {
+        uint8_t buf[1500];
+
+        iov_to_buf(&elem->in_sg[1], elem->in_num - 1, buf, 0, size - hdr_len);
+        work_around_broken_dhclient(hdr, buf, size - hdr_len);
+        iov_from_buf(&elem->in_sg[1], elem->in_num - 1, buf, size - hdr_len);
+    }
+
+    virtqueue_push(q->rx_vq, elem, total);
+    qemu_bh_schedule(q->rx_bh);
+}
+
+/* Packets are received in bursts from the fd handler: raise one interrupt
+ * for all of them */
+static void virtio_net_rx_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+
+    virtio_notify(&q->n->vdev, q->rx_vq);
+}
+
+static void virtio_net_flush_tx(VirtIONetQueue *q, VirtQueue *vq);
 
 static void virtio_net_tx_complete(VLANClientState *nc, ssize_t len)
 {
-    VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONetQueue *q = virtio_net_get_queue(nc);
+    VirtIONet *n = q->n;
 
-    virtqueue_push(n->tx_vq, &n->async_tx.elem, n->async_tx.len);
-    virtio_notify(&n->vdev, n->tx_vq);
+    virtqueue_push(q->tx_vq, &q->async_tx.elem, q->async_tx.len);
+    virtio_notify(&n->vdev, q->tx_vq);
 
-    n->async_tx.elem.out_num = n->async_tx.len = 0;
+    q->async_tx.elem.out_num = q->async_tx.len = 0;
 
-    virtio_queue_set_notification(n->tx_vq, 1);
-    virtio_net_flush_tx(n, n->tx_vq);
+    virtio_queue_set_notification(q->tx_vq, 1);
+    virtio_net_flush_tx(q, q->tx_vq);
 }
 
 /* TX */
-static void virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq)
+static void virtio_net_flush_tx(VirtIONetQueue *q, VirtQueue *vq)
 {
+    VirtIONet *n = q->n;
     VirtQueueElement elem;
+    unsigned int sent = 0;
 
     if (!(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK))
         return;
 
-    if (n->async_tx.elem.out_num) {
-        virtio_queue_set_notification(n->tx_vq, 0);
+    if (q->async_tx.elem.out_num) {
+        virtio_queue_set_notification(q->tx_vq, 0);
         return;
     }
 
@@ -706,18 +1064,24 @@ static void virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq)
             len += hdr_len;
         }
 
-        ret = qemu_sendv_packet_async(&n->nic->nc, out_sg, out_num,
+        ret = qemu_sendv_packet_async(&q->nic->nc, out_sg, out_num,
                                       virtio_net_tx_complete);
         if (ret == 0) {
-            virtio_queue_set_notification(n->tx_vq, 0);
-            n->async_tx.elem = elem;
-            n->async_tx.len  = len;
-            return;
+            virtio_queue_set_notification(q->tx_vq, 0);
+            q->async_tx.elem = elem;
+            q->async_tx.len  = len;
+            break;
         }
 
         len += ret;
 
-        virtqueue_push(vq, &elem, len);
+        /* Complete the whole batch with one used index update and one
+         * interrupt */
+        virtqueue_fill(vq, &elem, len, sent++);
+    }
+
+    if (sent) {
+        virtqueue_flush(vq, sent);
         virtio_notify(&n->vdev, vq);
     }
 }
@@ -725,37 +1089,40 @@ static void virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq)
 static void virtio_net_handle_tx(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    VirtIONetQueue *q = virtio_net_vq_to_queue(n, vq);
 
-    if (n->tx_timer_active) {
+    if (q->tx_timer_active) {
         virtio_queue_set_notification(vq, 1);
-        qemu_del_timer(n->tx_timer);
-        n->tx_timer_active = 0;
-        virtio_net_flush_tx(n, vq);
+        qemu_del_timer(q->tx_timer);
+        q->tx_timer_active = 0;
+        virtio_net_flush_tx(q, vq);
     } else {
-        qemu_mod_timer(n->tx_timer,
+        qemu_mod_timer(q->tx_timer,
                        qemu_get_clock(vm_clock) + TX_TIMER_INTERVAL);
-        n->tx_timer_active = 1;
+        q->tx_timer_active = 1;
         virtio_queue_set_notification(vq, 0);
     }
 }
 
 static void virtio_net_tx_timer(void *opaque)
 {
-    VirtIONet *n = opaque;
+    VirtIONetQueue *q = opaque;
+    VirtIONet *n = q->n;
 
-    n->tx_timer_active = 0;
+    q->tx_timer_active = 0;
 
     /* Just in case the driver is not ready on more */
     if (!(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK))
         return;
 
-    virtio_queue_set_notification(n->tx_vq, 1);
-    virtio_net_flush_tx(n, n->tx_vq);
+    virtio_queue_set_notification(q->tx_vq, 1);
+    virtio_net_flush_tx(q, q->tx_vq);
 }
 
 static void virtio_net_save(QEMUFile *f, void *opaque)
 {
     VirtIONet *n = opaque;
+    int i;
 
     /* At this point, backend must be stopped, otherwise
      * it might keep writing to memory. */
@@ -763,7 +1130,7 @@ static void virtio_net_save(QEMUFile *f, void *opaque)
     virtio_save(&n->vdev, f);
 
     qemu_put_buffer(f, n->mac, ETH_ALEN);
-    qemu_put_be32(f, n->tx_timer_active);
+    qemu_put_be32(f, n->vqs[0].tx_timer_active);
     qemu_put_be32(f, n->mergeable_rx_bufs);
     qemu_put_be16(f, n->status);
     qemu_put_byte(f, n->promisc);
@@ -779,6 +1146,15 @@ static void virtio_net_save(QEMUFile *f, void *opaque)
     qemu_put_byte(f, n->nouni);
     qemu_put_byte(f, n->nobcast);
     qemu_put_byte(f, n->has_ufo);
+
+    /* Only present when both sides were given a multiqueue backend */
+    if (n->max_queues > 1) {
+        qemu_put_be16(f, n->max_queues);
+        qemu_put_be16(f, n->curr_queues);
+        for (i = 1; i < n->curr_queues; i++) {
+            qemu_put_be32(f, n->vqs[i].tx_timer_active);
+        }
+    }
 }
 
 static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
@@ -792,7 +1168,7 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
     virtio_load(&n->vdev, f);
 
     qemu_get_buffer(f, n->mac, ETH_ALEN);
-    n->tx_timer_active = qemu_get_be32(f);
+    n->vqs[0].tx_timer_active = qemu_get_be32(f);
     n->mergeable_rx_bufs = qemu_get_be32(f);
 
     if (version_id >= 3)
@@ -831,13 +1207,8 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
         }
 
         if (n->has_vnet_hdr) {
-            tap_using_vnet_hdr(n->nic->nc.peer, 1);
-            tap_set_offload(n->nic->nc.peer,
-                    (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_CSUM) & 1,
-                    (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_TSO4) & 1,
-                    (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_TSO6) & 1,
-                    (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_ECN)  & 1,
-                    (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_UFO)  & 1);
+            peer_using_vnet_hdr(n);
+            peer_set_offload(n, n->vdev.guest_features);
         }
     }
 
@@ -860,6 +1231,24 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
         }
     }
 
+    if (n->max_queues > 1) {
+        if (qemu_get_be16(f) != n->max_queues) {
+            error_report("virtio-net: saved image requires %d queues",
+                         n->max_queues);
+            return -1;
+        }
+        n->curr_queues = qemu_get_be16(f);
+        if (n->curr_queues > n->max_queues) {
+            error_report("virtio-net: saved image enables %d queues",
+                         n->curr_queues);
+            return -1;
+        }
+        for (i = 1; i < n->curr_queues; i++) {
+            n->vqs[i].tx_timer_active = qemu_get_be32(f);
+        }
+        virtio_net_set_queues(n);
+    }
+
     /* Find the first multicast entry in the saved MAC filter */
     for (i = 0; i < n->mac_table.in_use; i++) {
         if (n->mac_table.macs[i * ETH_ALEN] & 1) {
@@ -868,18 +1257,20 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
     }
     n->mac_table.first_multi = i;
 
-    if (n->tx_timer_active) {
-        qemu_mod_timer(n->tx_timer,
-                       qemu_get_clock(vm_clock) + TX_TIMER_INTERVAL);
+    for (i = 0; i < n->curr_queues; i++) {
+        if (n->vqs[i].tx_timer_active) {
+            qemu_mod_timer(n->vqs[i].tx_timer,
+                           qemu_get_clock(vm_clock) + TX_TIMER_INTERVAL);
+        }
     }
     return 0;
 }
 
 static void virtio_net_cleanup(VLANClientState *nc)
 {
-    VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONetQueue *q = virtio_net_get_queue(nc);
 
-    n->nic = NULL;
+    q->nic = NULL;
 }
 
 static NetClientInfo net_virtio_info = {
@@ -889,6 +1280,8 @@ static NetClientInfo net_virtio_info = {
     .receive = virtio_net_receive,
         .cleanup = virtio_net_cleanup,
     .link_status_changed = virtio_net_set_link_status,
+    .get_rx_buffer = virtio_net_get_rx_buffer,
+    .put_rx_buffer = virtio_net_put_rx_buffer,
 };
 
 static void virtio_net_vmstate_change(void *opaque, int running, int reason)
@@ -904,10 +1297,33 @@ static void virtio_net_vmstate_change(void *opaque, int running, int reason)
 VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf)
 {
     VirtIONet *n;
+    VLANClientState *peers[MAX_QUEUE_NUM];
+    size_t config_size;
+    int i, queues = 1;
+
+    /* A multiqueue tap netdev is several clients with the same name: give
+     * each of them a queue pair of its own. */
+    if (conf->peer && conf->peer->info->type == NET_CLIENT_TYPE_TAP) {
+        queues = qemu_find_net_clients_except(conf->peer->name, peers,
+                                              NET_CLIENT_TYPE_NIC,
+                                              MAX_QUEUE_NUM);
+        assert(queues >= 1 && queues <= MAX_QUEUE_NUM && peers[0] == conf->peer);
+        for (i = 1; i < queues; i++) {
+            if (peers[i]->peer) {
+                error_report("virtio-net: queue %d of netdev '%s' is already in use",
+                             i, conf->peer->name);
+                return NULL;
+            }
+        }
+    }
+
+    /* Keep the old config layout (and migration format) for single queue
+     * devices */
+    config_size = queues > 1 ? sizeof(struct virtio_net_config) :
+                  offsetof(struct virtio_net_config, max_virtqueue_pairs);
 
     n = (VirtIONet *)virtio_common_init("virtio-net", VIRTIO_ID_NET,
-                                        sizeof(struct virtio_net_config),
-                                        sizeof(VirtIONet));
+                                        config_size, sizeof(VirtIONet));
 
     n->vdev.get_config = virtio_net_get_config;
     n->vdev.set_config = virtio_net_set_config;
@@ -916,19 +1332,34 @@ VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf)
     n->vdev.bad_features = virtio_net_bad_features;
     n->vdev.reset = virtio_net_reset;
     n->vdev.set_status = virtio_net_set_status;
-    n->rx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_rx);
-    n->tx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx);
+    n->vdev.get_stats = virtio_net_get_stats;
+    n->max_queues = queues;
+    n->curr_queues = 1;
+    n->multiqueue = 0;
+    n->vqs[0].rx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_rx);
+    n->vqs[0].tx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx);
     n->ctrl_vq = virtio_add_queue(&n->vdev, 64, virtio_net_handle_ctrl);
     qemu_macaddr_default_if_unset(&conf->macaddr);
     memcpy(&n->mac[0], &conf->macaddr, sizeof(n->mac));
     n->status = VIRTIO_NET_S_LINK_UP;
 
-    n->nic = qemu_new_nic(&net_virtio_info, conf, dev->info->name, dev->id, n);
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
 
-    qemu_format_nic_info_str(&n->nic->nc, conf->macaddr.a);
+        q->n = n;
+        q->conf = *conf;
+        if (i > 0) {
+            q->conf.peer = peers[i];
+        }
+        q->nic = qemu_new_nic(&net_virtio_info, &q->conf, dev->info->name,
+                              dev->id, q);
+        qemu_format_nic_info_str(&q->nic->nc, conf->macaddr.a);
+
+        q->tx_timer = qemu_new_timer(vm_clock, virtio_net_tx_timer, q);
+        q->tx_timer_active = 0;
+        q->rx_bh = qemu_bh_new(virtio_net_rx_bh, q);
+    }
 
-    n->tx_timer = qemu_new_timer(vm_clock, virtio_net_tx_timer, n);
-    n->tx_timer_active = 0;
     n->mergeable_rx_bufs = 0;
     n->promisc = 1; /* for compatibility */
 
@@ -947,21 +1378,30 @@ VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf)
 void virtio_net_exit(VirtIODevice *vdev)
 {
     VirtIONet *n = DO_UPCAST(VirtIONet, vdev, vdev);
+    int i;
+
     qemu_del_vm_change_state_handler(n->vmstate);
 
     /* This will stop vhost backend if appropriate. */
     virtio_net_set_status(vdev, 0);
 
-    qemu_purge_queued_packets(&n->nic->nc);
+    for (i = 0; i < n->max_queues; i++) {
+        qemu_purge_queued_packets(&n->vqs[i].nic->nc);
+    }
 
     unregister_savevm(n->qdev, "virtio-net", n);
 
     qemu_free(n->mac_table.macs);
     qemu_free(n->vlans);
 
-    qemu_del_timer(n->tx_timer);
-    qemu_free_timer(n->tx_timer);
+    for (i = 0; i < n->max_queues; i++) {
+        qemu_del_timer(n->vqs[i].tx_timer);
+        qemu_free_timer(n->vqs[i].tx_timer);
+        qemu_bh_delete(n->vqs[i].rx_bh);
+    }
 
     virtio_cleanup(&n->vdev);
-    qemu_del_vlan_client(&n->nic->nc);
+    for (i = 0; i < n->max_queues; i++) {
+        qemu_del_vlan_client(&n->vqs[i].nic->nc);
+    }
 }
@@ -24,6 +24,10 @@
 #include "net.h"
 #include "loader.h"
 #include "kvm.h"
+#include "sysemu.h"
+#ifdef CONFIG_IOTHREAD
+#include "qemu-thread.h"
+#endif
 
 /* from Linux's linux/virtio_pci.h */
 
@@ -83,6 +87,10 @@
    guests. */
 #define VIRTIO_PCI_BUG_BUS_MASTER	(1 << 0)
 
+/* Handle virtio-blk requests in a thread of their own (x-data-plane) */
+#define VIRTIO_PCI_FLAG_BLK_DATA_PLANE_BIT 0
+#define VIRTIO_PCI_FLAG_BLK_DATA_PLANE (1 << VIRTIO_PCI_FLAG_BLK_DATA_PLANE_BIT)
+
 /* QEMU doesn't strictly need write barriers since everything runs in
  * lock-step.  We'll leave the calls to wmb() in though to make it obvious for
  * KVM or if kqemu gets SMP support.
@@ -98,14 +106,25 @@ typedef struct {
     uint32_t addr;
     uint32_t class_code;
     uint32_t nvectors;
+    uint32_t flags;
     BlockConf block;
     NICConf nic;
     uint32_t host_features;
+    VirtIOCoalesceConf coalesce;
 #ifdef CONFIG_LINUX
     V9fsConf fsconf;
 #endif
     /* Max. number of ports we can have for a the virtio-serial device */
     uint32_t max_virtserial_ports;
+#ifdef CONFIG_IOTHREAD
+    /* With KVM, QUEUE_NOTIFY writes are taken by the vcpu threads under
+       kick_lock only; the queues are run later from the io thread. */
+    bool kick_deferred;
+    QemuMutex kick_lock;
+    uint64_t pending_kicks;
+    EventNotifier kick_notifier;
+    VMChangeStateEntry *kick_vmstate;
+#endif
 } VirtIOPCIProxy;
 
 /* virtio device */
@@ -186,6 +205,84 @@ static void virtio_pci_reset(DeviceState *d)
     proxy->bugs = 0;
 }
 
+#ifdef CONFIG_IOTHREAD
+/* Called with kick_lock held, possibly without the global mutex.  */
+static void virtio_pci_defer_kick(VirtIOPCIProxy *proxy, uint32_t n)
+{
+    if (n >= VIRTIO_PCI_QUEUE_MAX) {
+        return;
+    }
+    if (!proxy->pending_kicks) {
+        event_notifier_set(&proxy->kick_notifier);
+    }
+    proxy->pending_kicks |= 1ULL << n;
+}
+
+static void virtio_pci_run_kicks(VirtIOPCIProxy *proxy)
+{
+    uint64_t kicks;
+    int n;
+
+    qemu_mutex_lock(&proxy->kick_lock);
+    event_notifier_test_and_clear(&proxy->kick_notifier);
+    kicks = proxy->pending_kicks;
+    proxy->pending_kicks = 0;
+    qemu_mutex_unlock(&proxy->kick_lock);
+
+    for (n = 0; kicks; n++, kicks >>= 1) {
+        if (kicks & 1) {
+            virtio_queue_notify(proxy->vdev, n);
+        }
+    }
+}
+
+static void virtio_pci_kick_read(void *opaque)
+{
+    virtio_pci_run_kicks(opaque);
+}
+
+static void virtio_pci_kick_vmstate_change(void *opaque, int running,
+                                           int reason)
+{
+    /* do not carry kicks across a stop (and thus a migration) */
+    if (!running) {
+        virtio_pci_run_kicks(opaque);
+    }
+}
+
+static void virtio_pci_init_kicks(VirtIOPCIProxy *proxy)
+{
+    if (!kvm_enabled() ||
+        event_notifier_init(&proxy->kick_notifier, 0) < 0) {
+        return;
+    }
+    qemu_mutex_init(&proxy->kick_lock);
+    qemu_set_fd_handler(event_notifier_get_fd(&proxy->kick_notifier),
+                        virtio_pci_kick_read, NULL, proxy);
+    proxy->kick_vmstate =
+        qemu_add_vm_change_state_handler(virtio_pci_kick_vmstate_change,
+                                         proxy);
+    proxy->kick_deferred = true;
+}
+
+static void virtio_pci_cleanup_kicks(VirtIOPCIProxy *proxy)
+{
+    if (!proxy->kick_deferred) {
+        return;
+    }
+    qemu_mutex_lock(&proxy->kick_lock);
+    ioport_set_lock(proxy->addr + VIRTIO_PCI_QUEUE_NOTIFY, 2, NULL);
+    proxy->kick_deferred = false;
+    qemu_mutex_unlock(&proxy->kick_lock);
+    /* a vcpu may still be about to take kick_lock */
+    ioport_drain_own_locks();
+    qemu_del_vm_change_state_handler(proxy->kick_vmstate);
+    qemu_set_fd_handler(event_notifier_get_fd(&proxy->kick_notifier),
+                        NULL, NULL, NULL);
+    event_notifier_cleanup(&proxy->kick_notifier);
+}
+#endif
+
 static void virtio_ioport_write(void *opaque, uint32_t addr, uint32_t val)
 {
     VirtIOPCIProxy *proxy = opaque;
@@ -219,6 +316,12 @@ static void virtio_ioport_write(void *opaque, uint32_t addr, uint32_t val)
             vdev->queue_sel = val;
         break;
     case VIRTIO_PCI_QUEUE_NOTIFY:
+#ifdef CONFIG_IOTHREAD
+        if (proxy->kick_deferred) {
+            virtio_pci_defer_kick(proxy, val);
+            break;
+        }
+#endif
         virtio_queue_notify(vdev, val);
         break;
     case VIRTIO_PCI_STATUS:
@@ -389,6 +492,11 @@ static void virtio_map(PCIDevice *pci_dev, int region_num,
     register_ioport_read(addr, config_len, 1, virtio_pci_config_readb, proxy);
     register_ioport_read(addr, config_len, 2, virtio_pci_config_readw, proxy);
     register_ioport_read(addr, config_len, 4, virtio_pci_config_readl, proxy);
+#ifdef CONFIG_IOTHREAD
+    if (proxy->kick_deferred) {
+        ioport_set_lock(addr + VIRTIO_PCI_QUEUE_NOTIFY, 2, &proxy->kick_lock);
+    }
+#endif
 
     if (vdev->config_len)
         vdev->get_config(vdev, vdev->config);
@@ -492,7 +600,19 @@ static int virtio_pci_set_host_notifier(void *opaque, int n, bool assign)
                                        n, assign);
         if (r < 0) {
             event_notifier_cleanup(notifier);
+            return r;
+        }
+#ifdef CONFIG_IOTHREAD
+        /* hand a kick that is still queued for us over to the notifier */
+        if (proxy->kick_deferred) {
+            qemu_mutex_lock(&proxy->kick_lock);
+            if (proxy->pending_kicks & (1ULL << n)) {
+                proxy->pending_kicks &= ~(1ULL << n);
+                event_notifier_set(notifier);
+            }
+            qemu_mutex_unlock(&proxy->kick_lock);
         }
+#endif
     } else {
         r = kvm_set_ioeventfd_pio_word(event_notifier_get_fd(notifier),
                                        proxy->addr + VIRTIO_PCI_QUEUE_NOTIFY,
@@ -524,6 +644,8 @@ static void virtio_init_pci(VirtIOPCIProxy *proxy, VirtIODevice *vdev,
     uint32_t size;
 
     proxy->vdev = vdev;
+    vdev->id = proxy->pci_dev.qdev.id;
+    vdev->coalesce = proxy->coalesce;
 
     config = proxy->pci_dev.config;
     pci_config_set_vendor_id(config, vendor);
@@ -559,6 +681,9 @@ static void virtio_init_pci(VirtIOPCIProxy *proxy, VirtIODevice *vdev,
                            virtio_map);
 
     virtio_bind_device(vdev, &virtio_pci_bindings, proxy);
+#ifdef CONFIG_IOTHREAD
+    virtio_pci_init_kicks(proxy);
+#endif
     proxy->host_features |= 0x1 << VIRTIO_F_NOTIFY_ON_EMPTY;
     proxy->host_features |= 0x1 << VIRTIO_F_BAD_FEATURE;
     proxy->host_features = vdev->get_features(vdev, proxy->host_features);
@@ -573,7 +698,8 @@ static int virtio_blk_init_pci(PCIDevice *pci_dev)
         proxy->class_code != PCI_CLASS_STORAGE_OTHER)
         proxy->class_code = PCI_CLASS_STORAGE_SCSI;
 
-    vdev = virtio_blk_init(&pci_dev->qdev, &proxy->block);
+    vdev = virtio_blk_init(&pci_dev->qdev, &proxy->block,
+                           proxy->flags & VIRTIO_PCI_FLAG_BLK_DATA_PLANE);
     if (!vdev) {
         return -1;
     }
@@ -589,6 +715,12 @@ static int virtio_blk_init_pci(PCIDevice *pci_dev)
 
 static int virtio_exit_pci(PCIDevice *pci_dev)
 {
+    VirtIOPCIProxy *proxy = DO_UPCAST(VirtIOPCIProxy, pci_dev, pci_dev);
+
+#ifdef CONFIG_IOTHREAD
+    virtio_pci_cleanup_kicks(proxy);
+#endif
+    virtio_unbind_device(proxy->vdev);
     return msix_uninit(pci_dev);
 }
 
@@ -632,6 +764,9 @@ static int virtio_net_init_pci(PCIDevice *pci_dev)
     VirtIODevice *vdev;
 
     vdev = virtio_net_init(&pci_dev->qdev, &proxy->nic);
+    if (!vdev) {
+        return -1;
+    }
 
     vdev->nvectors = proxy->nvectors;
     virtio_init_pci(proxy, vdev,
@@ -695,6 +830,9 @@ static PCIDeviceInfo virtio_info[] = {
             DEFINE_BLOCK_PROPERTIES(VirtIOPCIProxy, block),
             DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors, 2),
             DEFINE_VIRTIO_BLK_FEATURES(VirtIOPCIProxy, host_features),
+            DEFINE_VIRTIO_COALESCE_PROPERTIES(VirtIOPCIProxy, coalesce),
+            DEFINE_PROP_BIT("x-data-plane", VirtIOPCIProxy, flags,
+                            VIRTIO_PCI_FLAG_BLK_DATA_PLANE_BIT, false),
             DEFINE_PROP_END_OF_LIST(),
         },
         .qdev.reset = virtio_pci_reset,
@@ -707,6 +845,7 @@ static PCIDeviceInfo virtio_info[] = {
         .qdev.props = (Property[]) {
             DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors, 3),
             DEFINE_VIRTIO_NET_FEATURES(VirtIOPCIProxy, host_features),
+            DEFINE_VIRTIO_COALESCE_PROPERTIES(VirtIOPCIProxy, coalesce),
             DEFINE_NIC_PROPERTIES(VirtIOPCIProxy, nic),
             DEFINE_PROP_END_OF_LIST(),
         },
@@ -722,6 +861,7 @@ static PCIDeviceInfo virtio_info[] = {
                                DEV_NVECTORS_UNSPECIFIED),
             DEFINE_PROP_HEX32("class", VirtIOPCIProxy, class_code, 0),
             DEFINE_VIRTIO_COMMON_FEATURES(VirtIOPCIProxy, host_features),
+            DEFINE_VIRTIO_COALESCE_PROPERTIES(VirtIOPCIProxy, coalesce),
             DEFINE_PROP_UINT32("max_ports", VirtIOPCIProxy, max_virtserial_ports,
                                31),
             DEFINE_PROP_END_OF_LIST(),
@@ -734,6 +874,7 @@ static PCIDeviceInfo virtio_info[] = {
         .exit      = virtio_exit_pci,
         .qdev.props = (Property[]) {
             DEFINE_VIRTIO_COMMON_FEATURES(VirtIOPCIProxy, host_features),
+            DEFINE_VIRTIO_COALESCE_PROPERTIES(VirtIOPCIProxy, coalesce),
             DEFINE_PROP_END_OF_LIST(),
         },
         .qdev.reset = virtio_pci_reset,
@@ -744,6 +885,7 @@ static PCIDeviceInfo virtio_info[] = {
         .init      = virtio_9p_init_pci,
         .qdev.props = (Property[]) {
             DEFINE_VIRTIO_COMMON_FEATURES(VirtIOPCIProxy, host_features),
+            DEFINE_VIRTIO_COALESCE_PROPERTIES(VirtIOPCIProxy, coalesce),
             DEFINE_PROP_STRING("mount_tag", VirtIOPCIProxy, fsconf.tag),
             DEFINE_PROP_STRING("fsdev", VirtIOPCIProxy, fsconf.fsdev_id),
             DEFINE_PROP_END_OF_LIST(),
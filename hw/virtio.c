@@ -15,6 +15,13 @@
 
 #include "virtio.h"
 #include "sysemu.h"
+#include "exec-all.h"
+/* For ranges_overlap */
+#include "pci.h"
+#include "qemu-timer.h"
+#include "qjson.h"
+#include "qlist.h"
+#include "monitor.h"
 
 /* The alignment to use between consumer and producer parts of vring.
  * x86 pagesize again. */
@@ -65,20 +72,167 @@ typedef struct VRing
     target_phys_addr_t used;
 } VRing;
 
+/* A descriptor table, either the ring's own or an indirect one; host is
+ * NULL if the table is not in RAM we can access directly */
+typedef struct VRingDescTable
+{
+    target_phys_addr_t pa;
+    VRingDesc *host;
+} VRingDescTable;
+
 struct VirtQueue
 {
     VRing vring;
+    /* Host view of the ring when it lies in guest RAM, see
+     * virtqueue_map_ring(); rebuilt on the next access if map_stale */
+    VRingDesc *desc;
+    VRingAvail *avail;
+    VRingUsed *used;
+    ram_addr_t used_ram;
+    bool map_stale;
     target_phys_addr_t pa;
     uint16_t last_avail_idx;
+    /* Used index at the last interrupt, for VIRTIO_RING_F_EVENT_IDX */
+    uint16_t signalled_used;
+    bool signalled_used_valid;
     int inuse;
     uint16_t vector;
     void (*handle_output)(VirtIODevice *vdev, VirtQueue *vq);
     VirtIODevice *vdev;
     EventNotifier guest_notifier;
     EventNotifier host_notifier;
+    /* Interrupt coalescing, see virtio_notify() */
+    QEMUTimer *notify_timer;
+    int notify_pending;
+    int64_t last_notify;
+    int64_t notify_interval;
+    struct {
+        uint64_t notifications;
+        uint64_t suppressed;
+        uint64_t deferred;
+        uint64_t interrupts;
+    } stats;
 };
 
+static QLIST_HEAD(, VirtIODevice) virtio_devices =
+    QLIST_HEAD_INITIALIZER(virtio_devices);
+
+/* Guest RAM regions recently used for descriptor tables and buffers.
+ * Entries cover at most one VIRTIO_MAP_CHUNK and are dropped when the
+ * guest memory map changes. */
+#define VIRTIO_MAP_CACHE_SIZE   64
+#define VIRTIO_MAP_CHUNK        (2 * 1024 * 1024)
+
+typedef struct VirtIOMapCacheEntry {
+    target_phys_addr_t start;
+    target_phys_addr_t len;
+    uint8_t *host;
+} VirtIOMapCacheEntry;
+
+static VirtIOMapCacheEntry virtio_map_cache[VIRTIO_MAP_CACHE_SIZE];
+
+/* Map up to *plen bytes of guest RAM at addr for long-lived use.  Unlike
+ * cpu_physical_memory_map() this never hands out the bounce buffer: the
+ * mapping stops at the first page that is not RAM, and NULL is returned
+ * if addr itself is not RAM. */
+static void *virtio_map_ram(target_phys_addr_t addr, target_phys_addr_t *plen,
+                            ram_addr_t *ram_addr)
+{
+    target_phys_addr_t page, len = 0;
+    ram_addr_t first = 0;
+
+    for (page = addr & TARGET_PAGE_MASK; page < addr + *plen;
+         page += TARGET_PAGE_SIZE) {
+        ram_addr_t pd = cpu_get_physical_page_desc(page);
+
+        if ((pd & ~TARGET_PAGE_MASK) != IO_MEM_RAM) {
+            break;
+        }
+        if (page == (addr & TARGET_PAGE_MASK)) {
+            first = pd & TARGET_PAGE_MASK;
+        } else if ((pd & TARGET_PAGE_MASK) !=
+                   first + (page - (addr & TARGET_PAGE_MASK))) {
+            break;
+        }
+        len = MIN(page + TARGET_PAGE_SIZE - addr, *plen);
+    }
+
+    *plen = len;
+    if (!len) {
+        return NULL;
+    }
+    if (ram_addr) {
+        *ram_addr = first + (addr & ~TARGET_PAGE_MASK);
+    }
+    return cpu_physical_memory_map(addr, plen, 1);
+}
+
+/* Host address of [addr, addr + len) if it lies in guest RAM, else NULL */
+static void *virtio_map_cached(target_phys_addr_t addr, target_phys_addr_t len)
+{
+    target_phys_addr_t chunk = addr & ~(target_phys_addr_t)(VIRTIO_MAP_CHUNK - 1);
+    VirtIOMapCacheEntry *e;
+
+    e = &virtio_map_cache[(chunk / VIRTIO_MAP_CHUNK) % VIRTIO_MAP_CACHE_SIZE];
+    if (!e->host || addr < e->start || addr - e->start >= e->len) {
+        /* Map from the chunk start if possible, so that one entry serves
+         * the whole chunk; below a hole, start at the page of addr */
+        e->start = chunk;
+        e->len = VIRTIO_MAP_CHUNK;
+        e->host = virtio_map_ram(e->start, &e->len, NULL);
+        if (!e->host || addr - e->start >= e->len) {
+            e->start = addr & TARGET_PAGE_MASK;
+            e->len = chunk + VIRTIO_MAP_CHUNK - e->start;
+            e->host = virtio_map_ram(e->start, &e->len, NULL);
+            if (!e->host) {
+                return NULL;
+            }
+        }
+    }
+
+    if (len > e->len - (addr - e->start)) {
+        return NULL;
+    }
+    return e->host + (addr - e->start);
+}
+
 /* virt queue functions */
+static void virtqueue_map_ring(VirtQueue *vq)
+{
+    target_phys_addr_t size, len;
+    uint8_t *ring;
+
+    vq->desc = NULL;
+    vq->avail = NULL;
+    vq->used = NULL;
+    vq->map_stale = false;
+
+    if (!vq->pa) {
+        return;
+    }
+
+    size = vq->vring.used + offsetof(VRingUsed, ring[vq->vring.num]) +
+           sizeof(uint16_t) - vq->pa;
+    len = size;
+    ring = virtio_map_ram(vq->pa, &len, &vq->used_ram);
+    if (!ring || len != size) {
+        /* Not plain RAM: fall back to the ld*_phys/st*_phys accessors */
+        return;
+    }
+
+    vq->desc = (VRingDesc *)ring;
+    vq->avail = (VRingAvail *)(ring + (vq->vring.avail - vq->pa));
+    vq->used = (VRingUsed *)(ring + (vq->vring.used - vq->pa));
+    vq->used_ram += vq->vring.used - vq->pa;
+}
+
+static inline void virtqueue_check_map(VirtQueue *vq)
+{
+    if (unlikely(vq->map_stale)) {
+        virtqueue_map_ring(vq);
+    }
+}
+
 static void virtqueue_init(VirtQueue *vq)
 {
     target_phys_addr_t pa = vq->pa;
@@ -88,39 +242,126 @@ static void virtqueue_init(VirtQueue *vq)
     vq->vring.used = vring_align(vq->vring.avail +
                                  offsetof(VRingAvail, ring[vq->vring.num]),
                                  VIRTIO_PCI_VRING_ALIGN);
+    virtqueue_map_ring(vq);
+}
+
+/*
+ * Guest memory is being remapped: drop the mappings that may go stale.  This
+ * runs before exec.c updates its page table, so nothing can be mapped again
+ * here; the rings are remapped on their next access instead.
+ */
+static void virtio_set_memory(CPUPhysMemoryClient *client,
+                              target_phys_addr_t start_addr,
+                              ram_addr_t size, ram_addr_t phys_offset)
+{
+    VirtIODevice *vdev;
+    int i;
+
+    for (i = 0; i < VIRTIO_MAP_CACHE_SIZE; i++) {
+        VirtIOMapCacheEntry *e = &virtio_map_cache[i];
+
+        if (e->host && ranges_overlap(e->start, e->len, start_addr, size)) {
+            e->host = NULL;
+        }
+    }
+
+    QLIST_FOREACH(vdev, &virtio_devices, list) {
+        for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+            VirtQueue *vq = &vdev->vq[i];
+
+            if (vq->pa &&
+                ranges_overlap(vq->pa, vq->vring.used - vq->pa +
+                               offsetof(VRingUsed, ring[vq->vring.num]) +
+                               sizeof(uint16_t),
+                               start_addr, size)) {
+                vq->desc = NULL;
+                vq->avail = NULL;
+                vq->used = NULL;
+                vq->map_stale = true;
+            }
+        }
+    }
+}
+
+static int virtio_sync_dirty_bitmap(CPUPhysMemoryClient *client,
+                                    target_phys_addr_t start_addr,
+                                    target_phys_addr_t end_addr)
+{
+    return 0;
 }
 
-static inline uint64_t vring_desc_addr(target_phys_addr_t desc_pa, int i)
+static int virtio_migration_log(CPUPhysMemoryClient *client, int enable)
+{
+    return 0;
+}
+
+static CPUPhysMemoryClient virtio_memory_client = {
+    .set_memory = virtio_set_memory,
+    .sync_dirty_bitmap = virtio_sync_dirty_bitmap,
+    .migration_log = virtio_migration_log,
+};
+
+static void vring_desc_table_init(VirtQueue *vq, VRingDescTable *t)
+{
+    virtqueue_check_map(vq);
+    t->pa = vq->vring.desc;
+    t->host = vq->desc;
+}
+
+static void vring_desc_table_indirect(VRingDescTable *t, target_phys_addr_t pa,
+                                      target_phys_addr_t len)
+{
+    t->pa = pa;
+    t->host = virtio_map_cached(pa, len);
+}
+
+static inline uint64_t vring_desc_addr(const VRingDescTable *t, int i)
 {
     target_phys_addr_t pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, addr);
+    if (t->host) {
+        return ldq_p(&t->host[i].addr);
+    }
+    pa = t->pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, addr);
     return ldq_phys(pa);
 }
 
-static inline uint32_t vring_desc_len(target_phys_addr_t desc_pa, int i)
+static inline uint32_t vring_desc_len(const VRingDescTable *t, int i)
 {
     target_phys_addr_t pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, len);
+    if (t->host) {
+        return ldl_p(&t->host[i].len);
+    }
+    pa = t->pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, len);
     return ldl_phys(pa);
 }
 
-static inline uint16_t vring_desc_flags(target_phys_addr_t desc_pa, int i)
+static inline uint16_t vring_desc_flags(const VRingDescTable *t, int i)
 {
     target_phys_addr_t pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, flags);
+    if (t->host) {
+        return lduw_p(&t->host[i].flags);
+    }
+    pa = t->pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, flags);
     return lduw_phys(pa);
 }
 
-static inline uint16_t vring_desc_next(target_phys_addr_t desc_pa, int i)
+static inline uint16_t vring_desc_next(const VRingDescTable *t, int i)
 {
     target_phys_addr_t pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, next);
+    if (t->host) {
+        return lduw_p(&t->host[i].next);
+    }
+    pa = t->pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, next);
     return lduw_phys(pa);
 }
 
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
     target_phys_addr_t pa;
+    virtqueue_check_map(vq);
+    if (vq->avail) {
+        return lduw_p(&vq->avail->flags);
+    }
     pa = vq->vring.avail + offsetof(VRingAvail, flags);
     return lduw_phys(pa);
 }
@@ -128,6 +369,10 @@ static inline uint16_t vring_avail_flags(VirtQueue *vq)
 static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
     target_phys_addr_t pa;
+    virtqueue_check_map(vq);
+    if (vq->avail) {
+        return lduw_p(&vq->avail->idx);
+    }
     pa = vq->vring.avail + offsetof(VRingAvail, idx);
     return lduw_phys(pa);
 }
@@ -135,13 +380,38 @@ static inline uint16_t vring_avail_idx(VirtQueue *vq)
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
 {
     target_phys_addr_t pa;
+    virtqueue_check_map(vq);
+    if (vq->avail) {
+        return lduw_p(&vq->avail->ring[i]);
+    }
     pa = vq->vring.avail + offsetof(VRingAvail, ring[i]);
     return lduw_phys(pa);
 }
 
+/* Stores through vq->used bypass the dirty tracking of st*_phys */
+static void vring_used_set_dirty(VirtQueue *vq, target_phys_addr_t offset,
+                                 target_phys_addr_t len)
+{
+    ram_addr_t addr = vq->used_ram + offset;
+    ram_addr_t end = addr + len;
+
+    for (addr &= TARGET_PAGE_MASK; addr < end; addr += TARGET_PAGE_SIZE) {
+        if (!cpu_physical_memory_is_dirty(addr)) {
+            tb_invalidate_phys_page_range(addr, addr + TARGET_PAGE_SIZE, 0);
+            cpu_physical_memory_set_dirty_flags(addr, (0xff & ~CODE_DIRTY_FLAG));
+        }
+    }
+}
+
 static inline void vring_used_ring_id(VirtQueue *vq, int i, uint32_t val)
 {
     target_phys_addr_t pa;
+    virtqueue_check_map(vq);
+    if (vq->used) {
+        stl_p(&vq->used->ring[i].id, val);
+        vring_used_set_dirty(vq, offsetof(VRingUsed, ring[i].id), sizeof(val));
+        return;
+    }
     pa = vq->vring.used + offsetof(VRingUsed, ring[i].id);
     stl_phys(pa, val);
 }
@@ -149,6 +419,12 @@ static inline void vring_used_ring_id(VirtQueue *vq, int i, uint32_t val)
 static inline void vring_used_ring_len(VirtQueue *vq, int i, uint32_t val)
 {
     target_phys_addr_t pa;
+    virtqueue_check_map(vq);
+    if (vq->used) {
+        stl_p(&vq->used->ring[i].len, val);
+        vring_used_set_dirty(vq, offsetof(VRingUsed, ring[i].len), sizeof(val));
+        return;
+    }
     pa = vq->vring.used + offsetof(VRingUsed, ring[i].len);
     stl_phys(pa, val);
 }
@@ -156,33 +432,98 @@ static inline void vring_used_ring_len(VirtQueue *vq, int i, uint32_t val)
 static uint16_t vring_used_idx(VirtQueue *vq)
 {
     target_phys_addr_t pa;
+    virtqueue_check_map(vq);
+    if (vq->used) {
+        return lduw_p(&vq->used->idx);
+    }
     pa = vq->vring.used + offsetof(VRingUsed, idx);
     return lduw_phys(pa);
 }
 
-static inline void vring_used_idx_increment(VirtQueue *vq, uint16_t val)
+static inline void vring_used_set_idx(VirtQueue *vq, uint16_t val)
 {
     target_phys_addr_t pa;
+    virtqueue_check_map(vq);
+    if (vq->used) {
+        stw_p(&vq->used->idx, val);
+        vring_used_set_dirty(vq, offsetof(VRingUsed, idx), sizeof(val));
+        return;
+    }
     pa = vq->vring.used + offsetof(VRingUsed, idx);
-    stw_phys(pa, vring_used_idx(vq) + val);
+    stw_phys(pa, val);
 }
 
-static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
+static inline void vring_used_idx_increment(VirtQueue *vq, uint16_t val)
+{
+    vring_used_set_idx(vq, vring_used_idx(vq) + val);
+}
+
+static inline uint16_t vring_used_flags(VirtQueue *vq)
 {
     target_phys_addr_t pa;
+    virtqueue_check_map(vq);
+    if (vq->used) {
+        return lduw_p(&vq->used->flags);
+    }
     pa = vq->vring.used + offsetof(VRingUsed, flags);
-    stw_phys(pa, lduw_phys(pa) | mask);
+    return lduw_phys(pa);
 }
 
-static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
+static inline void vring_used_set_flags(VirtQueue *vq, uint16_t val)
 {
     target_phys_addr_t pa;
+    virtqueue_check_map(vq);
+    if (vq->used) {
+        stw_p(&vq->used->flags, val);
+        vring_used_set_dirty(vq, offsetof(VRingUsed, flags), sizeof(val));
+        return;
+    }
     pa = vq->vring.used + offsetof(VRingUsed, flags);
-    stw_phys(pa, lduw_phys(pa) & ~mask);
+    stw_phys(pa, val);
+}
+
+/* With VIRTIO_RING_F_EVENT_IDX, used_event follows the avail ring and
+ * avail_event follows the used ring */
+static inline uint16_t vring_used_event(VirtQueue *vq)
+{
+    return vring_avail_ring(vq, vq->vring.num);
+}
+
+static inline void vring_set_avail_event(VirtQueue *vq, uint16_t val)
+{
+    target_phys_addr_t pa;
+    virtqueue_check_map(vq);
+    if (vq->used) {
+        stw_p(&vq->used->ring[vq->vring.num], val);
+        vring_used_set_dirty(vq, offsetof(VRingUsed, ring[vq->vring.num]),
+                             sizeof(val));
+        return;
+    }
+    pa = vq->vring.used + offsetof(VRingUsed, ring[vq->vring.num]);
+    stw_phys(pa, val);
+}
+
+static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
+{
+    vring_used_set_flags(vq, vring_used_flags(vq) | mask);
+}
+
+static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
+{
+    vring_used_set_flags(vq, vring_used_flags(vq) & ~mask);
 }
 
 void virtio_queue_set_notification(VirtQueue *vq, int enable)
 {
+    /* With event indexes, not moving avail_event along is enough to
+     * keep the guest from kicking */
+    if (vq->vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
+        if (enable) {
+            vring_set_avail_event(vq, vring_avail_idx(vq));
+        }
+        return;
+    }
+
     if (enable)
         vring_used_flags_unset_bit(vq, VRING_USED_F_NO_NOTIFY);
     else
@@ -243,6 +584,35 @@ void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
     virtqueue_flush(vq, 1);
 }
 
+/* Give back an element obtained with virtqueue_pop without using it; the
+ * guest will see it again on the next pop.  len is the number of bytes
+ * already written to its in buffers. */
+void virtqueue_discard(VirtQueue *vq, const VirtQueueElement *elem,
+                       unsigned int len)
+{
+    unsigned int offset;
+    int i;
+
+    offset = 0;
+    for (i = 0; i < elem->in_num; i++) {
+        size_t size = MIN(len - MIN(len, offset), elem->in_sg[i].iov_len);
+
+        cpu_physical_memory_unmap(elem->in_sg[i].iov_base,
+                                  elem->in_sg[i].iov_len,
+                                  1, size);
+
+        offset += elem->in_sg[i].iov_len;
+    }
+
+    for (i = 0; i < elem->out_num; i++)
+        cpu_physical_memory_unmap(elem->out_sg[i].iov_base,
+                                  elem->out_sg[i].iov_len,
+                                  0, elem->out_sg[i].iov_len);
+
+    vq->last_avail_idx--;
+    vq->inuse--;
+}
+
 static int virtqueue_num_heads(VirtQueue *vq, unsigned int idx)
 {
     uint16_t num_heads = vring_avail_idx(vq) - idx;
@@ -274,17 +644,17 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
     return head;
 }
 
-static unsigned virtqueue_next_desc(target_phys_addr_t desc_pa,
+static unsigned virtqueue_next_desc(const VRingDescTable *desc,
                                     unsigned int i, unsigned int max)
 {
     unsigned int next;
 
     /* If this descriptor says it doesn't chain, we're done. */
-    if (!(vring_desc_flags(desc_pa, i) & VRING_DESC_F_NEXT))
+    if (!(vring_desc_flags(desc, i) & VRING_DESC_F_NEXT))
         return max;
 
     /* Check they're not leading us off end of descriptors. */
-    next = vring_desc_next(desc_pa, i);
+    next = vring_desc_next(desc, i);
     /* Make sure compiler knows to grab that: we don't want it changing! */
     wmb();
 
@@ -306,16 +676,16 @@ int virtqueue_avail_bytes(VirtQueue *vq, int in_bytes, int out_bytes)
     total_bufs = in_total = out_total = 0;
     while (virtqueue_num_heads(vq, idx)) {
         unsigned int max, num_bufs, indirect = 0;
-        target_phys_addr_t desc_pa;
+        VRingDescTable desc;
         int i;
 
         max = vq->vring.num;
         num_bufs = total_bufs;
         i = virtqueue_get_head(vq, idx++);
-        desc_pa = vq->vring.desc;
+        vring_desc_table_init(vq, &desc);
 
-        if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_INDIRECT) {
-            if (vring_desc_len(desc_pa, i) % sizeof(VRingDesc)) {
+        if (vring_desc_flags(&desc, i) & VRING_DESC_F_INDIRECT) {
+            if (vring_desc_len(&desc, i) % sizeof(VRingDesc)) {
                 fprintf(stderr, "Invalid size for indirect buffer table\n");
                 exit(1);
             }
@@ -328,9 +698,10 @@ int virtqueue_avail_bytes(VirtQueue *vq, int in_bytes, int out_bytes)
 
             /* loop over the indirect descriptor table */
             indirect = 1;
-            max = vring_desc_len(desc_pa, i) / sizeof(VRingDesc);
+            max = vring_desc_len(&desc, i) / sizeof(VRingDesc);
+            vring_desc_table_indirect(&desc, vring_desc_addr(&desc, i),
+                                      vring_desc_len(&desc, i));
             num_bufs = i = 0;
-            desc_pa = vring_desc_addr(desc_pa, i);
         }
 
         do {
@@ -340,16 +711,16 @@ int virtqueue_avail_bytes(VirtQueue *vq, int in_bytes, int out_bytes)
                 exit(1);
             }
 
-            if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_WRITE) {
+            if (vring_desc_flags(&desc, i) & VRING_DESC_F_WRITE) {
                 if (in_bytes > 0 &&
-                    (in_total += vring_desc_len(desc_pa, i)) >= in_bytes)
+                    (in_total += vring_desc_len(&desc, i)) >= in_bytes)
                     return 1;
             } else {
                 if (out_bytes > 0 &&
-                    (out_total += vring_desc_len(desc_pa, i)) >= out_bytes)
+                    (out_total += vring_desc_len(&desc, i)) >= out_bytes)
                     return 1;
             }
-        } while ((i = virtqueue_next_desc(desc_pa, i, max)) != max);
+        } while ((i = virtqueue_next_desc(&desc, i, max)) != max);
 
         if (!indirect)
             total_bufs = num_bufs;
@@ -368,6 +739,10 @@ void virtqueue_map_sg(struct iovec *sg, target_phys_addr_t *addr,
 
     for (i = 0; i < num_sg; i++) {
         len = sg[i].iov_len;
+        sg[i].iov_base = virtio_map_cached(addr[i], len);
+        if (sg[i].iov_base) {
+            continue;
+        }
         sg[i].iov_base = cpu_physical_memory_map(addr[i], &len, is_write);
         if (sg[i].iov_base == NULL || len != sg[i].iov_len) {
             fprintf(stderr, "virtio: trying to map MMIO memory\n");
@@ -379,7 +754,7 @@ void virtqueue_map_sg(struct iovec *sg, target_phys_addr_t *addr,
 int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
 {
     unsigned int i, head, max;
-    target_phys_addr_t desc_pa = vq->vring.desc;
+    VRingDescTable desc;
 
     if (!virtqueue_num_heads(vq, vq->last_avail_idx))
         return 0;
@@ -390,16 +765,21 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
     max = vq->vring.num;
 
     i = head = virtqueue_get_head(vq, vq->last_avail_idx++);
+    if (vq->vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+    vring_desc_table_init(vq, &desc);
 
-    if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_INDIRECT) {
-        if (vring_desc_len(desc_pa, i) % sizeof(VRingDesc)) {
+    if (vring_desc_flags(&desc, i) & VRING_DESC_F_INDIRECT) {
+        if (vring_desc_len(&desc, i) % sizeof(VRingDesc)) {
             fprintf(stderr, "Invalid size for indirect buffer table\n");
             exit(1);
         }
 
         /* loop over the indirect descriptor table */
-        max = vring_desc_len(desc_pa, i) / sizeof(VRingDesc);
-        desc_pa = vring_desc_addr(desc_pa, i);
+        max = vring_desc_len(&desc, i) / sizeof(VRingDesc);
+        vring_desc_table_indirect(&desc, vring_desc_addr(&desc, i),
+                                  vring_desc_len(&desc, i));
         i = 0;
     }
 
@@ -407,22 +787,22 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
     do {
         struct iovec *sg;
 
-        if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_WRITE) {
-            elem->in_addr[elem->in_num] = vring_desc_addr(desc_pa, i);
+        if (vring_desc_flags(&desc, i) & VRING_DESC_F_WRITE) {
+            elem->in_addr[elem->in_num] = vring_desc_addr(&desc, i);
             sg = &elem->in_sg[elem->in_num++];
         } else {
-            elem->out_addr[elem->out_num] = vring_desc_addr(desc_pa, i);
+            elem->out_addr[elem->out_num] = vring_desc_addr(&desc, i);
             sg = &elem->out_sg[elem->out_num++];
         }
 
-        sg->iov_len = vring_desc_len(desc_pa, i);
+        sg->iov_len = vring_desc_len(&desc, i);
 
         /* If we've got too many, that implies a descriptor loop. */
         if ((elem->in_num + elem->out_num) > max) {
             fprintf(stderr, "Looped descriptor");
             exit(1);
         }
-    } while ((i = virtqueue_next_desc(desc_pa, i, max)) != max);
+    } while ((i = virtqueue_next_desc(&desc, i, max)) != max);
 
     /* Now map what we have collected */
     virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
@@ -470,8 +850,14 @@ void virtio_reset(void *opaque)
         vdev->vq[i].vring.avail = 0;
         vdev->vq[i].vring.used = 0;
         vdev->vq[i].last_avail_idx = 0;
+        vdev->vq[i].signalled_used_valid = false;
         vdev->vq[i].pa = 0;
+        virtqueue_map_ring(&vdev->vq[i]);
         vdev->vq[i].vector = VIRTIO_NO_VECTOR;
+        vdev->vq[i].notify_pending = 0;
+        if (vdev->vq[i].notify_timer) {
+            qemu_del_timer(vdev->vq[i].notify_timer);
+        }
     }
 }
 
@@ -556,6 +942,7 @@ void virtio_config_writel(VirtIODevice *vdev, uint32_t addr, uint32_t data)
 void virtio_queue_set_addr(VirtIODevice *vdev, int n, target_phys_addr_t addr)
 {
     vdev->vq[n].pa = addr;
+    vdev->vq[n].signalled_used_valid = false;
     virtqueue_init(&vdev->vq[n]);
 }
 
@@ -607,24 +994,156 @@ VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
     return &vdev->vq[i];
 }
 
+void virtio_del_queue(VirtIODevice *vdev, int n)
+{
+    if (n < 0 || n >= VIRTIO_PCI_QUEUE_MAX) {
+        abort();
+    }
+
+    vdev->vq[n].vring.num = 0;
+    vdev->vq[n].vring.desc = 0;
+    vdev->vq[n].vring.avail = 0;
+    vdev->vq[n].vring.used = 0;
+    vdev->vq[n].pa = 0;
+    virtqueue_map_ring(&vdev->vq[n]);
+    vdev->vq[n].last_avail_idx = 0;
+    vdev->vq[n].signalled_used_valid = false;
+    vdev->vq[n].inuse = 0;
+    vdev->vq[n].vector = VIRTIO_NO_VECTOR;
+    vdev->vq[n].handle_output = NULL;
+    vdev->vq[n].notify_pending = 0;
+    if (vdev->vq[n].notify_timer) {
+        qemu_del_timer(vdev->vq[n].notify_timer);
+        qemu_free_timer(vdev->vq[n].notify_timer);
+        vdev->vq[n].notify_timer = NULL;
+    }
+}
+
 void virtio_irq(VirtQueue *vq)
 {
     vq->vdev->isr |= 0x01;
     virtio_notify_vector(vq->vdev, vq->vector);
 }
 
-void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
+static int virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
+    uint16_t used;
+
     /* Always notify when queue is empty (when feature acknowledge) */
-    if ((vring_avail_flags(vq) & VRING_AVAIL_F_NO_INTERRUPT) &&
-        (!(vdev->guest_features & (1 << VIRTIO_F_NOTIFY_ON_EMPTY)) ||
-         (vq->inuse || vring_avail_idx(vq) != vq->last_avail_idx)))
-        return;
+    if ((vdev->guest_features & (1 << VIRTIO_F_NOTIFY_ON_EMPTY)) &&
+        !vq->inuse && vring_avail_idx(vq) == vq->last_avail_idx) {
+        return 1;
+    }
+
+    if (!(vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX))) {
+        return !(vring_avail_flags(vq) & VRING_AVAIL_F_NO_INTERRUPT);
+    }
+
+    /* The guest asked to be woken once the used index passes used_event;
+     * without an earlier interrupt there is nothing to compare against */
+    used = vring_used_idx(vq);
+    return !vq->signalled_used_valid ||
+           virtio_need_event(vring_used_event(vq), used, vq->signalled_used);
+}
+
+/* The guest has seen, or chose not to be told about, everything up to
+ * the current used index */
+static void virtio_set_signalled(VirtQueue *vq)
+{
+    vq->signalled_used = vring_used_idx(vq);
+    vq->signalled_used_valid = true;
+}
+
+static void virtio_raise_irq(VirtIODevice *vdev, VirtQueue *vq)
+{
+    vq->notify_pending = 0;
+    vq->stats.interrupts++;
+    virtio_set_signalled(vq);
 
     vdev->isr |= 0x01;
     virtio_notify_vector(vdev, vq->vector);
 }
 
+static void virtio_notify_timer(void *opaque)
+{
+    VirtQueue *vq = opaque;
+
+    if (!vq->notify_pending) {
+        return;
+    }
+
+    /* The guest may have disabled interrupts in the meantime */
+    if (virtio_should_notify(vq->vdev, vq)) {
+        virtio_raise_irq(vq->vdev, vq);
+    } else {
+        vq->notify_pending = 0;
+        vq->stats.suppressed++;
+        virtio_set_signalled(vq);
+    }
+}
+
+static void virtio_flush_notify(VirtIODevice *vdev)
+{
+    int i;
+
+    for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        if (vdev->vq[i].notify_pending) {
+            qemu_del_timer(vdev->vq[i].notify_timer);
+            virtio_notify_timer(&vdev->vq[i]);
+        }
+    }
+}
+
+/* With coalescing enabled (coalesce.usecs != 0), interrupts for a queue
+ * that sees used ring updates more often than once per coalesce.usecs are
+ * held back until coalesce.usecs have passed since the first of them, or
+ * until coalesce.frames of them have accumulated.  Queues with a lower
+ * rate still get an interrupt for every update, so that latency only
+ * suffers when there are interrupts to save. */
+void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
+{
+    int64_t now, window, interval;
+
+    vq->stats.notifications++;
+
+    if (!virtio_should_notify(vdev, vq)) {
+        vq->stats.suppressed++;
+        virtio_set_signalled(vq);
+        return;
+    }
+
+    window = vdev->coalesce.usecs * 1000LL;
+    if (!window) {
+        virtio_raise_irq(vdev, vq);
+        return;
+    }
+
+    /* Moving average of the time between updates; long gaps are clamped
+     * so that a burst is recognized after a few updates */
+    now = qemu_get_clock(vm_clock);
+    interval = MIN(now - vq->last_notify, 2 * window);
+    vq->notify_interval += (interval - vq->notify_interval) / 4;
+    vq->last_notify = now;
+
+    if (!vq->notify_pending && vq->notify_interval >= window) {
+        virtio_raise_irq(vdev, vq);
+        return;
+    }
+
+    vq->stats.deferred++;
+    vq->notify_pending++;
+
+    if (vdev->coalesce.frames && vq->notify_pending >= vdev->coalesce.frames) {
+        qemu_del_timer(vq->notify_timer);
+        virtio_raise_irq(vdev, vq);
+    } else if (vq->notify_pending == 1) {
+        if (!vq->notify_timer) {
+            vq->notify_timer = qemu_new_timer(vm_clock, virtio_notify_timer, vq);
+        }
+        qemu_mod_timer(vq->notify_timer, now + window);
+    }
+}
+
 void virtio_notify_config(VirtIODevice *vdev)
 {
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK))
@@ -638,6 +1157,9 @@ void virtio_save(VirtIODevice *vdev, QEMUFile *f)
 {
     int i;
 
+    /* Held back interrupts are not part of the migrated state */
+    virtio_flush_notify(vdev);
+
     if (vdev->binding->save_config)
         vdev->binding->save_config(vdev->binding_opaque, f);
 
@@ -701,6 +1223,7 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f)
         vdev->vq[i].vring.num = qemu_get_be32(f);
         vdev->vq[i].pa = qemu_get_be64(f);
         qemu_get_be16s(f, &vdev->vq[i].last_avail_idx);
+        vdev->vq[i].signalled_used_valid = false;
 
         if (vdev->vq[i].pa) {
             virtqueue_init(&vdev->vq[i]);
@@ -718,6 +1241,16 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f)
 
 void virtio_cleanup(VirtIODevice *vdev)
 {
+    int i;
+
+    virtio_unbind_device(vdev);
+
+    for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        if (vdev->vq[i].notify_timer) {
+            qemu_free_timer(vdev->vq[i].notify_timer);
+        }
+    }
+
     if (vdev->config)
         qemu_free(vdev->config);
     qemu_free(vdev->vq);
@@ -726,9 +1259,15 @@ void virtio_cleanup(VirtIODevice *vdev)
 VirtIODevice *virtio_common_init(const char *name, uint16_t device_id,
                                  size_t config_size, size_t struct_size)
 {
+    static int memory_client_registered;
     VirtIODevice *vdev;
     int i;
 
+    if (!memory_client_registered) {
+        cpu_register_phys_memory_client(&virtio_memory_client);
+        memory_client_registered = 1;
+    }
+
     vdev = qemu_mallocz(struct_size);
 
     vdev->device_id = device_id;
@@ -757,6 +1296,112 @@ void virtio_bind_device(VirtIODevice *vdev, const VirtIOBindings *binding,
 {
     vdev->binding = binding;
     vdev->binding_opaque = opaque;
+    QLIST_INSERT_HEAD(&virtio_devices, vdev, list);
+}
+
+/* Called when the transport goes away; idempotent */
+void virtio_unbind_device(VirtIODevice *vdev)
+{
+    int i;
+
+    if (!vdev->binding) {
+        return;
+    }
+
+    for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        if (vdev->vq[i].notify_timer) {
+            qemu_del_timer(vdev->vq[i].notify_timer);
+        }
+    }
+
+    QLIST_REMOVE(vdev, list);
+    vdev->binding = NULL;
+}
+
+static void virtio_stats_iter(QObject *data, void *opaque)
+{
+    Monitor *mon = opaque;
+    QDict *qdict = qobject_to_qdict(data);
+    QListEntry *entry;
+
+    monitor_printf(mon, "%s", qdict_get_str(qdict, "device"));
+    if (qdict_haskey(qdict, "id")) {
+        monitor_printf(mon, " (%s)", qdict_get_str(qdict, "id"));
+    }
+    monitor_printf(mon, ":\n");
+
+    if (qdict_haskey(qdict, "datapath")) {
+        monitor_printf(mon, "  datapath: %s (vhost starts=%" PRId64
+                       " fallbacks=%" PRId64 ")\n",
+                       qdict_get_str(qdict, "datapath"),
+                       qdict_get_int(qdict, "vhost-starts"),
+                       qdict_get_int(qdict, "vhost-fallbacks"));
+    }
+
+    QLIST_FOREACH_ENTRY(qdict_get_qlist(qdict, "queues"), entry) {
+        QDict *q = qobject_to_qdict(qlist_entry_obj(entry));
+
+        monitor_printf(mon, "  queue %" PRId64 ": notifications=%" PRId64
+                       " suppressed=%" PRId64 " deferred=%" PRId64
+                       " interrupts=%" PRId64 "\n",
+                       qdict_get_int(q, "queue"),
+                       qdict_get_int(q, "notifications"),
+                       qdict_get_int(q, "suppressed"),
+                       qdict_get_int(q, "deferred"),
+                       qdict_get_int(q, "interrupts"));
+    }
+}
+
+void virtio_stats_print(Monitor *mon, const QObject *data)
+{
+    qlist_iter(qobject_to_qlist(data), virtio_stats_iter, mon);
+}
+
+void virtio_info_stats(Monitor *mon, QObject **ret_data)
+{
+    QList *devices;
+    VirtIODevice *vdev;
+    int i;
+
+    devices = qlist_new();
+
+    QLIST_FOREACH(vdev, &virtio_devices, list) {
+        QList *queues = qlist_new();
+        QObject *obj;
+
+        for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+            VirtQueue *vq = &vdev->vq[i];
+
+            if (vq->vring.num == 0) {
+                continue;
+            }
+            obj = qobject_from_jsonf("{ 'queue': %d,"
+                                     "'notifications': %" PRId64 ","
+                                     "'suppressed': %" PRId64 ","
+                                     "'deferred': %" PRId64 ","
+                                     "'interrupts': %" PRId64 " }",
+                                     i, vq->stats.notifications,
+                                     vq->stats.suppressed,
+                                     vq->stats.deferred,
+                                     vq->stats.interrupts);
+            qlist_append_obj(queues, obj);
+        }
+
+        obj = qobject_from_jsonf("{ 'device': %s, 'coalesce_usecs': %d,"
+                                 "'coalesce_frames': %d }",
+                                 vdev->name, vdev->coalesce.usecs,
+                                 vdev->coalesce.frames);
+        if (vdev->id) {
+            qdict_put(qobject_to_qdict(obj), "id", qstring_from_str(vdev->id));
+        }
+        qdict_put(qobject_to_qdict(obj), "queues", queues);
+        if (vdev->get_stats) {
+            vdev->get_stats(vdev, qobject_to_qdict(obj));
+        }
+        qlist_append_obj(devices, obj);
+    }
+
+    *ret_data = QOBJECT(devices);
 }
 
 target_phys_addr_t virtio_queue_get_desc_addr(VirtIODevice *vdev, int n)
@@ -793,7 +1438,7 @@ target_phys_addr_t virtio_queue_get_avail_size(VirtIODevice *vdev, int n)
 target_phys_addr_t virtio_queue_get_used_size(VirtIODevice *vdev, int n)
 {
     return offsetof(VRingUsed, ring) +
-        sizeof(VRingUsedElem) * vdev->vq[n].vring.num;
+        sizeof(VRingUsedElem) * vdev->vq[n].vring.num + sizeof(uint16_t);
 }
 
 target_phys_addr_t virtio_queue_get_ring_size(VirtIODevice *vdev, int n)
@@ -817,6 +1462,11 @@ VirtQueue *virtio_get_queue(VirtIODevice *vdev, int n)
     return vdev->vq + n;
 }
 
+int virtio_get_queue_index(VirtQueue *vq)
+{
+    return vq - vq->vdev->vq;
+}
+
 EventNotifier *virtio_queue_get_guest_notifier(VirtQueue *vq)
 {
     return &vq->guest_notifier;
@@ -20,6 +20,7 @@
 #include "sysemu.h"
 #include "block_int.h"
 #include "event_notifier.h"
+#include "qdict.h"
 #ifdef CONFIG_LINUX
 #include "9p.h"
 #endif
@@ -46,6 +47,11 @@
 #define VIRTIO_F_NOTIFY_ON_EMPTY        24
 /* We support indirect buffer descriptors */
 #define VIRTIO_RING_F_INDIRECT_DESC     28
+/* The Guest publishes the used index for which it expects an interrupt
+ * at the end of the avail ring. Host should ignore the avail->flags field. */
+/* The Host publishes the avail index for which it expects a kick
+ * at the end of the used ring. Guest should ignore the used->flags field. */
+#define VIRTIO_RING_F_EVENT_IDX         29
 /* A guest should never accept this.  It implies negotiation is broken. */
 #define VIRTIO_F_BAD_FEATURE		30
 
@@ -63,6 +69,14 @@
 /* This means don't interrupt guest when buffer consumed. */
 #define VRING_AVAIL_F_NO_INTERRUPT      1
 
+/* The other side wants to be told once the index moves past event_idx:
+ * has it, in moving from old to new_idx? */
+static inline int virtio_need_event(uint16_t event_idx, uint16_t new_idx,
+                                    uint16_t old)
+{
+    return (uint16_t)(new_idx - event_idx - 1) < (uint16_t)(new_idx - old);
+}
+
 struct VirtQueue;
 
 static inline target_phys_addr_t vring_align(target_phys_addr_t addr,
@@ -101,6 +115,12 @@ typedef struct {
 
 #define VIRTIO_NO_VECTOR 0xffff
 
+/* Interrupt coalescing parameters, see virtio_notify() */
+typedef struct VirtIOCoalesceConf {
+    uint32_t usecs;     /* longest an interrupt is held back, 0 = off */
+    uint32_t frames;    /* used ring updates that force one, 0 = no limit */
+} VirtIOCoalesceConf;
+
 struct VirtIODevice
 {
     const char *name;
@@ -119,10 +139,15 @@ struct VirtIODevice
     void (*set_config)(VirtIODevice *vdev, const uint8_t *config);
     void (*reset)(VirtIODevice *vdev);
     void (*set_status)(VirtIODevice *vdev, uint8_t val);
+    /* Adds device specific entries to the "info virtio" statistics */
+    void (*get_stats)(VirtIODevice *vdev, QDict *stats);
     VirtQueue *vq;
     const VirtIOBindings *binding;
     void *binding_opaque;
     uint16_t device_id;
+    const char *id;
+    VirtIOCoalesceConf coalesce;
+    QLIST_ENTRY(VirtIODevice) list;
 };
 
 static inline void virtio_set_status(VirtIODevice *vdev, uint8_t val)
@@ -137,9 +162,13 @@ VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
                             void (*handle_output)(VirtIODevice *,
                                                   VirtQueue *));
 
+void virtio_del_queue(VirtIODevice *vdev, int n);
+
 void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len);
 void virtqueue_flush(VirtQueue *vq, unsigned int count);
+void virtqueue_discard(VirtQueue *vq, const VirtQueueElement *elem,
+                       unsigned int len);
 void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len, unsigned int idx);
 
@@ -185,9 +214,14 @@ void virtio_update_irq(VirtIODevice *vdev);
 
 void virtio_bind_device(VirtIODevice *vdev, const VirtIOBindings *binding,
                         void *opaque);
+void virtio_unbind_device(VirtIODevice *vdev);
+
+void virtio_stats_print(Monitor *mon, const QObject *data);
+void virtio_info_stats(Monitor *mon, QObject **ret_data);
 
 /* Base devices.  */
-VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf);
+VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf,
+                              int data_plane);
 VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf);
 VirtIODevice *virtio_serial_init(DeviceState *dev, uint32_t max_nr_ports);
 VirtIODevice *virtio_balloon_init(DeviceState *dev);
@@ -201,7 +235,13 @@ void virtio_blk_exit(VirtIODevice *vdev);
 
 #define DEFINE_VIRTIO_COMMON_FEATURES(_state, _field) \
 	DEFINE_PROP_BIT("indirect_desc", _state, _field, \
-			VIRTIO_RING_F_INDIRECT_DESC, true)
+			VIRTIO_RING_F_INDIRECT_DESC, true), \
+	DEFINE_PROP_BIT("event_idx", _state, _field, \
+			VIRTIO_RING_F_EVENT_IDX, true)
+
+#define DEFINE_VIRTIO_COALESCE_PROPERTIES(_state, _conf) \
+	DEFINE_PROP_UINT32("coalesce_usecs", _state, _conf.usecs, 0), \
+	DEFINE_PROP_UINT32("coalesce_frames", _state, _conf.frames, 32)
 
 target_phys_addr_t virtio_queue_get_desc_addr(VirtIODevice *vdev, int n);
 target_phys_addr_t virtio_queue_get_avail_addr(VirtIODevice *vdev, int n);
@@ -214,6 +254,7 @@ target_phys_addr_t virtio_queue_get_ring_size(VirtIODevice *vdev, int n);
 uint16_t virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n);
 void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx);
 VirtQueue *virtio_get_queue(VirtIODevice *vdev, int n);
+int virtio_get_queue_index(VirtQueue *vq);
 EventNotifier *virtio_queue_get_guest_notifier(VirtQueue *vq);
 EventNotifier *virtio_queue_get_host_notifier(VirtQueue *vq);
 void virtio_irq(VirtQueue *vq);
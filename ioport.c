@@ -26,6 +26,10 @@
  */
 
 #include "ioport.h"
+#ifdef CONFIG_IOTHREAD
+#include <sched.h>
+#include "qemu-thread.h"
+#endif
 
 /***********************************************************/
 /* IO Port */
@@ -50,6 +54,37 @@
 static void *ioport_opaque[MAX_IOPORTS];
 static IOPortReadFunc *ioport_read_table[3][MAX_IOPORTS];
 static IOPortWriteFunc *ioport_write_table[3][MAX_IOPORTS];
+#ifdef CONFIG_IOTHREAD
+/* Ports whose handlers serialize on a device lock instead of the global
+   mutex; such accesses can be dispatched by vcpu threads directly.  The
+   table is only changed under the global mutex, and the entries of a port
+   that has a device lock only with that lock held as well. */
+static QemuMutex *ioport_lock_table[MAX_IOPORTS];
+/* Number of vcpu threads in ioport_lock_own() .. ioport_unlock_own() */
+static int ioport_own_lock_users;
+/* The device lock the current thread took with ioport_lock_own() */
+static __thread QemuMutex *ioport_held_lock;
+
+static QemuMutex *ioport_lock_entry(int i)
+{
+    QemuMutex *lock = ioport_lock_table[i];
+
+    if (lock) {
+        qemu_mutex_lock(lock);
+    }
+    return lock;
+}
+
+static void ioport_unlock_entry(QemuMutex *lock)
+{
+    if (lock) {
+        qemu_mutex_unlock(lock);
+    }
+}
+#else
+#define ioport_lock_entry(i) NULL
+#define ioport_unlock_entry(lock) do { (void)(lock); } while (0)
+#endif
 
 static IOPortReadFunc default_ioport_readb, default_ioport_readw, default_ioport_readl;
 static IOPortWriteFunc default_ioport_writeb, default_ioport_writew, default_ioport_writel;
@@ -146,10 +181,13 @@ int register_ioport_read(pio_addr_t start, int length, int size,
         return -1;
     }
     for(i = start; i < start + length; i += size) {
+        struct QemuMutex *lock = ioport_lock_entry(i);
+
         ioport_read_table[bsize][i] = func;
         if (ioport_opaque[i] != NULL && ioport_opaque[i] != opaque)
             hw_error("register_ioport_read: invalid opaque");
         ioport_opaque[i] = opaque;
+        ioport_unlock_entry(lock);
     }
     return 0;
 }
@@ -165,10 +203,13 @@ int register_ioport_write(pio_addr_t start, int length, int size,
         return -1;
     }
     for(i = start; i < start + length; i += size) {
+        struct QemuMutex *lock = ioport_lock_entry(i);
+
         ioport_write_table[bsize][i] = func;
         if (ioport_opaque[i] != NULL && ioport_opaque[i] != opaque)
             hw_error("register_ioport_write: invalid opaque");
         ioport_opaque[i] = opaque;
+        ioport_unlock_entry(lock);
     }
     return 0;
 }
@@ -178,6 +219,8 @@ void isa_unassign_ioport(pio_addr_t start, int length)
     int i;
 
     for(i = start; i < start + length; i++) {
+        struct QemuMutex *lock = ioport_lock_entry(i);
+
         ioport_read_table[0][i] = default_ioport_readb;
         ioport_read_table[1][i] = default_ioport_readw;
         ioport_read_table[2][i] = default_ioport_readl;
@@ -187,33 +230,153 @@ void isa_unassign_ioport(pio_addr_t start, int length)
         ioport_write_table[2][i] = default_ioport_writel;
 
         ioport_opaque[i] = NULL;
+#ifdef CONFIG_IOTHREAD
+        ioport_lock_table[i] = NULL;
+#endif
+        ioport_unlock_entry(lock);
     }
 }
 
+#ifdef CONFIG_IOTHREAD
+/* The handlers of [start, start + length) do not need the global mutex
+   as long as they are called with lock held.  Pass NULL to undo; that must
+   be done with the old lock held, and the lock must not be freed before
+   ioport_drain_own_locks() returns.  */
+void ioport_set_lock(pio_addr_t start, int length, QemuMutex *lock)
+{
+    int i;
+
+    for (i = start; i < start + length; i++) {
+        ioport_lock_table[i] = lock;
+    }
+}
+
+static QemuMutex *ioport_find_lock(pio_addr_t addr, int size)
+{
+    int i;
+
+    for (i = 0; i < size; i++) {
+        QemuMutex *lock = ioport_lock_table[(addr + i) & IOPORTS_MASK];
+        if (lock) {
+            return lock;
+        }
+    }
+    return NULL;
+}
+
+/* Return the device lock if an access of size bytes at addr only touches
+   ports covered by that one lock.  */
+static QemuMutex *ioport_find_own_lock(pio_addr_t addr, int size)
+{
+    QemuMutex *lock = ioport_lock_table[addr & IOPORTS_MASK];
+    int i;
+
+    if (!lock) {
+        return NULL;
+    }
+    for (i = 1; i < size; i++) {
+        if (ioport_lock_table[(addr + i) & IOPORTS_MASK] != lock) {
+            return NULL;
+        }
+    }
+    return lock;
+}
+
+/* Take the device lock of an access of size bytes at addr, so that the
+   access can be dispatched with cpu_inb() etc. without the global mutex.
+   Return NULL if the access needs the global mutex.  The lock is checked
+   again once it is held, since the ports may have been unassigned or
+   handed to another lock meanwhile.  */
+QemuMutex *ioport_lock_own(pio_addr_t addr, int size)
+{
+    QemuMutex *lock;
+
+    __sync_fetch_and_add(&ioport_own_lock_users, 1);
+    lock = ioport_find_own_lock(addr, size);
+    if (lock) {
+        qemu_mutex_lock(lock);
+        if (ioport_find_own_lock(addr, size) == lock) {
+            ioport_held_lock = lock;
+            return lock;
+        }
+        qemu_mutex_unlock(lock);
+    }
+    __sync_fetch_and_sub(&ioport_own_lock_users, 1);
+    return NULL;
+}
+
+void ioport_unlock_own(QemuMutex *lock)
+{
+    ioport_held_lock = NULL;
+    qemu_mutex_unlock(lock);
+    __sync_fetch_and_sub(&ioport_own_lock_users, 1);
+}
+
+/* Wait until no vcpu thread can still be using a device lock that has been
+   removed from the table, so that the lock may be freed.  */
+void ioport_drain_own_locks(void)
+{
+    __sync_synchronize();
+    while (ioport_own_lock_users) {
+        sched_yield();
+    }
+}
+
+static uint32_t ioport_read_locked(int index, uint32_t address)
+{
+    QemuMutex *lock = ioport_find_lock(address, 1 << index);
+    uint32_t val;
+
+    if (!lock || lock == ioport_held_lock) {
+        return ioport_read(index, address);
+    }
+    qemu_mutex_lock(lock);
+    val = ioport_read(index, address);
+    qemu_mutex_unlock(lock);
+    return val;
+}
+
+static void ioport_write_locked(int index, uint32_t address, uint32_t data)
+{
+    QemuMutex *lock = ioport_find_lock(address, 1 << index);
+
+    if (!lock || lock == ioport_held_lock) {
+        ioport_write(index, address, data);
+        return;
+    }
+    qemu_mutex_lock(lock);
+    ioport_write(index, address, data);
+    qemu_mutex_unlock(lock);
+}
+#else
+#define ioport_read_locked ioport_read
+#define ioport_write_locked ioport_write
+#endif
+
 /***********************************************************/
 
 void cpu_outb(pio_addr_t addr, uint8_t val)
 {
     LOG_IOPORT("outb: %04"FMT_pioaddr" %02"PRIx8"\n", addr, val);
-    ioport_write(0, addr, val);
+    ioport_write_locked(0, addr, val);
 }
 
 void cpu_outw(pio_addr_t addr, uint16_t val)
 {
     LOG_IOPORT("outw: %04"FMT_pioaddr" %04"PRIx16"\n", addr, val);
-    ioport_write(1, addr, val);
+    ioport_write_locked(1, addr, val);
 }
 
 void cpu_outl(pio_addr_t addr, uint32_t val)
 {
     LOG_IOPORT("outl: %04"FMT_pioaddr" %08"PRIx32"\n", addr, val);
-    ioport_write(2, addr, val);
+    ioport_write_locked(2, addr, val);
 }
 
 uint8_t cpu_inb(pio_addr_t addr)
 {
     uint8_t val;
-    val = ioport_read(0, addr);
+    val = ioport_read_locked(0, addr);
     LOG_IOPORT("inb : %04"FMT_pioaddr" %02"PRIx8"\n", addr, val);
     return val;
 }
@@ -221,7 +384,7 @@ uint8_t cpu_inb(pio_addr_t addr)
 uint16_t cpu_inw(pio_addr_t addr)
 {
     uint16_t val;
-    val = ioport_read(1, addr);
+    val = ioport_read_locked(1, addr);
     LOG_IOPORT("inw : %04"FMT_pioaddr" %04"PRIx16"\n", addr, val);
     return val;
 }
@@ -229,7 +392,7 @@ uint16_t cpu_inw(pio_addr_t addr)
 uint32_t cpu_inl(pio_addr_t addr)
 {
     uint32_t val;
-    val = ioport_read(2, addr);
+    val = ioport_read_locked(2, addr);
     LOG_IOPORT("inl : %04"FMT_pioaddr" %08"PRIx32"\n", addr, val);
     return val;
 }
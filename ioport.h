@@ -42,6 +42,14 @@ int register_ioport_write(pio_addr_t start, int length, int size,
                           IOPortWriteFunc *func, void *opaque);
 void isa_unassign_ioport(pio_addr_t start, int length);
 
+#ifdef CONFIG_IOTHREAD
+struct QemuMutex;
+void ioport_set_lock(pio_addr_t start, int length, struct QemuMutex *lock);
+struct QemuMutex *ioport_lock_own(pio_addr_t addr, int size);
+void ioport_unlock_own(struct QemuMutex *lock);
+void ioport_drain_own_locks(void);
+#endif
+
 
 void cpu_outb(pio_addr_t addr, uint8_t val);
 void cpu_outw(pio_addr_t addr, uint16_t val);
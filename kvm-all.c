@@ -757,6 +757,35 @@ static int kvm_handle_io(uint16_t port, void *data, int direction, int size,
     return 1;
 }
 
+#ifdef CONFIG_IOTHREAD
+/* Port I/O to ports that have a device lock of their own is handled
+ * right away by the vcpu thread, without the global mutex, and the guest
+ * is reentered.  Returns 1 if the exit was handled that way; if the ports
+ * changed hands before the device lock was taken, the exit is handled as
+ * usual under the global mutex.
+ */
+static int kvm_handle_io_unlocked(struct kvm_run *run)
+{
+    struct QemuMutex *lock;
+    int ret;
+
+    if (run->exit_reason != KVM_EXIT_IO) {
+        return 0;
+    }
+    lock = ioport_lock_own(run->io.port, run->io.size);
+    if (!lock) {
+        return 0;
+    }
+    ret = kvm_handle_io(run->io.port,
+                        (uint8_t *)run + run->io.data_offset,
+                        run->io.direction,
+                        run->io.size,
+                        run->io.count);
+    ioport_unlock_own(lock);
+    return ret;
+}
+#endif
+
 #ifdef KVM_CAP_INTERNAL_ERROR_DATA
 static void kvm_handle_internal_error(CPUState *env, struct kvm_run *run)
 {
@@ -861,7 +890,15 @@ int kvm_cpu_exec(CPUState *env)
         kvm_arch_pre_run(env, run);
         cpu_single_env = NULL;
         qemu_mutex_unlock_iothread();
-        ret = kvm_vcpu_ioctl(env, KVM_RUN, 0);
+        do {
+            ret = kvm_vcpu_ioctl(env, KVM_RUN, 0);
+#ifdef CONFIG_IOTHREAD
+            /* A pending SIG_IPI makes the next KVM_RUN return -EINTR, so
+               requests from other threads still get us out of here. */
+        } while (ret == 0 && kvm_handle_io_unlocked(run));
+#else
+        } while (0);
+#endif
         qemu_mutex_lock_iothread();
         cpu_single_env = env;
         kvm_arch_post_run(env, run);
@@ -40,6 +40,11 @@ struct qemu_laio_state {
     int efd;
     int count;
     QLIST_HEAD(, qemu_laiocb) completed_reqs;
+
+    /* Requests queued while plugged, submitted with a single io_submit() */
+    int plugged;
+    int nb_queued;
+    struct iocb *queued[MAX_EVENTS];
 };
 
 static inline ssize_t io_event_ret(struct io_event *ev)
@@ -146,10 +151,47 @@ static void qemu_laio_completion_cb(void *opaque)
     }
 }
 
+/*
+ * Submits all queued requests. Requests that the kernel doesn't accept are
+ * completed with an error.
+ */
+static void qemu_laio_submit_queued(struct qemu_laio_state *s)
+{
+    struct iocb *iocbs[MAX_EVENTS];
+    int i, n, ret = 0;
+
+    /* Callbacks of failed requests may queue new ones */
+    n = s->nb_queued;
+    memcpy(iocbs, s->queued, n * sizeof(iocbs[0]));
+    s->nb_queued = 0;
+
+    i = 0;
+    while (i < n) {
+        ret = io_submit(s->ctx, n - i, &iocbs[i]);
+        if (ret <= 0) {
+            break;
+        }
+        i += ret;
+    }
+
+    for (; i < n; i++) {
+        struct qemu_laiocb *laiocb =
+                container_of(iocbs[i], struct qemu_laiocb, iocb);
+
+        laiocb->ret = (ret < 0) ? ret : -EIO;
+        qemu_laio_enqueue_completed(s, laiocb);
+    }
+}
+
 static int qemu_laio_flush_cb(void *opaque)
 {
     struct qemu_laio_state *s = opaque;
 
+    /* Somebody waits for requests to complete, they must be submitted */
+    if (s->nb_queued) {
+        qemu_laio_submit_queued(s);
+    }
+
     return (s->count > 0) ? 1 : 0;
 }
 
@@ -162,6 +204,11 @@ static void laio_cancel(BlockDriverAIOCB *blockacb)
     if (laiocb->ret != -EINPROGRESS)
         return;
 
+    /* A request that is still queued can't be found by io_cancel() */
+    if (laiocb->ctx->nb_queued) {
+        qemu_laio_submit_queued(laiocb->ctx);
+    }
+
     /*
      * Note that as of Linux 2.6.31 neither the block device code nor any
      * filesystem implements cancellation of AIO request.
@@ -223,6 +270,14 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
     io_set_eventfd(&laiocb->iocb, s->efd);
     s->count++;
 
+    if (s->plugged) {
+        if (s->nb_queued == MAX_EVENTS) {
+            qemu_laio_submit_queued(s);
+        }
+        s->queued[s->nb_queued++] = iocbs;
+        return &laiocb->common;
+    }
+
     if (io_submit(s->ctx, 1, &iocbs) < 0)
         goto out_dec_count;
     return &laiocb->common;
@@ -234,6 +289,27 @@ out_dec_count:
     return NULL;
 }
 
+/*
+ * While plugged, requests are only queued. They are submitted together when
+ * the last user unplugs, so that a batch of requests costs one io_submit().
+ */
+void laio_io_plug(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    s->plugged++;
+}
+
+void laio_io_unplug(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    assert(s->plugged > 0);
+    if (--s->plugged == 0 && s->nb_queued) {
+        qemu_laio_submit_queued(s);
+    }
+}
+
 void *laio_init(void)
 {
     struct qemu_laio_state *s;
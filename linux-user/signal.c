@@ -603,8 +603,12 @@ int do_sigaction(int sig, const struct target_sigaction *act,
 #endif
         k->sa_mask = act->sa_mask;
 
-        /* we update the host linux signal state */
+        /* we update the host linux signal state; SIGPROF stays with the
+           JIT profiler while it runs (see jit_profile_init) */
         host_sig = target_to_host_signal(sig);
+        if (host_sig == SIGPROF && jit_profile_active()) {
+            return 0;
+        }
         if (host_sig != SIGSEGV && host_sig != SIGBUS) {
             sigfillset(&act1.sa_mask);
             act1.sa_flags = SA_SIGINFO;
@@ -90,6 +90,7 @@ int __clone2(int (*fn)(void *), void *child_stack_base,
 
 #include "qemu.h"
 #include "qemu-common.h"
+#include "exec-all.h"
 
 #if defined(CONFIG_USE_NPTL)
 #define CLONE_NPTL_FLAGS2 (CLONE_SETTLS | \
@@ -4254,6 +4255,8 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         _mcleanup();
 #endif
         gdb_exit(cpu_env, arg1);
+        tcg_stats_report();
+        jit_profile_report();
         _exit(arg1);
         ret = 0; /* avoid warning */
         break;
@@ -5660,6 +5663,11 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
             } else {
                 pvalue = NULL;
             }
+            /* The JIT profiler samples with ITIMER_PROF */
+            if (arg1 == ITIMER_PROF && jit_profile_active()) {
+                ret = -TARGET_EBUSY;
+                break;
+            }
             ret = get_errno(setitimer(arg1, pvalue, &ovalue));
             if (!is_error(ret) && arg3) {
                 if (copy_to_user_timeval(arg3,
@@ -5879,6 +5887,8 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         _mcleanup();
 #endif
         gdb_exit(cpu_env, arg1);
+        tcg_stats_report();
+        jit_profile_report();
         ret = get_errno(exit_group(arg1));
         break;
 #endif
@@ -28,6 +28,7 @@
 #include "hw/pcmcia.h"
 #include "hw/pc.h"
 #include "hw/pci.h"
+#include "hw/virtio.h"
 #include "hw/watchdog.h"
 #include "hw/loader.h"
 #include "gdbstub.h"
@@ -910,6 +911,108 @@ static void do_info_jit(Monitor *mon)
     dump_exec_info((FILE *)mon, monitor_fprintf);
 }
 
+static int do_jit_profile(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    int perf_map = qdict_get_try_bool(qdict, "perfmap", 0);
+    int ret;
+
+    ret = jit_profile_set(qdict_get_bool(qdict, "enable"), perf_map);
+    if (ret == -ENOTSUP) {
+        qerror_report(QERR_UNDEFINED_ERROR);
+        return -1;
+    } else if (ret < 0) {
+        qerror_report(QERR_OPEN_FILE_FAILED, "/tmp/perf-<pid>.map");
+        return -1;
+    }
+    return 0;
+}
+
+static QObject *jit_profile_entries(const JitProfileEntry *e, int n,
+                                    int with_host)
+{
+    QList *list = qlist_new();
+    QObject *obj;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        obj = qobject_from_jsonf("{ 'pc': %" PRId64 ", 'samples': %" PRId64
+                                 " }", (int64_t)e[i].pc, e[i].samples);
+        if (with_host) {
+            qdict_put(qobject_to_qdict(obj), "host",
+                      qint_from_int(e[i].host_pc));
+        }
+        qlist_append_obj(list, obj);
+    }
+    return QOBJECT(list);
+}
+
+static void do_info_jit_profile(Monitor *mon, QObject **ret_data)
+{
+    JitProfile prof;
+    QDict *qdict;
+
+    jit_profile_get(&prof);
+    *ret_data = qobject_from_jsonf("{ 'enabled': %i, 'perf_map': %i,"
+                                   "'hz': %d, 'samples': {"
+                                   "'translate': %" PRId64 ","
+                                   "'exec': %" PRId64 ","
+                                   "'helper': %" PRId64 ","
+                                   "'dispatch': %" PRId64 ","
+                                   "'other': %" PRId64 " } }",
+                                   prof.enabled, prof.perf_map, prof.hz,
+                                   prof.samples[JIT_PROF_TRANSLATE],
+                                   prof.samples[JIT_PROF_EXEC],
+                                   prof.samples[JIT_PROF_HELPER],
+                                   prof.samples[JIT_PROF_DISPATCH],
+                                   prof.samples[JIT_PROF_OTHER]);
+    qdict = qobject_to_qdict(*ret_data);
+    qdict_put_obj(qdict, "tbs",
+                  jit_profile_entries(prof.hot_tbs, prof.nb_hot_tbs, 1));
+    qdict_put_obj(qdict, "pcs",
+                  jit_profile_entries(prof.hot_pcs, prof.nb_hot_pcs, 0));
+}
+
+static void do_info_jit_profile_print(Monitor *mon, const QObject *data)
+{
+    static const char * const names[] = {
+        "translate", "exec", "helper", "dispatch", "other",
+    };
+    QDict *qdict = qobject_to_qdict(data);
+    QDict *samples = qdict_get_qdict(qdict, "samples");
+    const QListEntry *entry;
+    int64_t total = 0;
+    int i;
+
+    monitor_printf(mon, "JIT profiler: %s%s\n",
+                   qdict_get_bool(qdict, "enabled") ? "on" : "off",
+                   qdict_get_bool(qdict, "perf_map") ? ", perf map" : "");
+    for (i = 0; i < ARRAY_SIZE(names); i++) {
+        total += qdict_get_int(samples, names[i]);
+    }
+    monitor_printf(mon, "%" PRId64 " samples at %" PRId64 " Hz:", total,
+                   qdict_get_int(qdict, "hz"));
+    for (i = 0; i < ARRAY_SIZE(names); i++) {
+        monitor_printf(mon, " %s %.1f%%", names[i], total ?
+                       qdict_get_int(samples, names[i]) * 100.0 / total : 0);
+    }
+    monitor_printf(mon, "\nhottest TBs:\n");
+    QLIST_FOREACH_ENTRY(qdict_get_qlist(qdict, "tbs"), entry) {
+        QDict *tb = qobject_to_qdict(qlist_entry_obj(entry));
+
+        monitor_printf(mon, "  pc 0x%" PRIx64 " host 0x%" PRIx64
+                       " %" PRId64 " samples\n",
+                       qdict_get_int(tb, "pc"), qdict_get_int(tb, "host"),
+                       qdict_get_int(tb, "samples"));
+    }
+    monitor_printf(mon, "hottest guest PCs:\n");
+    QLIST_FOREACH_ENTRY(qdict_get_qlist(qdict, "pcs"), entry) {
+        QDict *pc = qobject_to_qdict(qlist_entry_obj(entry));
+
+        monitor_printf(mon, "  pc 0x%" PRIx64 " %" PRId64 " samples\n",
+                       qdict_get_int(pc, "pc"), qdict_get_int(pc, "samples"));
+    }
+}
+
 static void do_info_history(Monitor *mon)
 {
     int i;
@@ -2371,6 +2474,14 @@ static const mon_cmd_t info_cmds[] = {
         .user_print = bdrv_stats_print,
         .mhandler.info_new = bdrv_info_stats,
     },
+    {
+        .name       = "virtio",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show virtio interrupt statistics",
+        .user_print = virtio_stats_print,
+        .mhandler.info_new = virtio_info_stats,
+    },
     {
         .name       = "registers",
         .args_type  = "",
@@ -2440,6 +2551,14 @@ static const mon_cmd_t info_cmds[] = {
         .help       = "show dynamic compiler info",
         .mhandler.info = do_info_jit,
     },
+    {
+        .name       = "jit-profile",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show dynamic compiler profile",
+        .user_print = do_info_jit_profile_print,
+        .mhandler.info_new = do_info_jit_profile,
+    },
     {
         .name       = "kvm",
         .args_type  = "",
@@ -509,6 +509,32 @@ void qemu_purge_queued_packets(VLANClientState *vc)
     qemu_net_queue_purge(queue, vc);
 }
 
+/* Ask the peer of sender for guest memory to read the next packet into.
+ * Only direct peers can do this, and only while nothing is queued for
+ * them, otherwise packets would be reordered. */
+int qemu_get_rx_buffer(VLANClientState *sender, struct iovec *iov, int iovcnt)
+{
+    VLANClientState *peer = sender->peer;
+
+    if (!peer || sender->link_down || peer->link_down ||
+        peer->receive_disabled || !peer->info->get_rx_buffer) {
+        return 0;
+    }
+
+    if (!qemu_net_queue_empty(peer->send_queue)) {
+        return 0;
+    }
+
+    return peer->info->get_rx_buffer(peer, iov, iovcnt);
+}
+
+void qemu_put_rx_buffer(VLANClientState *sender, ssize_t size)
+{
+    VLANClientState *peer = sender->peer;
+
+    peer->info->put_rx_buffer(peer, size);
+}
+
 void qemu_flush_queued_packets(VLANClientState *vc)
 {
     NetQueue *queue;
@@ -719,6 +745,29 @@ VLANClientState *qemu_find_netdev(const char *id)
     return NULL;
 }
 
+/* A multiqueue netdev is made of several clients sharing one name; return
+ * those whose type is not @type, in creation (i.e. queue) order. */
+int qemu_find_net_clients_except(const char *id, VLANClientState **ncs,
+                                 net_client_type type, int max)
+{
+    VLANClientState *vc;
+    int ret = 0;
+
+    QTAILQ_FOREACH(vc, &non_vlan_clients, next) {
+        if (vc->info->type == type) {
+            continue;
+        }
+        if (!strcmp(vc->name, id)) {
+            if (ret < max) {
+                ncs[ret] = vc;
+            }
+            ret++;
+        }
+    }
+
+    return ret;
+}
+
 static int nic_get_free_idx(void)
 {
     int index;
@@ -1014,11 +1063,16 @@ static const struct {
             }, {
                 .name = "vhost",
                 .type = QEMU_OPT_BOOL,
-                .help = "enable vhost-net network accelerator",
+                .help = "enable vhost-net network accelerator "
+                        "(default: used when available)",
             }, {
                 .name = "vhostfd",
                 .type = QEMU_OPT_STRING,
                 .help = "file descriptor of an already opened vhost net device",
+            }, {
+                .name = "queues",
+                .type = QEMU_OPT_NUMBER,
+                .help = "number of queues to open on a multiqueue tap device",
             },
 #endif /* _WIN32 */
             { /* end of list */ }
@@ -1253,14 +1307,19 @@ int do_netdev_add(Monitor *mon, const QDict *qdict, QObject **ret_data)
 int do_netdev_del(Monitor *mon, const QDict *qdict, QObject **ret_data)
 {
     const char *id = qdict_get_str(qdict, "id");
-    VLANClientState *vc;
+    VLANClientState *ncs[MAX_QUEUE_NUM];
+    int queues, i;
 
-    vc = qemu_find_netdev(id);
-    if (!vc || vc->info->type == NET_CLIENT_TYPE_NIC) {
+    queues = qemu_find_net_clients_except(id, ncs, NET_CLIENT_TYPE_NIC,
+                                          MAX_QUEUE_NUM);
+    if (!queues) {
         qerror_report(QERR_DEVICE_NOT_FOUND, id);
         return -1;
     }
-    qemu_del_vlan_client(vc);
+    assert(queues <= MAX_QUEUE_NUM);
+    for (i = 0; i < queues; i++) {
+        qemu_del_vlan_client(ncs[i]);
+    }
     qemu_opts_del(qemu_opts_find(&qemu_netdev_opts, id));
     return 0;
 }
@@ -1290,29 +1349,37 @@ void do_info_network(Monitor *mon)
 int do_set_link(Monitor *mon, const QDict *qdict, QObject **ret_data)
 {
     VLANState *vlan;
-    VLANClientState *vc = NULL;
+    VLANClientState *ncs[MAX_QUEUE_NUM];
     const char *name = qdict_get_str(qdict, "name");
     int up = qdict_get_bool(qdict, "up");
+    int queues, i;
 
+    queues = 0;
     QTAILQ_FOREACH(vlan, &vlans, next) {
-        QTAILQ_FOREACH(vc, &vlan->clients, next) {
-            if (strcmp(vc->name, name) == 0) {
+        QTAILQ_FOREACH(ncs[0], &vlan->clients, next) {
+            if (strcmp(ncs[0]->name, name) == 0) {
+                queues = 1;
                 goto done;
             }
         }
     }
-    vc = qemu_find_netdev(name);
+    /* all the queues of a multiqueue netdev or NIC share the name */
+    queues = qemu_find_net_clients_except(name, ncs, NET_CLIENT_TYPE_NONE,
+                                          MAX_QUEUE_NUM);
 done:
 
-    if (!vc) {
+    if (!queues) {
         qerror_report(QERR_DEVICE_NOT_FOUND, name);
         return -1;
     }
+    queues = MIN(queues, MAX_QUEUE_NUM);
 
-    vc->link_down = !up;
+    for (i = 0; i < queues; i++) {
+        ncs[i]->link_down = !up;
 
-    if (vc->info->link_status_changed) {
-        vc->info->link_status_changed(vc);
+        if (ncs[i]->info->link_status_changed) {
+            ncs[i]->info->link_status_changed(ncs[i]);
+        }
     }
     return 0;
 }
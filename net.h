@@ -42,6 +42,8 @@ typedef ssize_t (NetReceive)(VLANClientState *, const uint8_t *, size_t);
 typedef ssize_t (NetReceiveIOV)(VLANClientState *, const struct iovec *, int);
 typedef void (NetCleanup) (VLANClientState *);
 typedef void (LinkStatusChanged)(VLANClientState *);
+typedef int (NetGetRxBuffer)(VLANClientState *, struct iovec *, int);
+typedef void (NetPutRxBuffer)(VLANClientState *, ssize_t);
 
 typedef struct NetClientInfo {
     net_client_type type;
@@ -53,6 +55,12 @@ typedef struct NetClientInfo {
     NetCleanup *cleanup;
     LinkStatusChanged *link_status_changed;
     NetPoll *poll;
+    /* Optional zero-copy receive: get_rx_buffer lends up to iovcnt
+     * entries of memory big enough for any packet and returns how many it
+     * filled (0 if none is available); put_rx_buffer hands it back with
+     * the number of bytes written, or a size <= 0 to cancel. */
+    NetGetRxBuffer *get_rx_buffer;
+    NetPutRxBuffer *put_rx_buffer;
 } NetClientInfo;
 
 struct VLANClientState {
@@ -84,6 +92,8 @@ struct VLANState {
 
 VLANState *qemu_find_vlan(int id, int allocate);
 VLANClientState *qemu_find_netdev(const char *id);
+int qemu_find_net_clients_except(const char *id, VLANClientState **ncs,
+                                 net_client_type type, int max);
 VLANClientState *qemu_new_net_client(NetClientInfo *info,
                                      VLANState *vlan,
                                      VLANClientState *peer,
@@ -109,6 +119,8 @@ ssize_t qemu_send_packet_raw(VLANClientState *vc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_async(VLANClientState *vc, const uint8_t *buf,
                                int size, NetPacketSent *sent_cb);
 void qemu_purge_queued_packets(VLANClientState *vc);
+int qemu_get_rx_buffer(VLANClientState *sender, struct iovec *iov, int iovcnt);
+void qemu_put_rx_buffer(VLANClientState *sender, ssize_t size);
 void qemu_flush_queued_packets(VLANClientState *vc);
 void qemu_format_nic_info_str(VLANClientState *vc, uint8_t macaddr[6]);
 void qemu_macaddr_default_if_unset(MACAddr *macaddr);
@@ -123,6 +135,7 @@ int do_set_link(Monitor *mon, const QDict *qdict, QObject **ret_data);
 /* NIC info */
 
 #define MAX_NICS 8
+#define MAX_QUEUE_NUM 8         /* queues of a multiqueue netdev */
 
 struct NICInfo {
     uint8_t macaddr[6];
@@ -22,7 +22,7 @@
  */
 
 #include "net/queue.h"
-#include "qemu-queue.h"
+#include "iov.h"
 
 /* The delivery handler may only return zero if it will call
  * qemu_net_queue_flush() when it determines that it is once again able
@@ -36,15 +36,25 @@
  *
  * If a sent callback isn't provided, we just drop the packet to avoid
  * unbounded queueing.
+ *
+ * Queued packets live in a ring of NET_QUEUE_LEN slots with their own
+ * buffers, so that queueing a packet of ordinary size costs a memcpy and
+ * no allocation.  A full ring drops the packet, as above.  The ring is
+ * only allocated once a packet has to be queued for the first time.
+ * Slots released by purge() stay in the ring without a sender and are
+ * skipped by flush().
  */
 
+#define NET_QUEUE_LEN       128     /* a power of two */
+#define NET_PACKET_BUFSIZE  2048    /* larger packets get a buffer of their own */
+
 struct NetPacket {
-    QTAILQ_ENTRY(NetPacket) entry;
     VLANClientState *sender;
     unsigned flags;
     int size;
     NetPacketSent *sent_cb;
-    uint8_t data[0];
+    uint8_t *data;
+    uint8_t buf[NET_PACKET_BUFSIZE];
 };
 
 struct NetQueue {
@@ -52,9 +62,13 @@ struct NetQueue {
     NetPacketDeliverIOV *deliver_iov;
     void *opaque;
 
-    QTAILQ_HEAD(packets, NetPacket) packets;
+    NetPacket *packets;
+    unsigned int head;
+    unsigned int tail;
+    NetPacket *inflight;
 
     unsigned delivering : 1;
+    unsigned flushing : 1;
 };
 
 NetQueue *qemu_new_net_queue(NetPacketDeliver *deliver,
@@ -69,25 +83,73 @@ NetQueue *qemu_new_net_queue(NetPacketDeliver *deliver,
     queue->deliver_iov = deliver_iov;
     queue->opaque = opaque;
 
-    QTAILQ_INIT(&queue->packets);
+    queue->packets = NULL;
+    queue->head = queue->tail = 0;
 
     queue->delivering = 0;
 
     return queue;
 }
 
+static void qemu_net_packet_release(NetPacket *packet)
+{
+    if (packet->data != packet->buf) {
+        qemu_free(packet->data);
+        packet->data = packet->buf;
+    }
+    packet->sender = NULL;
+}
+
 void qemu_del_net_queue(NetQueue *queue)
 {
-    NetPacket *packet, *next;
+    unsigned int i;
+
+    for (i = queue->head; i != queue->tail; i++) {
+        NetPacket *packet = &queue->packets[i % NET_QUEUE_LEN];
 
-    QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
-        QTAILQ_REMOVE(&queue->packets, packet, entry);
-        qemu_free(packet);
+        /* Purged packets have been released already */
+        if (packet->sender) {
+            qemu_net_packet_release(packet);
+        }
     }
 
+    qemu_free(queue->packets);
     qemu_free(queue);
 }
 
+/* Claims the slot at the tail for a packet of size bytes; NULL if the
+ * ring is full.  The packet is not visible to the consumer until
+ * qemu_net_queue_commit(). */
+static NetPacket *qemu_net_queue_reserve(NetQueue *queue,
+                                         VLANClientState *sender,
+                                         unsigned flags,
+                                         size_t size,
+                                         NetPacketSent *sent_cb)
+{
+    NetPacket *packet;
+
+    if (!queue->packets) {
+        queue->packets = qemu_malloc(NET_QUEUE_LEN * sizeof(NetPacket));
+    }
+    if (queue->tail - queue->head == NET_QUEUE_LEN) {
+        return NULL;
+    }
+
+    packet = &queue->packets[queue->tail % NET_QUEUE_LEN];
+    packet->sender = sender;
+    packet->flags = flags;
+    packet->size = size;
+    packet->sent_cb = sent_cb;
+    packet->data = size > NET_PACKET_BUFSIZE ? qemu_malloc(size) : packet->buf;
+
+    return packet;
+}
+
+static void qemu_net_queue_commit(NetQueue *queue)
+{
+    queue->tail++;
+}
+
 static ssize_t qemu_net_queue_append(NetQueue *queue,
                                      VLANClientState *sender,
                                      unsigned flags,
@@ -97,14 +159,12 @@ static ssize_t qemu_net_queue_append(NetQueue *queue,
 {
     NetPacket *packet;
 
-    packet = qemu_malloc(sizeof(NetPacket) + size);
-    packet->sender = sender;
-    packet->flags = flags;
-    packet->size = size;
-    packet->sent_cb = sent_cb;
+    packet = qemu_net_queue_reserve(queue, sender, flags, size, sent_cb);
+    if (!packet) {
+        return 0;
+    }
     memcpy(packet->data, buf, size);
-
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    qemu_net_queue_commit(queue);
 
     return size;
 }
@@ -117,29 +177,27 @@ static ssize_t qemu_net_queue_append_iov(NetQueue *queue,
                                          NetPacketSent *sent_cb)
 {
     NetPacket *packet;
-    size_t max_len = 0;
+    size_t max_len = 0, offset = 0;
     int i;
 
     for (i = 0; i < iovcnt; i++) {
         max_len += iov[i].iov_len;
     }
 
-    packet = qemu_malloc(sizeof(NetPacket) + max_len);
-    packet->sender = sender;
-    packet->sent_cb = sent_cb;
-    packet->flags = flags;
-    packet->size = 0;
+    packet = qemu_net_queue_reserve(queue, sender, flags, max_len, sent_cb);
+    if (!packet) {
+        return 0;
+    }
 
     for (i = 0; i < iovcnt; i++) {
         size_t len = iov[i].iov_len;
 
-        memcpy(packet->data + packet->size, iov[i].iov_base, len);
-        packet->size += len;
+        memcpy(packet->data + offset, iov[i].iov_base, len);
+        offset += len;
     }
+    qemu_net_queue_commit(queue);
 
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
-
-    return packet->size;
+    return max_len;
 }
 
 static ssize_t qemu_net_queue_deliver(NetQueue *queue,
@@ -182,12 +240,17 @@ ssize_t qemu_net_queue_send(NetQueue *queue,
     ssize_t ret;
 
     if (queue->delivering) {
-        return qemu_net_queue_append(queue, sender, flags, data, size, NULL);
+        qemu_net_queue_append(queue, sender, flags, data, size, NULL);
+        return size;
     }
 
     ret = qemu_net_queue_deliver(queue, sender, flags, data, size);
     if (ret == 0) {
-        qemu_net_queue_append(queue, sender, flags, data, size, sent_cb);
+        /* With the ring full, the packet is dropped and the sender must
+         * not wait for its callback */
+        if (!qemu_net_queue_append(queue, sender, flags, data, size, sent_cb)) {
+            return size;
+        }
         return 0;
     }
 
@@ -206,12 +269,16 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
     ssize_t ret;
 
     if (queue->delivering) {
-        return qemu_net_queue_append_iov(queue, sender, flags, iov, iovcnt, NULL);
+        qemu_net_queue_append_iov(queue, sender, flags, iov, iovcnt, NULL);
+        return iov_size(iov, iovcnt);
     }
 
     ret = qemu_net_queue_deliver_iov(queue, sender, flags, iov, iovcnt);
     if (ret == 0) {
-        qemu_net_queue_append_iov(queue, sender, flags, iov, iovcnt, sent_cb);
+        if (!qemu_net_queue_append_iov(queue, sender, flags, iov, iovcnt,
+                                       sent_cb)) {
+            return iov_size(iov, iovcnt);
+        }
         return 0;
     }
 
@@ -220,34 +287,51 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
     return ret;
 }
 
+/* Purged packets stay in the ring without a sender until flush() gets
+ * to them; the one being delivered is left alone. */
 void qemu_net_queue_purge(NetQueue *queue, VLANClientState *from)
 {
-    NetPacket *packet, *next;
+    unsigned int i;
 
-    QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
-        if (packet->sender == from) {
-            QTAILQ_REMOVE(&queue->packets, packet, entry);
-            qemu_free(packet);
+    for (i = queue->head; i != queue->tail; i++) {
+        NetPacket *packet = &queue->packets[i % NET_QUEUE_LEN];
+
+        if (packet->sender == from && packet != queue->inflight) {
+            qemu_net_packet_release(packet);
         }
     }
 }
 
+/* Packets are delivered in order as long as the handler takes them, and
+ * their slots go back to the producer in one go at the end. */
 void qemu_net_queue_flush(NetQueue *queue)
 {
-    while (!QTAILQ_EMPTY(&queue->packets)) {
+    unsigned int head = queue->head;
+
+    /* A sent callback or the delivery handler may come back here */
+    if (queue->flushing) {
+        return;
+    }
+    queue->flushing = 1;
+
+    while (head != queue->tail) {
         NetPacket *packet;
-        int ret;
+        ssize_t ret;
 
-        packet = QTAILQ_FIRST(&queue->packets);
-        QTAILQ_REMOVE(&queue->packets, packet, entry);
+        packet = &queue->packets[head % NET_QUEUE_LEN];
+        if (!packet->sender) {
+            head++;
+            continue;
+        }
 
+        queue->inflight = packet;
         ret = qemu_net_queue_deliver(queue,
                                      packet->sender,
                                      packet->flags,
                                      packet->data,
                                      packet->size);
+        queue->inflight = NULL;
         if (ret == 0) {
-            QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
             break;
         }
 
@@ -255,6 +339,15 @@ void qemu_net_queue_flush(NetQueue *queue)
             packet->sent_cb(packet->sender, ret);
         }
 
-        qemu_free(packet);
+        qemu_net_packet_release(packet);
+        head++;
     }
+
+    queue->head = head;
+    queue->flushing = 0;
+}
+
+int qemu_net_queue_empty(NetQueue *queue)
+{
+    return queue->head == queue->tail;
 }
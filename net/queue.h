@@ -67,5 +67,6 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
 
 void qemu_net_queue_purge(NetQueue *queue, VLANClientState *from);
 void qemu_net_queue_flush(NetQueue *queue);
+int qemu_net_queue_empty(NetQueue *queue);
 
 #endif /* QEMU_NET_QUEUE_H */
@@ -741,3 +741,8 @@ struct vhost_net *tap_get_vhost_net(VLANClientState *nc)
 {
     return NULL;
 }
+
+int tap_set_queue_enabled(VLANClientState *nc, int enable)
+{
+    return -ENOTSUP;
+}
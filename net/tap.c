@@ -49,6 +49,9 @@
  */
 #define TAP_BUFSIZE (4096 + 65536)
 
+/* Most scatter-gather entries a peer may lend us for one packet */
+#define TAP_MAX_RX_IOV 64
+
 typedef struct TAPState {
     VLANClientState nc;
     int fd;
@@ -60,6 +63,7 @@ typedef struct TAPState {
     unsigned int has_vnet_hdr : 1;
     unsigned int using_vnet_hdr : 1;
     unsigned int has_ufo: 1;
+    unsigned int queue_enabled : 1;
     VHostNetState *vhost_net;
 } TAPState;
 
@@ -189,6 +193,42 @@ static void tap_send_completed(VLANClientState *nc, ssize_t len)
     tap_read_poll(s, 1);
 }
 
+#ifndef __sun__
+/* Read the next packet straight into memory lent by the peer, skipping
+ * s->buf and the send queue.  Returns the packet size, 0 if the peer had
+ * no buffer to lend, or -1 if there was nothing to read. */
+static int tap_send_direct(TAPState *s)
+{
+    struct iovec iov[TAP_MAX_RX_IOV + 1];
+    struct virtio_net_hdr hdr;
+    int iovcnt, skip = 0;
+    ssize_t size;
+
+    if (s->has_vnet_hdr && !s->using_vnet_hdr) {
+        iov[0].iov_base = &hdr;
+        iov[0].iov_len  = sizeof(hdr);
+        skip = 1;
+    }
+
+    iovcnt = qemu_get_rx_buffer(&s->nc, iov + skip, TAP_MAX_RX_IOV);
+    if (iovcnt <= 0) {
+        return 0;
+    }
+
+    do {
+        size = readv(s->fd, iov, iovcnt + skip);
+    } while (size == -1 && errno == EINTR);
+
+    if (skip && size > 0) {
+        size -= sizeof(hdr);
+    }
+
+    qemu_put_rx_buffer(&s->nc, size);
+
+    return size > 0 ? size : -1;
+}
+#endif
+
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
@@ -197,6 +237,15 @@ static void tap_send(void *opaque)
     do {
         uint8_t *buf = s->buf;
 
+#ifndef __sun__
+        size = tap_send_direct(s);
+        if (size < 0) {
+            break;
+        } else if (size > 0) {
+            continue;
+        }
+#endif
+
         size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
         if (size <= 0) {
             break;
@@ -277,6 +326,26 @@ static void tap_poll(VLANClientState *nc, bool enable)
     tap_write_poll(s, enable);
 }
 
+int tap_set_queue_enabled(VLANClientState *nc, int enable)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    int ret;
+
+    assert(nc->info->type == NET_CLIENT_TYPE_TAP);
+    if (s->queue_enabled == !!enable) {
+        return 0;
+    }
+
+    ret = tap_fd_set_queue_enabled(s->fd, enable);
+    if (ret == 0) {
+        s->queue_enabled = !!enable;
+        if (!enable) {
+            qemu_purge_queued_packets(nc);
+        }
+    }
+    return ret;
+}
+
 int tap_get_fd(VLANClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -313,6 +382,7 @@ static TAPState *net_tap_fd_init(VLANState *vlan,
     s->has_vnet_hdr = vnet_hdr != 0;
     s->using_vnet_hdr = 0;
     s->has_ufo = tap_probe_has_ufo(s->fd);
+    s->queue_enabled = 1;
     tap_set_offload(&s->nc, 0, 0, 0, 0, 0);
     tap_read_poll(s, 1);
     s->vhost_net = NULL;
@@ -363,7 +433,8 @@ static int launch_script(const char *setup_script, const char *ifname, int fd)
     return -1;
 }
 
-static int net_tap_init(QemuOpts *opts, int *vnet_hdr)
+static int net_tap_init(QemuOpts *opts, int *vnet_hdr, int mq_required,
+                        int run_script)
 {
     int fd, vnet_hdr_required;
     char ifname[128] = {0,};
@@ -380,13 +451,15 @@ static int net_tap_init(QemuOpts *opts, int *vnet_hdr)
         vnet_hdr_required = 0;
     }
 
-    TFR(fd = tap_open(ifname, sizeof(ifname), vnet_hdr, vnet_hdr_required));
+    TFR(fd = tap_open(ifname, sizeof(ifname), vnet_hdr, vnet_hdr_required,
+                      mq_required));
     if (fd < 0) {
         return -1;
     }
 
     setup_script = qemu_opt_get(opts, "script");
-    if (setup_script &&
+    if (run_script &&
+        setup_script &&
         setup_script[0] != '\0' &&
         strcmp(setup_script, "no") != 0 &&
         launch_script(setup_script, ifname, fd)) {
@@ -399,51 +472,20 @@ static int net_tap_init(QemuOpts *opts, int *vnet_hdr)
     return fd;
 }
 
-int net_init_tap(QemuOpts *opts, Monitor *mon, const char *name, VLANState *vlan)
+static TAPState *net_init_tap_one(QemuOpts *opts, Monitor *mon,
+                                  const char *name, VLANState *vlan,
+                                  int fd, int vnet_hdr, int queue, int queues)
 {
     TAPState *s;
-    int fd, vnet_hdr = 0;
-
-    if (qemu_opt_get(opts, "fd")) {
-        if (qemu_opt_get(opts, "ifname") ||
-            qemu_opt_get(opts, "script") ||
-            qemu_opt_get(opts, "downscript") ||
-            qemu_opt_get(opts, "vnet_hdr")) {
-            error_report("ifname=, script=, downscript= and vnet_hdr= is invalid with fd=");
-            return -1;
-        }
-
-        fd = net_handle_fd_param(mon, qemu_opt_get(opts, "fd"));
-        if (fd == -1) {
-            return -1;
-        }
-
-        fcntl(fd, F_SETFL, O_NONBLOCK);
-
-        vnet_hdr = tap_probe_vnet_hdr(fd);
-    } else {
-        if (!qemu_opt_get(opts, "script")) {
-            qemu_opt_set(opts, "script", DEFAULT_NETWORK_SCRIPT);
-        }
-
-        if (!qemu_opt_get(opts, "downscript")) {
-            qemu_opt_set(opts, "downscript", DEFAULT_NETWORK_DOWN_SCRIPT);
-        }
-
-        fd = net_tap_init(opts, &vnet_hdr);
-        if (fd == -1) {
-            return -1;
-        }
-    }
 
     s = net_tap_fd_init(vlan, "tap", name, fd, vnet_hdr);
     if (!s) {
         close(fd);
-        return -1;
+        return NULL;
     }
 
     if (tap_set_sndbuf(s->fd, opts) < 0) {
-        return -1;
+        goto fail;
     }
 
     if (qemu_opt_get(opts, "fd")) {
@@ -455,13 +497,14 @@ int net_init_tap(QemuOpts *opts, Monitor *mon, const char *name, VLANState *vlan
         script     = qemu_opt_get(opts, "script");
         downscript = qemu_opt_get(opts, "downscript");
 
-        snprintf(s->nc.info_str, sizeof(s->nc.info_str),
-                 "ifname=%s,script=%s,downscript=%s",
-                 ifname, script, downscript);
-
-        if (strcmp(downscript, "no") != 0) {
-            snprintf(s->down_script, sizeof(s->down_script), "%s", downscript);
-            snprintf(s->down_script_arg, sizeof(s->down_script_arg), "%s", ifname);
+        if (queues > 1) {
+            snprintf(s->nc.info_str, sizeof(s->nc.info_str),
+                     "ifname=%s,script=%s,downscript=%s,queue=%d/%d",
+                     ifname, script, downscript, queue, queues);
+        } else {
+            snprintf(s->nc.info_str, sizeof(s->nc.info_str),
+                     "ifname=%s,script=%s,downscript=%s",
+                     ifname, script, downscript);
         }
     }
 
@@ -470,23 +513,120 @@ int net_init_tap(QemuOpts *opts, Monitor *mon, const char *name, VLANState *vlan
         if (qemu_opt_get(opts, "vhostfd")) {
             r = net_handle_fd_param(mon, qemu_opt_get(opts, "vhostfd"));
             if (r == -1) {
-                return -1;
+                goto fail;
             }
             vhostfd = r;
         } else {
             vhostfd = -1;
         }
-        s->vhost_net = vhost_net_init(&s->nc, vhostfd);
+        /* Each queue pair gets its own vhost device, and so its own
+         * vhost worker thread in the host kernel. */
+        s->vhost_net = vhost_net_init(&s->nc, vhostfd, true);
         if (!s->vhost_net) {
             error_report("vhost-net requested but could not be initialized");
-            return -1;
+            goto fail;
         }
     } else if (qemu_opt_get(opts, "vhostfd")) {
         error_report("vhostfd= is not valid without vhost");
+        goto fail;
+    } else if (!qemu_opt_get(opts, "vhost")) {
+        /* Not asked for either way: use it if the host has it and it can
+         * take the features the device offers anyway.  Whether the guest
+         * side can use it is only known once it starts. */
+        s->vhost_net = vhost_net_init(&s->nc, -1, false);
+    }
+
+    /* The scripts run once per interface, not once per queue */
+    if (!qemu_opt_get(opts, "fd") && queue == 0) {
+        const char *downscript = qemu_opt_get(opts, "downscript");
+
+        if (strcmp(downscript, "no") != 0) {
+            snprintf(s->down_script, sizeof(s->down_script), "%s", downscript);
+            snprintf(s->down_script_arg, sizeof(s->down_script_arg), "%s",
+                     qemu_opt_get(opts, "ifname"));
+        }
+    }
+
+    return s;
+
+fail:
+    qemu_del_vlan_client(&s->nc);
+    return NULL;
+}
+
+int net_init_tap(QemuOpts *opts, Monitor *mon, const char *name, VLANState *vlan)
+{
+    TAPState *s[MAX_QUEUE_NUM];
+    int fd, vnet_hdr = 0;
+    int i, queues;
+
+    queues = qemu_opt_get_number(opts, "queues", 1);
+    if (queues < 1 || queues > MAX_QUEUE_NUM) {
+        error_report("queues= must be between 1 and %d", MAX_QUEUE_NUM);
         return -1;
     }
+    if (queues > 1) {
+        if (vlan) {
+            error_report("queues= is only valid with -netdev");
+            return -1;
+        }
+        if (qemu_opt_get(opts, "fd") || qemu_opt_get(opts, "vhostfd")) {
+            error_report("fd= and vhostfd= are invalid with queues=");
+            return -1;
+        }
+    }
+
+    if (qemu_opt_get(opts, "fd")) {
+        if (qemu_opt_get(opts, "ifname") ||
+            qemu_opt_get(opts, "script") ||
+            qemu_opt_get(opts, "downscript") ||
+            qemu_opt_get(opts, "vnet_hdr")) {
+            error_report("ifname=, script=, downscript= and vnet_hdr= is invalid with fd=");
+            return -1;
+        }
+
+        fd = net_handle_fd_param(mon, qemu_opt_get(opts, "fd"));
+        if (fd == -1) {
+            return -1;
+        }
+
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+
+        vnet_hdr = tap_probe_vnet_hdr(fd);
+
+        return net_init_tap_one(opts, mon, name, vlan, fd, vnet_hdr,
+                                0, 1) ? 0 : -1;
+    }
+
+    if (!qemu_opt_get(opts, "script")) {
+        qemu_opt_set(opts, "script", DEFAULT_NETWORK_SCRIPT);
+    }
+
+    if (!qemu_opt_get(opts, "downscript")) {
+        qemu_opt_set(opts, "downscript", DEFAULT_NETWORK_DOWN_SCRIPT);
+    }
+
+    /* The first open creates the interface (or attaches to a persistent
+     * one) and fills in ifname=, so the other queues attach to it. */
+    for (i = 0; i < queues; i++) {
+        fd = net_tap_init(opts, &vnet_hdr, queues > 1, i == 0);
+        if (fd == -1) {
+            goto fail;
+        }
+        s[i] = net_init_tap_one(opts, mon, name, vlan, fd, vnet_hdr,
+                                i, queues);
+        if (!s[i]) {
+            goto fail;
+        }
+    }
 
     return 0;
+
+fail:
+    while (--i >= 0) {
+        qemu_del_vlan_client(&s[i]->nc);
+    }
+    return -1;
 }
 
 VHostNetState *tap_get_vhost_net(VLANClientState *nc)
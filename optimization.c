@@ -39,6 +39,31 @@ void list_del(list_t *entry)
     // You should delete after calling list_del!
 }
 
+#ifdef ENABLE_OPTIMIZATION
+#ifdef ENABLE_OPTIMIZATION_SHACK
+/*
+ * gen_stats_inc()
+ *  Bump a tcg_stats counter from generated code.
+ */
+static void gen_stats_inc(uint64_t *counter)
+{
+    TCGv_ptr tcg_counter;
+    TCGv_i64 tcg_val;
+
+    if (!tcg_stats_enabled)
+        return;
+
+    tcg_counter = tcg_const_ptr((tcg_target_long)counter);
+    tcg_val = tcg_temp_new_i64();
+    tcg_gen_ld_i64(tcg_val, tcg_counter, 0);
+    tcg_gen_addi_i64(tcg_val, tcg_val, 1);
+    tcg_gen_st_i64(tcg_val, tcg_counter, 0);
+    tcg_temp_free_i64(tcg_val);
+    tcg_temp_free_ptr(tcg_counter);
+}
+#endif // ENABLE_OPTIMIZATION_SHACK
+#endif // ENABLE_OPTIMIZATION
+
 /*
  * Shadow Stack
  */
@@ -212,7 +237,7 @@ void push_shack(CPUState *env, TCGv_ptr cpu_env, target_ulong next_eip)
     tcg_gen_ld_ptr(tcg_shack_end, cpu_env, offsetof(CPUState, shack_end));
 
     int label_push = gen_new_label();
-    tcg_gen_brcond_tl(TCG_COND_NE, tcg_shack_top, tcg_shack_end, label_push);
+    tcg_gen_brcond_ptr(TCG_COND_NE, tcg_shack_top, tcg_shack_end, label_push);
 
     //   env->shack_top = env->shack;
     TCGv_ptr tcg_shack = tcg_temp_new_ptr();
@@ -252,7 +277,7 @@ void pop_shack(TCGv_ptr cpu_env, TCGv next_eip)
     TCGv_ptr tcg_shack_top = tcg_temp_local_new_ptr();
     TCGv_ptr tcg_shack = tcg_temp_local_new_ptr();
     TCGv_ptr tcg_sp = tcg_temp_local_new_ptr();
-    TCGv_ptr tcg_sp_guest_eip = tcg_temp_local_new_ptr();
+    TCGv tcg_sp_guest_eip = tcg_temp_local_new();
     TCGv_ptr tcg_sp_host_eip = tcg_temp_local_new_ptr();
 
     TCGv tcg_next_eip = tcg_temp_local_new();
@@ -267,29 +292,63 @@ void pop_shack(TCGv_ptr cpu_env, TCGv next_eip)
     tcg_gen_addi_ptr(tcg_shack_top, tcg_shack_top, -sizeof(struct shadow_pair*));
     tcg_gen_st_ptr(tcg_shack_top, cpu_env, offsetof(CPUState, shack_top));
     tcg_gen_ld_ptr(tcg_sp, tcg_shack_top, 0);
-    tcg_gen_ld_ptr(tcg_sp_guest_eip, tcg_sp, offsetof(struct shadow_pair, guest_eip));
-    tcg_gen_brcond_ptr(TCG_COND_NE, tcg_sp_guest_eip, tcg_next_eip, label_exit);
+    tcg_gen_ld_tl(tcg_sp_guest_eip, tcg_sp, offsetof(struct shadow_pair, guest_eip));
+    tcg_gen_brcond_tl(TCG_COND_NE, tcg_sp_guest_eip, tcg_next_eip, label_exit);
 
     tcg_gen_ld_ptr(tcg_sp_host_eip, tcg_sp, offsetof(struct shadow_pair, host_eip));
     tcg_gen_brcond_ptr(TCG_COND_EQ, tcg_sp_host_eip, tcg_const_ptr(NULL), label_exit);
 
+    gen_stats_inc(&tcg_stats.shack_hits);
     *gen_opc_ptr++ = INDEX_op_jmp;
     *gen_opparam_ptr++ = tcg_sp_host_eip;
 
 
     gen_set_label(label_exit);
+    gen_stats_inc(&tcg_stats.shack_misses);
 
     // free
     tcg_temp_free_ptr(tcg_shack_top);
     tcg_temp_free_ptr(tcg_shack);
     tcg_temp_free_ptr(tcg_sp);
-    tcg_temp_free_ptr(tcg_sp_guest_eip);
+    tcg_temp_free(tcg_sp_guest_eip);
     tcg_temp_free_ptr(tcg_sp_host_eip);
-    tcg_temp_free_ptr(tcg_next_eip);
+    tcg_temp_free(tcg_next_eip);
 #endif // ENABLE_OPTIMIZATION_SHACK
 #endif // ENABLE_OPTIMIZATION
 }
 
+/*
+ * shack_forget()
+ *  Drop the host eip of a shadow pair whose translation block went away;
+ *  tb == NULL drops all of them.
+ */
+static void shack_forget(CPUState *env, TranslationBlock *tb)
+{
+#ifdef ENABLE_OPTIMIZATION_SHACK
+    struct shadow_pair *sp;
+    list_t *head, *l;
+    int index;
+
+    if (!env->shadow_hash_table)
+        return;
+
+    if (tb) {
+        sp = SHACK_HASHTBL_LOOKUP(env, tb->pc);
+        if (sp && sp->host_eip == (unsigned long *)tb->tc_ptr)
+            sp->host_eip = NULL;
+        return;
+    }
+
+    for (index = 0; index < SHACK_HASHTBL_SIZE; ++index) {
+        head = &((list_t*)env->shadow_hash_table)[index];
+        for (l = head->next; l != head; l = l->next) {
+            sp = container_of(l, struct shadow_pair, l);
+            sp->host_eip = NULL;
+        }
+    }
+#endif // ENABLE_OPTIMIZATION_SHACK
+}
+
 /*
  * dump_shack_structure()
  *  Dump the shadow stack.
@@ -437,11 +496,13 @@ void *helper_lookup_ibtc(target_ulong guest_eip)
         // Cache hit
         // Return the context pointer of the related translation block.
         //fprintf(stderr, "[IBTC] Cache hit!\n");
+        tcg_stats.ibtc_hits++;
         return ibtc_tbl->htable[index].tb->tc_ptr;
     }
     
     // Cache miss
     // Enable update_ibtc_entry to update ibtc.
+    tcg_stats.ibtc_misses++;
     update_ibtc = 1;
 #endif ENABLE_OPTIMIZATION_IBTC
     return optimization_ret_addr;
@@ -479,6 +540,39 @@ static inline void ibtc_init(CPUState *env)
     update_ibtc = 0;
 }
 
+/*
+ * optimization_tb_invalidate()
+ *  Called when a translation block is invalidated: neither the shadow
+ *  stack nor the IBTC may hand out its code again.
+ */
+void optimization_tb_invalidate(TranslationBlock *tb)
+{
+    CPUState *env;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu)
+        shack_forget(env, tb);
+#ifdef ENABLE_OPTIMIZATION_IBTC
+    if (ibtc_tbl && ibtc_tbl->htable[tb->pc & IBTC_CACHE_MASK].tb == tb)
+        ibtc_tbl->htable[tb->pc & IBTC_CACHE_MASK].tb = NULL;
+#endif // ENABLE_OPTIMIZATION_IBTC
+}
+
+/*
+ * optimization_tb_flush()
+ *  Called when the code cache is flushed.
+ */
+void optimization_tb_flush(void)
+{
+    CPUState *env;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu)
+        shack_forget(env, NULL);
+#ifdef ENABLE_OPTIMIZATION_IBTC
+    if (ibtc_tbl)
+        memset(ibtc_tbl, 0, sizeof(struct ibtc_table));
+#endif // ENABLE_OPTIMIZATION_IBTC
+}
+
 /*
  * init_optimizations()
  *  Initialize optimization subsystem.
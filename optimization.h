@@ -6,8 +6,11 @@
 #ifndef __OPTIMIZATION_H
 #define __OPTIMIZATION_H
 
-/* Comment the next line to disable optimizations. */
+/* Comment the next line to disable optimizations.  The shadow stack and
+   IBTC are only set up by linux-user (init_optimizations()). */
+#ifdef CONFIG_USER_ONLY
 #define ENABLE_OPTIMIZATION
+#endif
 //#define ENABLE_OPTIMIZATION_DEBUG
 
 #ifdef ENABLE_OPTIMIZATION_DEBUG
@@ -105,6 +108,8 @@ struct ibtc_table
 
 int init_optimizations(CPUState *env);
 void update_ibtc_entry(TranslationBlock *tb);
+void optimization_tb_invalidate(TranslationBlock *tb);
+void optimization_tb_flush(void);
 
 #endif
 
@@ -30,8 +30,11 @@
 #include "block/raw-posix-aio.h"
 
 
+typedef struct PaioQueue PaioQueue;
+
 struct qemu_paiocb {
     BlockDriverAIOCB common;
+    PaioQueue *queue;
     int aio_fildes;
     union {
         struct iovec *aio_iov;
@@ -40,7 +43,6 @@ struct qemu_paiocb {
     int aio_niov;
     size_t aio_nbytes;
 #define aio_ioctl_cmd   aio_nbytes /* for QEMU_AIO_IOCTL */
-    int ev_signo;
     off_t aio_offset;
 
     QTAILQ_ENTRY(qemu_paiocb) node;
@@ -52,20 +54,58 @@ struct qemu_paiocb {
     int async_context_id;
 };
 
+/*
+ * Each drive has its own request queue, protected by its own lock, so that
+ * requests for different drives don't contend for a single lock. A queue has
+ * its own worker threads; a thread that finds its queue empty steals requests
+ * from other queues before it goes to sleep.
+ *
+ * Up to min_threads threads per queue are kept around even when they are
+ * idle, any others exit after 10 seconds without work.
+ */
+struct PaioQueue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    QTAILQ_HEAD(, qemu_paiocb) request_list;
+    int cur_threads;
+    int idle_threads;
+    int closing;
+
+    /* Set when another queue has requests that none of its threads can take */
+    int steal_pending;
+
+    /* Requests that haven't been completed yet, only used by the I/O thread */
+    int nb_inflight;
+
+    /* Statistics, protected by lock */
+    int depth;
+    int max_depth;
+    int64_t requests;
+    int64_t stolen;
+
+    QLIST_ENTRY(PaioQueue) next;
+};
+
 typedef struct PosixAioState {
     int rfd, wfd;
     struct qemu_paiocb *first_aio;
+    int notified;
 } PosixAioState;
 
 
-static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+/*
+ * Protects the list of queues. Taken before any queue lock. The total number
+ * of threads is updated with atomic operations so that a thread can be
+ * spawned with a queue lock held.
+ */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static QLIST_HEAD(, PaioQueue) queues = QLIST_HEAD_INITIALIZER(queues);
 static pthread_t thread_id;
 static pthread_attr_t attr;
 static int max_threads = 64;
+static int max_queue_threads = 16;
+static int min_threads = 2;
 static int cur_threads = 0;
-static int idle_threads = 0;
-static QTAILQ_HEAD(, qemu_paiocb) request_list;
 
 #ifdef CONFIG_PREADV
 static int preadv_present = 1;
@@ -104,12 +144,24 @@ static int cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
     return ret;
 }
 
+static void cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+    int ret = pthread_cond_wait(cond, mutex);
+    if (ret) die2(ret, "pthread_cond_wait");
+}
+
 static void cond_signal(pthread_cond_t *cond)
 {
     int ret = pthread_cond_signal(cond);
     if (ret) die2(ret, "pthread_cond_signal");
 }
 
+static void cond_broadcast(pthread_cond_t *cond)
+{
+    int ret = pthread_cond_broadcast(cond);
+    if (ret) die2(ret, "pthread_cond_broadcast");
+}
+
 static void thread_create(pthread_t *thread, pthread_attr_t *attr,
                           void *(*start_routine)(void*), void *arg)
 {
@@ -300,37 +352,125 @@ static ssize_t handle_aiocb_rw(struct qemu_paiocb *aiocb)
     return nbytes;
 }
 
-static void *aio_thread(void *unused)
+static PosixAioState *posix_aio_state;
+
+/* Takes the first request off a queue. Must be called with q->lock held. */
+static struct qemu_paiocb *paio_dequeue(PaioQueue *q)
+{
+    struct qemu_paiocb *aiocb;
+
+    aiocb = QTAILQ_FIRST(&q->request_list);
+    if (aiocb) {
+        QTAILQ_REMOVE(&q->request_list, aiocb, node);
+        aiocb->active = 1;
+        q->depth--;
+    }
+
+    return aiocb;
+}
+
+/* Looks for a request in the queues of other drives */
+static struct qemu_paiocb *paio_steal(PaioQueue *home)
 {
-    pid_t pid;
+    struct qemu_paiocb *aiocb = NULL;
+    PaioQueue *q;
 
-    pid = getpid();
+    mutex_lock(&pool_lock);
+    QLIST_FOREACH(q, &queues, next) {
+        if (q == home || QTAILQ_EMPTY(&q->request_list)) {
+            continue;
+        }
+        /* Don't wait for a queue that is busy anyway */
+        if (pthread_mutex_trylock(&q->lock)) {
+            continue;
+        }
+        aiocb = paio_dequeue(q);
+        if (aiocb) {
+            q->stolen++;
+        }
+        mutex_unlock(&q->lock);
+        if (aiocb) {
+            break;
+        }
+    }
+    mutex_unlock(&pool_lock);
+
+    return aiocb;
+}
+
+/*
+ * Wakes up the I/O thread. Only the first completion after the I/O thread
+ * has looked at the completed requests needs to do this, any others are
+ * processed in the same batch.
+ */
+static void paio_notify_completion(void)
+{
+    PosixAioState *s = posix_aio_state;
+    uint64_t val = 1;
+    ssize_t ret;
+
+    if (__sync_lock_test_and_set(&s->notified, 1)) {
+        return;
+    }
+
+    ret = write(s->wfd, &val, sizeof(val));
+    if (ret < 0 && errno != EAGAIN)
+        die("write()");
+
+#ifndef CONFIG_IOTHREAD
+    /* The I/O thread may be busy executing guest code, kick it */
+    if (kill(getpid(), SIGUSR2)) die("kill failed");
+#endif
+}
+
+static void *aio_thread(void *opaque)
+{
+    PaioQueue *home = opaque;
 
     while (1) {
         struct qemu_paiocb *aiocb;
         ssize_t ret = 0;
         qemu_timeval tv;
         struct timespec ts;
+        int closing;
 
-        qemu_gettimeofday(&tv);
-        ts.tv_sec = tv.tv_sec + 10;
-        ts.tv_nsec = 0;
-
-        mutex_lock(&lock);
+        mutex_lock(&home->lock);
+        aiocb = paio_dequeue(home);
+        closing = home->closing;
+        mutex_unlock(&home->lock);
 
-        while (QTAILQ_EMPTY(&request_list) &&
-               !(ret == ETIMEDOUT)) {
-            ret = cond_timedwait(&cond, &lock, &ts);
+        if (!aiocb && !closing) {
+            aiocb = paio_steal(home);
         }
 
-        if (QTAILQ_EMPTY(&request_list))
-            break;
+        if (!aiocb) {
+            qemu_gettimeofday(&tv);
+            ts.tv_sec = tv.tv_sec + 10;
+            ts.tv_nsec = 0;
 
-        aiocb = QTAILQ_FIRST(&request_list);
-        QTAILQ_REMOVE(&request_list, aiocb, node);
-        aiocb->active = 1;
-        idle_threads--;
-        mutex_unlock(&lock);
+            mutex_lock(&home->lock);
+            home->idle_threads++;
+            while (QTAILQ_EMPTY(&home->request_list) && !home->closing &&
+                   !home->steal_pending && ret != ETIMEDOUT) {
+                ret = cond_timedwait(&home->cond, &home->lock, &ts);
+            }
+            home->idle_threads--;
+
+            if (home->steal_pending) {
+                /* Another queue ran out of threads, go and help it */
+                home->steal_pending = 0;
+                mutex_unlock(&home->lock);
+                continue;
+            }
+
+            if (QTAILQ_EMPTY(&home->request_list) &&
+                (home->closing ||
+                 (ret == ETIMEDOUT && home->cur_threads > min_threads))) {
+                break;
+            }
+            mutex_unlock(&home->lock);
+            continue;
+        }
 
         switch (aiocb->aio_type & QEMU_AIO_TYPE_MASK) {
         case QEMU_AIO_READ:
@@ -349,56 +489,115 @@ static void *aio_thread(void *unused)
             break;
         }
 
-        mutex_lock(&lock);
+        mutex_lock(&aiocb->queue->lock);
         aiocb->ret = ret;
-        idle_threads++;
-        mutex_unlock(&lock);
+        mutex_unlock(&aiocb->queue->lock);
 
-        if (kill(pid, aiocb->ev_signo)) die("kill failed");
+        paio_notify_completion();
     }
 
-    idle_threads--;
-    cur_threads--;
-    mutex_unlock(&lock);
+    home->cur_threads--;
+    cond_broadcast(&home->cond);
+    mutex_unlock(&home->lock);
+
+    __sync_fetch_and_sub(&cur_threads, 1);
 
     return NULL;
 }
 
-static void spawn_thread(void)
+/*
+ * Must be called with q->lock held. Returns -1 if no thread could be started
+ * because the total number of threads is at its limit.
+ */
+static int spawn_thread(PaioQueue *q)
 {
     sigset_t set, oldset;
 
-    cur_threads++;
-    idle_threads++;
+    if (__sync_fetch_and_add(&cur_threads, 1) >= max_threads) {
+        __sync_fetch_and_sub(&cur_threads, 1);
+        return -1;
+    }
+
+    q->cur_threads++;
 
     /* block all signals */
     if (sigfillset(&set)) die("sigfillset");
     if (sigprocmask(SIG_SETMASK, &set, &oldset)) die("sigprocmask");
 
-    thread_create(&thread_id, &attr, aio_thread, NULL);
+    thread_create(&thread_id, &attr, aio_thread, q);
 
     if (sigprocmask(SIG_SETMASK, &oldset, NULL)) die("sigprocmask restore");
+
+    return 0;
+}
+
+/*
+ * Gets a thread of another queue to steal a request from a queue that can't
+ * take it itself. Must be called without any queue lock held.
+ *
+ * Every queue with threads is marked, so that a thread which is about to go
+ * idle after failing to steal looks again instead of sleeping. One idle
+ * thread is woken up.
+ */
+static void paio_wake_stealer(PaioQueue *busy)
+{
+    PaioQueue *q;
+    int woken = 0;
+
+    mutex_lock(&pool_lock);
+    QLIST_FOREACH(q, &queues, next) {
+        if (q == busy) {
+            continue;
+        }
+        mutex_lock(&q->lock);
+        if (q->cur_threads > 0) {
+            q->steal_pending = 1;
+            if (!woken && q->idle_threads > 0) {
+                cond_signal(&q->cond);
+                woken = 1;
+            }
+        }
+        mutex_unlock(&q->lock);
+    }
+    mutex_unlock(&pool_lock);
 }
 
 static void qemu_paio_submit(struct qemu_paiocb *aiocb)
 {
+    PaioQueue *q = aiocb->queue;
+    int wake_stealer = 0;
+
     aiocb->ret = -EINPROGRESS;
     aiocb->active = 0;
-    mutex_lock(&lock);
-    if (idle_threads == 0 && cur_threads < max_threads)
-        spawn_thread();
-    QTAILQ_INSERT_TAIL(&request_list, aiocb, node);
-    mutex_unlock(&lock);
-    cond_signal(&cond);
+    q->nb_inflight++;
+
+    mutex_lock(&q->lock);
+    QTAILQ_INSERT_TAIL(&q->request_list, aiocb, node);
+    q->requests++;
+    q->depth++;
+    if (q->depth > q->max_depth) {
+        q->max_depth = q->depth;
+    }
+
+    if (q->idle_threads > 0) {
+        cond_signal(&q->cond);
+    } else if (q->cur_threads >= max_queue_threads || spawn_thread(q) < 0) {
+        wake_stealer = 1;
+    }
+    mutex_unlock(&q->lock);
+
+    if (wake_stealer) {
+        paio_wake_stealer(q);
+    }
 }
 
 static ssize_t qemu_paio_return(struct qemu_paiocb *aiocb)
 {
     ssize_t ret;
 
-    mutex_lock(&lock);
+    mutex_lock(&aiocb->queue->lock);
     ret = aiocb->ret;
-    mutex_unlock(&lock);
+    mutex_unlock(&aiocb->queue->lock);
 
     return ret;
 }
@@ -440,6 +639,7 @@ static int posix_aio_process_queue(void *opaque)
             if (ret == ECANCELED) {
                 /* remove the request */
                 *pacb = acb->next;
+                acb->queue->nb_inflight--;
                 qemu_aio_release(acb);
                 result = 1;
             } else if (ret != EINPROGRESS) {
@@ -455,6 +655,7 @@ static int posix_aio_process_queue(void *opaque)
                 }
                 /* remove the request */
                 *pacb = acb->next;
+                acb->queue->nb_inflight--;
                 /* call the callback */
                 acb->common.cb(acb->common.opaque, ret);
                 qemu_aio_release(acb);
@@ -474,7 +675,7 @@ static void posix_aio_read(void *opaque)
     PosixAioState *s = opaque;
     ssize_t len;
 
-    /* read all bytes from signal pipe */
+    /* read all bytes from the eventfd (or pipe) */
     for (;;) {
         char bytes[16];
 
@@ -486,6 +687,10 @@ static void posix_aio_read(void *opaque)
         break;
     }
 
+    /* Requests completing from now on must notify us again */
+    __sync_lock_release(&s->notified);
+    __sync_synchronize();
+
     posix_aio_process_queue(s);
 }
 
@@ -495,21 +700,12 @@ static int posix_aio_flush(void *opaque)
     return !!s->first_aio;
 }
 
-static PosixAioState *posix_aio_state;
-
+#ifndef CONFIG_IOTHREAD
 static void aio_signal_handler(int signum)
 {
-    if (posix_aio_state) {
-        char byte = 0;
-        ssize_t ret;
-
-        ret = write(posix_aio_state->wfd, &byte, sizeof(byte));
-        if (ret < 0 && errno != EAGAIN)
-            die("write()");
-    }
-
     qemu_service_io();
 }
+#endif
 
 static void paio_remove(struct qemu_paiocb *acb)
 {
@@ -523,6 +719,7 @@ static void paio_remove(struct qemu_paiocb *acb)
             break;
         } else if (*pacb == acb) {
             *pacb = acb->next;
+            acb->queue->nb_inflight--;
             qemu_aio_release(acb);
             break;
         }
@@ -535,14 +732,15 @@ static void paio_cancel(BlockDriverAIOCB *blockacb)
     struct qemu_paiocb *acb = (struct qemu_paiocb *)blockacb;
     int active = 0;
 
-    mutex_lock(&lock);
+    mutex_lock(&acb->queue->lock);
     if (!acb->active) {
-        QTAILQ_REMOVE(&request_list, acb, node);
+        QTAILQ_REMOVE(&acb->queue->request_list, acb, node);
+        acb->queue->depth--;
         acb->ret = -ECANCELED;
     } else if (acb->ret == -EINPROGRESS) {
         active = 1;
     }
-    mutex_unlock(&lock);
+    mutex_unlock(&acb->queue->lock);
 
     if (active) {
         /* fail safe: if the aio could not be canceled, we wait for
@@ -559,7 +757,7 @@ static AIOPool raw_aio_pool = {
     .cancel             = paio_cancel,
 };
 
-BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
+BlockDriverAIOCB *paio_submit(BlockDriverState *bs, void *aio_queue, int fd,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque, int type)
 {
@@ -568,9 +766,9 @@ BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
     acb = qemu_aio_get(&raw_aio_pool, bs, cb, opaque);
     if (!acb)
         return NULL;
+    acb->queue = aio_queue;
     acb->aio_type = type;
     acb->aio_fildes = fd;
-    acb->ev_signo = SIGUSR2;
     acb->async_context_id = get_async_context_id();
 
     if (qiov) {
@@ -587,7 +785,7 @@ BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
     return &acb->common;
 }
 
-BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, int fd,
+BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, void *aio_queue, int fd,
         unsigned long int req, void *buf,
         BlockDriverCompletionFunc *cb, void *opaque)
 {
@@ -596,9 +794,9 @@ BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, int fd,
     acb = qemu_aio_get(&raw_aio_pool, bs, cb, opaque);
     if (!acb)
         return NULL;
+    acb->queue = aio_queue;
     acb->aio_type = QEMU_AIO_IOCTL;
     acb->aio_fildes = fd;
-    acb->ev_signo = SIGUSR2;
     acb->async_context_id = get_async_context_id();
     acb->aio_offset = 0;
     acb->aio_ioctl_buf = buf;
@@ -611,9 +809,75 @@ BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, int fd,
     return &acb->common;
 }
 
+/*
+ * Creates the request queue for a drive. Requests submitted with it are
+ * processed by the queue's own threads, or by idle threads of other queues.
+ */
+void *paio_queue_new(void)
+{
+    PaioQueue *q = qemu_mallocz(sizeof(*q));
+    int ret;
+
+    ret = pthread_mutex_init(&q->lock, NULL);
+    if (ret) die2(ret, "pthread_mutex_init");
+    ret = pthread_cond_init(&q->cond, NULL);
+    if (ret) die2(ret, "pthread_cond_init");
+    QTAILQ_INIT(&q->request_list);
+
+    mutex_lock(&pool_lock);
+    QLIST_INSERT_HEAD(&queues, q, next);
+    mutex_unlock(&pool_lock);
+
+    return q;
+}
+
+/*
+ * Waits for all requests of the queue to complete, stops its threads and
+ * frees it.
+ */
+void paio_queue_free(void *aio_queue)
+{
+    PaioQueue *q = aio_queue;
+
+    while (q->nb_inflight > 0) {
+        qemu_aio_wait();
+    }
+
+    mutex_lock(&pool_lock);
+    QLIST_REMOVE(q, next);
+    mutex_unlock(&pool_lock);
+
+    mutex_lock(&q->lock);
+    q->closing = 1;
+    cond_broadcast(&q->cond);
+    while (q->cur_threads > 0) {
+        cond_wait(&q->cond, &q->lock);
+    }
+    mutex_unlock(&q->lock);
+
+    pthread_cond_destroy(&q->cond);
+    pthread_mutex_destroy(&q->lock);
+    qemu_free(q);
+}
+
+void paio_get_stats(void *aio_queue, BlockAIOPoolStats *stats)
+{
+    PaioQueue *q = aio_queue;
+
+    mutex_lock(&q->lock);
+    stats->requests = q->requests;
+    stats->stolen = q->stolen;
+    stats->max_queue_depth = q->max_depth;
+    stats->threads = q->cur_threads;
+    stats->idle_threads = q->idle_threads;
+    mutex_unlock(&q->lock);
+}
+
 int paio_init(void)
 {
+#ifndef CONFIG_IOTHREAD
     struct sigaction act;
+#endif
     PosixAioState *s;
     int fds[2];
     int ret;
@@ -623,14 +887,17 @@ int paio_init(void)
 
     s = qemu_malloc(sizeof(PosixAioState));
 
+#ifndef CONFIG_IOTHREAD
     sigfillset(&act.sa_mask);
     act.sa_flags = 0; /* do not restart syscalls to interrupt select() */
     act.sa_handler = aio_signal_handler;
     sigaction(SIGUSR2, &act, NULL);
+#endif
 
     s->first_aio = NULL;
-    if (qemu_pipe(fds) == -1) {
-        fprintf(stderr, "failed to create pipe\n");
+    s->notified = 0;
+    if (qemu_eventfd(fds) == -1) {
+        fprintf(stderr, "failed to create eventfd\n");
         return -1;
     }
 
@@ -651,8 +918,6 @@ int paio_init(void)
     if (ret)
         die2(ret, "pthread_attr_setdetachstate");
 
-    QTAILQ_INIT(&request_list);
-
     posix_aio_state = s;
     return 0;
 }
@@ -232,6 +232,8 @@ typedef struct VirtIODevice VirtIODevice;
 typedef uint64_t pcibus_t;
 
 void cpu_exec_init_all(unsigned long tb_size);
+void jit_profile_init(void);
+int jit_profile_active(void);
 
 /* CPU save/load.  */
 void cpu_save(QEMUFile *f, void *opaque);
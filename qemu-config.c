@@ -59,6 +59,10 @@ QemuOptsList qemu_drive_opts = {
             .name = "aio",
             .type = QEMU_OPT_STRING,
             .help = "host AIO implementation (threads, native)",
+        },{
+            .name = "l2-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the image metadata (L2 table) cache",
         },{
             .name = "format",
             .type = QEMU_OPT_STRING,
@@ -564,13 +564,20 @@ static int img_commit(int argc, char **argv)
     return 0;
 }
 
+/*
+ * Returns true iff the buffer contains at least one non-NUL byte. len must be
+ * a multiple of 512 and sector must be aligned to sizeof(long).
+ */
 static int is_not_zero(const uint8_t *sector, int len)
 {
+    const unsigned long *p = (const unsigned long *) sector;
     int i;
-    len >>= 2;
-    for(i = 0;i < len; i++) {
-        if (((uint32_t *)sector)[i] != 0)
+
+    len /= sizeof(unsigned long);
+    for(i = 0; i < len; i += 4) {
+        if (p[i] | p[i + 1] | p[i + 2] | p[i + 3]) {
             return 1;
+        }
     }
     return 0;
 }
@@ -631,8 +638,128 @@ static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
     return res;
 }
 
+/*
+ * Returns true iff the first sector is allocated in bs or any of its backing
+ * files, i.e. if it may contain anything else than zeros.  Returns -EIO if
+ * the allocation state could not be determined (e.g. an L2 table could not
+ * be read).
+ *
+ * 'pnum' is set to the number of sectors (including and immediately following
+ * the first one) that are known to be in the same state.
+ */
+static int is_allocated_in_chain(BlockDriverState *bs, int64_t sector_num,
+    int n, int *pnum)
+{
+    while (bs && sector_num < bs->total_sectors) {
+        if (bdrv_is_allocated(bs, sector_num, n, pnum)) {
+            return 1;
+        }
+        /* bdrv_is_allocated() only reports 0 sectors inside the image
+           when the driver failed to look them up */
+        if (*pnum == 0) {
+            return -EIO;
+        }
+        n = *pnum;
+        bs = bs->backing_hd;
+    }
+
+    *pnum = n;
+    return 0;
+}
+
 #define IO_BUF_SIZE (2 * 1024 * 1024)
 
+/* Number of buffers that are read and written in parallel */
+#define CONVERT_REQS 8
+
+typedef struct ConvertState {
+    BlockDriverState *out_bs;
+    int copy_zeros;
+    int ret;
+} ConvertState;
+
+typedef struct ConvertReq {
+    ConvertState *s;
+    uint8_t *buf;
+    struct iovec iov;
+    QEMUIOVector qiov;
+    int64_t sector_num;
+    int nb_sectors;
+    int in_flight;
+} ConvertReq;
+
+typedef struct ConvertWrite {
+    ConvertReq *req;
+    struct iovec iov;
+    QEMUIOVector qiov;
+} ConvertWrite;
+
+static void convert_write_cb(void *opaque, int ret)
+{
+    ConvertWrite *w = opaque;
+    ConvertReq *req = w->req;
+
+    if (ret < 0 && req->s->ret == 0) {
+        error("error while writing");
+        req->s->ret = ret;
+    }
+    req->in_flight--;
+    qemu_free(w);
+}
+
+static void convert_read_cb(void *opaque, int ret)
+{
+    ConvertReq *req = opaque;
+    ConvertState *s = req->s;
+    const uint8_t *buf1 = req->buf;
+    int64_t sector_num = req->sector_num;
+    int n = req->nb_sectors, n1;
+
+    if (ret < 0) {
+        if (s->ret == 0) {
+            error("error while reading");
+            s->ret = ret;
+        }
+        goto done;
+    }
+
+    /* NOTE: at the same time we convert, we do not write zero
+       sectors to have a chance to compress the image. Ideally, we
+       should add a specific call to have the info to go faster */
+    while (n > 0 && s->ret == 0) {
+        /* If the output image is being created as a copy on write image,
+           copy all sectors even the ones containing only NUL bytes,
+           because they may differ from the sectors in the base image.
+
+           If the output is to a host device, we also write out
+           sectors that are entirely 0, since whatever data was
+           already there is garbage, not 0s. */
+        if (s->copy_zeros) {
+            n1 = n;
+        }
+        if (s->copy_zeros || is_allocated_sectors(buf1, n, &n1)) {
+            ConvertWrite *w = qemu_mallocz(sizeof(*w));
+
+            w->req = req;
+            w->iov.iov_base = (void *) buf1;
+            w->iov.iov_len = n1 * 512;
+            qemu_iovec_init_external(&w->qiov, &w->iov, 1);
+
+            req->in_flight++;
+            if (!bdrv_aio_writev(s->out_bs, sector_num, &w->qiov, n1,
+                                 convert_write_cb, w)) {
+                convert_write_cb(w, -EIO);
+            }
+        }
+        sector_num += n1;
+        n -= n1;
+        buf1 += n1 * 512;
+    }
+
+done:
+    req->in_flight--;
+}
+
 static int img_convert(int argc, char **argv)
 {
     int c, ret = 0, n, n1, bs_n, bs_i, flags, cluster_size, cluster_sectors;
@@ -642,15 +769,17 @@ static int img_convert(int argc, char **argv)
     int64_t total_sectors, nb_sectors, sector_num, bs_offset;
     uint64_t bs_sectors;
     uint8_t * buf = NULL;
-    const uint8_t *buf1;
     BlockDriverInfo bdi;
     QEMUOptionParameter *param = NULL, *create_options = NULL;
     char *options = NULL;
+    ConvertState cs;
+    ConvertReq reqs[CONVERT_REQS];
 
     fmt = NULL;
     out_fmt = "raw";
     out_baseimg = NULL;
     flags = 0;
+    memset(reqs, 0, sizeof(reqs));
     for(;;) {
         c = getopt(argc, argv, "f:O:B:hce6o:");
         if (c == -1)
@@ -793,7 +922,7 @@ static int img_convert(int argc, char **argv)
     bs_i = 0;
     bs_offset = 0;
     bdrv_get_geometry(bs[0], &bs_sectors);
-    buf = qemu_malloc(IO_BUF_SIZE);
+    buf = qemu_blockalign(out_bs, IO_BUF_SIZE);
 
     if (flags & BLOCK_FLAG_COMPRESS) {
         ret = bdrv_get_info(out_bs, &bdi);
@@ -842,10 +971,21 @@ static int img_convert(int argc, char **argv)
 
                 nlow = (remainder > bs_sectors - bs_num) ? bs_sectors - bs_num : remainder;
 
-                ret = bdrv_read(bs[bs_i], bs_num, buf2, nlow);
+                /* Unallocated sectors read as zeros, don't bother reading */
+                ret = is_allocated_in_chain(bs[bs_i], bs_num, nlow, &n1);
                 if (ret < 0) {
-                    error("error while reading");
+                    error("error while reading block status of sector %" PRId64,
+                          bs_num);
                     goto out;
+                } else if (ret == 0) {
+                    memset(buf2, 0, n1 * 512);
+                    nlow = n1;
+                } else {
+                    ret = bdrv_read(bs[bs_i], bs_num, buf2, nlow);
+                    if (ret < 0) {
+                        error("error while reading");
+                        goto out;
+                    }
                 }
 
                 buf2 += nlow * 512;
@@ -872,12 +1012,44 @@ static int img_convert(int argc, char **argv)
         bdrv_write_compressed(out_bs, 0, NULL, 0);
     } else {
         int has_zero_init = bdrv_has_zero_init(out_bs);
+        ConvertReq *req;
+        int i, busy;
+
+        cs.out_bs = out_bs;
+        cs.copy_zeros = !has_zero_init || out_baseimg;
+        cs.ret = 0;
+        for (i = 0; i < CONVERT_REQS; i++) {
+            reqs[i].s = &cs;
+            reqs[i].buf = qemu_blockalign(out_bs, IO_BUF_SIZE);
+        }
 
+        /*
+         * Up to CONVERT_REQS buffers are in flight at the same time. Each of
+         * them is read from the source and, once the read has completed, the
+         * parts that need to be copied are written to the destination.
+         */
         sector_num = 0; // total number of sectors converted so far
         for(;;) {
+            req = NULL;
+            busy = 0;
+            for (i = 0; i < CONVERT_REQS; i++) {
+                if (reqs[i].in_flight) {
+                    busy++;
+                } else if (!req) {
+                    req = &reqs[i];
+                }
+            }
+
+            /* On errors, only wait for the requests in flight to finish */
             nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0)
-                break;
+            if (cs.ret < 0 || nb_sectors <= 0 || !req) {
+                if (busy == 0) {
+                    break;
+                }
+                qemu_aio_wait();
+                continue;
+            }
+
             if (nb_sectors >= (IO_BUF_SIZE / 512))
                 n = (IO_BUF_SIZE / 512);
             else
@@ -910,46 +1082,46 @@ static int img_convert(int argc, char **argv)
                     /* The next 'n1' sectors are allocated in the input image. Copy
                        only those as they may be followed by unallocated sectors. */
                     n = n1;
-                }
-            } else {
-                n1 = n;
-            }
-
-            ret = bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n);
-            if (ret < 0) {
-                error("error while reading");
-                goto out;
-            }
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                /* If the output image is being created as a copy on write image,
-                   copy all sectors even the ones containing only NUL bytes,
-                   because they may differ from the sectors in the base image.
-
-                   If the output is to a host device, we also write out
-                   sectors that are entirely 0, since whatever data was
-                   already there is garbage, not 0s. */
-                if (!has_zero_init || out_baseimg ||
-                    is_allocated_sectors(buf1, n, &n1)) {
-                    ret = bdrv_write(out_bs, sector_num, buf1, n1);
+                } else {
+                    /* Sectors that are unallocated in the whole backing chain
+                       are zero, skip them without reading */
+                    ret = is_allocated_in_chain(bs[bs_i],
+                                                sector_num - bs_offset, n, &n1);
                     if (ret < 0) {
-                        error("error while writing");
-                        goto out;
+                        error("error while reading block status of sector %"
+                              PRId64, sector_num - bs_offset);
+                        cs.ret = ret;
+                        continue;
+                    } else if (ret == 0) {
+                        sector_num += n1;
+                        continue;
                     }
+                    n = n1;
                 }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
             }
+
+            req->sector_num = sector_num;
+            req->nb_sectors = n;
+            req->iov.iov_base = req->buf;
+            req->iov.iov_len = n * 512;
+            qemu_iovec_init_external(&req->qiov, &req->iov, 1);
+            req->in_flight = 1;
+
+            if (!bdrv_aio_readv(bs[bs_i], sector_num - bs_offset, &req->qiov,
+                                n, convert_read_cb, req)) {
+                convert_read_cb(req, -EIO);
+            }
+            sector_num += n;
         }
+        ret = cs.ret;
     }
 out:
     free_option_parameters(create_options);
     free_option_parameters(param);
-    qemu_free(buf);
+    qemu_vfree(buf);
+    for (bs_i = 0; bs_i < CONVERT_REQS; bs_i++) {
+        qemu_vfree(reqs[bs_i].buf);
+    }
     if (out_bs) {
         bdrv_delete(out_bs);
     }
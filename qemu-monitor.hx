@@ -356,6 +356,42 @@ Run the emulation in single step mode.
 If called with option off, the emulation returns to normal mode.
 ETEXI
 
+    {
+        .name       = "jit_profile",
+        .args_type  = "perfmap:-p,enable:b",
+        .params     = "[-p] on|off",
+        .help       = "start or stop sampling the dynamic compiler "
+                      "(-p: also write /tmp/perf-<pid>.map)",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_jit_profile,
+    },
+
+STEXI
+@item jit_profile [-p] on|off
+@findex jit_profile
+Start or stop the sampling profiler for translated code; see
+@code{info jit-profile}.  Starting it resets the samples.  With @code{-p},
+also write @file{/tmp/perf-<pid>.map} so that host @command{perf} can
+attribute samples in the code buffer to guest PCs.
+ETEXI
+SQMP
+jit_profile
+-----------
+
+Start or stop the sampling profiler for translated code.
+
+Arguments:
+
+- "enable": start (true) or stop (false) profiling (json-bool)
+- "perfmap": also write /tmp/perf-<pid>.map (json-bool, optional)
+
+Example:
+
+-> { "execute": "jit_profile", "arguments": { "enable": true } }
+<- { "return": {} }
+
+EQMP
+
     {
         .name       = "stop",
         .args_type  = "",
@@ -1837,6 +1873,15 @@ Each json-object contain the following:
     - "wr_operations": write operations (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "aio_pool": Statistics of the thread pool that serves the requests,
+                  only present for drivers that use one (json-object,
+                  optional), it contains:
+        - "requests": requests submitted (json-int)
+        - "stolen": requests processed by threads of other drives (json-int)
+        - "max_queue_depth": highest number of requests that were waiting
+                             for a thread (json-int)
+        - "threads": current number of threads (json-int)
+        - "idle_threads": current number of idle threads (json-int)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -1901,6 +1946,76 @@ Example:
 
 EQMP
 
+STEXI
+@item info virtio
+show virtio interrupt statistics
+ETEXI
+SQMP
+query-virtio
+------------
+
+Show interrupt coalescing settings, statistics and, for virtio-net, the
+data path of virtio devices.
+
+Return a json-array of all devices. Each device is represented by a
+json-object, which contains:
+
+- "device": device name (json-string)
+- "id": device id, if the device was given one (json-string, optional)
+- "coalesce_usecs": longest time an interrupt is held back, 0 if
+                    coalescing is disabled (json-int)
+- "coalesce_frames": number of used ring updates that force an
+                     interrupt, 0 for no limit (json-int)
+- "queues": json-array of the virtqueues, each one a json-object with:
+    - "queue": virtqueue index (json-int)
+    - "notifications": used ring updates that asked for an interrupt
+                       (json-int)
+    - "suppressed": notifications dropped because the guest disabled
+                    interrupts (json-int)
+    - "deferred": notifications held back for coalescing (json-int)
+    - "interrupts": interrupts raised (json-int)
+- "datapath": "vhost" while the in-kernel vhost-net data path serves the
+              device, "userspace" otherwise (json-string, virtio-net only)
+- "vhost-starts": times the vhost-net data path was started (json-int,
+                  virtio-net only)
+- "vhost-fallbacks": times starting it failed and the device stayed on
+                     the userspace data path (json-int, virtio-net only)
+
+Example:
+
+-> { "execute": "query-virtio" }
+<- {
+      "return":[
+         {
+            "device":"virtio-net",
+            "id":"net0",
+            "coalesce_usecs":50,
+            "coalesce_frames":32,
+            "datapath":"vhost",
+            "vhost-starts":1,
+            "vhost-fallbacks":0,
+            "queues":[
+               {
+                  "queue":0,
+                  "notifications":3117,
+                  "suppressed":0,
+                  "deferred":2949,
+                  "interrupts":412
+               },
+               {
+                  "queue":1,
+                  "notifications":1021,
+                  "suppressed":905,
+                  "deferred":0,
+                  "interrupts":116
+               }
+            ]
+         }
+      ]
+   }
+
+EQMP
+
 STEXI
 @item info registers
 show the cpu registers
@@ -2180,6 +2295,60 @@ ETEXI
 STEXI
 @item info jit
 show dynamic compiler info
+@item info jit-profile
+show dynamic compiler profile
+ETEXI
+SQMP
+query-jit-profile
+-----------------
+
+Show the samples taken by the JIT profiler (see jit_profile).
+
+Return a json-object with the following information:
+
+- "enabled": true if the profiler is running (json-bool)
+- "perf_map": true if /tmp/perf-<pid>.map is being written (json-bool)
+- "hz": sampling frequency (json-int)
+- "samples": json-object with the number of samples taken in each part
+  of the emulator:
+    - "translate": generating code (json-int)
+    - "exec": translated code (json-int)
+    - "helper": helpers called from translated code (json-int)
+    - "dispatch": looking up and entering translated code (json-int)
+    - "other": main loop, devices (json-int)
+- "tbs": json-array of the translated blocks with the most samples, each
+  one a json-object with "pc" (guest PC, json-int), "host" (address of
+  the generated code, json-int) and "samples" (json-int)
+- "pcs": json-array of the guest PCs with the most samples over all of
+  their translations, each one a json-object with "pc" and "samples"
+
+Example:
+
+-> { "execute": "query-jit-profile" }
+<- {
+      "return":{
+         "enabled":true,
+         "perf_map":false,
+         "hz":1000,
+         "samples":{
+            "translate":12,
+            "exec":2380,
+            "helper":301,
+            "dispatch":97,
+            "other":210
+         },
+         "tbs":[
+            { "pc":1049680, "host":140232458514496, "samples":811 }
+         ],
+         "pcs":[
+            { "pc":1049680, "samples":811 }
+         ]
+      }
+   }
+
+EQMP
+
+STEXI
 @item info kvm
 show KVM information
 @item info numa
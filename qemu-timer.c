@@ -48,6 +48,10 @@
 #include "hpet.h"
 #endif
 
+#ifdef CONFIG_TIMERFD
+#include <sys/timerfd.h>
+#endif
+
 #ifdef _WIN32
 #include <windows.h>
 #include <mmsystem.h>
@@ -237,9 +241,21 @@ struct QEMUTimer {
     int64_t expire_time;
     QEMUTimerCB *cb;
     void *opaque;
-    struct QEMUTimer *next;
+    uint64_t seq;    /* orders timers with the same expire_time */
+    int heap_index;  /* position in the clock's heap, 0 if not pending */
 };
 
+/* Pending timers of one clock, kept in a binary min-heap (heap[1] is the
+   earliest) so that qemu_mod_timer/qemu_del_timer are O(log n). */
+typedef struct QEMUTimerList {
+    QEMUTimer **heap;
+    int count;
+    int size;
+    /* expire time of heap[1], or INT64_MAX; this is all the alarm signal
+       handler looks at, so it never walks a heap that is being modified */
+    volatile int64_t next_expire;
+} QEMUTimerList;
+
 struct qemu_alarm_timer {
     char const *name;
     int (*start)(struct qemu_alarm_timer *t);
@@ -292,6 +308,19 @@ static void unix_stop_timer(struct qemu_alarm_timer *t);
 
 #ifdef __linux__
 
+#if defined(CONFIG_TIMERFD) && defined(CONFIG_IOTHREAD)
+struct qemu_alarm_timerfd {
+    int fd;
+    int64_t deadline;   /* get_clock() time the timerfd fires at, 0 if idle */
+};
+
+static struct qemu_alarm_timerfd alarm_timerfd_data = {-1, 0};
+
+static int timerfd_start_timer(struct qemu_alarm_timer *t);
+static void timerfd_stop_timer(struct qemu_alarm_timer *t);
+static void timerfd_rearm_timer(struct qemu_alarm_timer *t);
+#endif
+
 static int dynticks_start_timer(struct qemu_alarm_timer *t);
 static void dynticks_stop_timer(struct qemu_alarm_timer *t);
 static void dynticks_rearm_timer(struct qemu_alarm_timer *t);
@@ -317,7 +346,10 @@ static void icount_adjust(void)
     int64_t cur_time;
     int64_t cur_icount;
     int64_t delta;
+    int64_t insns;
+    int speed_shift;
     static int64_t last_delta;
+    static int64_t last_time, last_insns;
     /* If the VM is not running, then do nothing.  */
     if (!vm_running)
         return;
@@ -325,18 +357,34 @@ static void icount_adjust(void)
     cur_time = cpu_get_clock();
     cur_icount = qemu_get_clock(vm_clock);
     delta = cur_icount - cur_time;
-    /* FIXME: This is a very crude algorithm, somewhat prone to oscillation.  */
+
+    /* The shift that would have kept virtual time in step with real time
+       over the last period, given the instructions the guest actually
+       ran in it.  A step of one per adjustment takes seconds to get from
+       the initial guess to the host's real speed.  */
+    insns = (cur_icount - qemu_icount_bias) >> icount_time_shift;
+    speed_shift = icount_time_shift;
+    if (last_time && insns > last_insns) {
+        speed_shift = 0;
+        while (speed_shift < MAX_ICOUNT_SHIFT
+               && ((insns - last_insns) << speed_shift) < cur_time - last_time) {
+            speed_shift++;
+        }
+    }
+    last_time = cur_time;
+    last_insns = insns;
+
     if (delta > 0
         && last_delta + ICOUNT_WOBBLE < delta * 2
         && icount_time_shift > 0) {
         /* The guest is getting too far ahead.  Slow time down.  */
-        icount_time_shift--;
+        icount_time_shift = MIN(icount_time_shift - 1, speed_shift);
     }
     if (delta < 0
         && last_delta - ICOUNT_WOBBLE > delta * 2
         && icount_time_shift < MAX_ICOUNT_SHIFT) {
         /* The guest is getting too far behind.  Speed time up.  */
-        icount_time_shift++;
+        icount_time_shift = MAX(icount_time_shift + 1, speed_shift);
     }
     last_delta = delta;
     qemu_icount_bias = cur_icount - (qemu_icount << icount_time_shift);
@@ -364,6 +412,11 @@ int64_t qemu_icount_round(int64_t count)
 static struct qemu_alarm_timer alarm_timers[] = {
 #ifndef _WIN32
 #ifdef __linux__
+#if defined(CONFIG_TIMERFD) && defined(CONFIG_IOTHREAD)
+    /* timerfd is serviced by the io thread, no signal involved */
+    {"timerfd", timerfd_start_timer,
+     timerfd_stop_timer, timerfd_rearm_timer, &alarm_timerfd_data},
+#endif
     {"dynticks", dynticks_start_timer,
      dynticks_stop_timer, dynticks_rearm_timer, NULL},
     /* HPET - if available - is preferred */
@@ -451,7 +504,74 @@ QEMUClock *rt_clock;
 QEMUClock *vm_clock;
 QEMUClock *host_clock;
 
-static QEMUTimer *active_timers[QEMU_NUM_CLOCKS];
+static QEMUTimerList active_timers[QEMU_NUM_CLOCKS];
+static uint64_t timer_seq;
+
+static inline int timer_before(QEMUTimer *a, QEMUTimer *b)
+{
+    if (a->expire_time != b->expire_time) {
+        return a->expire_time < b->expire_time;
+    }
+    return a->seq < b->seq;
+}
+
+static inline void timer_heap_set(QEMUTimerList *list, int i, QEMUTimer *ts)
+{
+    list->heap[i] = ts;
+    ts->heap_index = i;
+}
+
+static void timer_heap_up(QEMUTimerList *list, int i)
+{
+    QEMUTimer *ts = list->heap[i];
+
+    while (i > 1 && timer_before(ts, list->heap[i / 2])) {
+        timer_heap_set(list, i, list->heap[i / 2]);
+        i /= 2;
+    }
+    timer_heap_set(list, i, ts);
+}
+
+static void timer_heap_down(QEMUTimerList *list, int i)
+{
+    QEMUTimer *ts = list->heap[i];
+    int child;
+
+    while ((child = 2 * i) <= list->count) {
+        if (child < list->count &&
+            timer_before(list->heap[child + 1], list->heap[child])) {
+            child++;
+        }
+        if (!timer_before(list->heap[child], ts)) {
+            break;
+        }
+        timer_heap_set(list, i, list->heap[child]);
+        i = child;
+    }
+    timer_heap_set(list, i, ts);
+}
+
+static inline QEMUTimer *timer_list_first(QEMUTimerList *list)
+{
+    return list->count ? list->heap[1] : NULL;
+}
+
+static inline void timer_list_update(QEMUTimerList *list)
+{
+    list->next_expire = list->count ? list->heap[1]->expire_time : INT64_MAX;
+}
+
+static inline int timer_list_expired(QEMUTimerList *list, int64_t current_time)
+{
+    return list->next_expire <= current_time;
+}
+
+static int qemu_timers_active(void)
+{
+    return active_timers[QEMU_CLOCK_REALTIME].count ||
+           active_timers[QEMU_CLOCK_VIRTUAL].count ||
+           active_timers[QEMU_CLOCK_HOST].count;
+}
 
 static QEMUClock *qemu_new_clock(int type)
 {
@@ -459,6 +579,7 @@ static QEMUClock *qemu_new_clock(int type)
     clock = qemu_mallocz(sizeof(QEMUClock));
     clock->type = type;
     clock->enabled = 1;
+    active_timers[type].next_expire = INT64_MAX;
     return clock;
 }
 
@@ -480,55 +601,58 @@ QEMUTimer *qemu_new_timer(QEMUClock *clock, QEMUTimerCB *cb, void *opaque)
 
 void qemu_free_timer(QEMUTimer *ts)
 {
+    qemu_del_timer(ts);
     qemu_free(ts);
 }
 
 /* stop a timer, but do not dealloc it */
 void qemu_del_timer(QEMUTimer *ts)
 {
-    QEMUTimer **pt, *t;
+    QEMUTimerList *list = &active_timers[ts->clock->type];
+    QEMUTimer *last;
+    int i = ts->heap_index;
 
-    /* NOTE: this code must be signal safe because
-       qemu_timer_expired() can be called from a signal. */
-    pt = &active_timers[ts->clock->type];
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t == ts) {
-            *pt = t->next;
-            break;
-        }
-        pt = &t->next;
+    if (!i) {
+        return;
+    }
+    ts->heap_index = 0;
+    last = list->heap[list->count--];
+    if (last != ts) {
+        /* move the last entry into the hole; it may need to go either way */
+        timer_heap_set(list, i, last);
+        timer_heap_up(list, i);
+        timer_heap_down(list, last->heap_index);
     }
+    /* NOTE: the alarm signal handler only reads next_expire */
+    timer_list_update(list);
 }
 
 /* modify the current timer so that it will be fired when current_time
    >= expire_time. The corresponding callback will be called. */
 void qemu_mod_timer(QEMUTimer *ts, int64_t expire_time)
 {
-    QEMUTimer **pt, *t;
+    QEMUTimerList *list = &active_timers[ts->clock->type];
 
-    qemu_del_timer(ts);
-
-    /* add the timer in the sorted list */
-    /* NOTE: this code must be signal safe because
-       qemu_timer_expired() can be called from a signal. */
-    pt = &active_timers[ts->clock->type];
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t->expire_time > expire_time)
-            break;
-        pt = &t->next;
-    }
     ts->expire_time = expire_time;
-    ts->next = *pt;
-    *pt = ts;
+    /* timers due at the same time fire in the order they were set */
+    ts->seq = timer_seq++;
+    if (ts->heap_index) {
+        timer_heap_up(list, ts->heap_index);
+        timer_heap_down(list, ts->heap_index);
+    } else {
+        if (list->count + 1 >= list->size) {
+            list->size = list->size ? list->size * 2 : 16;
+            list->heap = qemu_realloc(list->heap,
+                                      list->size * sizeof(QEMUTimer *));
+        }
+        list->count++;
+        timer_heap_set(list, list->count, ts);
+        timer_heap_up(list, list->count);
+    }
+    timer_list_update(list);
 
     /* Rearm if necessary  */
-    if (pt == &active_timers[ts->clock->type]) {
+    if (ts->heap_index == 1) {
         if (!alarm_timer->pending) {
             qemu_rearm_alarm_timer(alarm_timer);
         }
@@ -540,12 +664,7 @@ void qemu_mod_timer(QEMUTimer *ts, int64_t expire_time)
 
 int qemu_timer_pending(QEMUTimer *ts)
 {
-    QEMUTimer *t;
-    for(t = active_timers[ts->clock->type]; t != NULL; t = t->next) {
-        if (t == ts)
-            return 1;
-    }
-    return 0;
+    return ts->heap_index != 0;
 }
 
 int qemu_timer_expired(QEMUTimer *timer_head, int64_t current_time)
@@ -557,21 +676,21 @@ int qemu_timer_expired(QEMUTimer *timer_head, int64_t current_time)
 
 static void qemu_run_timers(QEMUClock *clock)
 {
-    QEMUTimer **ptimer_head, *ts;
+    QEMUTimerList *list = &active_timers[clock->type];
+    QEMUTimer *ts;
     int64_t current_time;
-   
+
     if (!clock->enabled)
         return;
 
+    /* every timer that is due by now is run in this one pass */
     current_time = qemu_get_clock (clock);
-    ptimer_head = &active_timers[clock->type];
     for(;;) {
-        ts = *ptimer_head;
+        ts = timer_list_first(list);
         if (!ts || ts->expire_time > current_time)
             break;
-        /* remove timer from the list before calling the callback */
-        *ptimer_head = ts->next;
-        ts->next = NULL;
+        /* remove timer from the heap before calling the callback */
+        qemu_del_timer(ts);
 
         /* run the callback (the timer list can be modified) */
         ts->cb(ts->opaque);
@@ -753,11 +872,11 @@ static void host_alarm_handler(int host_signum)
 #endif
     if (alarm_has_dynticks(t) ||
         (!use_icount &&
-            qemu_timer_expired(active_timers[QEMU_CLOCK_VIRTUAL],
+            timer_list_expired(&active_timers[QEMU_CLOCK_VIRTUAL],
                                qemu_get_clock(vm_clock))) ||
-        qemu_timer_expired(active_timers[QEMU_CLOCK_REALTIME],
+        timer_list_expired(&active_timers[QEMU_CLOCK_REALTIME],
                            qemu_get_clock(rt_clock)) ||
-        qemu_timer_expired(active_timers[QEMU_CLOCK_HOST],
+        timer_list_expired(&active_timers[QEMU_CLOCK_HOST],
                            qemu_get_clock(host_clock))) {
 
         t->expired = alarm_has_dynticks(t);
@@ -770,14 +889,15 @@ int64_t qemu_next_deadline(void)
 {
     /* To avoid problems with overflow limit this to 2^32.  */
     int64_t delta = INT32_MAX;
+    QEMUTimer *ts;
 
-    if (active_timers[QEMU_CLOCK_VIRTUAL]) {
-        delta = active_timers[QEMU_CLOCK_VIRTUAL]->expire_time -
-                     qemu_get_clock(vm_clock);
+    ts = timer_list_first(&active_timers[QEMU_CLOCK_VIRTUAL]);
+    if (ts) {
+        delta = ts->expire_time - qemu_get_clock(vm_clock);
     }
-    if (active_timers[QEMU_CLOCK_HOST]) {
-        int64_t hdelta = active_timers[QEMU_CLOCK_HOST]->expire_time -
-                 qemu_get_clock(host_clock);
+    ts = timer_list_first(&active_timers[QEMU_CLOCK_HOST]);
+    if (ts) {
+        int64_t hdelta = ts->expire_time - qemu_get_clock(host_clock);
         if (hdelta < delta)
             delta = hdelta;
     }
@@ -798,15 +918,16 @@ static uint64_t qemu_next_deadline_dyntick(void)
 {
     int64_t delta;
     int64_t rtdelta;
+    QEMUTimer *ts;
 
     if (use_icount)
         delta = INT32_MAX;
     else
         delta = (qemu_next_deadline() + 999) / 1000;
 
-    if (active_timers[QEMU_CLOCK_REALTIME]) {
-        rtdelta = (active_timers[QEMU_CLOCK_REALTIME]->expire_time -
-                 qemu_get_clock(rt_clock))*1000;
+    ts = timer_list_first(&active_timers[QEMU_CLOCK_REALTIME]);
+    if (ts) {
+        rtdelta = (ts->expire_time - qemu_get_clock(rt_clock))*1000;
         if (rtdelta < delta)
             delta = rtdelta;
     }
@@ -966,9 +1087,7 @@ static void dynticks_rearm_timer(struct qemu_alarm_timer *t)
     int64_t current_us;
 
     assert(alarm_has_dynticks(t));
-    if (!active_timers[QEMU_CLOCK_REALTIME] &&
-        !active_timers[QEMU_CLOCK_VIRTUAL] &&
-        !active_timers[QEMU_CLOCK_HOST])
+    if (!qemu_timers_active())
         return;
 
     nearest_delta_us = qemu_next_deadline_dyntick();
@@ -994,6 +1113,84 @@ static void dynticks_rearm_timer(struct qemu_alarm_timer *t)
     }
 }
 
+#if defined(CONFIG_TIMERFD) && defined(CONFIG_IOTHREAD)
+
+/* An armed expiry at most this much later than a new deadline is kept,
+   so that timers falling due close together share a single wakeup. */
+#define TIMERFD_SLACK_NS (MIN_TIMER_REARM_US * 1000)
+
+static void timerfd_alarm_handler(void *opaque)
+{
+    struct qemu_alarm_timer *t = opaque;
+    struct qemu_alarm_timerfd *data = t->priv;
+    uint64_t expirations;
+    ssize_t len;
+
+    do {
+        len = read(data->fd, &expirations, sizeof(expirations));
+    } while (len < 0 && errno == EINTR);
+
+    /* qemu_run_all_timers() runs right after the fd handlers */
+    data->deadline = 0;
+    t->expired = 1;
+    t->pending = 1;
+}
+
+static int timerfd_start_timer(struct qemu_alarm_timer *t)
+{
+    struct qemu_alarm_timerfd *data = t->priv;
+    int fd;
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    data->fd = fd;
+    data->deadline = 0;
+    qemu_set_fd_handler(fd, timerfd_alarm_handler, NULL, t);
+
+    return 0;
+}
+
+static void timerfd_stop_timer(struct qemu_alarm_timer *t)
+{
+    struct qemu_alarm_timerfd *data = t->priv;
+
+    qemu_set_fd_handler(data->fd, NULL, NULL, NULL);
+    close(data->fd);
+    data->fd = -1;
+}
+
+static void timerfd_rearm_timer(struct qemu_alarm_timer *t)
+{
+    struct qemu_alarm_timerfd *data = t->priv;
+    struct itimerspec timeout;
+    int64_t delta_ns, now;
+
+    assert(alarm_has_dynticks(t));
+    if (!qemu_timers_active())
+        return;
+
+    delta_ns = qemu_next_deadline_dyntick() * 1000;
+    now = get_clock();
+    if (data->deadline && data->deadline <= now + delta_ns + TIMERFD_SLACK_NS)
+        return;
+
+    timeout.it_interval.tv_sec = 0;
+    timeout.it_interval.tv_nsec = 0; /* 0 for one-shot timer */
+    timeout.it_value.tv_sec = delta_ns / 1000000000;
+    timeout.it_value.tv_nsec = delta_ns % 1000000000;
+    if (timerfd_settime(data->fd, 0 /* RELATIVE */, &timeout, NULL)) {
+        perror("timerfd_settime");
+        fprintf(stderr, "Internal timer error: aborting\n");
+        exit(1);
+    }
+    data->deadline = now + delta_ns;
+}
+
+#endif /* CONFIG_TIMERFD && CONFIG_IOTHREAD */
+
 #endif /* defined(__linux__) */
 
 static int unix_start_timer(struct qemu_alarm_timer *t)
@@ -1082,9 +1279,7 @@ static void win32_rearm_timer(struct qemu_alarm_timer *t)
     struct qemu_alarm_win32 *data = t->priv;
 
     assert(alarm_has_dynticks(t));
-    if (!active_timers[QEMU_CLOCK_REALTIME] &&
-        !active_timers[QEMU_CLOCK_VIRTUAL] &&
-        !active_timers[QEMU_CLOCK_HOST])
+    if (!qemu_timers_active())
         return;
 
     timeKillEvent(data->timerId);
@@ -208,13 +208,13 @@ struct Slirp {
 
     /* tcp states */
     struct socket tcb;
-    struct socket *tcp_last_so;
+    struct socket *tcp_cache[SO_HASH_SIZE];
     tcp_seq tcp_iss;        /* tcp initial send seq # */
     uint32_t tcp_now;       /* for RFC 1323 timestamps */
 
     /* udp states */
     struct socket udb;
-    struct socket *udp_last_so;
+    struct socket *udp_cache[SO_HASH_SIZE];
 
     /* tftp states */
     char *tftp_prefix;
@@ -15,11 +15,38 @@
 static void sofcantrcvmore(struct socket *so);
 static void sofcantsendmore(struct socket *so);
 
+/*
+ * Remember so in its slot of a lookup cache; a socket is in at most
+ * one slot, so that sofree() can clobber it
+ */
+void
+so_cache_set(struct socket **slot, struct socket *so)
+{
+	if (so->so_cache && *so->so_cache == so)
+		*so->so_cache = NULL;
+	if (*slot)
+		(*slot)->so_cache = NULL;
+	*slot = so;
+	so->so_cache = slot;
+}
+
+/*
+ * Find the socket for a connection.  cache is a table of SO_HASH_SIZE
+ * recently found sockets indexed by so_hash(), checked before the list,
+ * so that the lookup stays cheap with many connections open.
+ */
 struct socket *
-solookup(struct socket *head, struct in_addr laddr, u_int lport,
-         struct in_addr faddr, u_int fport)
+solookup(struct socket **cache, struct socket *head, struct in_addr laddr,
+         u_int lport, struct in_addr faddr, u_int fport)
 {
-	struct socket *so;
+	struct socket **slot = &cache[so_hash(laddr, lport, faddr, fport)];
+	struct socket *so = *slot;
+
+	if (so && so->so_lport == lport &&
+	    so->so_laddr.s_addr == laddr.s_addr &&
+	    so->so_faddr.s_addr == faddr.s_addr &&
+	    so->so_fport == fport)
+		return so;
 
 	for (so = head->so_next; so != head; so = so->so_next) {
 		if (so->so_lport == lport &&
@@ -31,6 +58,7 @@ solookup(struct socket *head, struct in_addr laddr, u_int lport,
 
 	if (so == head)
 	   return (struct socket *)NULL;
+	so_cache_set(slot, so);
 	return so;
 
 }
@@ -61,16 +89,12 @@ socreate(Slirp *slirp)
 void
 sofree(struct socket *so)
 {
-  Slirp *slirp = so->slirp;
-
   if (so->so_emu==EMU_RSH && so->extra) {
 	sofree(so->extra);
 	so->extra=NULL;
   }
-  if (so == slirp->tcp_last_so) {
-      slirp->tcp_last_so = &slirp->tcb;
-  } else if (so == slirp->udp_last_so) {
-      slirp->udp_last_so = &slirp->udb;
+  if (so->so_cache && *so->so_cache == so) {
+      *so->so_cache = NULL;
   }
   m_free(so->so_m);
 
@@ -11,6 +11,9 @@
 #define SO_EXPIRE 240000
 #define SO_EXPIREFAST 10000
 
+/* Size of the socket lookup caches, a power of two */
+#define SO_HASH_SIZE 1024
+
 /*
  * Our socket structure
  */
@@ -51,6 +54,8 @@ struct socket {
   struct sbuf so_rcv;		/* Receive buffer */
   struct sbuf so_snd;		/* Send buffer */
   void * extra;			/* Extra pointer */
+
+  struct socket **so_cache;	/* Lookup cache slot pointing to us, if any */
 };
 
 
@@ -74,7 +79,18 @@ struct socket {
 #define SS_HOSTFWD		0x1000	/* Socket describes host->guest forwarding */
 #define SS_INCOMING		0x2000	/* Connection was initiated by a host on the internet */
 
-struct socket * solookup(struct socket *, struct in_addr, u_int, struct in_addr, u_int);
+static inline unsigned int so_hash(struct in_addr laddr, u_int lport,
+                                   struct in_addr faddr, u_int fport)
+{
+  uint32_t h = laddr.s_addr ^ faddr.s_addr ^ (lport << 16) ^ fport;
+
+  h ^= h >> 16;
+  h ^= h >> 8;
+  return h & (SO_HASH_SIZE - 1);
+}
+
+void so_cache_set(struct socket **cache, struct socket *so);
+struct socket * solookup(struct socket **, struct socket *, struct in_addr, u_int, struct in_addr, u_int);
 struct socket * socreate(Slirp *);
 void sofree(struct socket *);
 int soread(struct socket *);
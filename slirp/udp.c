@@ -47,7 +47,6 @@ void
 udp_init(Slirp *slirp)
 {
     slirp->udb.so_next = slirp->udb.so_prev = &slirp->udb;
-    slirp->udp_last_so = &slirp->udb;
 }
 /* m->m_data  points at ip packet header
  * m->m_len   length ip packet
@@ -61,7 +60,8 @@ udp_input(register struct mbuf *m, int iphlen)
 	register struct udphdr *uh;
 	int len;
 	struct ip save_ip;
-	struct socket *so;
+	struct socket *so, **slot;
+	struct in_addr any_addr = { INADDR_ANY };
 
 	DEBUG_CALL("udp_input");
 	DEBUG_ARG("m = %lx", (long)m);
@@ -140,8 +140,11 @@ udp_input(register struct mbuf *m, int iphlen)
 	/*
 	 * Locate pcb for datagram.
 	 */
-	so = slirp->udp_last_so;
-	if (so->so_lport != uh->uh_sport ||
+	/* UDP sockets are identified by the guest's end alone */
+	slot = &slirp->udp_cache[so_hash(ip->ip_src, uh->uh_sport,
+	                                 any_addr, 0)];
+	so = *slot;
+	if (!so || so->so_lport != uh->uh_sport ||
 	    so->so_laddr.s_addr != ip->ip_src.s_addr) {
 		struct socket *tmp;
 
@@ -156,7 +159,7 @@ udp_input(register struct mbuf *m, int iphlen)
 		if (tmp == &slirp->udb) {
 		  so = NULL;
 		} else {
-		  slirp->udp_last_so = so;
+		  so_cache_set(slot, so);
 		}
 	}
 
@@ -912,8 +912,41 @@ static inline void gen_setcc_slow_T0(DisasContext *s, int jcc_op)
     }
 }
 
+/* a condition as a comparison: 'reg cond reg2' if use_reg2 is set,
+   'reg cond imm' otherwise */
+typedef struct CCPrepare {
+    TCGCond cond;
+    TCGv reg;
+    TCGv reg2;
+    target_ulong imm;
+    int use_reg2;
+} CCPrepare;
+
+static inline CCPrepare cc_prepare_imm(TCGCond cond, TCGv reg,
+                                       target_ulong imm)
+{
+    CCPrepare cc;
+    cc.cond = cond;
+    cc.reg = reg;
+    cc.reg2 = reg;
+    cc.imm = imm;
+    cc.use_reg2 = 0;
+    return cc;
+}
+
+static inline CCPrepare cc_prepare_reg(TCGCond cond, TCGv reg, TCGv reg2)
+{
+    CCPrepare cc;
+    cc.cond = cond;
+    cc.reg = reg;
+    cc.reg2 = reg2;
+    cc.imm = 0;
+    cc.use_reg2 = 1;
+    return cc;
+}
+
 /* return true if setcc_slow is not needed (WARNING: must be kept in
-   sync with gen_jcc1) */
+   sync with gen_prepare_cc) */
 static int is_fast_jcc_case(DisasContext *s, int b)
 {
     int jcc_op;
@@ -963,12 +996,13 @@ static int is_fast_jcc_case(DisasContext *s, int b)
     return 1;
 }
 
-/* generate a conditional jump to label 'l1' according to jump opcode
-   value 'b'. In the fast case, T0 is guaranted not to be used. */
-static inline void gen_jcc1(DisasContext *s, int cc_op, int b, int l1)
+/* compute the comparison equivalent to jump opcode value 'b'. In the
+   fast case, T0 is guaranted not to be used. */
+static CCPrepare gen_prepare_cc(DisasContext *s, int cc_op, int b)
 {
     int inv, jcc_op, size, cond;
     TCGv t0;
+    CCPrepare cc;
 
     inv = b & 1;
     jcc_op = (b >> 1) & 7;
@@ -1003,31 +1037,31 @@ static inline void gen_jcc1(DisasContext *s, int cc_op, int b, int l1)
                 t0 = cpu_cc_dst;
                 break;
             }
-            tcg_gen_brcondi_tl(inv ? TCG_COND_NE : TCG_COND_EQ, t0, 0, l1);
+            cc = cc_prepare_imm(inv ? TCG_COND_NE : TCG_COND_EQ, t0, 0);
             break;
         case JCC_S:
         fast_jcc_s:
             switch(size) {
             case 0:
                 tcg_gen_andi_tl(cpu_tmp0, cpu_cc_dst, 0x80);
-                tcg_gen_brcondi_tl(inv ? TCG_COND_EQ : TCG_COND_NE, cpu_tmp0, 
-                                   0, l1);
+                cc = cc_prepare_imm(inv ? TCG_COND_EQ : TCG_COND_NE,
+                                    cpu_tmp0, 0);
                 break;
             case 1:
                 tcg_gen_andi_tl(cpu_tmp0, cpu_cc_dst, 0x8000);
-                tcg_gen_brcondi_tl(inv ? TCG_COND_EQ : TCG_COND_NE, cpu_tmp0, 
-                                   0, l1);
+                cc = cc_prepare_imm(inv ? TCG_COND_EQ : TCG_COND_NE,
+                                    cpu_tmp0, 0);
                 break;
 #ifdef TARGET_X86_64
             case 2:
                 tcg_gen_andi_tl(cpu_tmp0, cpu_cc_dst, 0x80000000);
-                tcg_gen_brcondi_tl(inv ? TCG_COND_EQ : TCG_COND_NE, cpu_tmp0, 
-                                   0, l1);
+                cc = cc_prepare_imm(inv ? TCG_COND_EQ : TCG_COND_NE,
+                                    cpu_tmp0, 0);
                 break;
 #endif
             default:
-                tcg_gen_brcondi_tl(inv ? TCG_COND_GE : TCG_COND_LT, cpu_cc_dst, 
-                                   0, l1);
+                cc = cc_prepare_imm(inv ? TCG_COND_GE : TCG_COND_LT,
+                                    cpu_cc_dst, 0);
                 break;
             }
             break;
@@ -1061,7 +1095,7 @@ static inline void gen_jcc1(DisasContext *s, int cc_op, int b, int l1)
                 t0 = cpu_cc_src;
                 break;
             }
-            tcg_gen_brcond_tl(cond, cpu_tmp4, t0, l1);
+            cc = cc_prepare_reg(cond, cpu_tmp4, t0);
             break;
             
         case JCC_L:
@@ -1093,7 +1127,7 @@ static inline void gen_jcc1(DisasContext *s, int cc_op, int b, int l1)
                 t0 = cpu_cc_src;
                 break;
             }
-            tcg_gen_brcond_tl(cond, cpu_tmp4, t0, l1);
+            cc = cc_prepare_reg(cond, cpu_tmp4, t0);
             break;
             
         default:
@@ -1155,10 +1189,23 @@ static inline void gen_jcc1(DisasContext *s, int cc_op, int b, int l1)
     default:
     slow_jcc:
         gen_setcc_slow_T0(s, jcc_op);
-        tcg_gen_brcondi_tl(inv ? TCG_COND_EQ : TCG_COND_NE, 
-                           cpu_T[0], 0, l1);
+        cc = cc_prepare_imm(inv ? TCG_COND_EQ : TCG_COND_NE, cpu_T[0], 0);
         break;
     }
+    return cc;
+}
+
+/* generate a conditional jump to label 'l1' according to jump opcode
+   value 'b'. In the fast case, T0 is guaranted not to be used. */
+static inline void gen_jcc1(DisasContext *s, int cc_op, int b, int l1)
+{
+    CCPrepare cc = gen_prepare_cc(s, cc_op, b);
+
+    if (cc.use_reg2) {
+        tcg_gen_brcond_tl(cc.cond, cc.reg, cc.reg2, l1);
+    } else {
+        tcg_gen_brcondi_tl(cc.cond, cc.reg, cc.imm, l1);
+    }
 }
 
 /* XXX: does not work with gdbstub "ice" single step - not a
@@ -2361,20 +2408,17 @@ static inline void gen_jcc(DisasContext *s, int b,
 
 static void gen_setcc(DisasContext *s, int b)
 {
-    int inv, jcc_op, l1;
-    TCGv t0;
+    int inv, jcc_op;
+    CCPrepare cc;
 
     if (is_fast_jcc_case(s, b)) {
-        /* nominal case: we use a jump */
-        /* XXX: make it faster by adding new instructions in TCG */
-        t0 = tcg_temp_local_new();
-        tcg_gen_movi_tl(t0, 0);
-        l1 = gen_new_label();
-        gen_jcc1(s, s->cc_op, b ^ 1, l1);
-        tcg_gen_movi_tl(t0, 1);
-        gen_set_label(l1);
-        tcg_gen_mov_tl(cpu_T[0], t0);
-        tcg_temp_free(t0);
+        /* nominal case: the condition is a simple comparison */
+        cc = gen_prepare_cc(s, s->cc_op, b);
+        if (cc.use_reg2) {
+            tcg_gen_setcond_tl(cc.cond, cpu_T[0], cc.reg, cc.reg2);
+        } else {
+            tcg_gen_setcondi_tl(cc.cond, cpu_T[0], cc.reg, cc.imm);
+        }
     } else {
         /* slow case: it is more efficient not to generate a jump,
            although it is questionnable whether this optimization is
@@ -6390,14 +6434,14 @@ static target_ulong disas_insn(CPUState *env, DisasContext *s, target_ulong pc_s
         break;
     case 0x140 ... 0x14f: /* cmov Gv, Ev */
         {
-            int l1;
-            TCGv t0;
+            CCPrepare cc;
+            TCGv t0, t1;
 
             ot = dflag + OT_WORD;
             modrm = ldub_code(s->pc++);
             reg = ((modrm >> 3) & 7) | rex_r;
             mod = (modrm >> 6) & 3;
-            t0 = tcg_temp_local_new();
+            t0 = tcg_temp_new();
             if (mod != 3) {
                 gen_lea_modrm(s, modrm, &reg_addr, &offset_addr);
                 gen_op_ld_v(ot + s->mem_index, t0, cpu_A0);
@@ -6405,22 +6449,20 @@ static target_ulong disas_insn(CPUState *env, DisasContext *s, target_ulong pc_s
                 rm = (modrm & 7) | REX_B(s);
                 gen_op_mov_v_reg(ot, t0, rm);
             }
-#ifdef TARGET_X86_64
-            if (ot == OT_LONG) {
-                /* XXX: specific Intel behaviour ? */
-                l1 = gen_new_label();
-                gen_jcc1(s, s->cc_op, b ^ 1, l1);
-                tcg_gen_mov_tl(cpu_regs[reg], t0);
-                gen_set_label(l1);
-                tcg_gen_ext32u_tl(cpu_regs[reg], cpu_regs[reg]);
-            } else
-#endif
-            {
-                l1 = gen_new_label();
-                gen_jcc1(s, s->cc_op, b ^ 1, l1);
-                gen_op_mov_reg_v(ot, reg, t0);
-                gen_set_label(l1);
+            /* select without a branch: the register is written in any
+               case, so a 32-bit cmov always zero extends it on x86_64
+               (XXX: specific Intel behaviour ?) */
+            cc = gen_prepare_cc(s, s->cc_op, b);
+            if (cc.use_reg2) {
+                tcg_gen_movcond_tl(cc.cond, t0, cc.reg, cc.reg2,
+                                   t0, cpu_regs[reg]);
+            } else {
+                t1 = tcg_const_tl(cc.imm);
+                tcg_gen_movcond_tl(cc.cond, t0, cc.reg, t1,
+                                   t0, cpu_regs[reg]);
+                tcg_temp_free(t1);
             }
+            gen_op_mov_reg_v(ot, reg, t0);
             tcg_temp_free(t0);
         }
         break;
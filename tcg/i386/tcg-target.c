@@ -22,6 +22,11 @@
  * THE SOFTWARE.
  */
 
+#include <cpuid.h>
+#ifndef bit_BMI2
+#define bit_BMI2 (1 << 8)
+#endif
+
 uint8_t *optimization_ret_addr;
 
 #ifndef NDEBUG
@@ -85,6 +90,16 @@ static const int tcg_target_call_oarg_regs[2] = {
 
 static uint8_t *tb_ret_addr;
 
+/* Optional host instructions, detected by tcg_target_init().  CMOV is
+   part of the x86_64 base architecture.  */
+#if TCG_TARGET_REG_BITS == 64
+# define have_cmov 1
+#else
+static int have_cmov;
+#endif
+static int have_movbe;
+static int have_bmi2;
+
 static void patch_reloc(uint8_t *code_ptr, int type,
                         tcg_target_long value, tcg_target_long addend)
 {
@@ -148,6 +163,16 @@ static int target_parse_constraint(TCGArgConstraint *ct, const char **pct_str)
         ct->ct |= TCG_CT_REG;
         tcg_regset_set_reg(ct->u.regs, TCG_REG_ECX);
         break;
+    case 'C':
+        /* shift count: %ecx, or any register for the BMI2 shifts */
+        ct->ct |= TCG_CT_REG;
+        if (have_bmi2) {
+            tcg_regset_set32(ct->u.regs, 0,
+                             TCG_TARGET_REG_BITS == 64 ? 0xffff : 0xff);
+        } else {
+            tcg_regset_set_reg(ct->u.regs, TCG_REG_ECX);
+        }
+        break;
     case 'd':
         ct->ct |= TCG_CT_REG;
         tcg_regset_set_reg(ct->u.regs, TCG_REG_EDX);
@@ -231,6 +256,9 @@ static inline int tcg_target_const_match(tcg_target_long val,
 
 #define P_EXT		0x100		/* 0x0f opcode prefix */
 #define P_DATA16	0x200		/* 0x66 opcode prefix */
+#define P_EXT38		0x4000		/* 0x0f 0x38 opcode prefix */
+#define P_SIMDF3	0x8000		/* 0xf3 prefix, VEX encoding only */
+#define P_SIMDF2	0x10000		/* 0xf2 prefix, VEX encoding only */
 #if TCG_TARGET_REG_BITS == 64
 # define P_ADDR32	0x400		/* 0x67 opcode prefix */
 # define P_REXW		0x800		/* Set REX.W = 1 */
@@ -249,6 +277,7 @@ static inline int tcg_target_const_match(tcg_target_long val,
 #define OPC_ADD_GvEv	(OPC_ARITH_GvEv | (ARITH_ADD << 3))
 #define OPC_BSWAP	(0xc8 | P_EXT)
 #define OPC_CALL_Jz	(0xe8)
+#define OPC_CMOVCC      (0x40 | P_EXT)	/* ... plus condition code */
 #define OPC_CMP_GvEv	(OPC_ARITH_GvEv | (ARITH_CMP << 3))
 #define OPC_DEC_r32	(0x48)
 #define OPC_IMUL_GvEv	(0xaf | P_EXT)
@@ -265,6 +294,8 @@ static inline int tcg_target_const_match(tcg_target_long val,
 #define OPC_MOVL_GvEv	(0x8b)		/* loads, more or less */
 #define OPC_MOVL_EvIz	(0xc7)
 #define OPC_MOVL_Iv     (0xb8)
+#define OPC_MOVBE_GyMy  (0xf0 | P_EXT38)
+#define OPC_MOVBE_MyGy  (0xf1 | P_EXT38)
 #define OPC_MOVSBL	(0xbe | P_EXT)
 #define OPC_MOVSWL	(0xbf | P_EXT)
 #define OPC_MOVSLQ	(0x63 | P_REXW)
@@ -279,6 +310,9 @@ static inline int tcg_target_const_match(tcg_target_long val,
 #define OPC_SHIFT_1	(0xd1)
 #define OPC_SHIFT_Ib	(0xc1)
 #define OPC_SHIFT_cl	(0xd3)
+#define OPC_SARX        (0xf7 | P_EXT38 | P_SIMDF3)
+#define OPC_SHLX        (0xf7 | P_EXT38 | P_DATA16)
+#define OPC_SHRX        (0xf7 | P_EXT38 | P_SIMDF2)
 #define OPC_TESTL	(0x85)
 #define OPC_XCHG_ax_r32	(0x90)
 
@@ -381,8 +415,11 @@ static void tcg_out_opc(TCGContext *s, int opc, int r, int rm, int x)
         tcg_out8(s, (uint8_t)(rex | 0x40));
     }
 
-    if (opc & P_EXT) {
+    if (opc & (P_EXT | P_EXT38)) {
         tcg_out8(s, 0x0f);
+        if (opc & P_EXT38) {
+            tcg_out8(s, 0x38);
+        }
     }
     tcg_out8(s, opc);
 }
@@ -392,8 +429,11 @@ static void tcg_out_opc(TCGContext *s, int opc)
     if (opc & P_DATA16) {
         tcg_out8(s, 0x66);
     }
-    if (opc & P_EXT) {
+    if (opc & (P_EXT | P_EXT38)) {
         tcg_out8(s, 0x0f);
+        if (opc & P_EXT38) {
+            tcg_out8(s, 0x38);
+        }
     }
     tcg_out8(s, opc);
 }
@@ -409,6 +449,31 @@ static void tcg_out_modrm(TCGContext *s, int opc, int r, int rm)
     tcg_out8(s, 0xc0 | (LOWREGMASK(r) << 3) | LOWREGMASK(rm));
 }
 
+/* Output a 3-byte VEX encoded instruction from the 0x0f 0x38 map, with
+   the extra register operand V.  Only used for the BMI instructions,
+   which take their operands in general purpose registers.  */
+static void tcg_out_vex_modrm(TCGContext *s, int opc, int r, int v, int rm)
+{
+    int tmp;
+
+    /* VEX.R, VEX.X and VEX.B are stored inverted; map 2 is 0x0f 0x38.  */
+    tmp = (r & 8 ? 0 : 0x80) | 0x40 | (rm & 8 ? 0 : 0x20) | 2;
+    tcg_out8(s, 0xc4);
+    tcg_out8(s, tmp);
+
+    tmp = (opc & P_REXW ? 0x80 : 0) | ((~v & 15) << 3);
+    if (opc & P_DATA16) {
+        tmp |= 1;
+    } else if (opc & P_SIMDF3) {
+        tmp |= 2;
+    } else if (opc & P_SIMDF2) {
+        tmp |= 3;
+    }
+    tcg_out8(s, tmp);
+    tcg_out8(s, opc);
+    tcg_out8(s, 0xc0 | (LOWREGMASK(r) << 3) | LOWREGMASK(rm));
+}
+
 /* Output an opcode with a full "rm + (index<<shift) + offset" address mode.
    We handle either RM and INDEX missing with a negative value.  In 64-bit
    mode for absolute addresses, ~RM is the size of the immediate operand
@@ -882,7 +947,40 @@ static void tcg_out_setcond32(TCGContext *s, TCGCond cond, TCGArg dest,
     tcg_out_ext8u(s, dest, dest);
 }
 
+/* dest = cond ? v1 : dest, using the flags set by a previous compare */
+static void tcg_out_cmov(TCGContext *s, TCGCond cond, int rexw,
+                         TCGArg dest, TCGArg v1)
+{
+    if (dest == v1) {
+        return;
+    }
+    if (have_cmov) {
+        tcg_out_modrm(s, OPC_CMOVCC | tcg_cond_to_jcc[cond] | rexw, dest, v1);
+    } else {
+        /* Only on 32-bit hosts: jump over the 2-byte move if false.  */
+        tcg_out8(s, OPC_JCC_short + (tcg_cond_to_jcc[cond] ^ 1));
+        tcg_out8(s, 2);
+        tcg_out_mov(s, TCG_TYPE_I32, dest, v1);
+    }
+}
+
+static void tcg_out_movcond32(TCGContext *s, TCGCond cond, TCGArg dest,
+                              TCGArg c1, TCGArg c2, int const_c2,
+                              TCGArg v1)
+{
+    tcg_out_cmp(s, c1, c2, const_c2, 0);
+    tcg_out_cmov(s, cond, 0, dest, v1);
+}
+
 #if TCG_TARGET_REG_BITS == 64
+static void tcg_out_movcond64(TCGContext *s, TCGCond cond, TCGArg dest,
+                              TCGArg c1, TCGArg c2, int const_c2,
+                              TCGArg v1)
+{
+    tcg_out_cmp(s, c1, c2, const_c2, P_REXW);
+    tcg_out_cmov(s, cond, P_REXW, dest, v1);
+}
+
 static void tcg_out_setcond64(TCGContext *s, TCGCond cond, TCGArg dest,
                               TCGArg arg1, TCGArg arg2, int const_arg2)
 {
@@ -1079,7 +1177,12 @@ static void tcg_out_qemu_ld_direct(TCGContext *s, int datalo, int datahi,
         }
         break;
     case 1 | 4:
-        if (bswap) {
+        if (bswap && have_movbe) {
+            /* movbe only writes the low 16 bits */
+            tcg_out_modrm_offset(s, OPC_MOVBE_GyMy + P_DATA16,
+                                 datalo, base, ofs);
+            tcg_out_modrm(s, OPC_MOVSWL + P_REXW, datalo, datalo);
+        } else if (bswap) {
             tcg_out_modrm_offset(s, OPC_MOVZWL, datalo, base, ofs);
             tcg_out_rolw_8(s, datalo);
             tcg_out_modrm(s, OPC_MOVSWL + P_REXW, datalo, datalo);
@@ -1088,16 +1191,24 @@ static void tcg_out_qemu_ld_direct(TCGContext *s, int datalo, int datahi,
         }
         break;
     case 2:
-        tcg_out_ld(s, TCG_TYPE_I32, datalo, base, ofs);
-        if (bswap) {
-            tcg_out_bswap32(s, datalo);
+        if (bswap && have_movbe) {
+            tcg_out_modrm_offset(s, OPC_MOVBE_GyMy, datalo, base, ofs);
+        } else {
+            tcg_out_ld(s, TCG_TYPE_I32, datalo, base, ofs);
+            if (bswap) {
+                tcg_out_bswap32(s, datalo);
+            }
         }
         break;
 #if TCG_TARGET_REG_BITS == 64
     case 2 | 4:
         if (bswap) {
-            tcg_out_ld(s, TCG_TYPE_I32, datalo, base, ofs);
-            tcg_out_bswap32(s, datalo);
+            if (have_movbe) {
+                tcg_out_modrm_offset(s, OPC_MOVBE_GyMy, datalo, base, ofs);
+            } else {
+                tcg_out_ld(s, TCG_TYPE_I32, datalo, base, ofs);
+                tcg_out_bswap32(s, datalo);
+            }
             tcg_out_ext32s(s, datalo, datalo);
         } else {
             tcg_out_modrm_offset(s, OPC_MOVSLQ, datalo, base, ofs);
@@ -1106,24 +1217,33 @@ static void tcg_out_qemu_ld_direct(TCGContext *s, int datalo, int datahi,
 #endif
     case 3:
         if (TCG_TARGET_REG_BITS == 64) {
-            tcg_out_ld(s, TCG_TYPE_I64, datalo, base, ofs);
-            if (bswap) {
-                tcg_out_bswap64(s, datalo);
+            if (bswap && have_movbe) {
+                tcg_out_modrm_offset(s, OPC_MOVBE_GyMy + P_REXW,
+                                     datalo, base, ofs);
+            } else {
+                tcg_out_ld(s, TCG_TYPE_I64, datalo, base, ofs);
+                if (bswap) {
+                    tcg_out_bswap64(s, datalo);
+                }
             }
         } else {
+            int opc = OPC_MOVL_GvEv;
             if (bswap) {
                 int t = datalo;
                 datalo = datahi;
                 datahi = t;
+                if (have_movbe) {
+                    opc = OPC_MOVBE_GyMy;
+                }
             }
             if (base != datalo) {
-                tcg_out_ld(s, TCG_TYPE_I32, datalo, base, ofs);
-                tcg_out_ld(s, TCG_TYPE_I32, datahi, base, ofs + 4);
+                tcg_out_modrm_offset(s, opc, datalo, base, ofs);
+                tcg_out_modrm_offset(s, opc, datahi, base, ofs + 4);
             } else {
-                tcg_out_ld(s, TCG_TYPE_I32, datahi, base, ofs + 4);
-                tcg_out_ld(s, TCG_TYPE_I32, datalo, base, ofs);
+                tcg_out_modrm_offset(s, opc, datahi, base, ofs + 4);
+                tcg_out_modrm_offset(s, opc, datalo, base, ofs);
             }
-            if (bswap) {
+            if (bswap && !have_movbe) {
                 tcg_out_bswap32(s, datalo);
                 tcg_out_bswap32(s, datahi);
             }
@@ -1271,6 +1391,11 @@ static void tcg_out_qemu_st_direct(TCGContext *s, int datalo, int datahi,
         tcg_out_modrm_offset(s, OPC_MOVB_EvGv + P_REXB_R, datalo, base, ofs);
         break;
     case 1:
+        if (bswap && have_movbe) {
+            tcg_out_modrm_offset(s, OPC_MOVBE_MyGy + P_DATA16,
+                                 datalo, base, ofs);
+            break;
+        }
         if (bswap) {
             tcg_out_mov(s, TCG_TYPE_I32, scratch, datalo);
             tcg_out_rolw_8(s, scratch);
@@ -1279,6 +1404,10 @@ static void tcg_out_qemu_st_direct(TCGContext *s, int datalo, int datahi,
         tcg_out_modrm_offset(s, OPC_MOVL_EvGv + P_DATA16, datalo, base, ofs);
         break;
     case 2:
+        if (bswap && have_movbe) {
+            tcg_out_modrm_offset(s, OPC_MOVBE_MyGy, datalo, base, ofs);
+            break;
+        }
         if (bswap) {
             tcg_out_mov(s, TCG_TYPE_I32, scratch, datalo);
             tcg_out_bswap32(s, scratch);
@@ -1287,7 +1416,15 @@ static void tcg_out_qemu_st_direct(TCGContext *s, int datalo, int datahi,
         tcg_out_st(s, TCG_TYPE_I32, datalo, base, ofs);
         break;
     case 3:
-        if (TCG_TARGET_REG_BITS == 64) {
+        if (bswap && have_movbe) {
+            if (TCG_TARGET_REG_BITS == 64) {
+                tcg_out_modrm_offset(s, OPC_MOVBE_MyGy + P_REXW,
+                                     datalo, base, ofs);
+            } else {
+                tcg_out_modrm_offset(s, OPC_MOVBE_MyGy, datahi, base, ofs);
+                tcg_out_modrm_offset(s, OPC_MOVBE_MyGy, datalo, base, ofs + 4);
+            }
+        } else if (TCG_TARGET_REG_BITS == 64) {
             if (bswap) {
                 tcg_out_mov(s, TCG_TYPE_I64, scratch, datalo);
                 tcg_out_bswap64(s, scratch);
@@ -1432,7 +1569,7 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
 static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
                               const TCGArg *args, const int *const_args)
 {
-    int c, rexw = 0;
+    int c, vexop, rexw = 0;
 
 #if TCG_TARGET_REG_BITS == 64
 # define OP_32_64(x) \
@@ -1584,22 +1721,30 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
 
     OP_32_64(shl):
         c = SHIFT_SHL;
+        vexop = OPC_SHLX;
         goto gen_shift;
     OP_32_64(shr):
         c = SHIFT_SHR;
+        vexop = OPC_SHRX;
         goto gen_shift;
     OP_32_64(sar):
         c = SHIFT_SAR;
+        vexop = OPC_SARX;
         goto gen_shift;
     OP_32_64(rotl):
         c = SHIFT_ROL;
+        vexop = 0;
         goto gen_shift;
     OP_32_64(rotr):
         c = SHIFT_ROR;
+        vexop = 0;
         goto gen_shift;
     gen_shift:
         if (const_args[2]) {
             tcg_out_shifti(s, c + rexw, args[0], args[2]);
+        } else if (vexop && have_bmi2) {
+            /* the count may be in any register, see the 'C' constraint */
+            tcg_out_vex_modrm(s, vexop | rexw, args[0], args[2], args[0]);
         } else {
             tcg_out_modrm(s, OPC_SHIFT_cl + rexw, c, args[0]);
         }
@@ -1613,6 +1758,10 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
         tcg_out_setcond32(s, args[3], args[0], args[1],
                           args[2], const_args[2]);
         break;
+    case INDEX_op_movcond_i32:
+        tcg_out_movcond32(s, args[5], args[0], args[1],
+                          args[2], const_args[2], args[3]);
+        break;
 
     OP_32_64(bswap16):
         tcg_out_rolw_8(s, args[0]);
@@ -1735,6 +1884,10 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
         tcg_out_setcond64(s, args[3], args[0], args[1],
                           args[2], const_args[2]);
         break;
+    case INDEX_op_movcond_i64:
+        tcg_out_movcond64(s, args[5], args[0], args[1],
+                          args[2], const_args[2], args[3]);
+        break;
 
     case INDEX_op_bswap64_i64:
         tcg_out_bswap64(s, args[0]);
@@ -1780,9 +1933,9 @@ static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_or_i32, { "r", "0", "ri" } },
     { INDEX_op_xor_i32, { "r", "0", "ri" } },
 
-    { INDEX_op_shl_i32, { "r", "0", "ci" } },
-    { INDEX_op_shr_i32, { "r", "0", "ci" } },
-    { INDEX_op_sar_i32, { "r", "0", "ci" } },
+    { INDEX_op_shl_i32, { "r", "0", "Ci" } },
+    { INDEX_op_shr_i32, { "r", "0", "Ci" } },
+    { INDEX_op_sar_i32, { "r", "0", "Ci" } },
     { INDEX_op_rotl_i32, { "r", "0", "ci" } },
     { INDEX_op_rotr_i32, { "r", "0", "ci" } },
 
@@ -1801,6 +1954,7 @@ static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_ext16u_i32, { "r", "r" } },
 
     { INDEX_op_setcond_i32, { "q", "r", "ri" } },
+    { INDEX_op_movcond_i32, { "r", "r", "ri", "r", "0" } },
 
 #if TCG_TARGET_REG_BITS == 32
     { INDEX_op_mulu2_i32, { "a", "d", "a", "r" } },
@@ -1832,14 +1986,15 @@ static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_or_i64, { "r", "0", "re" } },
     { INDEX_op_xor_i64, { "r", "0", "re" } },
 
-    { INDEX_op_shl_i64, { "r", "0", "ci" } },
-    { INDEX_op_shr_i64, { "r", "0", "ci" } },
-    { INDEX_op_sar_i64, { "r", "0", "ci" } },
+    { INDEX_op_shl_i64, { "r", "0", "Ci" } },
+    { INDEX_op_shr_i64, { "r", "0", "Ci" } },
+    { INDEX_op_sar_i64, { "r", "0", "Ci" } },
     { INDEX_op_rotl_i64, { "r", "0", "ci" } },
     { INDEX_op_rotr_i64, { "r", "0", "ci" } },
 
     { INDEX_op_brcond_i64, { "r", "re" } },
     { INDEX_op_setcond_i64, { "r", "r", "re" } },
+    { INDEX_op_movcond_i64, { "r", "r", "re", "r", "0" } },
 
     { INDEX_op_bswap16_i64, { "r", "0" } },
     { INDEX_op_bswap32_i64, { "r", "0" } },
@@ -1953,6 +2108,28 @@ static void tcg_target_qemu_prologue(TCGContext *s)
     tcg_out_opc(s, OPC_RET, 0, 0, 0);
 }
 
+/* Probe the optional instructions used by the code generator.  Setting
+   QEMU_TCG_BASE_ISA in the environment restricts it to the base
+   instruction set, to compare both code paths.  */
+static void tcg_target_detect_isa(void)
+{
+    unsigned a, b, c, d;
+
+    if (getenv("QEMU_TCG_BASE_ISA")) {
+        return;
+    }
+    if (__get_cpuid(1, &a, &b, &c, &d)) {
+#if TCG_TARGET_REG_BITS == 32
+        have_cmov = (d & bit_CMOV) != 0;
+#endif
+        have_movbe = (c & bit_MOVBE) != 0;
+    }
+    if (__get_cpuid_max(0, NULL) >= 7) {
+        __cpuid_count(7, 0, a, b, c, d);
+        have_bmi2 = (b & bit_BMI2) != 0;
+    }
+}
+
 static void tcg_target_init(TCGContext *s)
 {
 #if !defined(CONFIG_USER_ONLY)
@@ -1961,6 +2138,9 @@ static void tcg_target_init(TCGContext *s)
         tcg_abort();
 #endif
 
+    /* must come before the constraints are parsed */
+    tcg_target_detect_isa();
+
     if (TCG_TARGET_REG_BITS == 64) {
         tcg_regset_set32(tcg_target_available_regs[TCG_TYPE_I32], 0, 0xffff);
         tcg_regset_set32(tcg_target_available_regs[TCG_TYPE_I64], 0, 0xffff);
@@ -44,6 +44,9 @@ DEF(br, 0, 0, 1, TCG_OPF_BB_END | TCG_OPF_SIDE_EFFECTS)
 DEF(mov_i32, 1, 1, 0, 0)
 DEF(movi_i32, 1, 0, 1, 0)
 DEF(setcond_i32, 1, 2, 1, 0)
+#ifdef TCG_TARGET_HAS_movcond_i32
+DEF(movcond_i32, 1, 4, 1, 0)
+#endif
 /* load/store */
 DEF(ld8u_i32, 1, 1, 1, 0)
 DEF(ld8s_i32, 1, 1, 1, 0)
@@ -131,6 +134,9 @@ DEF(nor_i32, 1, 2, 0, 0)
 DEF(mov_i64, 1, 1, 0, 0)
 DEF(movi_i64, 1, 0, 1, 0)
 DEF(setcond_i64, 1, 2, 1, 0)
+#ifdef TCG_TARGET_HAS_movcond_i64
+DEF(movcond_i64, 1, 4, 1, 0)
+#endif
 /* load/store */
 DEF(ld8u_i64, 1, 1, 1, 0)
 DEF(ld8s_i64, 1, 1, 1, 0)
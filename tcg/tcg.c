@@ -718,6 +718,76 @@ void tcg_gen_shifti_i64(TCGv_i64 ret, TCGv_i64 arg1,
 #endif
 
 
+#define TCG_LABEL_RECORDED 1 /* at least one branch state recorded */
+#define TCG_LABEL_BACKWARD 2 /* reached by a backward branch */
+#define TCG_LABEL_PLACED   4 /* set_label already seen by tcg_label_scan */
+
+/* return the label of a branch op, or -1 */
+static int tcg_branch_label(TCGOpcode opc, const TCGArg *args)
+{
+    switch(opc) {
+    case INDEX_op_br:
+        return args[0];
+    case INDEX_op_brcond_i32:
+        return args[3];
+#if TCG_TARGET_REG_BITS == 32
+    case INDEX_op_brcond2_i32:
+        return args[5];
+#else
+    case INDEX_op_brcond_i64:
+        return args[3];
+#endif
+    default:
+        return -1;
+    }
+}
+
+/* Allocate the per label register state and find the labels that are
+   the target of a backward branch: the register state cannot be known
+   when such a label is reached, so globals are in memory there. */
+static void tcg_label_scan(TCGContext *s)
+{
+    const TCGArg *args;
+    TCGOpcode opc;
+    int i, label;
+
+    s->label_reg_state = tcg_malloc(s->nb_labels * TCG_TARGET_NB_REGS *
+                                    sizeof(int16_t));
+    s->label_flags = tcg_malloc(s->nb_labels);
+    memset(s->label_flags, 0, s->nb_labels);
+    s->bb_unreachable = 0;
+
+    args = gen_opparam_buf;
+    for(i = 0;; i++) {
+        opc = gen_opc_buf[i];
+        switch(opc) {
+        case INDEX_op_end:
+            for(label = 0; label < s->nb_labels; label++) {
+                s->label_flags[label] &= TCG_LABEL_BACKWARD;
+            }
+            return;
+        case INDEX_op_nopn:
+            args += args[0];
+            break;
+        case INDEX_op_call:
+            args += (args[0] >> 16) + (args[0] & 0xffff) +
+                tcg_op_defs[opc].nb_cargs + 1;
+            break;
+        case INDEX_op_set_label:
+            s->label_flags[args[0]] |= TCG_LABEL_PLACED;
+            args += tcg_op_defs[opc].nb_args;
+            break;
+        default:
+            label = tcg_branch_label(opc, args);
+            if (label >= 0 && (s->label_flags[label] & TCG_LABEL_PLACED)) {
+                s->label_flags[label] |= TCG_LABEL_BACKWARD;
+            }
+            args += tcg_op_defs[opc].nb_args;
+            break;
+        }
+    }
+}
+
 static void tcg_reg_alloc_start(TCGContext *s)
 {
     int i;
@@ -739,6 +809,7 @@ static void tcg_reg_alloc_start(TCGContext *s)
     for(i = 0; i < TCG_TARGET_NB_REGS; i++) {
         s->reg_to_temp[i] = -1;
     }
+    tcg_label_scan(s);
 }
 
 static char *tcg_get_arg_str_idx(TCGContext *s, char *buf, int buf_size,
@@ -949,6 +1020,12 @@ void tcg_dump_ops(TCGContext *s, FILE *outfile)
             case INDEX_op_setcond2_i32:
 #elif TCG_TARGET_REG_BITS == 64
             case INDEX_op_setcond_i64:
+#endif
+#ifdef TCG_TARGET_HAS_movcond_i32
+            case INDEX_op_movcond_i32:
+#endif
+#ifdef TCG_TARGET_HAS_movcond_i64
+            case INDEX_op_movcond_i64:
 #endif
                 if (args[k] < ARRAY_SIZE(cond_name) && cond_name[args[k]])
                     fprintf(outfile, ",%s", cond_name[args[k++]]);
@@ -1446,7 +1523,17 @@ static int tcg_reg_alloc(TCGContext *s, TCGRegSet reg1, TCGRegSet reg2)
             return reg;
     }
 
-    /* XXX: do better spill choice */
+    /* then prefer a register whose value is already in memory, so
+       that no store is needed */
+    for(i = 0; i < ARRAY_SIZE(tcg_target_reg_alloc_order); i++) {
+        reg = tcg_target_reg_alloc_order[i];
+        if (tcg_regset_test_reg(reg_ct, reg) &&
+            s->temps[s->reg_to_temp[reg]].mem_coherent) {
+            tcg_reg_free(s, reg);
+            return reg;
+        }
+    }
+
     for(i = 0; i < ARRAY_SIZE(tcg_target_reg_alloc_order); i++) {
         reg = tcg_target_reg_alloc_order[i];
         if (tcg_regset_test_reg(reg_ct, reg)) {
@@ -1491,6 +1578,44 @@ static void temp_save(TCGContext *s, int temp, TCGRegSet allocated_regs)
     }
 }
 
+/* store a temporary to memory if needed, but keep it in its register
+   so that following code can still use it. 'allocated_regs' is used in
+   case a temporary registers needs to be allocated to store a
+   constant. */
+static void temp_sync(TCGContext *s, int temp, TCGRegSet allocated_regs)
+{
+    TCGTemp *ts;
+
+    ts = &s->temps[temp];
+    if (!ts->fixed_reg) {
+        switch(ts->val_type) {
+        case TEMP_VAL_REG:
+            if (!ts->mem_coherent) {
+                if (!ts->mem_allocated)
+                    temp_allocate_frame(s, temp);
+                tcg_out_st(s, ts->type, ts->reg, ts->mem_reg, ts->mem_offset);
+                ts->mem_coherent = 1;
+            }
+            break;
+        default:
+            temp_save(s, temp, allocated_regs);
+            break;
+        }
+    }
+}
+
+/* store the globals to their canonical location, keeping the copies
+   held in registers. Used when the following code may read but not
+   modify the globals. */
+static void sync_globals(TCGContext *s, TCGRegSet allocated_regs)
+{
+    int i;
+
+    for(i = 0; i < s->nb_globals; i++) {
+        temp_sync(s, i, allocated_regs);
+    }
+}
+
 /* save globals to their cannonical location and assume they can be
    modified be the following code. 'allocated_regs' is used in case a
    temporary registers needs to be allocated to store a constant. */
@@ -1525,6 +1650,90 @@ static void tcg_reg_alloc_bb_end(TCGContext *s, TCGRegSet allocated_regs)
     save_globals(s, allocated_regs);
 }
 
+/* record in 'label' which globals are held in which register: the
+   target only keeps the bindings that all its predecessors agree on */
+static void tcg_label_record(TCGContext *s, int label)
+{
+    int16_t *state;
+    int reg, temp;
+
+    state = &s->label_reg_state[label * TCG_TARGET_NB_REGS];
+    for(reg = 0; reg < TCG_TARGET_NB_REGS; reg++) {
+        temp = s->reg_to_temp[reg];
+        if (temp >= s->nb_globals) {
+            temp = -1;
+        }
+        if (!(s->label_flags[label] & TCG_LABEL_RECORDED)) {
+            state[reg] = temp;
+        } else if (state[reg] != temp) {
+            state[reg] = -1;
+        }
+    }
+    s->label_flags[label] |= TCG_LABEL_RECORDED;
+}
+
+/* forward branch to 'label': like the end of a basic block, except that
+   globals and local temporaries are only synced, so that they stay in
+   their registers both on the fall-through path and at the target. */
+static void tcg_reg_alloc_branch(TCGContext *s, int label,
+                                 TCGRegSet allocated_regs)
+{
+    TCGTemp *ts;
+    int i;
+
+    for(i = s->nb_globals; i < s->nb_temps; i++) {
+        ts = &s->temps[i];
+        if (ts->temp_local) {
+            temp_sync(s, i, allocated_regs);
+        } else {
+            if (ts->val_type == TEMP_VAL_REG) {
+                s->reg_to_temp[ts->reg] = -1;
+            }
+            ts->val_type = TEMP_VAL_DEAD;
+        }
+    }
+
+    sync_globals(s, allocated_regs);
+    tcg_label_record(s, label);
+}
+
+static void tcg_reg_alloc_label(TCGContext *s, int label)
+{
+    int16_t *state;
+    TCGTemp *ts;
+    int reg, temp;
+
+    if (s->label_flags[label] & TCG_LABEL_BACKWARD) {
+        tcg_reg_alloc_bb_end(s, s->reserved_regs);
+        s->bb_unreachable = 0;
+        return;
+    }
+
+    /* the fall-through path is one more predecessor */
+    if (!s->bb_unreachable) {
+        tcg_reg_alloc_branch(s, label, s->reserved_regs);
+    }
+    s->bb_unreachable = 0;
+
+    /* everything is in memory at this point: reload the register state
+       common to all the predecessors */
+    tcg_reg_alloc_bb_end(s, s->reserved_regs);
+    if (!(s->label_flags[label] & TCG_LABEL_RECORDED)) {
+        return;
+    }
+    state = &s->label_reg_state[label * TCG_TARGET_NB_REGS];
+    for(reg = 0; reg < TCG_TARGET_NB_REGS; reg++) {
+        temp = state[reg];
+        if (temp >= 0) {
+            ts = &s->temps[temp];
+            ts->val_type = TEMP_VAL_REG;
+            ts->reg = reg;
+            ts->mem_coherent = 1;
+            s->reg_to_temp[reg] = temp;
+        }
+    }
+}
+
 #define IS_DEAD_IARG(n) ((dead_iargs >> (n)) & 1)
 
 static void tcg_reg_alloc_movi(TCGContext *s, const TCGArg *args)
@@ -1690,7 +1899,16 @@ static void tcg_reg_alloc_op(TCGContext *s,
     }
     
     if (def->flags & TCG_OPF_BB_END) {
-        tcg_reg_alloc_bb_end(s, allocated_regs);
+        i = tcg_branch_label(opc, args);
+        if (i >= 0 && !(s->label_flags[i] & TCG_LABEL_BACKWARD)) {
+            tcg_reg_alloc_branch(s, i, allocated_regs);
+        } else {
+            tcg_reg_alloc_bb_end(s, allocated_regs);
+        }
+        if (opc == INDEX_op_br || opc == INDEX_op_jmp ||
+            opc == INDEX_op_exit_tb) {
+            s->bb_unreachable = 1;
+        }
     } else {
         /* mark dead temporaries and free the associated registers */
         for(i = 0; i < nb_iargs; i++) {
@@ -1715,9 +1933,9 @@ static void tcg_reg_alloc_op(TCGContext *s,
             /* XXX: for load/store we could do that only for the slow path
                (i.e. when a memory callback is called) */
             
-            /* store globals and free associated registers (we assume the insn
-               can modify any global. */
-            save_globals(s, allocated_regs);
+            /* store globals; the memory callbacks only read them, so
+               the registers holding them are kept */
+            sync_globals(s, allocated_regs);
         }
         
         /* satisfy the output constraints */
@@ -1918,8 +2136,13 @@ static int tcg_reg_alloc_call(TCGContext *s, const TCGOpDef *def,
     }
     
     /* store globals and free associated registers (we assume the call
-       can modify any global. */
-    if (!(flags & TCG_CALL_CONST)) {
+       can modify any global. A pure call can only read them, so they
+       are only synced. */
+    if (flags & TCG_CALL_CONST) {
+        /* nothing to do */
+    } else if (flags & TCG_CALL_PURE) {
+        sync_globals(s, allocated_regs);
+    } else {
         save_globals(s, allocated_regs);
     }
 
@@ -2059,7 +2282,7 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
             }
             break;
         case INDEX_op_set_label:
-            tcg_reg_alloc_bb_end(s, s->reserved_regs);
+            tcg_reg_alloc_label(s, args[0]);
             tcg_out_label(s, args[0], (long)s->code_ptr);
             break;
         case INDEX_op_call:
@@ -293,6 +293,12 @@ struct TCGContext {
        into account fixed registers */
     int reg_to_temp[TCG_TARGET_NB_REGS];
     TCGRegSet reserved_regs;
+
+    /* forward branches: for each label, the global held by each
+       register on every branch seen so far (-1 if none) */
+    int16_t *label_reg_state;
+    uint8_t *label_flags;
+    int bb_unreachable; /* the previous op does not fall through */
     tcg_target_long current_frame_offset;
     tcg_target_long frame_start;
     tcg_target_long frame_end;
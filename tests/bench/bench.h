@@ -0,0 +1,169 @@
+/*
+ * Minimal freestanding runtime for the TCG benchmark kernels.
+ *
+ * Every kernel provides bench_run(), which does a fixed amount of work and
+ * returns a checksum.  The same object runs either as a static i386 Linux
+ * binary under qemu-i386 (BENCH_USER) or as a multiboot kernel under
+ * qemu -kernel (BENCH_SYSTEM, see start-system.S).
+ */
+#ifndef BENCH_H
+#define BENCH_H
+
+typedef unsigned char uint8_t;
+typedef unsigned short uint16_t;
+typedef unsigned int uint32_t;
+typedef unsigned long long uint64_t;
+
+extern const char bench_name[];
+uint32_t bench_run(void);
+
+static void bench_write(const char *buf, int len);
+static void bench_exit(int status) __attribute__((noreturn));
+
+#if defined(BENCH_USER)
+
+#define __NR_exit   1
+#define __NR_write  4
+#define __NR_mmap2  192
+
+static void bench_write(const char *buf, int len)
+{
+    int ret;
+    asm volatile ("pushl %%ebx\n"
+                  "movl %%esi, %%ebx\n"
+                  "int $0x80\n"
+                  "popl %%ebx\n"
+                  : "=a" (ret)
+                  : "0" (__NR_write), "S" (1), "c" (buf), "d" (len)
+                  : "memory");
+}
+
+static void bench_exit(int status)
+{
+    asm volatile ("movl %%ecx, %%ebx\n"
+                  "int $0x80\n"
+                  : : "a" (__NR_exit), "c" (status));
+    for (;;) {
+    }
+}
+
+/* Writable and executable memory for code generated at run time. */
+static inline void *bench_code_buffer(uint32_t size)
+{
+    static uint8_t *buf;
+    long ret;
+
+    if (!buf) {
+        /* PROT_READ|PROT_WRITE|PROT_EXEC, MAP_PRIVATE|MAP_ANONYMOUS */
+        asm volatile ("pushl %%ebp\n"
+                      "xorl %%ebp, %%ebp\n"
+                      "int $0x80\n"
+                      "popl %%ebp\n"
+                      : "=a" (ret)
+                      : "0" (__NR_mmap2), "b" (0), "c" (size), "d" (7),
+                        "S" (0x22), "D" (-1)
+                      : "memory");
+        buf = (uint8_t *)ret;
+    }
+    return buf;
+}
+
+#elif defined(BENCH_SYSTEM)
+
+static inline void bench_outb(uint16_t port, uint8_t val)
+{
+    asm volatile ("outb %0, %1" : : "a" (val), "Nd" (port));
+}
+
+static inline uint8_t bench_inb(uint16_t port)
+{
+    uint8_t val;
+    asm volatile ("inb %1, %0" : "=a" (val) : "Nd" (port));
+    return val;
+}
+
+static void bench_write(const char *buf, int len)
+{
+    while (len--) {
+        while (!(bench_inb(0x3fd) & 0x20)) {
+        }
+        bench_outb(0x3f8, *buf++);
+    }
+}
+
+/* Triple fault; run with -no-reboot so that qemu exits.  */
+static void bench_exit(int status)
+{
+    static const struct {
+        uint16_t limit;
+        uint32_t base;
+    } __attribute__((packed)) null_idt = { 0, 0 };
+
+    (void)status;
+    asm volatile ("lidt %0\n"
+                  "int3\n" : : "m" (null_idt));
+    for (;;) {
+    }
+}
+
+/* Flat protected mode without paging: any buffer is executable.  */
+static inline void *bench_code_buffer(uint32_t size)
+{
+    static uint8_t buf[65536] __attribute__((aligned(4096)));
+
+    (void)size;
+    return buf;
+}
+
+#else
+#error "define BENCH_USER or BENCH_SYSTEM"
+#endif
+
+static inline uint32_t bench_strlen(const char *s)
+{
+    uint32_t n = 0;
+
+    while (s[n]) {
+        n++;
+    }
+    return n;
+}
+
+static void bench_puts(const char *s)
+{
+    bench_write(s, bench_strlen(s));
+}
+
+static void bench_puthex(uint32_t v)
+{
+    char buf[8];
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        buf[i] = "0123456789abcdef"[(v >> (28 - 4 * i)) & 15];
+    }
+    bench_write(buf, 8);
+}
+
+/* Prevent the compiler from folding work whose result is not used.  */
+#define bench_keep(x) asm volatile ("" : "+r" (x))
+
+void bench_start(void)
+{
+    uint32_t sum = bench_run();
+
+    bench_puts(bench_name);
+    bench_puts(" checksum ");
+    bench_puthex(sum);
+    bench_puts("\n");
+    bench_exit(0);
+}
+
+#if defined(BENCH_USER)
+asm (".globl _start\n"
+     "_start:\n"
+     "    andl $-16, %esp\n"
+     "    call bench_start\n");
+#endif
+
+#endif /* BENCH_H */
@@ -0,0 +1,26 @@
+/* Data dependent selects and flag materialisation (cmov, setcc) on
+   pseudo-random values: measures the branchless movcond/setcond
+   lowering against compare-and-branch sequences.  */
+#include "bench.h"
+
+const char bench_name[] = "cmov";
+
+uint32_t bench_run(void)
+{
+    uint32_t x = 12345, lo = ~0u, hi = 0, acc = 0, cnt = 0, i, v;
+
+    for (i = 0; i < 20000000; i++) {
+        x = x * 1103515245 + 12345;
+        v = x >> 7;
+        lo = v < lo ? v : lo;
+        hi = v > hi ? v : hi;
+        acc += (x & 0x100) ? v : ~v;
+        cnt += v > (acc >> 7);
+        if ((i & 255) == 0) {
+            lo = ~0u;
+            hi = 0;
+        }
+        bench_keep(acc);
+    }
+    return lo ^ hi ^ acc ^ cnt;
+}
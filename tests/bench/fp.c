@@ -0,0 +1,17 @@
+/* x87 arithmetic, which is all softfloat helper calls under TCG.  */
+#include "bench.h"
+
+const char bench_name[] = "fp";
+
+uint32_t bench_run(void)
+{
+    volatile double x = 0.5, y = 1.0;
+    double acc = 0;
+    uint32_t i;
+
+    for (i = 0; i < 2000000; i++) {
+        acc += x * y / (y + 1.0);
+        y = y * 1.000001 - x * 0.0000001;
+    }
+    return (uint32_t)(acc * 1000.0);
+}
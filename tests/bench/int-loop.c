@@ -0,0 +1,18 @@
+/* Straight-line integer arithmetic in a tight loop: the baseline for
+   block chaining and register allocation.  */
+#include "bench.h"
+
+const char bench_name[] = "int-loop";
+
+uint32_t bench_run(void)
+{
+    uint32_t a = 1, b = 2, c = 3, i;
+
+    for (i = 0; i < 50000000; i++) {
+        a += b ^ i;
+        b = (b << 3) - c + (a >> 5);
+        c ^= a + i;
+        bench_keep(c);
+    }
+    return a ^ b ^ c;
+}
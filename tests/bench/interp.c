@@ -0,0 +1,43 @@
+/* A bytecode interpreter dispatching through a function-pointer table:
+   every instruction ends in an indirect call and a return, so this
+   stresses the IBTC and the shadow stack.  */
+#include "bench.h"
+
+const char bench_name[] = "interp";
+
+enum { OP_ADD, OP_SUB, OP_XOR, OP_SHL, OP_MUL, OP_ROT, OP_INC, OP_DUP, NOPS };
+
+typedef struct VM {
+    uint32_t acc, tmp;
+} VM;
+
+static void __attribute__((noinline)) op_add(VM *vm) { vm->acc += vm->tmp; }
+static void __attribute__((noinline)) op_sub(VM *vm) { vm->acc -= 7; }
+static void __attribute__((noinline)) op_xor(VM *vm) { vm->acc ^= vm->tmp; }
+static void __attribute__((noinline)) op_shl(VM *vm) { vm->acc = vm->acc << 1 | vm->acc >> 31; }
+static void __attribute__((noinline)) op_mul(VM *vm) { vm->acc *= 2654435761u; }
+static void __attribute__((noinline)) op_rot(VM *vm) { vm->tmp = vm->acc >> 7; }
+static void __attribute__((noinline)) op_inc(VM *vm) { vm->tmp++; }
+static void __attribute__((noinline)) op_dup(VM *vm) { vm->tmp = vm->acc; }
+
+static void (* const ops[NOPS])(VM *vm) = {
+    op_add, op_sub, op_xor, op_shl, op_mul, op_rot, op_inc, op_dup,
+};
+
+static const uint8_t program[] = {
+    OP_DUP, OP_ADD, OP_ROT, OP_XOR, OP_MUL, OP_INC, OP_SHL, OP_SUB,
+    OP_INC, OP_ADD, OP_MUL, OP_ROT, OP_XOR, OP_DUP, OP_SHL, OP_ADD,
+};
+
+uint32_t bench_run(void)
+{
+    VM vm = { 1, 1 };
+    uint32_t i, pc;
+
+    for (i = 0; i < 1000000; i++) {
+        for (pc = 0; pc < sizeof(program); pc++) {
+            ops[program[pc]](&vm);
+        }
+    }
+    return vm.acc ^ vm.tmp;
+}
@@ -0,0 +1,44 @@
+/* Block copies with rep movs and with a byte loop over a working set
+   larger than the softmmu TLB reach.  */
+#include "bench.h"
+
+const char bench_name[] = "memcpy";
+
+#define BUF_SIZE (1024 * 1024)
+
+static uint8_t src[BUF_SIZE] __attribute__((aligned(4096)));
+static uint8_t dst[BUF_SIZE] __attribute__((aligned(4096)));
+
+static void copy_rep(void *d, const void *s, uint32_t n)
+{
+    asm volatile ("rep movsl"
+                  : "+D" (d), "+S" (s), "+c" (n) : : "memory");
+}
+
+static void __attribute__((noinline)) copy_loop(uint8_t *d, const uint8_t *s,
+                                                uint32_t n)
+{
+    while (n--) {
+        *d++ = *s++;
+    }
+}
+
+uint32_t bench_run(void)
+{
+    uint32_t i, sum = 0;
+
+    for (i = 0; i < BUF_SIZE; i++) {
+        src[i] = i * 31;
+    }
+    for (i = 0; i < 200; i++) {
+        copy_rep(dst, src, BUF_SIZE / 4);
+        src[i] ^= dst[BUF_SIZE - 1 - i];
+    }
+    for (i = 0; i < 16; i++) {
+        copy_loop(src, dst, BUF_SIZE);
+    }
+    for (i = 0; i < BUF_SIZE; i += 4096) {
+        sum = sum * 33 + src[i] + dst[i + 17];
+    }
+    return sum;
+}
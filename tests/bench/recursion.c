@@ -0,0 +1,24 @@
+/* Deep call/return chains that are not tail calls: a direct-call
+   workload for the shadow stack.  */
+#include "bench.h"
+
+const char bench_name[] = "recursion";
+
+static uint32_t __attribute__((noinline)) fib(uint32_t n)
+{
+    if (n < 2) {
+        return n;
+    }
+    return fib(n - 1) + fib(n - 2);
+}
+
+uint32_t bench_run(void)
+{
+    uint32_t sum = 0, i;
+
+    for (i = 0; i < 4; i++) {
+        sum += fib(30 + (i & 1));
+        bench_keep(sum);
+    }
+    return sum;
+}
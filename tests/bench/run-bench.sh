@@ -0,0 +1,95 @@
+#!/bin/sh
+#
+# Run TCG benchmark kernels and print one JSON object per kernel.
+#
+#   run-bench.sh user|system|sparc "<qemu command>" kernel...
+#
+# sparc kernels replace the boot PROM of qemu-system-sparc.  Each kernel's
+# checksum is compared with the one listed in the checksums file next to
+# this script; the script exits non-zero if any kernel has no result or a
+# different checksum.
+#
+# qemu writes its raw counters to $QEMU_TCG_STATS when it exits (see
+# tcg_stats_report() in exec.c); this script turns them into rates:
+#
+#   mips               guest instructions per wall-clock microsecond
+#                      (null when the host does not count instructions)
+#   tb_per_s           translation blocks generated per second
+#   translate_share    fraction of the run spent in the translator
+#   tb_flushes         full code cache flushes
+#   tb_invalidates     blocks invalidated, e.g. by self-modifying code
+#   ibtc_hit_rate      indirect branch target cache hits / lookups
+#   shack_hit_rate     shadow stack return predictions that hit
+#   tlb_miss_per_kinsn softmmu TLB refills per 1000 guest instructions
+
+mode=$1
+qemu=$2
+shift 2
+
+case "$mode" in
+user)
+    opts=""
+    ;;
+system)
+    opts="-m 64 -vnc none -monitor null -serial stdio -parallel none -no-reboot -kernel"
+    ;;
+sparc)
+    opts="-m 64 -vnc none -monitor null -serial stdio -parallel none -no-reboot -bios"
+    ;;
+*)
+    echo "usage: $0 user|system|sparc \"<qemu command>\" kernel..." >&2
+    exit 1
+    ;;
+esac
+
+checksums=$(dirname "$0")/checksums
+stats=${TMPDIR:-/tmp}/tcg-bench.$$
+trap 'rm -f "$stats"' EXIT
+status=0
+
+for kernel in "$@"; do
+    rm -f "$stats"
+    out=$(QEMU_TCG_STATS="$stats" $qemu $opts ./$kernel 2>&1 < /dev/null)
+    checksum=$(echo "$out" | sed -n 's/.* checksum \([0-9a-f]*\)$/\1/p')
+    if [ -z "$checksum" ] || [ ! -s "$stats" ]; then
+        echo "$kernel: no result" >&2
+        echo "$out" >&2
+        status=1
+        continue
+    fi
+    name=${kernel%-$mode}
+    expected=$(awk -v name="$name" '$1 == name { print $2 }' "$checksums")
+    if [ "$checksum" != "$expected" ]; then
+        echo "$kernel: checksum $checksum, expected ${expected:-none}" >&2
+        status=1
+    fi
+    tr -d '{}",:' < "$stats" | awk -v name="$name" -v mode="$mode" \
+                                     -v sum="$checksum" '
+    function rate(n, d) {
+        return d > 0 ? sprintf("%.4f", n / d) : "null"
+    }
+    {
+        for (i = 1; i < NF; i += 2) {
+            v[$i] = $(i + 1)
+        }
+        us = v["wall_us"]
+        printf "{\"bench\": \"%s\", \"mode\": \"%s\", \"checksum\": \"%s\"", \
+               name, mode, sum
+        printf ", \"wall_us\": %d, \"insns\": %s", us, v["insns"]
+        printf ", \"mips\": %s", (v["insns"] > 0 ? rate(v["insns"], us) : "null")
+        printf ", \"tb_translated\": %d", v["tb_translated"]
+        printf ", \"tb_per_s\": %s", rate(v["tb_translated"] * 1000000, us)
+        printf ", \"translate_share\": %s", rate(v["translate_us"], us)
+        printf ", \"tb_flushes\": %d", v["tb_flushes"]
+        printf ", \"tb_invalidates\": %d", v["tb_invalidates"]
+        printf ", \"ibtc_hit_rate\": %s", \
+               rate(v["ibtc_hits"], v["ibtc_hits"] + v["ibtc_misses"])
+        printf ", \"shack_hit_rate\": %s", \
+               rate(v["shack_hits"], v["shack_hits"] + v["shack_misses"])
+        printf ", \"tlb_fills\": %d", v["tlb_fills"]
+        printf ", \"tlb_miss_per_kinsn\": %s}\n", \
+               (v["insns"] > 0 ? rate(v["tlb_fills"] * 1000, v["insns"]) : "null")
+    }'
+done
+
+exit $status
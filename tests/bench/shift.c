@@ -0,0 +1,21 @@
+/* Shifts by a variable count (shl/shr/sar %cl): the count no longer
+   has to live in %ecx when the host has the BMI2 shifts.  */
+#include "bench.h"
+
+const char bench_name[] = "shift";
+
+uint32_t bench_run(void)
+{
+    uint32_t x = 1, a = 3, b = 5, n, i;
+    int c = 7;
+
+    for (i = 0; i < 20000000; i++) {
+        x = x * 1664525 + 1013904223;
+        n = x >> 27;
+        a ^= x << n;
+        b += a >> (n ^ 31);
+        c ^= (int)b >> (n & 15);
+        bench_keep(c);
+    }
+    return a ^ b ^ c;
+}
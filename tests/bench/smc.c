@@ -0,0 +1,25 @@
+/* Self-modifying code: patch the immediate of a small generated function
+   and call it again, forcing invalidation and retranslation each round.  */
+#include "bench.h"
+
+const char bench_name[] = "smc";
+
+typedef uint32_t (*gen_fn)(uint32_t);
+
+uint32_t bench_run(void)
+{
+    uint8_t *code = bench_code_buffer(4096);
+    gen_fn fn = (gen_fn)code;
+    uint32_t i, sum = 0;
+
+    /* mov 4(%esp), %eax; add $imm32, %eax; ret */
+    code[0] = 0x8b; code[1] = 0x44; code[2] = 0x24; code[3] = 0x04;
+    code[4] = 0x05;
+    code[9] = 0xc3;
+
+    for (i = 0; i < 100000; i++) {
+        *(volatile uint32_t *)(code + 5) = i * 3;
+        sum = fn(sum) ^ i;
+    }
+    return sum;
+}
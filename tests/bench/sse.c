@@ -0,0 +1,33 @@
+/* Packed SSE2 arithmetic through the generic vector extensions.  */
+#include "bench.h"
+
+const char bench_name[] = "sse";
+
+typedef float v4sf __attribute__((vector_size(16)));
+typedef int v4si __attribute__((vector_size(16)));
+
+uint32_t bench_run(void)
+{
+    v4sf a = { 1.0f, 2.0f, 3.0f, 4.0f };
+    v4sf b = { 0.5f, 0.25f, 0.125f, 0.0625f };
+    const v4sf m = { 0.5f, 0.75f, 0.875f, 0.9375f };
+    v4si c = { 1, 2, 3, 4 };
+    v4si d = { 7, 11, 13, 17 };
+    uint32_t i;
+    union {
+        v4sf f;
+        v4si i;
+        uint32_t w[4];
+    } u;
+
+    /* a and b converge, so the values stay normal throughout */
+    for (i = 0; i < 3000000; i++) {
+        a = a * m + b;
+        b = b * m + (a - b) * (v4sf){ 0.125f, 0.125f, 0.125f, 0.125f };
+        c = (c + d) ^ (c >> 1);
+        asm volatile ("" : "+x" (a), "+x" (b), "+x" (c));
+    }
+    u.f = a + b;
+    u.i ^= c;
+    return u.w[0] ^ u.w[1] ^ u.w[2] ^ u.w[3];
+}
@@ -0,0 +1,209 @@
+#!/usr/bin/env python3
+#
+# virtio-net live migration test
+#
+#   run-migration.py "<qemu command>" rx-guest
+#
+# 1. The device must offer the guest the same features whether the tap
+#    has vhost=off or leaves the choice to qemu, so that a guest can move
+#    between hosts with and without vhost-net.
+# 2. rx-guest is migrated while the host sends it ICMP echo requests
+#    through the tap; it must see every frame intact on the destination.
+#    With /dev/vhost-net this covers the dirty logging of the rings and
+#    buffers that the host kernel writes.
+#
+# Needs root (for the tap device) and KVM.  VHOST=on|off sets vhost= on
+# the tap for the migration run; by default qemu picks the data path.
+#
+# This work is licensed under the terms of the GNU GPL, version 2.  See
+# the COPYING file in the top-level directory.
+
+import os
+import shutil
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+GUEST_MAC = b"\x52\x54\x00\x12\x34\x56"
+HOST_MAC = b"\x02\x00\x00\x00\x00\x01"
+PATTERN = 0xa5
+DATA_LEN = 56
+STAMP_LEN = 16
+
+
+class Guest(object):
+    def __init__(self, name, netdev_opts, device_opts, extra=[]):
+        self.serial = os.path.join(tmpdir, name + ".serial")
+        self.mon_path = os.path.join(tmpdir, name + ".mon")
+        self.mon = None
+        open(self.serial, "w").close()
+        cmd = qemu + ["-enable-kvm", "-m", "64", "-vnc", "none",
+                      "-parallel", "none", "-no-reboot",
+                      "-serial", "file:" + self.serial,
+                      "-monitor", "unix:%s,server,nowait" % self.mon_path,
+                      "-netdev", "tap,id=n0,ifname=%s,script=no,downscript=no%s"
+                      % (tap, netdev_opts),
+                      "-device", "virtio-net-pci,netdev=n0" + device_opts,
+                      "-kernel", guest] + extra
+        self.log = open(os.path.join(tmpdir, name + ".log"), "w")
+        self.proc = subprocess.Popen(cmd, stdout=self.log,
+                                     stderr=subprocess.STDOUT)
+
+    def output(self):
+        return open(self.serial).read()
+
+    def wait_for(self, text, timeout=30):
+        end = time.time() + timeout
+        while time.time() < end:
+            out = self.output()
+            if text in out:
+                return True
+            if "FAIL" in out or self.proc.poll() is not None:
+                break
+            time.sleep(0.05)
+        return False
+
+    def monitor(self, cmd):
+        if not self.mon:
+            self.mon = socket.socket(socket.AF_UNIX)
+            self.mon.connect(self.mon_path)
+            self.mon_read()
+        self.mon.sendall((cmd + "\n").encode())
+        return self.mon_read()
+
+    def mon_read(self):
+        buf = b""
+        while not buf.endswith(b"(qemu) "):
+            data = self.mon.recv(4096)
+            if not data:
+                break
+            buf += data
+        return buf.decode(errors="replace")
+
+    def stop(self):
+        if self.proc.poll() is None:
+            self.proc.kill()
+        self.proc.wait()
+        self.log.close()
+
+
+class Sender(threading.Thread):
+    """Sends numbered ICMP echo requests to the guest until stopped."""
+
+    def __init__(self, interval):
+        threading.Thread.__init__(self)
+        self.interval = interval
+        self.done = False
+        self.sock = socket.socket(socket.AF_PACKET, socket.SOCK_RAW)
+        self.sock.bind((tap, 0))
+
+    def frame(self, seq):
+        data = struct.pack("!QQ", int(time.time()), seq)
+        data += bytes([PATTERN]) * (DATA_LEN - STAMP_LEN)
+        icmp = struct.pack("!BBHHH", 8, 0, 0, 0x5151, seq & 0xffff) + data
+        ip = struct.pack("!BBHHHBBH4s4s", 0x45, 0, 20 + len(icmp), seq & 0xffff,
+                         0, 64, 1, 0, b"\x0a\xfe\x00\x01", b"\x0a\xfe\x00\x02")
+        return GUEST_MAC + HOST_MAC + b"\x08\x00" + ip + icmp
+
+    def run(self):
+        seq = 0
+        while not self.done:
+            try:
+                self.sock.send(self.frame(seq))
+                seq += 1
+            except OSError:
+                # nobody attached to the tap (between source and destination)
+                pass
+            time.sleep(self.interval)
+
+
+def features(netdev_opts, device_opts):
+    g = Guest("features", netdev_opts, device_opts)
+    try:
+        if not g.wait_for("READY"):
+            raise SystemExit("guest did not start:\n" + g.output())
+        for line in g.output().splitlines():
+            if line.startswith("features="):
+                return line[len("features="):]
+    finally:
+        g.stop()
+
+
+def check_features():
+    ok = True
+    for device_opts in ["", ",mrg_rxbuf=off"]:
+        off = features(",vhost=off", device_opts)
+        auto = features("", device_opts)
+        print("features%s: vhost=off %s, automatic %s"
+              % (device_opts, off, auto))
+        if off != auto:
+            ok = False
+    return ok
+
+
+def check_migration():
+    vhost = os.environ.get("VHOST")
+    netdev_opts = ",vhost=" + vhost if vhost else ""
+    # vhost-net does not do mergeable receive buffers, so it is only
+    # picked automatically without them
+    device_opts = ",mrg_rxbuf=off"
+    state = os.path.join(tmpdir, "state")
+
+    sender = Sender(float(os.environ.get("INTERVAL", "0.002")))
+    src = Guest("source", netdev_opts, device_opts)
+    dst = None
+    try:
+        if not src.wait_for("READY"):
+            raise SystemExit("guest did not start:\n" + src.output())
+        sender.start()
+        if not src.wait_for("rx 00000100"):
+            print(src.output())
+            return False
+        for line in src.monitor("info virtio").splitlines():
+            if "datapath" in line:
+                print(line.strip())
+        src.monitor("migrate \"exec:cat > %s\"" % state)
+        src.monitor("quit")
+        src.stop()
+        if "PASS" in src.output() or "FAIL" in src.output():
+            print("guest finished before migration:\n" + src.output())
+            return False
+
+        dst = Guest("destination", netdev_opts, device_opts,
+                    ["-incoming", "exec:cat %s" % state])
+        ok = dst.wait_for("PASS", 60)
+        print(dst.output().strip())
+        return ok
+    finally:
+        sender.done = True
+        if sender.is_alive():
+            sender.join()
+        src.stop()
+        if dst:
+            dst.stop()
+
+
+if len(sys.argv) != 3:
+    sys.stderr.write("usage: %s \"<qemu command>\" rx-guest\n" % sys.argv[0])
+    sys.exit(1)
+
+qemu = sys.argv[1].split()
+guest = sys.argv[2]
+tap = "qmig%d" % os.getpid()
+tmpdir = tempfile.mkdtemp(prefix="vhost-net.")
+
+# A persistent tap keeps its state while no qemu is attached
+subprocess.check_call(["ip", "tuntap", "add", "dev", tap, "mode", "tap"])
+try:
+    subprocess.check_call(["ip", "link", "set", tap, "up"])
+    ok = check_features() and check_migration()
+finally:
+    subprocess.call(["ip", "tuntap", "del", "dev", tap, "mode", "tap"])
+    shutil.rmtree(tmpdir)
+
+print("PASS" if ok else "FAIL")
+sys.exit(0 if ok else 1)
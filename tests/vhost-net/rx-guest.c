@@ -0,0 +1,299 @@
+/*
+ * Guest for the virtio-net migration test (see run-migration.py).
+ *
+ * It drives the first legacy virtio-net PCI device by polling and checks
+ * every ICMP echo request that the host sends it: the payload must carry
+ * the host's pattern and the sequence numbers must go up.  With
+ * vhost-net, the host kernel writes the receive buffers and the used ring
+ * behind qemu's back; if those writes are not in the dirty log during
+ * migration, the guest on the destination finds stale frames (the
+ * sequence goes back) or buffers that never come back (receive stalls).
+ *
+ * Output on the serial port:
+ *   features=XXXXXXXX   device features, before any are acked
+ *   READY               receive ring is set up
+ *   rx XXXXXXXX         progress, every RX_REPORT frames
+ *   PASS | FAIL ...
+ */
+
+typedef unsigned char uint8_t;
+typedef unsigned short uint16_t;
+typedef unsigned int uint32_t;
+typedef unsigned long long uint64_t;
+
+#define RX_WANT         4000    /* echo requests to see before PASS */
+#define RX_REPORT       256
+#define RX_STALL        20000000 /* polls without a frame before FAIL */
+
+#define PING_PATTERN    0xa5
+#define PING_DATA       56
+#define PING_STAMP      16      /* time stamp at the start of the data */
+
+/* Legacy virtio PCI registers */
+#define VIRTIO_PCI_HOST_FEATURES    0
+#define VIRTIO_PCI_GUEST_FEATURES   4
+#define VIRTIO_PCI_QUEUE_PFN        8
+#define VIRTIO_PCI_QUEUE_NUM        12
+#define VIRTIO_PCI_QUEUE_SEL        14
+#define VIRTIO_PCI_QUEUE_NOTIFY     16
+#define VIRTIO_PCI_STATUS           18
+#define VIRTIO_PCI_ISR              19
+
+#define VRING_DESC_F_NEXT   1
+#define VRING_DESC_F_WRITE  2
+
+#define QUEUE_MAX   256
+#define NB_RX       64
+#define HDR_LEN     10  /* struct virtio_net_hdr, no mergeable buffers */
+#define BUF_LEN     1536
+
+struct vring_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct vring_used_elem {
+    uint32_t id;
+    uint32_t len;
+};
+
+struct vq {
+    struct vring_desc *desc;
+    volatile uint16_t *avail_idx;
+    volatile uint16_t *avail_ring;
+    volatile uint16_t *used_idx;
+    volatile struct vring_used_elem *used_ring;
+    uint16_t num;
+    uint16_t avail;
+    uint16_t last_used;
+};
+
+static uint8_t rings[2][3 * 4096] __attribute__((aligned(4096)));
+static struct vq rxq, txq;
+static uint8_t rx_hdr[NB_RX][HDR_LEN];
+static uint8_t rx_buf[NB_RX][BUF_LEN];
+static uint16_t io;
+
+static inline void outb(uint16_t port, uint8_t val)
+{
+    asm volatile ("outb %0, %1" : : "a" (val), "Nd" (port));
+}
+
+static inline void outw(uint16_t port, uint16_t val)
+{
+    asm volatile ("outw %0, %1" : : "a" (val), "Nd" (port));
+}
+
+static inline void outl(uint16_t port, uint32_t val)
+{
+    asm volatile ("outl %0, %1" : : "a" (val), "Nd" (port));
+}
+
+static inline uint8_t inb(uint16_t port)
+{
+    uint8_t val;
+    asm volatile ("inb %1, %0" : "=a" (val) : "Nd" (port));
+    return val;
+}
+
+static inline uint16_t inw(uint16_t port)
+{
+    uint16_t val;
+    asm volatile ("inw %1, %0" : "=a" (val) : "Nd" (port));
+    return val;
+}
+
+static inline uint32_t inl(uint16_t port)
+{
+    uint32_t val;
+    asm volatile ("inl %1, %0" : "=a" (val) : "Nd" (port));
+    return val;
+}
+
+#define barrier() asm volatile ("" : : : "memory")
+
+static void putc(char c)
+{
+    while (!(inb(0x3fd) & 0x20)) {
+    }
+    outb(0x3f8, c);
+}
+
+static void puts(const char *s)
+{
+    while (*s) {
+        putc(*s++);
+    }
+}
+
+static void puthex(uint32_t v)
+{
+    int i;
+
+    for (i = 28; i >= 0; i -= 4) {
+        putc("0123456789abcdef"[(v >> i) & 15]);
+    }
+}
+
+static void fail(const char *what, uint32_t val)
+{
+    puts("FAIL ");
+    puts(what);
+    putc(' ');
+    puthex(val);
+    putc('\n');
+    for (;;) {
+        asm volatile ("hlt");
+    }
+}
+
+static uint32_t pci_config_read(int dev, int reg)
+{
+    outl(0xcf8, 0x80000000 | dev << 11 | reg);
+    return inl(0xcfc);
+}
+
+static void pci_config_write(int dev, int reg, uint32_t val)
+{
+    outl(0xcf8, 0x80000000 | dev << 11 | reg);
+    outl(0xcfc, val);
+}
+
+static void setup_vq(struct vq *q, int index)
+{
+    uint8_t *r = rings[index];
+    uint32_t used;
+
+    outw(io + VIRTIO_PCI_QUEUE_SEL, index);
+    q->num = inw(io + VIRTIO_PCI_QUEUE_NUM);
+    if (!q->num || q->num > QUEUE_MAX) {
+        fail("queue size", q->num);
+    }
+    used = (16 * q->num + 6 + 2 * q->num + 4095) & ~4095;
+    q->desc = (struct vring_desc *)r;
+    q->avail_idx = (uint16_t *)(r + 16 * q->num + 2);
+    q->avail_ring = (uint16_t *)(r + 16 * q->num + 4);
+    q->used_idx = (uint16_t *)(r + used + 2);
+    q->used_ring = (struct vring_used_elem *)(r + used + 4);
+    outl(io + VIRTIO_PCI_QUEUE_PFN, (uint32_t)r >> 12);
+}
+
+/* Buffer k uses descriptors 2k (header) and 2k + 1 (frame) */
+static void post_rx(int k)
+{
+    struct vring_desc *d = &rxq.desc[2 * k];
+
+    d[0].addr = (uint32_t)rx_hdr[k];
+    d[0].len = HDR_LEN;
+    d[0].flags = VRING_DESC_F_WRITE | VRING_DESC_F_NEXT;
+    d[0].next = 2 * k + 1;
+    d[1].addr = (uint32_t)rx_buf[k];
+    d[1].len = BUF_LEN;
+    d[1].flags = VRING_DESC_F_WRITE;
+    d[1].next = 0;
+    rxq.avail_ring[rxq.avail % rxq.num] = 2 * k;
+    rxq.avail++;
+}
+
+static void kick_rx(void)
+{
+    barrier();
+    *rxq.avail_idx = rxq.avail;
+    barrier();
+    outw(io + VIRTIO_PCI_QUEUE_NOTIFY, 0);
+}
+
+static uint32_t received;
+static uint16_t last_seq;
+
+static void check_frame(const uint8_t *f, uint32_t len)
+{
+    const uint8_t *data = f + 14 + 20 + 8;
+    uint16_t seq;
+    int i;
+
+    /* IPv4, ICMP, echo request; anything else is host noise */
+    if (len < 14 + 20 + 8 + PING_DATA || f[12] != 0x08 || f[13] != 0x00 ||
+        f[14 + 9] != 1 || f[14 + 20] != 8) {
+        return;
+    }
+    for (i = PING_STAMP; i < PING_DATA; i++) {
+        if (data[i] != PING_PATTERN) {
+            fail("payload", i << 8 | data[i]);
+        }
+    }
+    seq = f[14 + 20 + 6] << 8 | f[14 + 20 + 7];
+    if (received && (uint16_t)(seq - last_seq - 1) >= 0x8000) {
+        fail("sequence", (uint32_t)last_seq << 16 | seq);
+    }
+    last_seq = seq;
+    if (++received % RX_REPORT == 0) {
+        puts("rx ");
+        puthex(received);
+        putc('\n');
+    }
+}
+
+void guest_main(void)
+{
+    uint32_t idle = 0;
+    int dev, k;
+
+    for (dev = 0; dev < 32; dev++) {
+        uint32_t id = pci_config_read(dev, 0);
+        if ((id & 0xffff) == 0x1af4 && (pci_config_read(dev, 0x2c) >> 16) == 1) {
+            break;
+        }
+    }
+    if (dev == 32) {
+        fail("no virtio-net device", 0);
+    }
+    io = pci_config_read(dev, 0x10) & ~3;
+    pci_config_write(dev, 4, pci_config_read(dev, 4) | 5);
+
+    outb(io + VIRTIO_PCI_STATUS, 0);
+    outb(io + VIRTIO_PCI_STATUS, 1);
+    outb(io + VIRTIO_PCI_STATUS, 3);
+    puts("features=");
+    puthex(inl(io + VIRTIO_PCI_HOST_FEATURES));
+    putc('\n');
+    outl(io + VIRTIO_PCI_GUEST_FEATURES, 0);
+    setup_vq(&rxq, 0);
+    setup_vq(&txq, 1);
+    outb(io + VIRTIO_PCI_STATUS, 7);
+
+    for (k = 0; k < NB_RX; k++) {
+        post_rx(k);
+    }
+    kick_rx();
+    puts("READY\n");
+
+    while (received < RX_WANT) {
+        int any = 0;
+
+        while (rxq.last_used != *rxq.used_idx) {
+            volatile struct vring_used_elem *e;
+
+            barrier();
+            e = &rxq.used_ring[rxq.last_used % rxq.num];
+            k = e->id / 2;
+            if (e->id & 1 || k >= NB_RX || e->len < HDR_LEN) {
+                fail("used element", e->id);
+            }
+            check_frame(rx_buf[k], e->len - HDR_LEN);
+            rxq.last_used++;
+            post_rx(k);
+            any = 1;
+        }
+        if (any) {
+            kick_rx();
+            idle = 0;
+        } else if (++idle == RX_STALL) {
+            fail("receive stalled", received);
+        }
+        inb(io + VIRTIO_PCI_ISR);
+    }
+    puts("PASS\n");
+}
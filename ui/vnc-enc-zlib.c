@@ -66,8 +66,8 @@ static int vnc_zlib_stop(VncState *vs)
     // compress the zlib buffer
 
     // initialize the stream
-    // XXX need one stream per session
-    if (zstream->opaque != vs) {
+    // the stream is per session; vs may be an encoding thread's local copy
+    if (zstream->opaque == NULL) {
         int err;
 
         VNC_DEBUG("VNC: initializing zlib stream\n");
@@ -40,19 +40,27 @@
  * - VncState::output lock: used to make sure the output buffer is not corrupted
  * 		   	 if two threads try to write on it at the same time
  *
- * While the VNC worker thread is working, the VncDisplay global lock is hold
- * to avoid screen corruptions (this does not block vnc_refresh() because it
- * uses trylock()) but the output lock is not hold because the thread work on
- * its own output buffer.
+ * Encoding jobs are run by a small pool of worker threads.  Several workers
+ * may read the server surface at the same time, so instead of holding the
+ * VncDisplay lock for a whole job a worker registers itself in
+ * vd->encoders; vnc_refresh() only updates the server surface when its
+ * trylock() succeeds and no encoder is registered.  The output lock is not
+ * hold while encoding because each worker works on its own output buffer.
  * When the encoding job is done, the worker thread will hold the output lock
  * and copy its output buffer in vs->output.
+ *
+ * The tight and zlib encoders keep per-client compression streams, so the
+ * jobs of one client are always encoded in order by one worker at a time;
+ * jobs of different clients are encoded in parallel.
 */
 
+#define VNC_MAX_WORKER_THREADS 4
+
 struct VncJobQueue {
     QemuCond cond;
     QemuMutex mutex;
-    QemuThread thread;
-    Buffer buffer;
+    QemuThread threads[VNC_MAX_WORKER_THREADS];
+    int nthreads;
     bool exit;
     QTAILQ_HEAD(, VncJob) jobs;
 };
@@ -60,8 +68,7 @@ struct VncJobQueue {
 typedef struct VncJobQueue VncJobQueue;
 
 /*
- * We use a single global queue, but most of the functions are
- * already reetrant, so we can easilly add more than one encoding thread
+ * We use a single global queue, shared by all the encoding threads
  */
 static VncJobQueue *queue;
 
@@ -141,8 +148,10 @@ void vnc_jobs_clear(VncState *vs)
 
     vnc_lock_queue(queue);
     QTAILQ_FOREACH_SAFE(job, &queue->jobs, next, tmp) {
-        if (job->vs == vs || !vs) {
+        /* Running jobs are removed by their worker once they are done */
+        if ((job->vs == vs || !vs) && !job->busy) {
             QTAILQ_REMOVE(&queue->jobs, job, next);
+            qemu_free(job);
         }
     }
     vnc_unlock_queue(queue);
@@ -159,9 +168,20 @@ void vnc_jobs_join(VncState *vs)
 
 /*
  * Copy data for local use
+ *
+ * zlib streams keep a pointer back to the z_stream they were initialized
+ * in, so a client's updates are always encoded through the same copy of
+ * its state, whichever worker runs the job.
  */
-static void vnc_async_encoding_start(VncState *orig, VncState *local)
+static VncState *vnc_async_encoding_start(VncState *orig, Buffer *buffer)
 {
+    VncState *local;
+
+    if (!orig->async_vs) {
+        orig->async_vs = qemu_mallocz(sizeof(VncState));
+    }
+    local = orig->async_vs;
+
     local->vnc_encoding = orig->vnc_encoding;
     local->features = orig->features;
     local->ds = orig->ds;
@@ -171,39 +191,80 @@ static void vnc_async_encoding_start(VncState *orig, VncState *local)
     local->tight = orig->tight;
     local->zlib = orig->zlib;
     local->hextile = orig->hextile;
-    local->output =  queue->buffer;
+    local->output = *buffer;
     local->csock = -1; /* Don't do any network work on this thread */
 
     buffer_reset(&local->output);
+    return local;
 }
 
-static void vnc_async_encoding_end(VncState *orig, VncState *local)
+static void vnc_async_encoding_end(VncState *orig, VncState *local,
+                                   Buffer *buffer)
 {
     orig->tight = local->tight;
     orig->zlib = local->zlib;
     orig->hextile = local->hextile;
+    *buffer = local->output; /* Keep the output buffer for the next job */
+}
+
+/*
+ * Return the oldest job that can run now: it must not be running already,
+ * and no older job for the same client may still be queued or running.
+ */
+static VncJob *vnc_next_job_locked(VncJobQueue *queue)
+{
+    VncJob *job, *prev;
+
+    QTAILQ_FOREACH(job, &queue->jobs, next) {
+        bool blocked = job->busy;
+
+        for (prev = QTAILQ_FIRST(&queue->jobs); !blocked && prev != job;
+             prev = QTAILQ_NEXT(prev, next)) {
+            blocked = (prev->vs == job->vs);
+        }
+        if (!blocked) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+static void vnc_encoder_enter(VncDisplay *vd)
+{
+    vnc_lock_display(vd);
+    vd->encoders++;
+    vnc_unlock_display(vd);
 }
 
-static int vnc_worker_thread_loop(VncJobQueue *queue)
+static void vnc_encoder_leave(VncDisplay *vd)
+{
+    vnc_lock_display(vd);
+    vd->encoders--;
+    vnc_unlock_display(vd);
+}
+
+static int vnc_worker_thread_loop(VncJobQueue *queue, Buffer *buffer)
 {
     VncJob *job;
     VncRectEntry *entry, *tmp;
-    VncState vs;
+    VncState *vs;
     int n_rectangles;
     int saved_offset;
     bool flush;
 
     vnc_lock_queue(queue);
-    while (QTAILQ_EMPTY(&queue->jobs) && !queue->exit) {
+    while (!queue->exit && !(job = vnc_next_job_locked(queue))) {
         qemu_cond_wait(&queue->cond, &queue->mutex);
     }
-    /* Here job can only be NULL if queue->exit is true */
-    job = QTAILQ_FIRST(&queue->jobs);
-    vnc_unlock_queue(queue);
-
     if (queue->exit) {
+        vnc_unlock_queue(queue);
         return -1;
     }
+    job->busy = true;
+    vnc_unlock_queue(queue);
+
+    /* Make a local copy of vs and switch output buffers */
+    vs = vnc_async_encoding_start(job->vs, buffer);
 
     vnc_lock_output(job->vs);
     if (job->vs->csock == -1 || job->vs->abort == true) {
@@ -211,26 +272,24 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     }
     vnc_unlock_output(job->vs);
 
-    /* Make a local copy of vs and switch output buffers */
-    vnc_async_encoding_start(job->vs, &vs);
-
     /* Start sending rectangles */
     n_rectangles = 0;
-    vnc_write_u8(&vs, VNC_MSG_SERVER_FRAMEBUFFER_UPDATE);
-    vnc_write_u8(&vs, 0);
-    saved_offset = vs.output.offset;
-    vnc_write_u16(&vs, 0);
+    vnc_write_u8(vs, VNC_MSG_SERVER_FRAMEBUFFER_UPDATE);
+    vnc_write_u8(vs, 0);
+    saved_offset = vs->output.offset;
+    vnc_write_u16(vs, 0);
 
-    vnc_lock_display(job->vs->vd);
+    vnc_encoder_enter(job->vs->vd);
     QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
         int n;
 
         if (job->vs->csock == -1) {
-            vnc_unlock_display(job->vs->vd);
+            vnc_encoder_leave(job->vs->vd);
+            vnc_lock_output(job->vs);
             goto disconnected;
         }
 
-        n = vnc_send_framebuffer_update(&vs, entry->rect.x, entry->rect.y,
+        n = vnc_send_framebuffer_update(vs, entry->rect.x, entry->rect.y,
                                         entry->rect.w, entry->rect.h);
 
         if (n >= 0) {
@@ -238,11 +297,11 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
         }
         qemu_free(entry);
     }
-    vnc_unlock_display(job->vs->vd);
+    vnc_encoder_leave(job->vs->vd);
 
     /* Put n_rectangles at the beginning of the message */
-    vs.output.buffer[saved_offset] = (n_rectangles >> 8) & 0xFF;
-    vs.output.buffer[saved_offset + 1] = n_rectangles & 0xFF;
+    vs->output.buffer[saved_offset] = (n_rectangles >> 8) & 0xFF;
+    vs->output.buffer[saved_offset + 1] = n_rectangles & 0xFF;
 
     /* Switch back buffers */
     vnc_lock_output(job->vs);
@@ -250,11 +309,11 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
         goto disconnected;
     }
 
-    vnc_write(job->vs, vs.output.buffer, vs.output.offset);
+    vnc_write(job->vs, vs->output.buffer, vs->output.offset);
 
 disconnected:
     /* Copy persistent encoding data */
-    vnc_async_encoding_end(job->vs, &vs);
+    vnc_async_encoding_end(job->vs, vs, buffer);
     flush = (job->vs->csock != -1 && job->vs->abort != true);
     vnc_unlock_output(job->vs);
 
@@ -284,7 +343,6 @@ static void vnc_queue_clear(VncJobQueue *q)
 {
     qemu_cond_destroy(&queue->cond);
     qemu_mutex_destroy(&queue->mutex);
-    buffer_free(&queue->buffer);
     qemu_free(q);
     queue = NULL; /* Unset global queue */
 }
@@ -292,24 +350,43 @@ static void vnc_queue_clear(VncJobQueue *q)
 static void *vnc_worker_thread(void *arg)
 {
     VncJobQueue *queue = arg;
+    Buffer buffer = { 0 };
+    bool last;
 
-    qemu_thread_self(&queue->thread);
+    while (!vnc_worker_thread_loop(queue, &buffer)) ;
+    buffer_free(&buffer);
 
-    while (!vnc_worker_thread_loop(queue)) ;
-    vnc_queue_clear(queue);
+    vnc_lock_queue(queue);
+    last = (--queue->nthreads == 0);
+    vnc_unlock_queue(queue);
+    if (last) {
+        vnc_queue_clear(queue);
+    }
     return NULL;
 }
 
+static int vnc_worker_thread_count(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return MAX(1, MIN(n, VNC_MAX_WORKER_THREADS));
+}
+
 void vnc_start_worker_thread(void)
 {
     VncJobQueue *q;
+    int i, n;
 
     if (vnc_worker_thread_running())
         return ;
 
     q = vnc_queue_init();
-    qemu_thread_create(&q->thread, vnc_worker_thread, q);
+    n = vnc_worker_thread_count();
+    q->nthreads = n;
     queue = q; /* Set global queue */
+    for (i = 0; i < n; i++) {
+        qemu_thread_create(&q->threads[i], vnc_worker_thread, q);
+    }
 }
 
 bool vnc_worker_thread_running(void)
@@ -322,10 +399,11 @@ void vnc_stop_worker_thread(void)
     if (!vnc_worker_thread_running())
         return ;
 
-    /* Remove all jobs and wake up the thread */
+    /* Remove all jobs and wake up the threads; the last one to leave
+     * frees the queue */
+    vnc_jobs_clear(NULL);
     vnc_lock_queue(queue);
     queue->exit = true;
-    vnc_unlock_queue(queue);
-    vnc_jobs_clear(NULL);
     qemu_cond_broadcast(&queue->cond);
+    vnc_unlock_queue(queue);
 }
@@ -50,7 +50,15 @@ void vnc_stop_worker_thread(void);
 static inline int vnc_trylock_display(VncDisplay *vd)
 {
 #ifdef CONFIG_VNC_THREAD
-    return qemu_mutex_trylock(&vd->mutex);
+    if (qemu_mutex_trylock(&vd->mutex)) {
+        return EBUSY;
+    }
+    if (vd->encoders) {
+        /* an encoder is still reading the server surface */
+        qemu_mutex_unlock(&vd->mutex);
+        return EBUSY;
+    }
+    return 0;
 #else
     return 0;
 #endif
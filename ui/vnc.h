@@ -109,6 +109,7 @@ struct VncDisplay
     int lock_key_sync;
 #ifdef CONFIG_VNC_THREAD
     QemuMutex mutex;
+    int encoders;   /* workers reading the server surface, under mutex */
 #endif
 
     QEMUCursor *cursor;
@@ -181,6 +182,7 @@ struct VncJob
     VncState *vs;
 
     QLIST_HEAD(, VncRectEntry) rectangles;
+    bool busy;
     QTAILQ_ENTRY(VncJob) next;
 };
 #else
@@ -244,6 +246,7 @@ struct VncState
     VncJob job;
 #else
     QemuMutex output_mutex;
+    struct VncState *async_vs;  /* encoding copy used by the worker threads */
 #endif
 
     /* Encoding specific, if you add something here, don't forget to
@@ -47,6 +47,9 @@
 #include <dirent.h>
 #include <netdb.h>
 #include <sys/select.h>
+#ifdef CONFIG_EPOLL
+#include <sys/epoll.h>
+#endif
 #ifdef CONFIG_BSD
 #include <sys/stat.h>
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__) || defined(__DragonFly__)
@@ -945,14 +948,152 @@ typedef struct IOHandlerRecord {
     IOHandler *fd_write;
     int deleted;
     void *opaque;
-    /* temporary data */
-    struct pollfd *ufd;
+    /* fd_read_poll result of the last main loop iteration */
+    int read_ready;
+    /* events registered with epoll; the fd cannot be polled if epoll
+     * refuses it, and is then treated as always ready, as by select() */
+    uint32_t events;
+    int always_ready;
     QLIST_ENTRY(IOHandlerRecord) next;
+    QLIST_ENTRY(IOHandlerRecord) poll_next;
 } IOHandlerRecord;
 
 static QLIST_HEAD(, IOHandlerRecord) io_handlers =
     QLIST_HEAD_INITIALIZER(io_handlers);
 
+/* Handlers with a fd_read_poll callback; only these are visited before
+ * every wait, the others cost nothing until their fd becomes ready. */
+static QLIST_HEAD(, IOHandlerRecord) io_poll_handlers =
+    QLIST_HEAD_INITIALIZER(io_poll_handlers);
+
+/* Handlers indexed by fd */
+static IOHandlerRecord **io_handler_table;
+static int io_handler_table_size;
+static int io_handlers_deleted;
+
+#ifdef CONFIG_EPOLL
+#define IO_EPOLL_MAX_EVENTS 64
+
+static int io_epoll_fd = -2;    /* -1 if epoll is not available */
+static int io_always_ready;
+
+static void io_handler_epoll_init(void)
+{
+    io_epoll_fd = epoll_create(IO_EPOLL_MAX_EVENTS);
+    if (io_epoll_fd >= 0) {
+        fcntl(io_epoll_fd, F_SETFD, FD_CLOEXEC);
+    }
+}
+
+/* Tell epoll about changes to what the handler is waiting for */
+static void io_handler_update(IOHandlerRecord *ioh)
+{
+    struct epoll_event ev;
+    uint32_t events = 0;
+    int op, r;
+
+    if (io_epoll_fd < 0) {
+        return;
+    }
+    if (!ioh->deleted) {
+        if (ioh->fd_read && (!ioh->fd_read_poll || ioh->read_ready)) {
+            events |= EPOLLIN;
+        }
+        if (ioh->fd_write) {
+            events |= EPOLLOUT;
+        }
+    }
+
+    if (ioh->always_ready) {
+        io_always_ready += !!events - !!ioh->events;
+        ioh->events = events;
+        return;
+    }
+    if (events == ioh->events) {
+        return;
+    }
+
+    op = !ioh->events ? EPOLL_CTL_ADD :
+         !events ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = ioh;
+    r = epoll_ctl(io_epoll_fd, op, ioh->fd, &ev);
+    if (r < 0 && op == EPOLL_CTL_MOD && errno == ENOENT) {
+        /* The fd was closed and reopened under the same handler */
+        op = EPOLL_CTL_ADD;
+        r = epoll_ctl(io_epoll_fd, op, ioh->fd, &ev);
+    }
+    if (r < 0) {
+        if (op == EPOLL_CTL_ADD && errno == EPERM) {
+            /* Regular files and the like */
+            ioh->always_ready = 1;
+            io_always_ready += !!events;
+        } else if (op != EPOLL_CTL_DEL) {
+            fprintf(stderr, "epoll_ctl(%d) failed: %s\n", ioh->fd,
+                    strerror(errno));
+        }
+    }
+    ioh->events = events;
+}
+#else
+static void io_handler_update(IOHandlerRecord *ioh)
+{
+}
+#endif
+
+static IOHandlerRecord *io_handler_find(int fd)
+{
+    if (fd < 0 || fd >= io_handler_table_size) {
+        return NULL;
+    }
+    return io_handler_table[fd];
+}
+
+static IOHandlerRecord *io_handler_new(int fd)
+{
+    IOHandlerRecord *ioh;
+
+    if (fd >= io_handler_table_size) {
+        int size = MAX(fd + 1, io_handler_table_size * 2);
+
+        io_handler_table = qemu_realloc(io_handler_table,
+                                        size * sizeof(*io_handler_table));
+        memset(io_handler_table + io_handler_table_size, 0,
+               (size - io_handler_table_size) * sizeof(*io_handler_table));
+        io_handler_table_size = size;
+    }
+
+    ioh = qemu_mallocz(sizeof(IOHandlerRecord));
+    ioh->fd = fd;
+    QLIST_INSERT_HEAD(&io_handlers, ioh, next);
+    io_handler_table[fd] = ioh;
+    return ioh;
+}
+
+/* Handlers are only freed here, between dispatch loops, as a callback
+ * may remove its own or another handler. */
+static void io_handlers_sweep(void)
+{
+    IOHandlerRecord *ioh, *pioh;
+
+    if (!io_handlers_deleted) {
+        return;
+    }
+    io_handlers_deleted = 0;
+
+    QLIST_FOREACH_SAFE(ioh, &io_handlers, next, pioh) {
+        if (!ioh->deleted) {
+            continue;
+        }
+        QLIST_REMOVE(ioh, next);
+        if (ioh->fd_read_poll) {
+            QLIST_REMOVE(ioh, poll_next);
+        }
+        io_handler_table[ioh->fd] = NULL;
+        qemu_free(ioh);
+    }
+}
 
 /* XXX: fd_read_poll should be suppressed, but an API change is
    necessary in the character devices to suppress fd_can_read(). */
@@ -964,27 +1105,40 @@ int qemu_set_fd_handler2(int fd,
 {
     IOHandlerRecord *ioh;
 
+#ifdef CONFIG_EPOLL
+    if (io_epoll_fd == -2) {
+        io_handler_epoll_init();
+    }
+#endif
+
+    ioh = io_handler_find(fd);
     if (!fd_read && !fd_write) {
-        QLIST_FOREACH(ioh, &io_handlers, next) {
-            if (ioh->fd == fd) {
-                ioh->deleted = 1;
-                break;
-            }
+        if (ioh && !ioh->deleted) {
+            ioh->deleted = 1;
+            io_handlers_deleted = 1;
+            io_handler_update(ioh);
         }
     } else {
-        QLIST_FOREACH(ioh, &io_handlers, next) {
-            if (ioh->fd == fd)
-                goto found;
+        if (!ioh) {
+            ioh = io_handler_new(fd);
+        }
+        if (!ioh->fd_read_poll != !fd_read_poll) {
+            if (fd_read_poll) {
+                QLIST_INSERT_HEAD(&io_poll_handlers, ioh, poll_next);
+            } else {
+                QLIST_REMOVE(ioh, poll_next);
+            }
+        }
+        if (ioh->fd_read_poll != fd_read_poll || ioh->opaque != opaque) {
+            /* Not ready until the next main loop iteration asks */
+            ioh->read_ready = 0;
         }
-        ioh = qemu_mallocz(sizeof(IOHandlerRecord));
-        QLIST_INSERT_HEAD(&io_handlers, ioh, next);
-    found:
-        ioh->fd = fd;
         ioh->fd_read_poll = fd_read_poll;
         ioh->fd_read = fd_read;
         ioh->fd_write = fd_write;
         ioh->opaque = opaque;
         ioh->deleted = 0;
+        io_handler_update(ioh);
     }
     return 0;
 }
@@ -1222,71 +1376,175 @@ void qemu_system_powerdown_request(void)
     qemu_notify_event();
 }
 
-void main_loop_wait(int nonblocking)
+/* Evaluate the fd_read_poll callbacks, and pass on those that changed */
+static void io_handlers_poll(void)
 {
     IOHandlerRecord *ioh;
-    fd_set rfds, wfds, xfds;
-    int ret, nfds;
-    struct timeval tv;
-    int timeout;
 
-    if (nonblocking)
-        timeout = 0;
-    else {
-        timeout = qemu_calculate_timeout();
-        qemu_bh_update_timeout(&timeout);
+    QLIST_FOREACH(ioh, &io_poll_handlers, poll_next) {
+        int ready;
+
+        if (ioh->deleted || !ioh->fd_read) {
+            continue;
+        }
+        ready = ioh->fd_read_poll(ioh->opaque) != 0;
+        if (ready != ioh->read_ready) {
+            ioh->read_ready = ready;
+            io_handler_update(ioh);
+        }
     }
+}
 
-    os_host_main_loop_wait(&timeout);
+static int io_handlers_select_fill(fd_set *rfds, fd_set *wfds)
+{
+    IOHandlerRecord *ioh;
+    int nfds = -1;
 
-    /* poll any events */
-    /* XXX: separate device handlers from system ones */
-    nfds = -1;
-    FD_ZERO(&rfds);
-    FD_ZERO(&wfds);
-    FD_ZERO(&xfds);
     QLIST_FOREACH(ioh, &io_handlers, next) {
         if (ioh->deleted)
             continue;
         if (ioh->fd_read &&
-            (!ioh->fd_read_poll ||
-             ioh->fd_read_poll(ioh->opaque) != 0)) {
-            FD_SET(ioh->fd, &rfds);
+            (!ioh->fd_read_poll || ioh->read_ready)) {
+            FD_SET(ioh->fd, rfds);
             if (ioh->fd > nfds)
                 nfds = ioh->fd;
         }
         if (ioh->fd_write) {
-            FD_SET(ioh->fd, &wfds);
+            FD_SET(ioh->fd, wfds);
             if (ioh->fd > nfds)
                 nfds = ioh->fd;
         }
     }
+    return nfds;
+}
+
+static void io_handlers_select_dispatch(fd_set *rfds, fd_set *wfds)
+{
+    IOHandlerRecord *ioh;
+
+    QLIST_FOREACH(ioh, &io_handlers, next) {
+        if (ioh->deleted) {
+            continue;
+        }
+        if (ioh->fd_read && FD_ISSET(ioh->fd, rfds)) {
+            ioh->fd_read(ioh->opaque);
+        }
+        if (!ioh->deleted && ioh->fd_write && FD_ISSET(ioh->fd, wfds)) {
+            ioh->fd_write(ioh->opaque);
+        }
+    }
+}
 
-    tv.tv_sec = timeout / 1000;
-    tv.tv_usec = (timeout % 1000) * 1000;
+#ifdef CONFIG_EPOLL
+static void io_handlers_epoll_dispatch(struct epoll_event *events, int n)
+{
+    IOHandlerRecord *ioh;
+    int i;
 
-    slirp_select_fill(&nfds, &rfds, &wfds, &xfds);
+    for (i = 0; i < n; i++) {
+        uint32_t ev = events[i].events;
 
-    qemu_mutex_unlock_iothread();
-    ret = select(nfds + 1, &rfds, &wfds, &xfds, &tv);
-    qemu_mutex_lock_iothread();
-    if (ret > 0) {
-        IOHandlerRecord *pioh;
+        ioh = events[i].data.ptr;
+        /* Errors and hangups are reported to whoever is waiting, as
+         * select() would mark the fd ready */
+        if (ev & (EPOLLERR | EPOLLHUP)) {
+            ev |= ioh->events;
+        }
+        if (!ioh->deleted && ioh->fd_read && (ev & EPOLLIN)) {
+            ioh->fd_read(ioh->opaque);
+        }
+        if (!ioh->deleted && ioh->fd_write && (ev & EPOLLOUT)) {
+            ioh->fd_write(ioh->opaque);
+        }
+    }
 
-        QLIST_FOREACH_SAFE(ioh, &io_handlers, next, pioh) {
-            if (ioh->deleted) {
-                QLIST_REMOVE(ioh, next);
-                qemu_free(ioh);
+    if (io_always_ready) {
+        QLIST_FOREACH(ioh, &io_handlers, next) {
+            if (!ioh->always_ready) {
                 continue;
             }
-            if (ioh->fd_read && FD_ISSET(ioh->fd, &rfds)) {
+            if (!ioh->deleted && (ioh->events & EPOLLIN)) {
                 ioh->fd_read(ioh->opaque);
             }
-            if (ioh->fd_write && FD_ISSET(ioh->fd, &wfds)) {
+            if (!ioh->deleted && (ioh->events & EPOLLOUT)) {
                 ioh->fd_write(ioh->opaque);
             }
         }
     }
+}
+#endif
+
+void main_loop_wait(int nonblocking)
+{
+    fd_set rfds, wfds, xfds;
+    int ret, nfds;
+    struct timeval tv;
+    int timeout;
+
+    if (nonblocking)
+        timeout = 0;
+    else {
+        timeout = qemu_calculate_timeout();
+        qemu_bh_update_timeout(&timeout);
+    }
+
+    os_host_main_loop_wait(&timeout);
+
+    /* poll any events */
+    /* XXX: separate device handlers from system ones */
+    io_handlers_poll();
+
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    FD_ZERO(&xfds);
+    nfds = -1;
+    slirp_select_fill(&nfds, &rfds, &wfds, &xfds);
+
+#ifdef CONFIG_EPOLL
+    if (io_epoll_fd >= 0) {
+        struct epoll_event events[IO_EPOLL_MAX_EVENTS];
+        int n = 0;
+
+        if (io_always_ready) {
+            timeout = 0;
+        }
+
+        if (nfds >= 0) {
+            /* slirp still wants select(); wait on the epoll fd with it */
+            FD_SET(io_epoll_fd, &rfds);
+            nfds = MAX(nfds, io_epoll_fd);
+            tv.tv_sec = timeout / 1000;
+            tv.tv_usec = (timeout % 1000) * 1000;
+
+            qemu_mutex_unlock_iothread();
+            ret = select(nfds + 1, &rfds, &wfds, &xfds, &tv);
+            if (ret > 0 && FD_ISSET(io_epoll_fd, &rfds)) {
+                n = epoll_wait(io_epoll_fd, events, IO_EPOLL_MAX_EVENTS, 0);
+            }
+            qemu_mutex_lock_iothread();
+        } else {
+            qemu_mutex_unlock_iothread();
+            ret = n = epoll_wait(io_epoll_fd, events, IO_EPOLL_MAX_EVENTS,
+                                 timeout);
+            qemu_mutex_lock_iothread();
+        }
+
+        io_handlers_epoll_dispatch(events, MAX(n, 0));
+    } else
+#endif
+    {
+        nfds = MAX(nfds, io_handlers_select_fill(&rfds, &wfds));
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+
+        qemu_mutex_unlock_iothread();
+        ret = select(nfds + 1, &rfds, &wfds, &xfds, &tv);
+        qemu_mutex_lock_iothread();
+        if (ret > 0) {
+            io_handlers_select_dispatch(&rfds, &wfds);
+        }
+    }
+    io_handlers_sweep();
 
     slirp_select_poll(&rfds, &wfds, &xfds, (ret < 0));
 
@@ -2770,6 +3028,7 @@ int main(int argc, char **argv, char **envp)
 
     /* init the dynamic translator */
     cpu_exec_init_all(tb_size * 1024 * 1024);
+    jit_profile_init();
 
     bdrv_init_with_whitelist();
 